@@ -468,3 +468,32 @@ SEV_ERROR_CODE AMDCert::amd_cert_init(amd_cert *cert, const uint8_t *buffer)
 
     return cmd_ret;
 }
+
+/**
+ * Initialize an amd_cert object from a buffer of len bytes (ex. a FileView
+ * of a .cert file), which must hold the whole certificate
+ *
+ * Parameters:
+ *     cert     [out] AMD certificate object,
+ *     buffer   [in]  buffer starting with the raw AMD certificate
+ *     len      [in]  bytes in the buffer
+ */
+SEV_ERROR_CODE AMDCert::amd_cert_init(amd_cert *cert, const uint8_t *buffer, size_t len)
+{
+    uint32_t fixed_offset = offsetof(amd_cert, pub_exp);    // 64 bytes
+    amd_cert tmp;
+
+    if (!cert || !buffer)
+        return ERROR_INVALID_PARAM;
+    if (len < fixed_offset)
+        return ERROR_INVALID_LENGTH;
+
+    // The key sizes in the fixed body say how long the rest is
+    memcpy(&tmp, buffer, fixed_offset);
+    if (tmp.pub_exp_size/8 > sizeof(tmp.pub_exp) || tmp.modulus_size/8 > sizeof(tmp.modulus))
+        return ERROR_INVALID_CERTIFICATE;
+    if (amd_cert_get_size(&tmp) > len)
+        return ERROR_INVALID_LENGTH;
+
+    return amd_cert_init(cert, buffer);
+}
@@ -74,6 +74,7 @@ public:
     SEV_ERROR_CODE amd_cert_export_pub_key(const amd_cert *cert,
                                            sev_cert *pub_key_cert);
     SEV_ERROR_CODE amd_cert_init(amd_cert *cert, const uint8_t *buffer);
+    SEV_ERROR_CODE amd_cert_init(amd_cert *cert, const uint8_t *buffer, size_t len);
 };
 
 #endif /* AMDCERT_H */
@@ -0,0 +1,255 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "archive.h"
+#include "utilities.h"
+#include <climits>
+#include <time.h>
+#include <unistd.h>     // for dup, dup2
+
+// Zip record signatures and fields. See APPNOTE.TXT from PKWARE
+#define ZIP_LOCAL_HEADER_SIG        0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG      0x02014b50
+#define ZIP_END_OF_CENTRAL_DIR_SIG  0x06054b50
+#define ZIP_VERSION_STORE           10          // 1.0, stored entries only
+#define ZIP_VERSION_MADE_BY_UNIX    ((3 << 8) | ZIP_VERSION_STORE)
+#define ZIP_METHOD_STORE            0
+#define ZIP_EXT_ATTR_FILE_0644      (0100644U << 16)
+
+static void put_u16(std::string &buf, uint16_t val)
+{
+    buf += (char)(val & 0xFF);
+    buf += (char)((val >> 8) & 0xFF);
+}
+
+static void put_u32(std::string &buf, uint32_t val)
+{
+    put_u16(buf, (uint16_t)(val & 0xFFFF));
+    put_u16(buf, (uint16_t)(val >> 16));
+}
+
+struct crc32_table_t {
+    uint32_t val[256];
+};
+
+static crc32_table_t make_crc32_table(void)
+{
+    crc32_table_t table;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+        table.val[i] = c;
+    }
+    return table;
+}
+
+uint32_t sev::crc32(const void *data, size_t len, uint32_t crc)
+{
+    // Function-local static, so built exactly once even with multiple threads
+    static const crc32_table_t table = make_crc32_table();
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    crc = ~crc;
+    while (len--)
+        crc = table.val[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+int sev::redirect_stdout_to_stderr(void)
+{
+    int fd = -1;
+
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    if (fd < 0)
+        return -1;
+
+    if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ZipWriter::ZipWriter()
+    : m_out(NULL),
+      m_file(NULL),
+      m_offset(0),
+      m_dos_time(0),
+      m_dos_date(0)
+{
+    // All entries get stamped with the time the archive was created
+    time_t now = time(NULL);
+    struct tm tm_now;
+    localtime_r(&now, &tm_now);
+    m_dos_time = (uint16_t)((tm_now.tm_hour << 11) | (tm_now.tm_min << 5) | (tm_now.tm_sec / 2));
+    m_dos_date = (uint16_t)(((tm_now.tm_year - 80) << 9) | ((tm_now.tm_mon + 1) << 5) | tm_now.tm_mday);
+}
+
+ZipWriter::~ZipWriter()
+{
+    // Don't leave a half written archive's FILE* open. No central directory
+    // is written here, close() must be called for a valid archive. An
+    // unfinished archive file is removed
+    delete m_out;
+    m_out = NULL;
+    if (m_file)
+        fclose(m_file);
+    m_file = NULL;
+}
+
+// Written aside and renamed over file_name by close(), like write_file
+bool ZipWriter::open(const std::string file_name)
+{
+    delete m_out;
+    m_out = new sev::OutputFile();
+    if (!m_out->open(file_name)) {
+        printf("Error: unable to create zip file %s\n", file_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ZipWriter::open(int fd)
+{
+    m_file = fdopen(fd, "wb");
+    if (!m_file) {
+        printf("Error: unable to open fd %d for zip output\n", fd);
+        ::close(fd);
+        return false;
+    }
+    return true;
+}
+
+bool ZipWriter::write(const std::string &buf)
+{
+    if (!m_file && !(m_out && m_out->is_open()))
+        return false;
+    if ((uint64_t)m_offset + buf.size() > UINT32_MAX) {
+        printf("Error: zip archive too large\n");
+        return false;
+    }
+    if (m_file ? (fwrite(buf.data(), 1, buf.size(), m_file) != buf.size()) :
+                 !m_out->write(buf.data(), buf.size())) {
+        printf("Error: writing zip archive\n");
+        return false;
+    }
+    m_offset += (uint32_t)buf.size();
+    return true;
+}
+
+bool ZipWriter::add_entry(const std::string name, const void *data, size_t len)
+{
+    zip_entry_t entry;
+    std::string header = "";
+
+    if (name.empty() || name.size() > UINT16_MAX || len > UINT32_MAX)
+        return false;
+
+    entry.name = name;
+    entry.crc = sev::crc32(data, len);
+    entry.size = (uint32_t)len;
+    entry.offset = m_offset;
+
+    put_u32(header, ZIP_LOCAL_HEADER_SIG);
+    put_u16(header, ZIP_VERSION_STORE);
+    put_u16(header, 0);                     // flags
+    put_u16(header, ZIP_METHOD_STORE);
+    put_u16(header, m_dos_time);
+    put_u16(header, m_dos_date);
+    put_u32(header, entry.crc);
+    put_u32(header, entry.size);            // compressed size
+    put_u32(header, entry.size);            // uncompressed size
+    put_u16(header, (uint16_t)name.size());
+    put_u16(header, 0);                     // extra field length
+    header += name;
+
+    if (!write(header) || !write(std::string((const char *)data, len)))
+        return false;
+
+    m_entries.push_back(entry);
+    return true;
+}
+
+/**
+ * Writes the central directory. An archive file is only renamed into place
+ * if the whole archive was written, otherwise it's removed
+ */
+bool ZipWriter::close(void)
+{
+    bool ret = false;
+    std::string central_dir = "";
+    std::string end_record = "";
+    uint32_t central_dir_offset = m_offset;
+
+    do {
+        if ((!m_file && !(m_out && m_out->is_open())) || m_entries.size() > UINT16_MAX)
+            break;
+
+        for (size_t i = 0; i < m_entries.size(); i++) {
+            put_u32(central_dir, ZIP_CENTRAL_HEADER_SIG);
+            put_u16(central_dir, ZIP_VERSION_MADE_BY_UNIX);
+            put_u16(central_dir, ZIP_VERSION_STORE);
+            put_u16(central_dir, 0);                // flags
+            put_u16(central_dir, ZIP_METHOD_STORE);
+            put_u16(central_dir, m_dos_time);
+            put_u16(central_dir, m_dos_date);
+            put_u32(central_dir, m_entries[i].crc);
+            put_u32(central_dir, m_entries[i].size);
+            put_u32(central_dir, m_entries[i].size);
+            put_u16(central_dir, (uint16_t)m_entries[i].name.size());
+            put_u16(central_dir, 0);                // extra field length
+            put_u16(central_dir, 0);                // comment length
+            put_u16(central_dir, 0);                // disk number
+            put_u16(central_dir, 0);                // internal attributes
+            put_u32(central_dir, ZIP_EXT_ATTR_FILE_0644);
+            put_u32(central_dir, m_entries[i].offset);
+            central_dir += m_entries[i].name;
+        }
+        if (!write(central_dir))
+            break;
+
+        put_u32(end_record, ZIP_END_OF_CENTRAL_DIR_SIG);
+        put_u16(end_record, 0);                     // this disk
+        put_u16(end_record, 0);                     // disk with central dir
+        put_u16(end_record, (uint16_t)m_entries.size());
+        put_u16(end_record, (uint16_t)m_entries.size());
+        put_u32(end_record, (uint32_t)central_dir.size());
+        put_u32(end_record, central_dir_offset);
+        put_u16(end_record, 0);                     // comment length
+        if (!write(end_record))
+            break;
+
+        ret = true;
+    } while (0);
+
+    if (m_file) {
+        if (fflush(m_file) != 0)
+            ret = false;
+        if (fclose(m_file) != 0)
+            ret = false;
+    }
+    m_file = NULL;
+    if (m_out && m_out->is_open()) {
+        if (ret)
+            ret = m_out->commit();
+        else
+            m_out->abort();
+    }
+
+    return ret;
+}
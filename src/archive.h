@@ -0,0 +1,82 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace sev { class OutputFile; }
+
+/**
+ * Writes a zip archive (stored entries, no compression) straight from memory
+ * buffers. Each entry is written out as soon as it's added and the central
+ * directory is written on close(), so the output never needs to be seekable
+ * and can be a pipe (ex. stdout piped over ssh).
+ */
+class ZipWriter
+{
+private:
+    struct zip_entry_t {
+        std::string name;
+        uint32_t crc;
+        uint32_t size;
+        uint32_t offset;
+    };
+
+    sev::OutputFile *m_out; // Archive written to a file
+    FILE *m_file;           // Or streamed to an fd
+    uint32_t m_offset;      // Bytes written so far
+    uint16_t m_dos_time;
+    uint16_t m_dos_date;
+    std::vector<zip_entry_t> m_entries;
+
+    ZipWriter(const ZipWriter &);               // Not copyable, owns its output
+    ZipWriter &operator=(const ZipWriter &);
+
+    bool write(const std::string &buf);
+
+public:
+    ZipWriter();
+    ~ZipWriter();
+
+    bool open(const std::string file_name);
+    bool open(int fd);
+    bool add_entry(const std::string name, const void *data, size_t len);
+    bool close(void);
+};
+
+namespace sev
+{
+    /**
+     * Standard (zip/gzip/png) CRC-32. Pass the previous return value as crc
+     * to continue a running checksum
+     */
+    uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
+
+    /**
+     * Points stdout at stderr so all of the tool's normal printf output
+     * stays out of the way, and returns a new fd for the original stdout
+     * that binary output can be streamed to. Returns -1 on failure
+     */
+    int redirect_stdout_to_stderr(void);
+} // namespace
+
+#endif /* ARCHIVE_H */
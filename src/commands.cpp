@@ -16,18 +16,42 @@
 
 #include "amdcert.h"
 #include "commands.h"
+#include "cpuidpage.h"
 #include "crypto.h"
+#include "idblock.h"
+#include "launchsession.h"
+#include "measurecache.h"
+#include "ovmf.h"
 #include "rmp.h"
+#include "rmptable.h"
+#include "rmpmodel.h"
 #include "sevcert.h"
+#include "sevmeasure.h"
+#include "snpmeasure.h"
+#include "swapverify.h"
+#include "vmsa.h"
 #include "utilities.h"      // for WriteToFile
 #include "x509cert.h"
-#include <openssl/hmac.h>   // for calc_measurement
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <stdio.h>          // printf
 #include <stdlib.h>         // malloc
+#include <sys/stat.h>       // mkdir
+#include <algorithm>      // std::min
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>         // std::cin
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+// Measurement cache key kinds for SNP layouts, see snp_layout_cache_key
+#define SNP_LD_CACHE_KIND               "snp-launch-digest-v1"
+#define SNP_LAYOUT_PREFIX_CACHE_KIND    "snp-layout-prefix-v1"
 
 Command::Command(void)
        : m_sev_device(&SEVDevice::get_sev_device())
@@ -660,7 +684,10 @@ int Command::get_ask_ark(void)
     return (int)cmd_ret;
 }
 
-int Command::generate_all_certs(void)
+/**
+ * Writes out each cert, and adds it to certs for the zip
+ */
+int Command::generate_all_certs(std::vector<zip_cert_t> &certs)
 {
     int cmd_ret = -1;
     uint8_t pdh_cert_export_data[sizeof(sev_pdh_cert_export_cmd_buf)];  // pdh_cert_export
@@ -699,19 +726,20 @@ int Command::generate_all_certs(void)
             break;
 
         // Read in the ask_ark so we can split it into 2 separate cert files
-        uint8_t ask_ark_buf[sizeof(amd_cert)*2] = {0};
-        if (sev::read_file(ask_ark_full, ask_ark_buf, sizeof(ask_ark_buf)) == 0)
+        sev::FileView ask_ark;
+        cmd_ret = ERROR_INVALID_CERTIFICATE;
+        if (!ask_ark.open(ask_ark_full))
             break;
 
         // Initialize the ask
-        cmd_ret = tmp_amd.amd_cert_init(&ask, ask_ark_buf);
+        cmd_ret = tmp_amd.amd_cert_init(&ask, ask_ark.data(), ask_ark.size());
         if (cmd_ret != STATUS_SUCCESS)
             break;
         // print_amd_cert_readable(&ask);
 
         // Initialize the ark
         size_t ask_size = tmp_amd.amd_cert_get_size(&ask);
-        cmd_ret = tmp_amd.amd_cert_init(&ark, (uint8_t *)(ask_ark_buf + ask_size));
+        cmd_ret = tmp_amd.amd_cert_init(&ark, ask_ark.data() + ask_size, ask_ark.size() - ask_size);
         if (cmd_ret != STATUS_SUCCESS)
             break;
         // print_amd_cert_readable(&ark);
@@ -738,6 +766,19 @@ int Command::generate_all_certs(void)
         if (sev::write_file(ark_full, ark_binary, ark_size) != ark_size)
             break;
 
+        zip_cert_t cek = { CEK_FILENAME, "" };
+        if (!sev::read_file(cek_full, cek.data))     // Only exists as the download
+            break;
+        zip_cert_t entries[] = {
+            { PDH_FILENAME, std::string((const char *)pdh, sizeof(sev_cert)) },
+            { PEK_FILENAME, std::string((const char *)PEK_IN_CERT_CHAIN(cert_chain), sizeof(sev_cert)) },
+            { OCA_FILENAME, std::string((const char *)OCA_IN_CERT_CHAIN(cert_chain), sizeof(sev_cert)) },
+            cek,
+            { ASK_FILENAME, std::string((const char *)ask_binary, ask_size) },
+            { ARK_FILENAME, std::string((const char *)ark_binary, ark_size) },
+        };
+        certs.assign(entries, entries + sizeof(entries)/sizeof(entries[0]));
+
         cmd_ret = STATUS_SUCCESS;
     } while (0);
 
@@ -748,29 +789,30 @@ int Command::generate_all_certs(void)
     return (int)cmd_ret;
 }
 
-int Command::export_cert_chain(void)
+/**
+ * If archive_fd is valid, the zip is streamed to it (ex. stdout) instead of
+ * being written to the output folder
+ */
+int Command::export_cert_chain(int archive_fd)
 {
     int cmd_ret = -1;
     std::string zip_name = CERTS_ZIP_FILENAME;
-    std::string space = " ";
-    std::string cert_names = m_output_folder + PDH_FILENAME + space +
-                             m_output_folder + PEK_FILENAME + space +
-                             m_output_folder + OCA_FILENAME + space +
-                             m_output_folder + CEK_FILENAME + space +
-                             m_output_folder + ASK_FILENAME + space +
-                             m_output_folder + ARK_FILENAME;
+    std::vector<zip_cert_t> certs;
 
     do {
-        cmd_ret = generate_all_certs();
+        cmd_ret = generate_all_certs(certs);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        cmd_ret = sev::zip_certs(m_output_folder, zip_name, cert_names);
+        cmd_ret = sev::zip_certs(m_output_folder, zip_name, certs, archive_fd);
     } while (0);
     return (int)cmd_ret;
 }
 
-int Command::generate_all_certs_vcek(void)
+/**
+ * Writes out (or revalidates) each cert, and adds it to certs for the zip
+ */
+int Command::generate_all_certs_vcek(std::vector<zip_cert_t> &certs)
 {
     int cmd_ret = -1;
 
@@ -783,13 +825,13 @@ int Command::generate_all_certs_vcek(void)
     do {
         // Generate the vcek from the AMD KDS server
         cmd_ret = m_sev_device->generate_vcek_ask(m_output_folder, vcek_der_file,
-                                                  vcek_pem_file);
+                                                  vcek_pem_file, &certs);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
         // Get the cert_chain (ask_ark) from the AMD KDS server
         cmd_ret = sev::get_ask_ark_pem(m_output_folder, cert_chain_file,
-                                       ask_file, ark_file);
+                                       ask_file, ark_file, &certs);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
@@ -799,16 +841,11 @@ int Command::generate_all_certs_vcek(void)
     return (int)cmd_ret;
 }
 
-int Command::export_cert_chain_vcek(void)
+int Command::export_cert_chain_vcek(int archive_fd)
 {
     int cmd_ret = -1;
     std::string zip_name = CERTS_VCEK_ZIP_FILENAME;
-    std::string space = " ";
-    std::string cert_names = m_output_folder + VCEK_DER_FILENAME + space +
-                             m_output_folder + VCEK_PEM_FILENAME + space +
-                             m_output_folder + VCEK_CERT_CHAIN_PEM_FILENAME + space +
-                             m_output_folder + VCEK_ASK_PEM_FILENAME + space +
-                             m_output_folder + VCEK_ARK_PEM_FILENAME;
+    std::vector<zip_cert_t> certs;
 
     do {
         if (sev::get_device_type() != PSP_DEVICE_TYPE_MILAN) {
@@ -817,11 +854,11 @@ int Command::export_cert_chain_vcek(void)
             break;
         }
 
-        cmd_ret = generate_all_certs_vcek();
+        cmd_ret = generate_all_certs_vcek(certs);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        cmd_ret = sev::zip_certs(m_output_folder, zip_name, cert_names);
+        cmd_ret = sev::zip_certs(m_output_folder, zip_name, certs, archive_fd);
     } while (0);
     return (int)cmd_ret;
 }
@@ -830,43 +867,7 @@ int Command::export_cert_chain_vcek(void)
 // exist in this context, so we read the user input params for all of our data
 int Command::calculate_measurement(measurement_t *user_data, hmac_sha_256 *final_meas)
 {
-    int cmd_ret = ERROR_UNSUPPORTED;
-
-    uint32_t measurement_length = sizeof(final_meas);
-
-    // Create and initialize the context
-    HMAC_CTX *ctx;
-    if (!(ctx = HMAC_CTX_new()))
-        return ERROR_BAD_MEASUREMENT;
-
-    do {
-        if (HMAC_Init_ex(ctx, user_data->tik, sizeof(user_data->tik), EVP_sha256(), NULL) != 1)
-            break;
-        if (sev::min_api_version(user_data->api_major, user_data->api_minor, 0, 17)) {
-            if (HMAC_Update(ctx, &user_data->meas_ctx, sizeof(user_data->meas_ctx)) != 1)
-                break;
-            if (HMAC_Update(ctx, &user_data->api_major, sizeof(user_data->api_major)) != 1)
-                break;
-            if (HMAC_Update(ctx, &user_data->api_minor, sizeof(user_data->api_minor)) != 1)
-                break;
-            if (HMAC_Update(ctx, &user_data->build_id, sizeof(user_data->build_id)) != 1)
-                break;
-        }
-        if (HMAC_Update(ctx, (uint8_t *)&user_data->policy, sizeof(user_data->policy)) != 1)
-            break;
-        if (HMAC_Update(ctx, (uint8_t *)&user_data->digest, sizeof(user_data->digest)) != 1)
-            break;
-        // Use the same random MNonce as the FW in our validation calculations
-        if (HMAC_Update(ctx, (uint8_t *)&user_data->mnonce, sizeof(user_data->mnonce)) != 1)
-            break;
-        if (HMAC_Final(ctx, (uint8_t *)final_meas, &measurement_length) != 1)  // size = 32
-            break;
-
-        cmd_ret = STATUS_SUCCESS;
-    } while (0);
-
-    HMAC_CTX_free(ctx);
-    return cmd_ret;
+    return LaunchSession::calculate_measurement(user_data, final_meas);
 }
 
 int Command::calc_measurement(measurement_t *user_data)
@@ -917,6 +918,1545 @@ int Command::calc_measurement(measurement_t *user_data)
     return (int)cmd_ret;
 }
 
+/**
+ * Parses one line of calc_measurement_batch input: the same 8 args as
+ * calc_measurement, in the same order, separated by whitespace. The hex
+ * byte arrays must be exactly the right length
+ */
+static bool parse_measurement_line(const std::string &line, measurement_t *user_data)
+{
+    std::istringstream fields(line);
+    std::string meas_ctx, api_major, api_minor, build_id, policy, digest, mnonce, tik, extra;
+    char *end = NULL;
+
+    if (!(fields >> meas_ctx >> api_major >> api_minor >> build_id >> policy >>
+                    digest >> mnonce >> tik) || (fields >> extra))
+        return false;
+
+    if (digest.size() != sizeof(user_data->digest)*2 ||
+        mnonce.size() != sizeof(user_data->mnonce)*2 ||
+        tik.size() != sizeof(user_data->tik)*2)
+        return false;
+
+    user_data->meas_ctx = (uint8_t)strtoul(meas_ctx.c_str(), &end, 16);
+    if (*end != '\0')
+        return false;
+    user_data->api_major = (uint8_t)strtoul(api_major.c_str(), &end, 16);
+    if (*end != '\0')
+        return false;
+    user_data->api_minor = (uint8_t)strtoul(api_minor.c_str(), &end, 16);
+    if (*end != '\0')
+        return false;
+    user_data->build_id = (uint8_t)strtoul(build_id.c_str(), &end, 16);
+    if (*end != '\0')
+        return false;
+    user_data->policy = (uint32_t)strtoul(policy.c_str(), &end, 16);
+    if (*end != '\0')
+        return false;
+
+    return sev::str_to_array(digest, (uint8_t *)&user_data->digest, sizeof(user_data->digest)) &&
+           sev::str_to_array(mnonce, (uint8_t *)&user_data->mnonce, sizeof(user_data->mnonce)) &&
+           sev::str_to_array(tik, (uint8_t *)&user_data->tik, sizeof(user_data->tik));
+}
+
+/**
+ * Appends a measurement (and so its TIK) to inputs. When inputs is full it is
+ * grown by hand and the old buffer wiped, so no reallocation leaves a copy
+ * of a TIK behind
+ */
+static void push_back_measurement(std::vector<measurement_t> &inputs, const measurement_t &user_data)
+{
+    if (inputs.size() == inputs.capacity()) {
+        std::vector<measurement_t> grown;
+        grown.reserve(std::max((size_t)64, inputs.capacity() * 2));
+        grown.assign(inputs.begin(), inputs.end());
+        if (!inputs.empty())
+            OPENSSL_cleanse(inputs.data(), inputs.size() * sizeof(measurement_t));
+        inputs.swap(grown);
+    }
+    inputs.push_back(user_data);
+}
+
+/**
+ * Computes a launch measurement for every line of input_file ("-" for stdin),
+ * spread across one worker thread per CPU (each computing its measurements
+ * with its own HMACSha256 per call, see LaunchSession::calculate_measurement).
+ * Blank lines and lines starting with '#' are skipped. The measurements are
+ * written one per line, in the same order as the input
+ */
+int Command::calc_measurement_batch(const std::string input_file)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    std::string meas_batch_path = m_output_folder + CALC_MEASUREMENT_BATCH_FILENAME;
+    std::ifstream input_fstream;
+    std::istream *input = &std::cin;
+    std::string line = "";
+    size_t line_num = 0;
+    std::vector<measurement_t> inputs;
+    std::vector<uint8_t> results;          // sizeof(hmac_sha_256) per input
+    std::atomic<uint32_t> num_failed(0);
+    std::vector<std::thread> workers;
+    size_t num_threads = std::thread::hardware_concurrency();
+
+    do {
+        if (input_file != "-") {
+            input_fstream.open(input_file);
+            if (!input_fstream.is_open()) {
+                printf("Error: unable to open %s\n", input_file.c_str());
+                break;
+            }
+            input = &input_fstream;
+        }
+
+        while (std::getline(*input, line)) {
+            measurement_t user_data;
+            line_num++;
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#')
+                continue;
+            memset(&user_data, 0, sizeof(user_data));
+            bool parsed = parse_measurement_line(line, &user_data);
+            if (parsed)
+                push_back_measurement(inputs, user_data);
+            OPENSSL_cleanse(&user_data, sizeof(user_data));
+            if (!parsed) {
+                printf("Error: invalid calc_measurement args on line %zu\n", line_num);
+                cmd_ret = ERROR_INVALID_PARAM;
+                break;
+            }
+        }
+        if (cmd_ret == ERROR_INVALID_PARAM)
+            break;
+        if (inputs.empty()) {
+            printf("Error: no measurements found in %s\n", input_file.c_str());
+            cmd_ret = ERROR_INVALID_PARAM;
+            break;
+        }
+
+        // Each thread does one contiguous slice, writing straight into its
+        // slot in results, so the output order matches the input order
+        results.resize(inputs.size() * sizeof(hmac_sha_256));
+        if (num_threads == 0)
+            num_threads = 1;
+        if (num_threads > inputs.size())
+            num_threads = inputs.size();
+        size_t per_thread = (inputs.size() + num_threads - 1) / num_threads;
+
+        for (size_t t = 0; t < num_threads; t++) {
+            size_t first = t * per_thread;
+            size_t last = std::min(first + per_thread, inputs.size());
+            workers.push_back(std::thread([&, first, last]() {
+                for (size_t i = first; i < last; i++) {
+                    hmac_sha_256 *final_meas = (hmac_sha_256 *)&results[i * sizeof(hmac_sha_256)];
+                    if (calculate_measurement(&inputs[i], final_meas) != STATUS_SUCCESS)
+                        num_failed++;
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+
+        if (num_failed != 0)
+            break;
+
+        std::string out = "";
+        out.reserve(inputs.size() * (sizeof(hmac_sha_256)*2 + 1));
+        for (size_t i = 0; i < inputs.size(); i++) {
+            char meas_buf[sizeof(hmac_sha_256)*2+1] = {0};  // 2 chars per byte +1 for null term
+            for (size_t j = 0; j < sizeof(hmac_sha_256); j++)
+                sprintf(meas_buf + j*2, "%02x", results[i * sizeof(hmac_sha_256) + j]);
+            out += meas_buf;
+            out += "\n";
+        }
+
+        if (m_verbose_flag)
+            printf("%s\n%zu measurements using %zu threads\n", out.c_str(),
+                   inputs.size(), num_threads);
+
+        if (sev::write_file(meas_batch_path, out.data(), out.size()) != out.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    // The inputs hold every TIK, the only copies left (see push_back_measurement)
+    if (!inputs.empty())
+        OPENSSL_cleanse(inputs.data(), inputs.size() * sizeof(measurement_t));
+
+    return (int)cmd_ret;
+}
+
+/**
+ * Adds every range in an SNP page layout file to digest. Each line is
+ *   [page type] [gpa] [length] [source]
+ * page type is normal, vmsa, zero, unmeasured, secrets or cpuid. Numbers are
+ * decimal or 0x hex. NORMAL and VMSA pages need a source: either an offset
+ * into the firmware image, or the name of a file holding the contents. The
+ * line "firmware" on its own adds the whole image as NORMAL pages ending at
+ * 4GB, where OVMF is mapped. Files named as sources are mapped into files
+ * and must be unmapped by the caller
+ */
+static int parse_snp_layout(const std::string layout_file, const uint8_t *fw, size_t fw_size,
+                            SNPLaunchDigest &digest, VMSASet &vmsas,
+                            std::vector<std::pair<const uint8_t *, size_t> > &files)
+{
+    std::ifstream layout(layout_file);
+    std::string line = "";
+    size_t line_num = 0;
+
+    if (!layout.is_open()) {
+        printf("Error: unable to open %s\n", layout_file.c_str());
+        return ERROR_INVALID_PARAM;
+    }
+
+    while (std::getline(layout, line)) {
+        std::istringstream fields(line);
+        std::string type_str = "", gpa_str = "", length_str = "", source = "", extra = "";
+        uint8_t page_type = 0;
+        uint64_t gpa = 0, length = 0;
+        const uint8_t *data = NULL;
+        char *end = NULL;
+
+        line_num++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        fields >> type_str;
+        if (type_str == "firmware" && !(fields >> extra)) {
+            if ((fw_size % PAGE_SIZE_4K) != 0) {
+                printf("Error: firmware image size isn't a multiple of 4K\n");
+                return ERROR_INVALID_LENGTH;
+            }
+            if (fw_size > 0x100000000ULL) {
+                printf("Error: firmware image is larger than 4GB, it must end at 4GB\n");
+                return ERROR_INVALID_LENGTH;
+            }
+            if (digest.add_range(SNP_PAGE_TYPE_NORMAL, 0x100000000ULL - fw_size, fw_size, fw) != STATUS_SUCCESS)
+                return ERROR_INVALID_PARAM;
+            continue;
+        }
+
+        // vcpus [count] [vcpu type] [ap eip] [vmm]: every vCPU's VMSA, built here
+        if (type_str == "vcpus") {
+            std::string count_str = "", vcpu_type = "", ap_eip_str = "0", vmm = "qemu";
+            unsigned long count = 0, ap_eip = 0;
+            uint32_t vcpu_sig = 0;
+            vmm_type_t vmm_type = VMM_TYPE_QEMU;
+
+            fields >> count_str >> vcpu_type;
+            if (!(fields >> ap_eip_str) || !(fields >> vmm))
+                fields.clear();
+            count = strtoul(count_str.c_str(), &end, 0);
+            bool valid = !count_str.empty() && *end == '\0' && count != 0 && count <= UINT32_MAX;
+            ap_eip = strtoul(ap_eip_str.c_str(), &end, 0);
+            valid = valid && *end == '\0' && ap_eip <= UINT32_MAX && (count == 1 || ap_eip != 0);
+            if (!valid || fields >> extra || !vcpu_sig_from_name(vcpu_type, &vcpu_sig) ||
+                !vmm_type_from_name(vmm, &vmm_type)) {
+                printf("Error: invalid vcpus line %zu\n", line_num);
+                return ERROR_INVALID_PARAM;
+            }
+
+            size_t first_vcpu = vmsas.num_vcpus();
+            vmsas.add_vcpus((uint32_t)count, (uint32_t)ap_eip, VMSA_SEV_FEATURE_SNP,
+                            vcpu_sig, vmm_type);
+            for (size_t vcpu = first_vcpu; vcpu < vmsas.num_vcpus(); vcpu++) {
+                if (digest.add_range(SNP_PAGE_TYPE_VMSA, VMSA_SNP_GPA, VMSA_PAGE_SIZE,
+                                     (const uint8_t *)vmsas.page(vcpu)) != STATUS_SUCCESS)
+                    return ERROR_INVALID_PARAM;
+            }
+            continue;
+        }
+
+        if (!SNPLaunchDigest::page_type_from_name(type_str, &page_type) ||
+            !(fields >> gpa_str >> length_str)) {
+            printf("Error: invalid page layout on line %zu\n", line_num);
+            return ERROR_INVALID_PARAM;
+        }
+        gpa = strtoull(gpa_str.c_str(), &end, 0);
+        if (*end != '\0') {
+            printf("Error: invalid gpa on line %zu\n", line_num);
+            return ERROR_INVALID_PARAM;
+        }
+        length = strtoull(length_str.c_str(), &end, 0);
+        if (*end != '\0') {
+            printf("Error: invalid length on line %zu\n", line_num);
+            return ERROR_INVALID_PARAM;
+        }
+
+        if (fields >> source) {
+            uint64_t offset = strtoull(source.c_str(), &end, 0);
+            if (*end == '\0') {     // Offset into the firmware image
+                if (offset > fw_size || length > fw_size - offset) {
+                    printf("Error: line %zu is past the end of the firmware image\n", line_num);
+                    return ERROR_INVALID_LENGTH;
+                }
+                data = fw + offset;
+            }
+            else {                  // Contents from another file
+                size_t file_size = 0;
+                if (!(data = sev::map_file(source, &file_size)))
+                    return ERROR_INVALID_PARAM;
+                files.push_back(std::make_pair(data, file_size));
+                if (length > file_size) {
+                    printf("Error: %s is shorter than line %zu's length\n", source.c_str(), line_num);
+                    return ERROR_INVALID_LENGTH;
+                }
+            }
+        }
+
+        if (fields >> extra ||
+            digest.add_range(page_type, gpa, length, data) != STATUS_SUCCESS) {
+            printf("Error: invalid page layout on line %zu\n", line_num);
+            return ERROR_INVALID_PARAM;
+        }
+    }
+
+    if (digest.num_pages() == 0) {
+        printf("Error: no pages found in %s\n", layout_file.c_str());
+        return ERROR_INVALID_PARAM;
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Cache key for a layout's launch digest: the firmware image's digest, and
+ * each layout line's fields with source files replaced by their digests.
+ * kind keeps what's cached apart: calc_snp_measurement's full launch digests
+ * and calc_snp_measurement_matrix's prefixes (the layout without vCPUs,
+ * which the matrix adds) must never be mistaken for each other
+ */
+static bool snp_layout_cache_key(MeasurementCache &cache, const char *kind,
+                                 const std::string firmware_file, const std::string layout_file,
+                                 uint8_t key[MEASUREMENT_CACHE_KEY_SIZE])
+{
+    MeasurementCacheKey builder(kind);
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    std::ifstream layout(layout_file);
+    std::string line = "";
+
+    if (!layout.is_open()) {
+        printf("Error: unable to open %s\n", layout_file.c_str());
+        return false;
+    }
+    if (!cache.file_digest(firmware_file, digest))
+        return false;
+    builder.add(digest, sizeof(digest));
+
+    while (std::getline(layout, line)) {
+        std::istringstream fields(line);
+        std::string field = "";
+        size_t num_fields = 0;
+
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        while (fields >> field) {
+            char *end = NULL;
+            strtoull(field.c_str(), &end, 0);
+            // [page type] [gpa] [length] [source]: a source that isn't an offset is a file
+            if (num_fields++ == 3 && *end != '\0') {
+                if (!cache.file_digest(field, digest))
+                    return false;
+                builder.add(digest, sizeof(digest));
+                continue;
+            }
+            builder.add(field);
+        }
+        builder.add((uint64_t)num_fields);
+    }
+
+    return builder.final(key);
+}
+
+/**
+ * Calculates the SNP launch digest (MEASUREMENT in the attestation report)
+ * the firmware will compute for a guest launched with the given firmware
+ * image and page layout, without a platform
+ */
+int Command::calc_snp_measurement(const std::string firmware_file, const std::string layout_file)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    std::string meas_path = m_output_folder + CALC_SNP_MEASUREMENT_FILENAME;
+    std::string meas_readable_path = m_output_folder + CALC_SNP_MEASUREMENT_READABLE_FILENAME;
+    const uint8_t *fw = NULL;
+    size_t fw_size = 0;
+    std::vector<std::pair<const uint8_t *, size_t> > files;
+    SNPLaunchDigest digest;
+    VMSASet vmsas;
+    uint8_t ld[SNP_LD_SIZE];
+
+    MeasurementCache cache;
+    uint8_t key[MEASUREMENT_CACHE_KEY_SIZE];
+    bool cached = false;
+
+    do {
+        if (!m_measurement_cache.empty()) {
+            if (!cache.open(m_measurement_cache))
+                printf("Warning: unable to read the measurement cache %s\n", m_measurement_cache.c_str());
+            if (!snp_layout_cache_key(cache, SNP_LD_CACHE_KIND, firmware_file, layout_file, key)) {
+                cmd_ret = ERROR_INVALID_PARAM;
+                break;
+            }
+            cached = cache.lookup(key, ld, sizeof(ld));
+        }
+
+        if (!cached) {
+            if (!(fw = sev::map_file(firmware_file, &fw_size)))
+                break;
+
+            cmd_ret = parse_snp_layout(layout_file, fw, fw_size, digest, vmsas, files);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+
+            cmd_ret = digest.calculate(ld);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+
+            if (!m_measurement_cache.empty() && !cache.store(key, ld, sizeof(ld)))
+                printf("Warning: unable to update the measurement cache %s\n", m_measurement_cache.c_str());
+        }
+
+        char meas_buf[sizeof(ld)*2+1] = {0}; // 2 chars per byte +1 for null term
+        for (size_t i = 0; i < sizeof(ld); i++)
+            sprintf(meas_buf + i*2, "%02x", ld[i]);
+        std::string meas_str = meas_buf;
+
+        if (m_verbose_flag && cached)
+            printf("From the measurement cache\n%s\n", meas_str.c_str());
+        else if (m_verbose_flag)
+            printf("%zu pages measured\n%s\n", digest.num_pages(), meas_str.c_str());
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(meas_readable_path, meas_str.c_str(), meas_str.size()) != meas_str.size())
+            break;
+        if (sev::write_file(meas_path, ld, sizeof(ld)) != sizeof(ld))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    for (size_t i = 0; i < files.size(); i++)
+        sev::unmap_file(files[i].first, files[i].second);
+    sev::unmap_file(fw, fw_size);
+
+    return cmd_ret;
+}
+
+/**
+ * One firmware image of an SNP measurement matrix. Its layout is measured
+ * once into prefix_ld, which every vCPU count and VMM variant continues from
+ */
+struct snp_matrix_image_t {
+    std::string name;
+    std::string firmware_file;
+    std::string layout_file;
+    uint32_t ap_eip;                // 0 to read it from the image's footer table
+    uint8_t prefix_ld[SNP_LD_SIZE];
+};
+
+/**
+ * Parses a calc_snp_measurement_matrix input file, whose lines are
+ *   image [name] [firmware file] [layout file] [ap eip]
+ *   vcpus [count] ...
+ *   policy [policy in hex] ...
+ *   vmm [qemu|ec2] ...
+ *   vcpu_type [QEMU CPU model or hex signature]
+ * ap eip is optional. Every line but vcpu_type may repeat, each value adding
+ * to its axis
+ */
+static int parse_snp_matrix(const std::string input_file, std::vector<snp_matrix_image_t> &images,
+                            std::set<uint32_t> &vcpus, std::set<uint64_t> &policies,
+                            std::set<vmm_type_t> &vmms, uint32_t *vcpu_sig)
+{
+    std::ifstream input(input_file);
+    std::string line = "";
+    size_t line_num = 0;
+    bool have_vcpu_type = false;
+
+    if (!input.is_open()) {
+        printf("Error: unable to open %s\n", input_file.c_str());
+        return ERROR_INVALID_PARAM;
+    }
+
+    while (std::getline(input, line)) {
+        std::istringstream fields(line);
+        std::string key = "", value = "", extra = "";
+        char *end = NULL;
+        bool valid = true;
+
+        line_num++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        fields >> key;
+        if (key == "image") {
+            snp_matrix_image_t image;
+            std::string ap_eip_str = "0";
+            fields >> image.name >> image.firmware_file >> image.layout_file;
+            if (!(fields >> ap_eip_str))
+                fields.clear();
+            unsigned long ap_eip = strtoul(ap_eip_str.c_str(), &end, 0);
+            valid = !image.layout_file.empty() && *end == '\0' && ap_eip <= UINT32_MAX &&
+                    !(fields >> extra);
+            image.ap_eip = (uint32_t)ap_eip;
+            for (size_t i = 0; valid && i < images.size(); i++)
+                valid = (images[i].name != image.name);
+            if (valid)
+                images.push_back(image);
+        }
+        else if (key == "vcpu_type") {
+            valid = (fields >> value) && !(fields >> extra) && !have_vcpu_type &&
+                    vcpu_sig_from_name(value, vcpu_sig);
+            have_vcpu_type = true;
+        }
+        else if (key == "vcpus" || key == "policy" || key == "vmm") {
+            size_t num_values = 0;
+            while (valid && fields >> value) {
+                num_values++;
+                if (key == "vcpus") {
+                    unsigned long count = strtoul(value.c_str(), &end, 10);
+                    valid = (*end == '\0' && count != 0 && count <= UINT32_MAX);
+                    vcpus.insert((uint32_t)count);
+                }
+                else if (key == "policy") {
+                    unsigned long long policy = strtoull(value.c_str(), &end, 16);
+                    valid = (*end == '\0');
+                    policies.insert((uint64_t)policy);
+                }
+                else {
+                    vmm_type_t vmm_type = VMM_TYPE_QEMU;
+                    valid = vmm_type_from_name(value, &vmm_type);
+                    vmms.insert(vmm_type);
+                }
+            }
+            valid = valid && num_values != 0;
+        }
+        else {
+            valid = false;
+        }
+
+        if (!valid) {
+            printf("Error: invalid matrix input on line %zu\n", line_num);
+            return ERROR_INVALID_PARAM;
+        }
+    }
+
+    if (vmms.empty())
+        vmms.insert(VMM_TYPE_QEMU);
+    if (images.empty() || vcpus.empty() || policies.empty() || !have_vcpu_type) {
+        printf("Error: the matrix needs at least one image, vcpus and policy, and a vcpu_type\n");
+        return ERROR_INVALID_PARAM;
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Calculates the SNP launch digest of every combination of firmware image,
+ * vCPU count, VMM and policy in input_file, and writes them as an index
+ * sorted by measurement, one line per combination:
+ *   [measurement] [image] [vcpus] [vmm] [policy]
+ * The work that doesn't depend on the varying axes is done once: each image's
+ * firmware pages are measured once, then for each image and VMM the vCPUs'
+ * VMSAs are chained onto that digest one at a time, reading off the digest
+ * for every requested vCPU count along the way (a guest with N vCPUs measures
+ * the same pages as one with N-1, plus one more VMSA). The policy isn't part
+ * of the launch digest, so policies of the same guest share one measurement.
+ * The image/VMM chains run on one worker thread per CPU
+ */
+int Command::calc_snp_measurement_matrix(const std::string input_file)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    std::string index_path = m_output_folder + CALC_SNP_MEASUREMENT_MATRIX_FILENAME;
+    std::vector<snp_matrix_image_t> images;
+    std::set<uint32_t> vcpu_set;
+    std::set<uint64_t> policies;
+    std::set<vmm_type_t> vmm_set;
+    uint32_t vcpu_sig = 0;
+    MeasurementCache cache;
+    std::vector<uint8_t> lds;       // SNP_LD_SIZE per (image, vmm, vcpus)
+    std::atomic<size_t> next_task(0);
+    std::atomic<uint32_t> num_failed(0);
+    std::vector<std::thread> workers;
+    size_t num_threads = std::thread::hardware_concurrency();
+    size_t num_cached = 0;
+
+    do {
+        cmd_ret = parse_snp_matrix(input_file, images, vcpu_set, policies, vmm_set, &vcpu_sig);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = ERROR_INVALID_PARAM;
+        std::vector<uint32_t> vcpus(vcpu_set.begin(), vcpu_set.end());
+        std::vector<vmm_type_t> vmms(vmm_set.begin(), vmm_set.end());
+        uint32_t max_vcpus = vcpus.back();
+
+        if (!m_measurement_cache.empty() && !cache.open(m_measurement_cache))
+            printf("Warning: unable to read the measurement cache %s\n", m_measurement_cache.c_str());
+
+        // The shared prefix: each image's layout (without vCPUs), measured on all CPUs
+        size_t i = 0;
+        for (i = 0; i < images.size(); i++) {
+            snp_matrix_image_t &image = images[i];
+            const uint8_t *fw = NULL;
+            size_t fw_size = 0;
+            std::vector<std::pair<const uint8_t *, size_t> > files;
+            SNPLaunchDigest digest;
+            VMSASet vmsas;
+            OVMFImage ovmf;
+            uint8_t key[MEASUREMENT_CACHE_KEY_SIZE];
+            bool cached = false;
+            int ret = ERROR_INVALID_PARAM;
+
+            do {
+                if (!(fw = sev::map_file(image.firmware_file, &fw_size)))
+                    break;
+                if (image.ap_eip == 0 && max_vcpus > 1 &&
+                    (!ovmf.parse(fw, fw_size) || !ovmf.sev_es_reset_eip(&image.ap_eip))) {
+                    printf("Error: %s has no SEV-ES reset block, give image %s's ap eip\n",
+                           image.firmware_file.c_str(), image.name.c_str());
+                    break;
+                }
+
+                if (!m_measurement_cache.empty()) {
+                    if (!snp_layout_cache_key(cache, SNP_LAYOUT_PREFIX_CACHE_KIND,
+                                              image.firmware_file, image.layout_file, key))
+                        break;
+                    cached = cache.lookup(key, image.prefix_ld, sizeof(image.prefix_ld));
+                }
+                if (cached) {
+                    num_cached++;
+                    ret = STATUS_SUCCESS;
+                    break;
+                }
+
+                ret = parse_snp_layout(image.layout_file, fw, fw_size, digest, vmsas, files);
+                if (ret != STATUS_SUCCESS)
+                    break;
+                if (vmsas.num_vcpus() != 0) {
+                    printf("Error: %s has a vcpus line, the matrix adds the vCPUs\n",
+                           image.layout_file.c_str());
+                    ret = ERROR_INVALID_PARAM;
+                    break;
+                }
+                ret = digest.calculate(image.prefix_ld);
+                if (ret != STATUS_SUCCESS)
+                    break;
+
+                if (!m_measurement_cache.empty() &&
+                    !cache.store(key, image.prefix_ld, sizeof(image.prefix_ld)))
+                    printf("Warning: unable to update the measurement cache %s\n", m_measurement_cache.c_str());
+            } while (0);
+
+            for (size_t f = 0; f < files.size(); f++)
+                sev::unmap_file(files[f].first, files[f].second);
+            sev::unmap_file(fw, fw_size);
+            if (ret != STATUS_SUCCESS)
+                break;
+        }
+        if (i != images.size())
+            break;
+
+        // One task per image and VMM, each walking the vCPU counts in order
+        size_t num_tasks = images.size() * vmms.size();
+        lds.resize(num_tasks * vcpus.size() * SNP_LD_SIZE);
+        if (num_threads == 0)
+            num_threads = 1;
+        if (num_threads > num_tasks)
+            num_threads = num_tasks;
+
+        for (size_t t = 0; t < num_threads; t++) {
+            workers.push_back(std::thread([&]() {
+                size_t task = 0;
+                while ((task = next_task++) < num_tasks && num_failed == 0) {
+                    const snp_matrix_image_t &image = images[task / vmms.size()];
+                    VMSASet vmsas;
+                    std::map<const sev_es_save_area *, std::vector<uint8_t> > hashes;
+                    uint8_t cur[SNP_LD_SIZE];
+                    size_t next_count = 0;
+
+                    vmsas.add_vcpus(max_vcpus, image.ap_eip, VMSA_SEV_FEATURE_SNP, vcpu_sig,
+                                    vmms[task % vmms.size()]);
+                    memcpy(cur, image.prefix_ld, sizeof(cur));
+                    for (size_t vcpu = 0; vcpu < vmsas.num_vcpus(); vcpu++) {
+                        std::vector<uint8_t> &contents = hashes[vmsas.page(vcpu)];
+                        if (contents.empty()) {     // Each distinct VMSA is hashed once
+                            contents.resize(SNP_LD_SIZE);
+                            if (!digest_sha(vmsas.page(vcpu), VMSA_PAGE_SIZE, contents.data(),
+                                            SNP_LD_SIZE, SHA_TYPE_384)) {
+                                num_failed++;
+                                break;
+                            }
+                        }
+                        if (!SNPLaunchDigest::update_page(cur, contents.data(), SNP_PAGE_TYPE_VMSA,
+                                                          VMSA_SNP_GPA)) {
+                            num_failed++;
+                            break;
+                        }
+                        if (vcpu + 1 == vcpus[next_count])
+                            memcpy(&lds[(task * vcpus.size() + next_count++) * SNP_LD_SIZE],
+                                   cur, sizeof(cur));
+                    }
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+        if (num_failed != 0)
+            break;
+
+        // Sorted by measurement, so a report's MEASUREMENT can be binary searched
+        struct index_entry_t {
+            std::string measurement;
+            const std::string *image;
+            uint32_t vcpus;
+            vmm_type_t vmm;
+            uint64_t policy;
+            bool operator<(const index_entry_t &other) const {
+                if (measurement != other.measurement)
+                    return measurement < other.measurement;
+                if (*image != *other.image)
+                    return *image < *other.image;
+                if (vcpus != other.vcpus)
+                    return vcpus < other.vcpus;
+                if (vmm != other.vmm)
+                    return vmm < other.vmm;
+                return policy < other.policy;
+            }
+        };
+        std::vector<index_entry_t> index;
+        index.reserve(num_tasks * vcpus.size() * policies.size());
+        for (size_t task = 0; task < num_tasks; task++) {
+            for (size_t v = 0; v < vcpus.size(); v++) {
+                const uint8_t *ld = &lds[(task * vcpus.size() + v) * SNP_LD_SIZE];
+                char meas_buf[SNP_LD_SIZE*2+1] = {0};   // 2 chars per byte +1 for null term
+                for (size_t j = 0; j < SNP_LD_SIZE; j++)
+                    sprintf(meas_buf + j*2, "%02x", ld[j]);
+                for (std::set<uint64_t>::iterator it = policies.begin(); it != policies.end(); ++it) {
+                    index_entry_t entry;
+                    entry.measurement = meas_buf;
+                    entry.image = &images[task / vmms.size()].name;
+                    entry.vcpus = vcpus[v];
+                    entry.vmm = vmms[task % vmms.size()];
+                    entry.policy = *it;
+                    index.push_back(entry);
+                }
+            }
+        }
+        std::sort(index.begin(), index.end());
+
+        std::string out = "";
+        out.reserve(index.size() * (SNP_LD_SIZE*2 + 64));
+        for (size_t e = 0; e < index.size(); e++) {
+            char fields[64];
+            snprintf(fields, sizeof(fields), " %u %s %llx\n", index[e].vcpus,
+                     index[e].vmm == VMM_TYPE_EC2 ? "ec2" : "qemu",
+                     (unsigned long long)index[e].policy);
+            out += index[e].measurement + " " + *index[e].image + fields;
+        }
+
+        if (m_verbose_flag)
+            printf("%s\n%zu measurements, %zu images (%zu from the cache), %zu chains using %zu threads\n",
+                   out.c_str(), index.size(), images.size(), num_cached, num_tasks, num_threads);
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(index_path, out.data(), out.size()) != out.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Reads a calc_launch_digest input file: key=value lines, blank lines and
+ * lines starting with '#' skipped
+ */
+static bool parse_launch_digest_input(const std::string input_file,
+                                      std::map<std::string, std::string> &values)
+{
+    std::ifstream input(input_file);
+    std::string line = "";
+    size_t line_num = 0;
+
+    if (!input.is_open()) {
+        printf("Error: unable to open %s\n", input_file.c_str());
+        return false;
+    }
+
+    while (std::getline(input, line)) {
+        line_num++;
+        if (!line.empty() && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            printf("Error: expecting key=value on line %zu\n", line_num);
+            return false;
+        }
+        values[line.substr(first, eq - first)] = line.substr(eq + 1);
+    }
+    return true;
+}
+
+static bool parse_hex_value(const std::string str, uint32_t max, uint32_t *value)
+{
+    char *end = NULL;
+    unsigned long val = strtoul(str.c_str(), &end, 16);
+    if (str.empty() || *end != '\0' || val > max)
+        return false;
+    *value = (uint32_t)val;
+    return true;
+}
+
+/**
+ * Computes a SEV or SEV-ES guest's launch digest (GCTX.LD) from its OVMF
+ * image, and kernel, initrd and command line if booted with -kernel. If the
+ * input also has the LAUNCH_MEASURE inputs (api_major, api_minor, build_id,
+ * policy, mnonce, tik), the launch measurement is calculated from it too,
+ * as calc_measurement would
+ */
+int Command::calc_launch_digest(const std::string input_file)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string ld_path = m_output_folder + CALC_LAUNCH_DIGEST_FILENAME;
+    std::string ld_readable_path = m_output_folder + CALC_LAUNCH_DIGEST_READABLE_FILENAME;
+    std::map<std::string, std::string> values;
+    sev_launch_digest_input_t input;
+    uint8_t ld[SHA256_DIGEST_LENGTH];
+    measurement_t user_data;
+    const char *measure_keys[] = { "api_major", "api_minor", "build_id", "policy", "mnonce", "tik" };
+    size_t num_measure_keys = 0;
+
+    memset(&user_data, 0, sizeof(user_data));
+
+    do {
+        if (!parse_launch_digest_input(input_file, values))
+            break;
+
+        if (values["mode"] == "sev") {
+            input.mode = SEV_LAUNCH_MODE_SEV;
+        }
+        else if (values["mode"] == "sev-es") {
+            input.mode = SEV_LAUNCH_MODE_SEV_ES;
+        }
+        else {
+            printf("Error: mode must be sev or sev-es\n");
+            break;
+        }
+
+        input.ovmf_file = values["ovmf"];
+        input.kernel_file = values["kernel"];
+        input.initrd_file = values["initrd"];
+        input.append = values["append"];
+        input.vcpus = 1;
+        input.vcpu_sig = 0;
+        input.vmm_type = VMM_TYPE_QEMU;
+        if (input.ovmf_file.empty()) {
+            printf("Error: ovmf is required\n");
+            break;
+        }
+        if (input.kernel_file.empty() && (!input.initrd_file.empty() || !input.append.empty())) {
+            printf("Error: initrd and append need a kernel\n");
+            break;
+        }
+
+        if (input.mode == SEV_LAUNCH_MODE_SEV_ES) {
+            char *end = NULL;
+            if (values.count("vcpus")) {
+                unsigned long vcpus = strtoul(values["vcpus"].c_str(), &end, 10);
+                if (*end != '\0' || vcpus == 0 || vcpus > UINT32_MAX) {
+                    printf("Error: invalid vcpus\n");
+                    break;
+                }
+                input.vcpus = (uint32_t)vcpus;
+            }
+            if (values.count("vcpu_type")) {
+                if (!vcpu_sig_from_name(values["vcpu_type"], &input.vcpu_sig)) {
+                    printf("Error: unknown vcpu_type %s\n", values["vcpu_type"].c_str());
+                    break;
+                }
+            }
+            else if (!parse_hex_value(values["vcpu_sig"], UINT32_MAX, &input.vcpu_sig)) {
+                printf("Error: sev-es needs vcpu_type, or vcpu_sig (the vCPU's CPUID 1 EAX in hex)\n");
+                break;
+            }
+            if (values.count("vmm") && !vmm_type_from_name(values["vmm"], &input.vmm_type)) {
+                printf("Error: vmm must be qemu or ec2\n");
+                break;
+            }
+        }
+
+        // Either all or none of the measurement inputs
+        for (size_t i = 0; i < sizeof(measure_keys)/sizeof(measure_keys[0]); i++)
+            num_measure_keys += values.count(measure_keys[i]);
+        if (num_measure_keys != 0) {
+            uint32_t val = 0;
+            if (num_measure_keys != sizeof(measure_keys)/sizeof(measure_keys[0])) {
+                printf("Error: calculating the measurement needs all of api_major, " \
+                       "api_minor, build_id, policy, mnonce, tik\n");
+                break;
+            }
+            user_data.meas_ctx = LAUNCH_MEASURE_CTX;
+            if (!parse_hex_value(values["api_major"], 0xff, &val))
+                break;
+            user_data.api_major = (uint8_t)val;
+            if (!parse_hex_value(values["api_minor"], 0xff, &val))
+                break;
+            user_data.api_minor = (uint8_t)val;
+            if (!parse_hex_value(values["build_id"], 0xff, &val))
+                break;
+            user_data.build_id = (uint8_t)val;
+            if (!parse_hex_value(values["policy"], UINT32_MAX, &user_data.policy))
+                break;
+            if (values["mnonce"].size() != sizeof(user_data.mnonce)*2 ||
+                values["tik"].size() != sizeof(user_data.tik)*2 ||
+                !sev::str_to_array(values["mnonce"], user_data.mnonce, sizeof(user_data.mnonce)) ||
+                !sev::str_to_array(values["tik"], user_data.tik, sizeof(user_data.tik))) {
+                printf("Error: mnonce and tik must be 16 bytes of hex\n");
+                break;
+            }
+        }
+
+        // Identical images and settings always give the same digest
+        MeasurementCache cache;
+        uint8_t key[MEASUREMENT_CACHE_KEY_SIZE];
+        bool cached = false;
+        if (!m_measurement_cache.empty()) {
+            if (!cache.open(m_measurement_cache))
+                printf("Warning: unable to read the measurement cache %s\n", m_measurement_cache.c_str());
+            if (!sev_launch_digest_cache_key(cache, input, key))
+                break;
+            cached = cache.lookup(key, ld, sizeof(ld));
+        }
+
+        if (!cached) {
+            cmd_ret = calc_sev_launch_digest(input, ld);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+            if (!m_measurement_cache.empty() && !cache.store(key, ld, sizeof(ld)))
+                printf("Warning: unable to update the measurement cache %s\n", m_measurement_cache.c_str());
+        }
+        cmd_ret = ERROR_INVALID_PARAM;
+
+        char ld_buf[sizeof(ld)*2+1] = {0};  // 2 chars per byte +1 for null term
+        for (size_t i = 0; i < sizeof(ld); i++)
+            sprintf(ld_buf + i*2, "%02x", ld[i]);
+        std::string ld_str = ld_buf;
+        if (m_verbose_flag)
+            printf("Launch digest%s: %s\n", cached ? " (cached)" : "", ld_str.c_str());
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(ld_readable_path, ld_str.c_str(), ld_str.size()) != ld_str.size())
+            break;
+        if (sev::write_file(ld_path, ld, sizeof(ld)) != sizeof(ld))
+            break;
+
+        if (num_measure_keys != 0) {
+            memcpy(user_data.digest, ld, sizeof(user_data.digest));
+            cmd_ret = calc_measurement(&user_data);
+            break;
+        }
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    OPENSSL_cleanse(&user_data, sizeof(user_data));     // Holds the TIK
+
+    return cmd_ret;
+}
+
+/**
+ * Parses one ID block's fields, all hex:
+ *   [ld] [family_id] [image_id] [guest_svn] [policy]
+ */
+static bool parse_id_block_line(const std::string &line, snp_launch_finish_id_block *id_block)
+{
+    std::istringstream fields(line);
+    std::string ld_str, family_id_str, image_id_str, guest_svn_str, policy_str, extra;
+    uint8_t ld[sizeof(id_block->ld)];
+    uint8_t family_id[sizeof(id_block->family_id)];
+    uint8_t image_id[sizeof(id_block->image_id)];
+    char *end = NULL;
+
+    if (!(fields >> ld_str >> family_id_str >> image_id_str >> guest_svn_str >> policy_str) ||
+        (fields >> extra))
+        return false;
+
+    if (ld_str.size() != sizeof(ld)*2 || family_id_str.size() != sizeof(family_id)*2 ||
+        image_id_str.size() != sizeof(image_id)*2)
+        return false;
+    if (!sev::str_to_array(ld_str, ld, sizeof(ld)) ||
+        !sev::str_to_array(family_id_str, family_id, sizeof(family_id)) ||
+        !sev::str_to_array(image_id_str, image_id, sizeof(image_id)))
+        return false;
+
+    unsigned long guest_svn = strtoul(guest_svn_str.c_str(), &end, 16);
+    if (*end != '\0' || guest_svn > UINT32_MAX)
+        return false;
+    unsigned long long policy = strtoull(policy_str.c_str(), &end, 16);
+    if (*end != '\0')
+        return false;
+
+    SNPIDBlockSigner::build_id_block(ld, family_id, image_id, (uint32_t)guest_svn,
+                                     (uint64_t)policy, id_block);
+    return true;
+}
+
+/**
+ * Builds the SNP ID block for the given launch digest, family/image IDs,
+ * guest SVN and policy, and the ID auth page signing it with the ID key (and
+ * the ID key with the author key, if given). Writes both as binaries and as
+ * base64 for QEMU's sev-snp-guest object
+ */
+int Command::generate_id_block(const std::string id_block_args, const std::string id_key_file,
+                               const std::string author_key_file)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string id_block_path = m_output_folder + SNP_ID_BLOCK_FILENAME;
+    std::string id_auth_path = m_output_folder + SNP_ID_AUTH_FILENAME;
+    std::string readable_path = m_output_folder + SNP_ID_BLOCK_READABLE_FILENAME;
+    SNPIDBlockSigner signer;
+    snp_launch_finish_id_block id_block;
+    snp_launch_finish_id_auth_page id_auth;
+
+    do {
+        if (!parse_id_block_line(id_block_args, &id_block)) {
+            printf("Error: invalid ID block args\n");
+            break;
+        }
+
+        cmd_ret = signer.load(id_key_file, author_key_file);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = signer.sign(&id_block, &id_auth);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        std::string readable = "id-block=" + sev::base64_encode(&id_block, sizeof(id_block)) + "\n" +
+                               "id-auth=" + sev::base64_encode(&id_auth, sizeof(id_auth)) + "\n";
+        if (signer.has_author_key())
+            readable += "author-key-enabled=on\n";
+        if (m_verbose_flag)
+            printf("%s", readable.c_str());
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(id_block_path, &id_block, sizeof(id_block)) != sizeof(id_block))
+            break;
+        if (sev::write_file(id_auth_path, &id_auth, sizeof(id_auth)) != sizeof(id_auth))
+            break;
+        if (sev::write_file(readable_path, readable.data(), readable.size()) != readable.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Signs an ID block for every line of input_file ("-" for stdin), each line
+ * the args of generate_id_block. The keys are loaded (and the ID key signed
+ * by the author key) once; the ID blocks are then signed across one worker
+ * thread per CPU. Writes one line per input line, in order:
+ *   [id block base64] [id auth base64]
+ */
+int Command::generate_id_block_batch(const std::string input_file, const std::string id_key_file,
+                                     const std::string author_key_file)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    std::string batch_path = m_output_folder + SNP_ID_BLOCK_BATCH_FILENAME;
+    std::ifstream input_fstream;
+    std::istream *input = &std::cin;
+    std::string line = "";
+    size_t line_num = 0;
+    SNPIDBlockSigner signer;
+    std::vector<snp_launch_finish_id_block> id_blocks;
+    std::vector<std::string> results;
+    std::atomic<uint32_t> num_failed(0);
+    std::vector<std::thread> workers;
+    size_t num_threads = std::thread::hardware_concurrency();
+
+    do {
+        if (input_file != "-") {
+            input_fstream.open(input_file);
+            if (!input_fstream.is_open()) {
+                printf("Error: unable to open %s\n", input_file.c_str());
+                break;
+            }
+            input = &input_fstream;
+        }
+
+        while (std::getline(*input, line)) {
+            snp_launch_finish_id_block id_block;
+            line_num++;
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#')
+                continue;
+            if (!parse_id_block_line(line, &id_block)) {
+                printf("Error: invalid ID block args on line %zu\n", line_num);
+                cmd_ret = ERROR_INVALID_PARAM;
+                break;
+            }
+            id_blocks.push_back(id_block);
+        }
+        if (cmd_ret == ERROR_INVALID_PARAM)
+            break;
+        if (id_blocks.empty()) {
+            printf("Error: no ID blocks found in %s\n", input_file.c_str());
+            cmd_ret = ERROR_INVALID_PARAM;
+            break;
+        }
+
+        cmd_ret = signer.load(id_key_file, author_key_file);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = ERROR_UNSUPPORTED;
+
+        // Each thread does one contiguous slice, writing straight into its
+        // slot in results, so the output order matches the input order
+        results.resize(id_blocks.size());
+        if (num_threads == 0)
+            num_threads = 1;
+        if (num_threads > id_blocks.size())
+            num_threads = id_blocks.size();
+        size_t per_thread = (id_blocks.size() + num_threads - 1) / num_threads;
+
+        for (size_t t = 0; t < num_threads; t++) {
+            size_t first = t * per_thread;
+            size_t last = std::min(first + per_thread, id_blocks.size());
+            workers.push_back(std::thread([&, first, last]() {
+                snp_launch_finish_id_auth_page id_auth;
+                for (size_t i = first; i < last; i++) {
+                    if (signer.sign(&id_blocks[i], &id_auth) != STATUS_SUCCESS) {
+                        num_failed++;
+                        continue;
+                    }
+                    results[i] = sev::base64_encode(&id_blocks[i], sizeof(id_blocks[i])) + " " +
+                                 sev::base64_encode(&id_auth, sizeof(id_auth)) + "\n";
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+
+        if (num_failed != 0) {
+            cmd_ret = ERROR_BAD_SIGNATURE;
+            break;
+        }
+
+        std::string out = "";
+        for (size_t i = 0; i < results.size(); i++)
+            out += results[i];
+
+        if (m_verbose_flag)
+            printf("%zu ID blocks signed using %zu threads\n", id_blocks.size(), num_threads);
+
+        if (sev::write_file(batch_path, out.data(), out.size()) != out.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Builds the SNP CPUID page (SNP_LAUNCH_UPDATE page type CPUID) from this
+ * host's CPUID, keeping the leaves allowed by the policy file ("default"
+ * for the built-in policy). The host's CPUID snapshot is cached in the
+ * output folder and reused until the CPU, microcode or kernel changes
+ */
+int Command::build_cpuid_page(const std::string policy_file)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string page_path = m_output_folder + SNP_CPUID_PAGE_FILENAME;
+    std::string readable_path = m_output_folder + SNP_CPUID_PAGE_READABLE_FILENAME;
+    std::string cache_path = m_output_folder + CPUID_SNAPSHOT_CACHE_FILENAME;
+    cpuid_policy_t policy;
+    CPUIDSnapshot snapshot;
+    bool from_cache = false;
+    std::vector<uint8_t> page(PAGE_SIZE_4K, 0);
+    snp_launch_update_cpuid_page *cpuid_page = (snp_launch_update_cpuid_page *)page.data();
+
+    static_assert(sizeof(snp_launch_update_cpuid_page) <= PAGE_SIZE_4K, "Error, static assertion failed");
+
+    do {
+        if (!read_cpuid_policy(policy_file, &policy))
+            break;
+
+        cmd_ret = snapshot.load_or_capture(cache_path, &from_cache);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = snapshot.build_page(policy, cpuid_page);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        std::string readable = "# [eax_in] [ecx_in] [xcr0_in] [xss_in] [eax] [ebx] [ecx] [edx]\n";
+        for (uint32_t i = 0; i < cpuid_page->count; i++) {
+            const snp_cpuid_function_t &func = cpuid_page->cpuid_function[i];
+            char line[128];
+            snprintf(line, sizeof(line), "%08x %08x %016llx %016llx %08x %08x %08x %08x\n",
+                     func.eax_in, func.ecx_in, (unsigned long long)func.xcr0_in,
+                     (unsigned long long)func.xss_in, func.eax, func.ebx, func.ecx, func.edx);
+            readable += line;
+        }
+        if (m_verbose_flag)
+            printf("%s%u CPUID functions, host snapshot %s\n", readable.c_str(),
+                   cpuid_page->count, from_cache ? "cached" : "captured");
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(page_path, page.data(), page.size()) != page.size())
+            break;
+        if (sev::write_file(readable_path, readable.data(), readable.size()) != readable.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Summarizes an RMP dump (16K of ASID counters, then one 8 byte rmp_entry_t
+ * per 4K page): per-ASID assigned/validated/2M/4K/VMSA counts, where the VMSAs
+ * are, and any inconsistencies. Inconsistencies are reported, not treated as
+ * a failure
+ */
+int Command::analyze_rmp(const std::string dump_file)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string analysis_path = m_output_folder + RMP_ANALYSIS_FILENAME;
+    RMPDump dump;
+    rmp_analysis_t analysis;
+
+    do {
+        if (!dump.open(dump_file))
+            break;
+
+        cmd_ret = rmp_analyze(dump, analysis);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        char line[160];
+        std::string out = "";
+        snprintf(line, sizeof(line), "entries %llu (%llu MB of memory)\n"
+                 "assigned %llu validated %llu immutable %llu\n"
+                 "pages_2m %llu pages_4k %llu\n",
+                 (unsigned long long)analysis.num_entries,
+                 (unsigned long long)(analysis.num_entries * PAGE_SIZE_4K >> 20),
+                 (unsigned long long)analysis.assigned, (unsigned long long)analysis.validated,
+                 (unsigned long long)analysis.immutable,
+                 (unsigned long long)analysis.pages_2m, (unsigned long long)analysis.pages_4k);
+        out += line;
+        out += "# [asid] [assigned] [validated] [pages_2m] [pages_4k] [vmsas]\n";
+        for (size_t a = 0; a < analysis.asids.size(); a++) {
+            const rmp_asid_stats_t &asid = analysis.asids[a];
+            if (asid.assigned == 0)
+                continue;
+            snprintf(line, sizeof(line), "asid %zu %llu %llu %llu %llu %llu\n", a,
+                     (unsigned long long)asid.assigned, (unsigned long long)asid.validated,
+                     (unsigned long long)asid.pages_2m, (unsigned long long)asid.pages_4k,
+                     (unsigned long long)asid.vmsas);
+            out += line;
+        }
+        for (size_t v = 0; v < analysis.vmsas.size(); v++) {
+            snprintf(line, sizeof(line), "vmsa 0x%llx asid %u\n",
+                     (unsigned long long)analysis.vmsas[v].first * PAGE_SIZE_4K,
+                     analysis.vmsas[v].second);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "inconsistencies %llu\n", (unsigned long long)analysis.num_errors);
+        out += line;
+        for (size_t e = 0; e < analysis.errors.size(); e++)
+            out += "error " + analysis.errors[e] + "\n";
+
+        if (m_verbose_flag)
+            printf("%s", out.c_str());
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(analysis_path, out.data(), out.size()) != out.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Lists what changed between two RMP dumps of the same host (ex. periodic
+ * snapshots, to debug page-state churn): a record per changed field of each
+ * changed entry, and the changes totalled by ASID
+ */
+int Command::diff_rmp(const std::string before_file, const std::string after_file)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string diff_path = m_output_folder + RMP_DIFF_FILENAME;
+    RMPDump before, after;
+    rmp_diff_t diff;
+
+    do {
+        if (!before.open(before_file) || !after.open(after_file))
+            break;
+
+        cmd_ret = rmp_diff(before, after, diff);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        char line[160];
+        std::string summary = "", out = "";
+        snprintf(line, sizeof(line), "entries %llu changed %llu identical_chunks %llu of %llu\n",
+                 (unsigned long long)diff.num_entries, (unsigned long long)diff.changed_entries,
+                 (unsigned long long)diff.identical_chunks, (unsigned long long)diff.num_chunks);
+        summary += line;
+        summary += "# [asid] [gained] [lost] [validated] [invalidated] [page_size]\n";
+        for (size_t a = 0; a < diff.asids.size(); a++) {
+            const rmp_asid_changes_t &asid = diff.asids[a];
+            if (asid.gained == 0 && asid.lost == 0 && asid.validated == 0 &&
+                asid.invalidated == 0 && asid.page_size == 0)
+                continue;
+            snprintf(line, sizeof(line), "asid %zu %llu %llu %llu %llu %llu\n", a,
+                     (unsigned long long)asid.gained, (unsigned long long)asid.lost,
+                     (unsigned long long)asid.validated, (unsigned long long)asid.invalidated,
+                     (unsigned long long)asid.page_size);
+            summary += line;
+        }
+        for (size_t c = 0; c < diff.counters.size(); c++) {
+            snprintf(line, sizeof(line), "counter %zu %llu %llu\n", diff.counters[c].first,
+                     (unsigned long long)diff.counters[c].second.first,
+                     (unsigned long long)diff.counters[c].second.second);
+            summary += line;
+        }
+
+        out = summary;
+        out.reserve(summary.size() + diff.changes.size() * 48);
+        out += "# [spa] [field] [old] [new]\n";
+        for (size_t c = 0; c < diff.changes.size(); c++) {
+            const rmp_change_t &change = diff.changes[c];
+            snprintf(line, sizeof(line), "0x%llx %s 0x%llx 0x%llx\n",
+                     (unsigned long long)change.entry * PAGE_SIZE_4K, rmp_field_name(change.field),
+                     (unsigned long long)change.old_value, (unsigned long long)change.new_value);
+            out += line;
+        }
+
+        if (m_verbose_flag)
+            printf("%s", summary.c_str());
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(diff_path, out.data(), out.size()) != out.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Checks a swapped-out page set offline: the swap image, and the metadata
+ * pages whose valid entries describe its pages in order. Reports the page
+ * counts, any problems, and how fast the set was checked. Problems are
+ * reported, not treated as a failure
+ */
+int Command::verify_swap(const std::string image_file, const std::string metadata_file)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string verify_path = m_output_folder + SWAP_VERIFY_FILENAME;
+    SwapSet swap_set;
+    swap_verify_t result;
+
+    do {
+        if (!swap_set.open(image_file, metadata_file))
+            break;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        cmd_ret = swap_verify(swap_set, result);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed = end - start;
+        double total_mb = (double)(swap_set.image_size() + result.num_entries * SNP_METADATA_ENTRY_SIZE) /
+                          (1024.0 * 1024.0);
+
+        char line[192];
+        std::string out = "";
+        snprintf(line, sizeof(line), "entries %llu image_bytes %llu\n"
+                 "pages_4k %llu pages_2m %llu vmsas %llu metadata_pages %llu validated %llu\n"
+                 "verified %.1f MB in %.3f ms (%.0f MB/s)\n",
+                 (unsigned long long)result.num_entries, (unsigned long long)result.image_bytes,
+                 (unsigned long long)result.pages_4k, (unsigned long long)result.pages_2m,
+                 (unsigned long long)result.vmsas, (unsigned long long)result.metadata_pages,
+                 (unsigned long long)result.validated, total_mb, elapsed.count(),
+                 total_mb * 1000.0 / std::max(elapsed.count(), 0.001));
+        out += line;
+        snprintf(line, sizeof(line), "problems %llu\n", (unsigned long long)result.num_errors);
+        out += line;
+        for (size_t e = 0; e < result.errors.size(); e++)
+            out += "error " + result.errors[e] + "\n";
+
+        if (m_verbose_flag)
+            printf("%s", out.c_str());
+
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (sev::write_file(verify_path, out.data(), out.size()) != out.size())
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Drives an in-memory RMP model of num_pages pages through every page-state
+ * transition, as 4K pages and as 2M pages that get smashed and unsmashed,
+ * and reports the transitions per second
+ */
+int Command::rmp_model_benchmark(uint64_t num_pages, std::vector<double> &measurements)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    const uint32_t asid = 1;
+
+    do {
+        if (num_pages == 0 || num_pages % RMP_ENTRIES_PER_2M != 0) {
+            printf("Error: rmp_model_benchmark needs a multiple of %u pages\n",
+                   (unsigned)RMP_ENTRIES_PER_2M);
+            break;
+        }
+
+        RMPModel rmp((size_t)num_pages);
+        uint64_t transitions = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // 4K: assign, validate, adjust, invalidate, unassign
+        for (uint64_t page = 0; page < num_pages; page++) {
+            uint64_t spa = page * PAGE_SIZE_4K;
+            cmd_ret = rmp.rmpupdate(spa, false, true, asid, spa);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.pvalidate(asid, spa, false, true);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.rmpadjust(asid, spa, 1, (uint8_t)MAX_VMPL_PERM);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.pvalidate(asid, spa, false, false);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.rmpupdate(spa, false, false);
+            if (cmd_ret != STATUS_SUCCESS) {
+                printf("Error: 4K transition failed at 0x%llx: 0x%02x\n", (unsigned long long)spa, cmd_ret);
+                break;
+            }
+            transitions += 5;
+        }
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // 2M: assign, validate, smash, unsmash, invalidate, unassign
+        for (uint64_t page = 0; page < num_pages; page += RMP_ENTRIES_PER_2M) {
+            uint64_t spa = page * PAGE_SIZE_4K;
+            snp_page_unsmash_cmd_buf unsmash;
+            memset(&unsmash, 0, sizeof(unsmash));
+            unsmash.page_p_addr = spa;
+            cmd_ret = rmp.rmpupdate(spa, true, true, asid, spa);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.pvalidate(asid, spa, true, true);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.psmash(spa);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.page_unsmash(unsmash);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.pvalidate(asid, spa, true, false);
+            if (cmd_ret == STATUS_SUCCESS)
+                cmd_ret = rmp.rmpupdate(spa, true, false);
+            if (cmd_ret != STATUS_SUCCESS) {
+                printf("Error: 2M transition failed at 0x%llx: 0x%02x\n", (unsigned long long)spa, cmd_ret);
+                break;
+            }
+            transitions += 6;
+        }
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed = end - start;
+        measurements.push_back(elapsed.count());
+
+        cmd_ret = ERROR_INVALID_PAGE_STATE;
+        if (rmp.asid_counter(asid) != 0) {     // Every page went back to the hypervisor
+            printf("Error: RMP model left %llu pages assigned to ASID %u\n",
+                   (unsigned long long)rmp.asid_counter(asid), asid);
+            break;
+        }
+
+        if (m_verbose_flag) {
+            printf("%llu transitions in %.3f ms, %.0f transitions/s\n",
+                   (unsigned long long)transitions, elapsed.count(),
+                   (double)transitions * 1000.0 / elapsed.count());
+        }
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * Draws from gen_random_bytes the way a launch service does, for
+ * num_launches launches split across all CPUs
+ */
+int Command::random_benchmark(uint64_t num_launches, std::vector<double> &measurements)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::vector<std::thread> workers;
+    size_t num_threads = std::thread::hardware_concurrency();
+
+    do {
+        if (num_launches == 0) {
+            printf("Error: random_benchmark needs at least 1 launch\n");
+            break;
+        }
+        if (num_threads == 0)
+            num_threads = 1;
+        if (num_threads > num_launches)
+            num_threads = (size_t)num_launches;
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Each worker takes a contiguous share of the launches
+        for (size_t t = 0; t < num_threads; t++) {
+            uint64_t first = num_launches * t / num_threads;
+            uint64_t last = num_launches * (t + 1) / num_threads;
+            workers.push_back(std::thread([first, last]() {
+                uint8_t buf[RANDOM_BENCHMARK_REQUEST_SIZE];
+                for (uint64_t i = first; i < last; i++) {
+                    for (size_t r = 0; r < RANDOM_BENCHMARK_REQUESTS; r++)
+                        sev::gen_random_bytes(buf, sizeof(buf));
+                }
+                OPENSSL_cleanse(buf, sizeof(buf));
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed = end - start;
+        measurements.push_back(elapsed.count());
+
+        if (m_verbose_flag) {
+            printf("%llu launches (%llu requests) on %zu threads in %.3f ms, %.0f launches/s\n",
+                   (unsigned long long)num_launches,
+                   (unsigned long long)(num_launches * RANDOM_BENCHMARK_REQUESTS),
+                   num_threads, elapsed.count(),
+                   (double)num_launches * 1000.0 / elapsed.count());
+        }
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
 int Command::import_all_certs(sev_cert *pdh, sev_cert *pek, sev_cert *oca,
                               sev_cert *cek, amd_cert *ask, amd_cert *ark)
 {
@@ -930,25 +2470,22 @@ int Command::import_all_certs(sev_cert *pdh, sev_cert *pek, sev_cert *oca,
     std::string pdh_full = m_output_folder + PDH_FILENAME;
 
     do {
-        // Read in the ark
-        uint8_t ark_buf[sizeof(amd_cert)] = {0};
-        if (sev::read_file(ark_full, ark_buf, sizeof(amd_cert)) == 0) // Variable size
+        // Read in and initialize the ark, which is variable size
+        sev::FileView ark_view, ask_view;
+        if (!ark_view.open(ark_full))
             break;
-
-        // Initialize the ark
-        cmd_ret = tmp_amd.amd_cert_init(ark, ark_buf);
+        cmd_ret = tmp_amd.amd_cert_init(ark, ark_view.data(), ark_view.size());
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        // Read in the ark
-        uint8_t ask_buf[sizeof(amd_cert)] = {0};
-        if (sev::read_file(ask_full, ask_buf, sizeof(amd_cert)) == 0) // Variable size
+        // Read in and initialize the ask
+        cmd_ret = ERROR_INVALID_CERTIFICATE;
+        if (!ask_view.open(ask_full))
             break;
-
-        // Initialize the ark
-        cmd_ret = tmp_amd.amd_cert_init(ask, ask_buf);
+        cmd_ret = tmp_amd.amd_cert_init(ask, ask_view.data(), ask_view.size());
         if (cmd_ret != STATUS_SUCCESS)
             break;
+        cmd_ret = ERROR_INVALID_CERTIFICATE;
 
         // Read in the cek
         if (sev::read_file(cek_full, cek, sizeof(sev_cert)) != sizeof(sev_cert))
@@ -1029,7 +2566,49 @@ int Command::validate_cert_chain(void)
             break;
     } while (0);
 
-    return (int)cmd_ret;
+    return (int)cmd_ret;
+}
+
+/**
+ * Creates one launch session (new GODH keypair and session buffer) against
+ * an already parsed PDH public key, and writes godh.cert, tmp_tk.bin and
+ * launch_blob.bin into folder. Doesn't use any Command state, so multiple
+ * sessions can be generated at once from different threads
+ */
+int Command::generate_launch_session(const std::string folder, uint32_t policy,
+                                     EVP_PKEY *plat_pub_key, tek_tik *tk,
+                                     sev_session_buf *session_data_buf,
+                                     ECDHKeyPool *key_pool)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    std::string godh_cert_file = folder + GUEST_OWNER_DH_FILENAME;
+    std::string tmp_tk_file = folder + GUEST_TK_FILENAME;
+    std::string buf_file = folder + LAUNCH_BLOB_FILENAME;
+    LaunchSession session;
+
+    do {
+        cmd_ret = session.create(plat_pub_key, policy, key_pool);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = ERROR_UNSUPPORTED;
+
+        memcpy(tk, session.tk(), sizeof(tek_tik));
+        memcpy(session_data_buf, session.session_buf(), sizeof(sev_session_buf));
+
+        // Write the cert to file
+        if (sev::write_file(godh_cert_file, session.godh_cert(), sizeof(sev_cert)) != sizeof(sev_cert))
+            break;
+
+        // Write the unencrypted TK (TIK and TEK) to a tmp file so it can be
+        // read in during package_secret
+        if (sev::write_file(tmp_tk_file, tk, sizeof(tek_tik)) != sizeof(tek_tik) ||
+            sev::write_file(buf_file, session_data_buf, sizeof(sev_session_buf)) != sizeof(sev_session_buf))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
 }
 
 int Command::generate_launch_blob(uint32_t policy)
@@ -1037,42 +2616,21 @@ int Command::generate_launch_blob(uint32_t policy)
     int cmd_ret = ERROR_UNSUPPORTED;
     sev_session_buf session_data_buf;
     std::string pdh_full = m_output_folder + PDH_FILENAME;
-    std::string godh_cert_file = m_output_folder + GUEST_OWNER_DH_FILENAME;
-    std::string tmp_tk_file = m_output_folder + GUEST_TK_FILENAME;
-    std::string buf_file = m_output_folder + LAUNCH_BLOB_FILENAME;
-    sev_cert pdh;
-    EVP_PKEY *godh_key_pair = NULL;      // Guest Owner Diffie-Hellman
-    sev_cert godh_pubkey_cert;
+    sev::FileView pdh;
+    EVP_PKEY *plat_pub_key = NULL;       // Platform Diffie-Hellman
 
     memset(&session_data_buf, 0, sizeof(sev_session_buf));
 
     do {
         // Read in the PDH (Platform Diffie-Hellman Public Key)
-        if (sev::read_file(pdh_full, &pdh, sizeof(sev_cert)) != sizeof(sev_cert))
-            break;
-
-        // Launch Start needs the GODH Pubkey as a cert, so need to create it
-        SEVCert cert_obj(&godh_pubkey_cert);
-
-        // Generate a new GODH Public/Private keypair
-        if (!generate_ecdh_key_pair(&godh_key_pair)) {
-            printf("Error generating new GODH ECDH keypair\n");
-            break;
-        }
-
-        // This cert is really just a way to send over the godh public key,
-        // so the api major/minor don't matter here
-        if (!cert_obj.create_godh_cert(&godh_key_pair, 0, 0)) {
-            printf("Error creating GODH certificate\n");
+        if (!pdh.open(pdh_full) || !pdh.as<sev_cert>())
             break;
-        }
-        memcpy(&godh_pubkey_cert, cert_obj.data(), sizeof(sev_cert)); // TODO, shouldn't need this?
 
-        // Write the cert to file
-        if (sev::write_file(godh_cert_file, &godh_pubkey_cert, sizeof(sev_cert)) != sizeof(sev_cert))
+        if (!(plat_pub_key = compile_pdh_pub_key(pdh.as<sev_cert>())))
             break;
 
-        cmd_ret = build_session_buffer(&session_data_buf, policy, godh_key_pair, &pdh);
+        cmd_ret = generate_launch_session(m_output_folder, policy, plat_pub_key,
+                                          m_tk.get(), &session_data_buf);
         if (cmd_ret == STATUS_SUCCESS) {
             if (m_verbose_flag) {
                 printf("Guest Policy (input): %08x\n", policy);
@@ -1102,18 +2660,117 @@ int Command::generate_launch_blob(uint32_t policy)
                 }
                 printf("\n");
             }
+        }
+    } while (0);
+
+    EVP_PKEY_free(plat_pub_key);
+
+    return (int)cmd_ret;
+}
+
+/**
+ * Generates num_guests independent launch sessions, each in its own
+ * output_folder/guest_<n>/ folder (same files as generate_launch_blob).
+ * The PDH is read and parsed once, and the sessions are spread across
+ * one worker thread per CPU
+ */
+int Command::generate_launch_blob_batch(uint32_t policy, uint32_t num_guests)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    std::string pdh_full = m_output_folder + PDH_FILENAME;
+    sev::FileView pdh;
+    EVP_PKEY *plat_pub_key = NULL;       // Platform Diffie-Hellman
+    std::atomic<uint32_t> next_guest(0);
+    std::atomic<uint32_t> num_failed(0);
+    std::vector<std::thread> workers;
+    uint32_t num_threads = std::thread::hardware_concurrency();
+
+    do {
+        if (num_guests == 0) {
+            printf("Error: number of guests must be at least 1\n");
+            cmd_ret = ERROR_INVALID_PARAM;
+            break;
+        }
+
+        // Read in the PDH (Platform Diffie-Hellman Public Key)
+        if (!pdh.open(pdh_full) || !pdh.as<sev_cert>())
+            break;
+
+        if (!(plat_pub_key = compile_pdh_pub_key(pdh.as<sev_cert>())))
+            break;
+
+        // Create all of the per-guest folders up front
+        uint32_t i = 0;
+        for (i = 0; i < num_guests; i++) {
+            std::string folder = m_output_folder + LAUNCH_BLOB_BATCH_FOLDER_PREFIX + std::to_string(i);
+            if (mkdir(folder.c_str(), 0775) != 0 && errno != EEXIST) {
+                printf("Error: Unable to create directory: %s\n", folder.c_str());
+                break;
+            }
+        }
+        if (i != num_guests)
+            break;
+
+        if (num_threads == 0)
+            num_threads = 1;
+        if (num_threads > num_guests)
+            num_threads = num_guests;
+
+        // Keep a few GODH keys ahead of the workers, so each session only
+        // pays for the KDF, wrap and HMAC work
+        ECDHKeyPool key_pool(num_threads,
+                             std::min<size_t>(num_guests, LAUNCH_BLOB_BATCH_KEY_POOL_MAX),
+                             num_guests);
+        key_pool.start();
+
+        for (uint32_t t = 0; t < num_threads; t++) {
+            workers.push_back(std::thread([&]() {
+                uint32_t guest = 0;
+                while ((guest = next_guest++) < num_guests) {
+                    std::string folder = m_output_folder + LAUNCH_BLOB_BATCH_FOLDER_PREFIX +
+                                         std::to_string(guest) + "/";
+                    SecureKey<tek_tik> tk;
+                    sev_session_buf session_data_buf;
+                    if (!tk.valid() ||
+                        generate_launch_session(folder, policy, plat_pub_key, tk.get(),
+                                                &session_data_buf, &key_pool) != STATUS_SUCCESS) {
+                        printf("Error: generating launch blob for guest %u\n", guest);
+                        num_failed++;
+                    }
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+        key_pool.stop();
 
-            // Write the unencrypted TK (TIK and TEK) to a tmp file so it can be
-            // read in during package_secret
-            sev::write_file(tmp_tk_file, &m_tk, sizeof(m_tk));
+        if (num_failed != 0)
+            break;
 
-            sev::write_file(buf_file, (void *)&session_data_buf, sizeof(sev_session_buf));
+        if (m_verbose_flag) {
+            ecdh_key_pool_stats_t stats = key_pool.stats();
+            printf("Generated %u launch blobs using %u threads\n", num_guests, num_threads);
+            printf("GODH key pool: %lu hits, %lu misses (%.1f%% hit rate), %lu unused\n",
+                   (unsigned long)stats.hits, (unsigned long)stats.misses,
+                   100.0 * (double)stats.hits / (double)(stats.hits + stats.misses),
+                   (unsigned long)stats.discarded);
         }
+
+        cmd_ret = STATUS_SUCCESS;
     } while (0);
 
+    EVP_PKEY_free(plat_pub_key);
+
     return (int)cmd_ret;
 }
 
+/**
+ * The secret is streamed through a fixed size buffer: each chunk is
+ * encrypted (AES-128-CTR), added to the header HMAC and written out before
+ * the next one is read, so memory use doesn't depend on the secret's size.
+ * It's read, not mapped, so a file truncated or rewritten while being
+ * packaged is an error rather than a SIGBUS or a header over the wrong data
+ */
 int Command::package_secret(void)
 {
     int cmd_ret = ERROR_UNSUPPORTED;
@@ -1124,71 +2781,116 @@ int Command::package_secret(void)
     std::string packaged_secret_header_file = m_output_folder + PACKAGED_SECRET_HEADER_FILENAME;
     std::string measurement_file = m_output_folder + CALC_MEASUREMENT_FILENAME;
     std::string tmp_tk_file = m_output_folder + GUEST_TK_FILENAME;
-    sev_cert pek;
+    sev::FileView pek;
+    FILE *secret_in = NULL;
+    struct stat secret_details;
+    sev::OutputFile packaged_out;
+    LaunchSession session;
+    std::vector<uint8_t> secret_mem(PACKAGE_SECRET_CHUNK_SIZE);
+    std::vector<uint8_t> encrypted_mem(PACKAGE_SECRET_CHUNK_SIZE);
+    size_t secret_size = 0;
+    size_t total_read = 0;
 
     uint32_t flags = 0;
-    iv_128 iv;
-    sev::gen_random_bytes(&iv, sizeof(iv));     // Pick a random IV
 
     do {
-        // Get the size of the secret, so we can allocate that much memory
-        size_t secret_size = sev::get_file_size(secret_file);
+        // The header HMAC covers the length before the data, so get it up front
+        if (!(secret_in = fopen(secret_file.c_str(), "rb")) ||
+            fstat(fileno(secret_in), &secret_details) != 0) {
+            printf("Error reading in %s\n", secret_file.c_str());
+            break;
+        }
+        secret_size = (size_t)secret_details.st_size;
         if (secret_size < 8) {
             printf("Error: SEV requires a secret greater than 8 bytes\n");
             break;
         }
-        uint8_t secret_mem[secret_size];
-        uint8_t encrypted_mem[secret_size];
-
-        // Read in the secret
-        // printf("Attempting to read in Secrets file\n");
-        if (sev::read_file(secret_file, secret_mem, secret_size) != secret_size)
+        if (secret_size > UINT32_MAX) {
+            printf("Error: secret must be smaller than 4GB\n");
             break;
+        }
 
         // Read in the PEK to obtain API major/minor version
         // printf("Attempting to read in PEK file to get the API Maj/Min versions\n");
-        if (sev::read_file(pek_file, &pek, sizeof(sev_cert)) != sizeof(sev_cert))
+        if (!pek.open(pek_file) || !pek.as<sev_cert>())
             break;
 
-        // Read in the unencrypted TK (TIK and TEK) created in build_session_buffer
-        if (sev::read_file(tmp_tk_file, &m_tk, sizeof(m_tk)) != sizeof(m_tk)) {
+        session.set_api_version(pek.as<sev_cert>()->api_major, pek.as<sev_cert>()->api_minor);
+
+        // Read in the unencrypted TK (TIK and TEK) created in generate_launch_blob
+        if (!m_tk.valid() ||
+            sev::read_file(tmp_tk_file, m_tk.get(), sizeof(tek_tik)) != sizeof(tek_tik)) {
             printf("Error reading in %s\n", tmp_tk_file.c_str());
             break;
         }
+        if (!session.set_tk(m_tk.get()))
+            break;
+
+        // Read in the measurement, to be used as part of the launch secret header hmac
+        if (sev::read_file(measurement_file, &m_measurement, sizeof(m_measurement)) != sizeof(m_measurement)) {
+            printf("Error reading in %s\n", measurement_file.c_str());
+            break;
+        }
+        session.set_measurement(m_measurement);
+
+        if (!packaged_out.open(packaged_secret_file))
+            break;
 
-        // Encrypt the secret with the TEK
-        encrypt_with_tek(encrypted_mem, secret_mem, secret_size, iv);
+        // Picks the IV and sets up the Launch_Secret packet header hmac
+        if (session.begin_secret(secret_size, flags, &packaged_secret_header) != STATUS_SUCCESS)
+            break;
 
         if (m_verbose_flag) {
             printf("Random IV\n");
-            for (size_t i = 0; i < sizeof(iv); i++) {
-                printf("%02x ", iv[i]);
+            for (size_t i = 0; i < sizeof(packaged_secret_header.iv); i++) {
+                printf("%02x ", packaged_secret_header.iv[i]);
             }
             printf("\n");
         }
 
-        // Read in the measurement, to be used as part of the launch secret header hmac
-        if (sev::read_file(measurement_file, &m_measurement, sizeof(m_measurement)) != sizeof(m_measurement)) {
-            printf("Error reading in %s\n", measurement_file.c_str());
+        while (total_read < secret_size) {
+            size_t chunk = std::min(secret_mem.size(), secret_size - total_read);
+            if (fread(secret_mem.data(), 1, chunk, secret_in) != chunk) {
+                printf("Error reading in %s\n", secret_file.c_str());
+                break;
+            }
+            // Encrypt with the TEK (AES-128-CTR) and add to the header hmac
+            if (session.encrypt_secret(secret_mem.data(), encrypted_mem.data(), chunk) != STATUS_SUCCESS)
+                break;
+            if (!packaged_out.write(encrypted_mem.data(), chunk)) {
+                printf("Error: writing %s\n", packaged_secret_file.c_str());
+                break;
+            }
+            total_read += chunk;
+        }
+        if (total_read != secret_size)
+            break;
+
+        // The secret changed size while being read
+        if (fgetc(secret_in) != EOF) {
+            printf("Error: %s changed while being read\n", secret_file.c_str());
             break;
         }
 
-        // Write the encrypted secret to a file
-        sev::write_file(packaged_secret_file, encrypted_mem, secret_size);
+        if (session.finish_secret(&packaged_secret_header) != STATUS_SUCCESS)
+            break;
 
-        // Set up the Launch_Secret packet header
-        if (!create_launch_secret_header(&packaged_secret_header, &iv, encrypted_mem,
-                                         sizeof(encrypted_mem), flags,
-                                         pek.api_major, pek.api_minor)) {
+        if (!packaged_out.commit())
             break;
-        }
 
         // Write the header to a file
-        sev::write_file(packaged_secret_header_file, &packaged_secret_header, sizeof(packaged_secret_header));
+        if (sev::write_file(packaged_secret_header_file, &packaged_secret_header,
+                            sizeof(packaged_secret_header)) != sizeof(packaged_secret_header))
+            break;
 
         cmd_ret = STATUS_SUCCESS;
     } while (0);
 
+    if (secret_in)
+        fclose(secret_in);
+    OPENSSL_cleanse(secret_mem.data(), secret_mem.size());
+    // A partial packaged secret is never renamed into place, packaged_out removes it
+
     return (int)cmd_ret;
 }
 
@@ -1199,25 +2901,22 @@ int Command::validate_attestation(void)
     std::string pek_full = m_output_folder + PEK_FILENAME;
     bool success = false;
     EVP_PKEY *pek_pub_key = NULL;
-    sev_cert pek;
+    sev::FileView report_view;
+    sev::FileView pek;
 
     do {
-        // Get the size of the report, so we can allocate that much memory
-        size_t report_size = sev::get_file_size(report_file);
-        if (report_size != sizeof(attestation_report)) {
-            printf("Error: The size of the attestation report is %ld bytes\n", sizeof(attestation_report));
-            break;
-        }
-        uint8_t report_mem[report_size];
-        attestation_report *report = (attestation_report *)report_mem;
-
         // Read in the report
         // printf("Attempting to read in Report file\n");
-        if (sev::read_file(report_file, report_mem, report_size) != report_size)
+        if (!report_view.open(report_file))
+            break;
+        if (report_view.size() != sizeof(attestation_report)) {
+            printf("Error: The size of the attestation report is %ld bytes\n", sizeof(attestation_report));
             break;
+        }
+        const attestation_report *report = report_view.as<attestation_report>();
 
         // Read in the PEK (Platform Encryption Public Key)
-        if (sev::read_file(pek_full, &pek, sizeof(sev_cert)) != sizeof(sev_cert))
+        if (!pek.open(pek_full) || !pek.as<sev_cert>())
             break;
 
         // Build up a pek_pub_key so we can verify the signature on the report
@@ -1233,12 +2932,12 @@ int Command::validate_attestation(void)
         // This function allocates memory and attaches an EC_Key
         //  to your EVP_PKEY so, to prevent mem leaks, make sure
         //  the EVP_PKEY is freed at the end of this function
-        if (temp_obj.compile_public_key_from_certificate(&pek, pek_pub_key) != STATUS_SUCCESS)
+        if (temp_obj.compile_public_key_from_certificate(pek.as<sev_cert>(), pek_pub_key) != STATUS_SUCCESS)
             break;
 
         // Validate the report
         success = verify_message((sev_sig *)&report->sig1,
-                                  &pek_pub_key, report_mem,
+                                  &pek_pub_key, report_view.data(),
                                   offsetof(attestation_report, sig_usage),
                                   SEV_SIG_ALGO_ECDSA_SHA256);
         if (!success) {
@@ -1264,21 +2963,18 @@ int Command::validate_guest_report(void)
     bool success = false;
     EVP_PKEY *vcek_pub_key = NULL;
     X509 *x509_vcek = NULL;
+    sev::FileView report_view;
 
     do {
-        // Get the size of the report, so we can allocate that much memory
-        size_t report_size = sev::get_file_size(report_file);
-        if (report_size != sizeof(snp_attestation_report_t)) {
-            printf("Error: The size of the attestation report is %ld bytes\n", sizeof(snp_attestation_report_t));
-            break;
-        }
-        uint8_t report_mem[report_size];
-        snp_attestation_report_t *report = (snp_attestation_report_t *)report_mem;
-
         // Read in the report
         // printf("Attempting to read in Report file\n");
-        if (sev::read_file(report_file, report_mem, report_size) != report_size)
+        if (!report_view.open(report_file))
+            break;
+        if (report_view.size() != sizeof(snp_attestation_report_t)) {
+            printf("Error: The size of the attestation report is %ld bytes\n", sizeof(snp_attestation_report_t));
             break;
+        }
+        const snp_attestation_report_t *report = report_view.as<snp_attestation_report_t>();
 
         // Read in the VCEK
         if (!read_pem_into_x509(vcek_file, &x509_vcek))
@@ -1298,7 +2994,7 @@ int Command::validate_guest_report(void)
 
         // Validate the report
         success = verify_message((sev_sig *)&report->signature,
-                                  &vcek_pub_key, report_mem,
+                                  &vcek_pub_key, report_view.data(),
                                   offsetof(snp_attestation_report_t, signature),
                                   SEV_SIG_ALGO_ECDSA_SHA384);
         if (!success) {
@@ -1376,371 +3072,32 @@ int Command::validate_cert_chain_vcek(void)
 // ---------------- generate_launch_blob functions --------------- //
 // --------------------------------------------------------------- //
 /*
- * NIST Compliant KDF
- */
-bool Command::kdf(uint8_t *key_out,       size_t key_out_length,
-                  const uint8_t *key_in,  size_t key_in_length,
-                  const uint8_t *label,   size_t label_length,
-                  const uint8_t *context, size_t context_length)
-{
-    if (!key_out || !key_in || !label || (key_out_length == 0) ||
-       (key_in_length == 0) || (label_length == 0))
-        return false;
-
-    bool cmd_ret = false;
-    uint8_t null_byte = '\0';
-    unsigned int out_len = 0;
-    uint8_t prf_out[NIST_KDF_H_BYTES];      // Buffer to collect PRF output
-
-    // length in bits of derived key
-    uint32_t l = (uint32_t)(key_out_length * BITS_PER_BYTE);
-
-    // number of iterations to produce enough derived key bits
-    uint32_t n = ((l - 1) / NIST_KDF_H) + 1;
-
-    size_t bytes_left = key_out_length;
-    uint32_t offset = 0;
-
-    // Create and initialize the context
-    HMAC_CTX *ctx;
-    if (!(ctx = HMAC_CTX_new()))
-        return cmd_ret;
-
-    for (unsigned int i = 1; i <= n; i++)
-    {
-        if (HMAC_CTX_reset(ctx) != 1)
-            break;
-
-        // calculate a chunk of random data from the PRF
-        if (HMAC_Init_ex(ctx, key_in, (int)key_in_length, EVP_sha256(), NULL) != 1)
-            break;
-        if (HMAC_Update(ctx, (uint8_t *)&i, sizeof(i)) != 1)
-            break;
-        if (HMAC_Update(ctx, (unsigned char*)label, label_length) != 1)
-            break;
-        if (HMAC_Update(ctx, &null_byte, sizeof(null_byte)) != 1)
-            break;
-        if ((context) && (context_length != 0)) {
-            if (HMAC_Update(ctx, (unsigned char*)context, context_length) != 1)
-                break;
-        }
-        if (HMAC_Update(ctx, (uint8_t *)&l, sizeof(l)) != 1)
-            break;
-        if (HMAC_Final(ctx, prf_out, &out_len) != 1)
-            break;
-
-        // Write out the key bytes
-        if (bytes_left <= NIST_KDF_H_BYTES) {
-            memcpy(key_out + offset, prf_out, bytes_left);
-        }
-        else {
-            memcpy(key_out + offset, prf_out, NIST_KDF_H_BYTES);
-            offset     += NIST_KDF_H_BYTES;
-            bytes_left -= NIST_KDF_H_BYTES;
-        }
-
-        if (i == n)          // If successfully finished all iterations
-            cmd_ret = true;
-    }
-
-    HMAC_CTX_free(ctx);
-    return cmd_ret;
-}
-
-/*
- * Note that this function NEWs/allocates memory for a
- * uint8_t array using OPENSSL_malloc that must be freed
- * in the calling function using OPENSSL_FREE()
- */
-uint8_t * Command::calculate_shared_secret(EVP_PKEY *priv_key, EVP_PKEY *peer_key,
-                                           size_t& shared_key_len_out)
-{
-    if (!priv_key || !peer_key)
-        return NULL;
-
-    bool success = false;
-    EVP_PKEY_CTX *ctx = NULL;
-    uint8_t *shared_key = NULL;
-
-    do {
-        // Create the context using your private key
-        if (!(ctx = EVP_PKEY_CTX_new(priv_key, NULL)))
-            break;
-
-        // Calculate the intermediate secret
-        if (EVP_PKEY_derive_init(ctx) <= 0)
-            break;
-        if (EVP_PKEY_derive_set_peer(ctx, peer_key) <= 0)
-            break;
-
-        // Determine buffer length
-        if (EVP_PKEY_derive(ctx, NULL, &shared_key_len_out) <= 0)
-            break;
-
-        // Need to free shared_key using OPENSSL_FREE() in the calling function
-        shared_key = (unsigned char*)OPENSSL_malloc(shared_key_len_out);
-        if (!shared_key)
-            break;      // malloc failure
-
-        // Compute the shared secret with the ECDH key material.
-        if (EVP_PKEY_derive(ctx, shared_key, &shared_key_len_out) <= 0)
-            break;
-
-        success = true;
-    } while (0);
-
-    EVP_PKEY_CTX_free(ctx);
-
-    return success ? shared_key : NULL;
-}
-
-/*
- * Generate a master_secret value from our (test suite) Private DH key,
- *   the Platform's public DH key, and a nonce
- * This function calls two functions (above) which allocate memory
- *   for keys, and this function must free that memory
+ * Parse the Platform's public DH key out of the PDH cert. Done once per
+ *   command, no matter how many sessions are created against it
+ * Returns NULL on failure. Caller must EVP_PKEY_free the result
  */
-bool Command::derive_master_secret(aes_128_key master_secret,
-                                   EVP_PKEY *godh_priv_key,
-                                   const sev_cert *pdh_public,
-                                   const uint8_t nonce[sizeof(nonce_128)])
+EVP_PKEY *Command::compile_pdh_pub_key(const sev_cert *pdh_public)
 {
-    if (!godh_priv_key || !pdh_public)
-        return false;
-
     sev_cert dummy;
     memset(&dummy, 0, sizeof(sev_cert));    // To remove compile warnings
     SEVCert temp_obj(&dummy);                // TODO. Hack b/c just want to call function later
-    bool ret = false;
     EVP_PKEY *plat_pub_key = NULL;    // Platform public key
-    size_t shared_key_len = 0;
-
-    do {
-        // New up the Platform's public EVP_PKEY
-        if (!(plat_pub_key = EVP_PKEY_new()))
-            break;
-
-        // Get the friend's Public EVP_PKEY from the certificate
-        // This function allocates memory and attaches an EC_Key
-        //  to your EVP_PKEY so, to prevent mem leaks, make sure
-        //  the EVP_PKEY is freed at the end of this function
-        if (temp_obj.compile_public_key_from_certificate(pdh_public, plat_pub_key) != STATUS_SUCCESS)
-            break;
-
-        // Calculate the shared secret
-        // This function is allocating memory for this uint8_t[],
-        //  must free it at the end of this function
-        uint8_t *shared_key = calculate_shared_secret(godh_priv_key, plat_pub_key, shared_key_len);
-        if (!shared_key)
-            break;
-
-        // Derive the master secret from the intermediate secret
-        if (!kdf((unsigned char*)master_secret, sizeof(aes_128_key), shared_key,
-            shared_key_len, (uint8_t *)SEV_MASTER_SECRET_LABEL,
-            sizeof(SEV_MASTER_SECRET_LABEL)-1, nonce, sizeof(nonce_128))) // sizeof(nonce), bad?
-            break;
-
-        // Free memory allocated in calculate_shared_secret
-        OPENSSL_free(shared_key);    // Local variable
-
-        ret = true;
-    } while (0);
-
-    // Free memory
-    EVP_PKEY_free(plat_pub_key);
-
-    return ret;
-}
-
-bool Command::derive_kek(aes_128_key kek, const aes_128_key master_secret)
-{
-    bool ret = kdf((unsigned char*)kek, sizeof(aes_128_key), master_secret, sizeof(aes_128_key),
-                   (uint8_t *)SEV_KEK_LABEL, sizeof(SEV_KEK_LABEL)-1, NULL, 0);
-    return ret;
-}
-
-bool Command::derive_kik(hmac_key_128 kik, const aes_128_key master_secret)
-{
-    bool ret = kdf((unsigned char*)kik, sizeof(aes_128_key), master_secret, sizeof(aes_128_key),
-                   (uint8_t *)SEV_KIK_LABEL, sizeof(SEV_KIK_LABEL)-1, NULL, 0);
-    return ret;
-}
-
-bool Command::gen_hmac(hmac_sha_256 *out, hmac_key_128 key, uint8_t *msg, size_t msg_len)
-{
-    if (!out || !msg)
-        return false;
-
-    unsigned int out_len = 0;
-    HMAC(EVP_sha256(), key, sizeof(hmac_key_128), msg,    // Returns NULL or value of out
-         msg_len, (uint8_t *)out, &out_len);
-
-    if ((out != NULL) && (out_len == sizeof(hmac_sha_256)))
-        return true;
-    else
-        return false;
-}
-
-/*
- * AES128 Encrypt a buffer
- */
-bool Command::encrypt(uint8_t *out, const uint8_t *in, size_t length,
-                      const aes_128_key Key, const iv_128 IV)
-{
-    if (!out || !in)
-        return false;
-
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    bool cmd_ret = false;
-
-    do {
-        // Create and initialize the context
-        if (!(ctx = EVP_CIPHER_CTX_new()))
-            break;
-
-        // Initialize the encryption operation. IMPORTANT - ensure you
-        // use a key and IV size appropriate for your cipher
-        if (EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, Key, IV) != 1)
-            break;
-
-        // Provide the message to be encrypted, and obtain the encrypted output
-        if (EVP_EncryptUpdate(ctx, out, &len, in, (int)length) != 1)
-            break;
-
-        // Finalize the encryption. Further out bytes may be written at
-        // this stage
-        if (EVP_EncryptFinal_ex(ctx, out + len, &len) != 1)
-            break;
-
-        cmd_ret = true;
-    } while (0);
-
-    // Clean up
-    EVP_CIPHER_CTX_free(ctx);
-
-    return cmd_ret;
-}
-
-int Command::build_session_buffer(sev_session_buf *buf, uint32_t guest_policy,
-                                  EVP_PKEY *godh_priv_key, sev_cert *pdh_pub)
-{
-    int cmd_ret = -1;
-
-    aes_128_key master_secret;
-    nonce_128 nonce;
-    aes_128_key kek;
-    hmac_key_128 kik;
-    iv_128 iv;
-    tek_tik wrap_tk;
-    hmac_sha_256 wrap_mac;
-    hmac_sha_256 policy_mac;
-
-    do {
-        // Generate a random nonce
-        sev::gen_random_bytes(nonce, sizeof(nonce_128));
-
-        // Derive Master Secret
-        if (!derive_master_secret(master_secret, godh_priv_key, pdh_pub, nonce))
-            break;
-
-        // Derive the KEK and KIK
-        if (!derive_kek(kek, master_secret))
-            break;
-        if (!derive_kik(kik, master_secret))
-            break;
-
-        // Generate a random TEK and TIK. Combine in to TK. Wrap.
-        // Preserve TK for use in LAUNCH_MEASURE and LAUNCH_SECRET
-        sev::gen_random_bytes(m_tk.tek, sizeof(m_tk.tek));
-        sev::gen_random_bytes(m_tk.tik, sizeof(m_tk.tik));
-
-        // Create an IV and wrap the TK with KEK and IV
-        sev::gen_random_bytes(iv, sizeof(iv_128));
-        if (!encrypt((uint8_t *)&wrap_tk, (uint8_t *)&m_tk, sizeof(m_tk), kek, iv))
-            break;
-
-        // Generate the HMAC for the wrap_tk
-        if (!gen_hmac(&wrap_mac, kik, (uint8_t *)&wrap_tk, sizeof(wrap_tk)))
-            break;
-
-        // Generate the HMAC for the Policy bits
-        if (!gen_hmac(&policy_mac, m_tk.tik, (uint8_t *)&guest_policy, sizeof(guest_policy)))
-            break;
-
-        // Copy everything to the session data buffer
-        memcpy(&buf->nonce, &nonce, sizeof(buf->nonce));
-        memcpy(&buf->wrap_tk, &wrap_tk, sizeof(buf->wrap_tk));
-        memcpy(&buf->wrap_iv, &iv, sizeof(buf->wrap_iv));
-        memcpy(&buf->wrap_mac, &wrap_mac, sizeof(buf->wrap_mac));
-        memcpy(&buf->policy_mac, &policy_mac, sizeof(buf->policy_mac));
-
-        cmd_ret = STATUS_SUCCESS;
-    } while (0);
-
-    return cmd_ret;
-}
-
-// --------------------------------------------------------------- //
-// ------------------- package_secret functions ------------------ //
-// --------------------------------------------------------------- //
-/*
- * Used in Launch_Secret to encrypt the transfer data with the TEK
- */
-int Command::encrypt_with_tek(uint8_t *encrypted_mem, const uint8_t *secret_mem,
-                              size_t secret_mem_size, const iv_128 iv)
-{
-    return encrypt(encrypted_mem, secret_mem, secret_mem_size, m_tk.tek, iv); // AES-128-CTR
-}
-
-bool Command::create_launch_secret_header(sev_hdr_buf *out_header, iv_128 *iv,
-                                          uint8_t *buf, size_t buffer_len,
-                                          uint32_t hdr_flags,
-                                          uint8_t api_major, uint8_t api_minor)
-{
-    bool ret = false;
-
-    // Note: API <= 0.16 and older does LaunchSecret differently than Naples API >= 0.17
-    const uint8_t meas_ctx = 0x01;
-    sev_hdr_buf header;
-    uint32_t measurement_length = sizeof(header.mac);
-    const uint32_t buf_len = (uint32_t)buffer_len;
-
-    memcpy(header.iv, iv, sizeof(iv_128));
-    header.flags = hdr_flags;
-
-    // Create and initialize the context
-    HMAC_CTX *ctx;
-    if (!(ctx = HMAC_CTX_new()))
-        return ret;
 
-    do {
-        if (HMAC_Init_ex(ctx, m_tk.tik, sizeof(m_tk.tik), EVP_sha256(), NULL) != 1)
-            break;
-        if (HMAC_Update(ctx, &meas_ctx, sizeof(meas_ctx)) != 1)
-            break;
-        if (HMAC_Update(ctx, (uint8_t *)&header.flags, sizeof(header.flags)) != 1)
-            break;
-        if (HMAC_Update(ctx, (uint8_t *)&header.iv, sizeof(header.iv)) != 1)
-            break;
-        if (HMAC_Update(ctx, (uint8_t *)&buf_len, sizeof(buf_len)) != 1) // Guest Length
-            break;
-        if (HMAC_Update(ctx, (uint8_t *)&buf_len, sizeof(buf_len)) != 1) // Trans Length
-            break;
-        if (HMAC_Update(ctx, buf, buf_len) != 1)                        // Data
-            break;
-        if (sev::min_api_version(api_major, api_minor, 0, 17)) {
-            if (HMAC_Update(ctx, m_measurement, sizeof(m_measurement)) != 1) // Measure
-                break;
-        }
-        if (HMAC_Final(ctx, (uint8_t *)&header.mac, &measurement_length) != 1)
-            break;
+    if (!pdh_public)
+        return NULL;
 
-        memcpy(out_header, &header, sizeof(sev_hdr_buf));
-        ret = true;
-    } while (0);
+    // New up the Platform's public EVP_PKEY
+    if (!(plat_pub_key = EVP_PKEY_new()))
+        return NULL;
 
-    HMAC_CTX_free(ctx);
+    // Get the friend's Public EVP_PKEY from the certificate
+    // This function allocates memory and attaches an EC_Key
+    //  to your EVP_PKEY so, to prevent mem leaks, make sure
+    //  the EVP_PKEY is freed by the caller
+    if (temp_obj.compile_public_key_from_certificate(pdh_public, plat_pub_key) != STATUS_SUCCESS) {
+        EVP_PKEY_free(plat_pub_key);
+        return NULL;
+    }
 
-    return ret;
+    return plat_pub_key;
 }
@@ -18,6 +18,8 @@
 #define COMMANDS_H
 
 #include "sevapi.h"      // for hmac_sha_256, nonce_128, aes_128_key
+#include "keyarena.h"    // for SecureKey
+#include "keypool.h"     // for ECDHKeyPool
 #include "sevcore.h"     // for SEVDevice
 #include <openssl/evp.h> // for EVP_PKEY
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
@@ -54,9 +56,26 @@ const std::string GET_ID_S0_FILENAME = "getid_s0_out.txt";
 const std::string GET_ID_S1_FILENAME = "getid_s1_out.txt";                         // get_id
 const std::string CALC_MEASUREMENT_READABLE_FILENAME = "calc_measurement_out.txt"; // calc_measurement
 const std::string CALC_MEASUREMENT_FILENAME = "calc_measurement_out.bin";          // calc_measurement
+const std::string CALC_MEASUREMENT_BATCH_FILENAME = "calc_measurement_batch_out.txt"; // calc_measurement_batch
+const std::string CALC_SNP_MEASUREMENT_READABLE_FILENAME = "calc_snp_measurement_out.txt"; // calc_snp_measurement
+const std::string CALC_SNP_MEASUREMENT_FILENAME = "calc_snp_measurement_out.bin";          // calc_snp_measurement
+const std::string CALC_SNP_MEASUREMENT_MATRIX_FILENAME = "calc_snp_measurement_matrix_out.txt"; // calc_snp_measurement_matrix
+const std::string CALC_LAUNCH_DIGEST_READABLE_FILENAME = "calc_launch_digest_out.txt"; // calc_launch_digest
+const std::string CALC_LAUNCH_DIGEST_FILENAME = "calc_launch_digest_out.bin";          // calc_launch_digest
+const std::string SNP_ID_BLOCK_FILENAME = "id_block.bin";                          // generate_id_block
+const std::string SNP_ID_AUTH_FILENAME = "id_auth.bin";                            // generate_id_block
+const std::string SNP_ID_BLOCK_READABLE_FILENAME = "id_block_out.txt";             // generate_id_block
+const std::string SNP_ID_BLOCK_BATCH_FILENAME = "id_block_batch_out.txt";          // generate_id_block_batch
+const std::string SNP_CPUID_PAGE_FILENAME = "cpuid_page.bin";                      // build_cpuid_page
+const std::string SNP_CPUID_PAGE_READABLE_FILENAME = "cpuid_page_readable.txt";    // build_cpuid_page
+const std::string CPUID_SNAPSHOT_CACHE_FILENAME = "cpuid_snapshot.cache";          // build_cpuid_page
+const std::string RMP_ANALYSIS_FILENAME = "rmp_analysis.txt";                     // analyze_rmp
+const std::string RMP_DIFF_FILENAME = "rmp_diff.txt";                             // diff_rmp
+const std::string SWAP_VERIFY_FILENAME = "swap_verify.txt";                        // verify_swap
 const std::string LAUNCH_BLOB_FILENAME = "launch_blob.bin";                        // generate_launch_blob
 const std::string GUEST_OWNER_DH_FILENAME = "godh.cert";                           // generate_launch_blob
 const std::string GUEST_TK_FILENAME = "tmp_tk.bin";                                // generate_launch_blob
+const std::string LAUNCH_BLOB_BATCH_FOLDER_PREFIX = "guest_";                      // generate_launch_blob_batch
 const std::string SECRET_FILENAME = "secret.txt";                                  // package_secret
 const std::string PACKAGED_SECRET_FILENAME = "packaged_secret.bin";                // package_secret
 const std::string PACKAGED_SECRET_HEADER_FILENAME = "packaged_secret_header.bin";  // package_secret
@@ -74,6 +93,17 @@ constexpr uint8_t SEV_KIK_LABEL[] = "sev-kik";
 
 constexpr auto LAUNCH_MEASURE_CTX = 0x4;
 
+// package_secret encrypts and MACs the secret this many bytes at a time
+constexpr size_t PACKAGE_SECRET_CHUNK_SIZE = 64 * 1024;
+
+// gen_random_bytes requests random_benchmark makes per launch: TEK, TIK,
+// session nonce, wrap IV and launch secret IV, 16 bytes each
+constexpr size_t RANDOM_BENCHMARK_REQUESTS = 5;
+constexpr size_t RANDOM_BENCHMARK_REQUEST_SIZE = 16;
+
+// Most GODH keys generate_launch_blob_batch generates ahead of its workers
+constexpr size_t LAUNCH_BLOB_BATCH_KEY_POOL_MAX = 64;
+
 struct measurement_t
 {
     uint8_t meas_ctx; // LAUNCH_MEASURE_CTX
@@ -96,44 +126,31 @@ class Command
 {
 private:
     SEVDevice *m_sev_device;
-    tek_tik m_tk;               // Unencrypted TIK/TEK. wrap_tk is this enc with KEK
+    SecureKey<tek_tik> m_tk;    // Unencrypted TIK/TEK. wrap_tk is this enc with KEK
     hmac_sha_256 m_measurement; // Measurement. Used in LaunchSecret header HMAC
     std::string m_output_folder = "";
     int m_verbose_flag = 0;
+    std::string m_measurement_cache = "";   // Expected measurement cache file, if any
 
     int calculate_measurement(measurement_t *user_data, hmac_sha_256 *final_meas);
-    int generate_all_certs(void);
-    int generate_all_certs_vcek(void);
+    int generate_all_certs(std::vector<zip_cert_t> &certs);
+    int generate_all_certs_vcek(std::vector<zip_cert_t> &certs);
     int import_all_certs(sev_cert *pdh, sev_cert *pek, sev_cert *oca,
                          sev_cert *cek, amd_cert *ask, amd_cert *ark);
-    bool kdf(uint8_t *key_out, size_t key_out_length, const uint8_t *key_in,
-             size_t key_in_length, const uint8_t *label, size_t label_length,
-             const uint8_t *context, size_t context_length);
-    uint8_t *calculate_shared_secret(EVP_PKEY *priv_key, EVP_PKEY *peer_key,
-                                     size_t &shared_key_len_out);
-    bool derive_master_secret(aes_128_key master_secret,
-                              EVP_PKEY *godh_priv_key,
-                              const sev_cert *pdh_public,
-                              const uint8_t nonce[sizeof(nonce_128)]);
-    bool derive_kek(aes_128_key kek, const aes_128_key master_secret);
-    bool derive_kik(hmac_key_128 kik, const aes_128_key master_secret);
-    bool gen_hmac(hmac_sha_256 *out, hmac_key_128 key, uint8_t *msg, size_t msg_len);
-    bool encrypt(uint8_t *out, const uint8_t *in, size_t length,
-                 const aes_128_key Key, const uint8_t IV[128 / 8]);
-    int build_session_buffer(sev_session_buf *buf, uint32_t guest_policy,
-                             EVP_PKEY *godh_priv_key, sev_cert *pdh_pub);
-    int encrypt_with_tek(uint8_t *encrypted_mem, const uint8_t *secret_mem,
-                         size_t secret_mem_size, const iv_128 iv);
-    bool create_launch_secret_header(sev_hdr_buf *out_header, iv_128 *iv,
-                                     uint8_t *buf, size_t buffer_len,
-                                     uint32_t hdr_flags, uint8_t api_major,
-                                     uint8_t api_minor);
+    EVP_PKEY *compile_pdh_pub_key(const sev_cert *pdh_public);
+    int generate_launch_session(const std::string folder, uint32_t policy,
+                                EVP_PKEY *plat_pub_key, tek_tik *tk,
+                                sev_session_buf *session_data_buf,
+                                ECDHKeyPool *key_pool = NULL);
 
 public:
     Command();
     Command(std::string output_folder, int verbose_flag, ccp_required_t ccp = CCP_REQ);
     ~Command();
 
+    // Cache file for calc_launch_digest and calc_snp_measurement(_matrix) results
+    void set_measurement_cache(const std::string cache_file) { m_measurement_cache = cache_file; }
+
     int factory_reset(void);
     int factory_reset(std::vector<double> &measurements);
 
@@ -167,11 +184,26 @@ public:
     int set_externally_owned(std::string oca_priv_key_file);
     int generate_cek_ask(void);
     int get_ask_ark(void);
-    int export_cert_chain(void);
-    int export_cert_chain_vcek(void);
+    int export_cert_chain(int archive_fd = -1);
+    int export_cert_chain_vcek(int archive_fd = -1);
     int calc_measurement(measurement_t *user_data);
+    int calc_measurement_batch(const std::string input_file);
+    int calc_snp_measurement(const std::string firmware_file, const std::string layout_file);
+    int calc_snp_measurement_matrix(const std::string input_file);
+    int calc_launch_digest(const std::string input_file);
+    int generate_id_block(const std::string id_block_args, const std::string id_key_file,
+                          const std::string author_key_file = "");
+    int generate_id_block_batch(const std::string input_file, const std::string id_key_file,
+                                const std::string author_key_file = "");
+    int build_cpuid_page(const std::string policy_file);
+    int analyze_rmp(const std::string dump_file);
+    int diff_rmp(const std::string before_file, const std::string after_file);
+    int verify_swap(const std::string image_file, const std::string metadata_file);
+    int rmp_model_benchmark(uint64_t num_pages, std::vector<double> &measurements);
+    int random_benchmark(uint64_t num_launches, std::vector<double> &measurements);
     int validate_cert_chain(void);
     int generate_launch_blob(uint32_t policy);
+    int generate_launch_blob_batch(uint32_t policy, uint32_t num_guests);
     int package_secret(void);
     int validate_attestation(void);
     int validate_guest_report(void);
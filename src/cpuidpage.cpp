@@ -0,0 +1,465 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "cpuidpage.h"
+#include "utilities.h"  // for native_cpuid
+#include <algorithm>    // std::sort
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <sys/utsname.h>
+
+static bool parse_number(const std::string str, uint64_t *value)
+{
+    char *end = NULL;
+    unsigned long long val = strtoull(str.c_str(), &end, 0);
+    if (str.empty() || *end != '\0')
+        return false;
+    *value = (uint64_t)val;
+    return true;
+}
+
+static void add_policy_entry(cpuid_policy_t *policy, uint32_t leaf, bool all_subleaves,
+                             uint32_t subleaf = 0)
+{
+    cpuid_policy_entry_t entry;
+    entry.leaf = leaf;
+    entry.subleaf = subleaf;
+    entry.all_subleaves = all_subleaves;
+    for (size_t i = 0; i < 4; i++)
+        entry.mask[i] = 0xffffffff;
+    policy->entries.push_back(entry);
+}
+
+void default_cpuid_policy(cpuid_policy_t *policy)
+{
+    policy->entries.clear();
+    policy->xcr0.clear();
+    policy->xss.clear();
+
+    for (uint32_t leaf = 0x0; leaf <= 0xD; leaf++) {
+        if (leaf == 0x3 || leaf == 0x9 || leaf == 0xC)  // Reserved/not on AMD
+            continue;
+        add_policy_entry(policy, leaf, true);
+
+        // Drop the IDs of the CPU that ran the capture, so every CPU gives
+        // the same page: the initial APIC ID and the x2APIC ID
+        if (leaf == 0x1)
+            policy->entries.back().mask[1] = 0x00ffffff;    // EBX[31:24]
+        else if (leaf == 0xB)
+            policy->entries.back().mask[3] = 0;             // EDX, every subleaf
+    }
+    for (uint32_t leaf = 0x80000000; leaf <= 0x80000008; leaf++)
+        add_policy_entry(policy, leaf, true);
+    add_policy_entry(policy, 0x8000001F, true);     // SEV capabilities
+}
+
+bool read_cpuid_policy(const std::string file_name, cpuid_policy_t *policy)
+{
+    if (file_name == "default") {
+        default_cpuid_policy(policy);
+        return true;
+    }
+
+    std::ifstream file(file_name);
+    std::string line = "";
+    size_t line_num = 0;
+
+    policy->entries.clear();
+    policy->xcr0.clear();
+    policy->xss.clear();
+
+    if (!file.is_open()) {
+        printf("Error: unable to open %s\n", file_name.c_str());
+        return false;
+    }
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string type = "", str = "", extra = "";
+        uint64_t value = 0;
+        bool valid = true;
+
+        line_num++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        fields >> type;
+        if (type == "xcr0" || type == "xss") {
+            valid = (fields >> str) && parse_number(str, &value) && !(fields >> extra);
+            if (valid)
+                (type == "xcr0" ? policy->xcr0 : policy->xss).push_back(value);
+        }
+        else if (type == "leaf") {
+            std::string leaf_str = "", subleaf_str = "";
+            cpuid_policy_entry_t entry;
+
+            valid = (fields >> leaf_str >> subleaf_str) && parse_number(leaf_str, &value) &&
+                    value <= UINT32_MAX;
+            entry.leaf = (uint32_t)value;
+            entry.all_subleaves = (subleaf_str == "*");
+            entry.subleaf = 0;
+            if (valid && !entry.all_subleaves) {
+                valid = parse_number(subleaf_str, &value) && value <= UINT32_MAX;
+                entry.subleaf = (uint32_t)value;
+            }
+            for (size_t i = 0; i < 4 && valid; i++) {
+                entry.mask[i] = 0xffffffff;
+                if (fields >> str) {
+                    valid = parse_number(str, &value) && value <= UINT32_MAX;
+                    entry.mask[i] = (uint32_t)value;
+                }
+            }
+            valid = valid && !(fields >> extra);
+            if (valid)
+                policy->entries.push_back(entry);
+        }
+        else {
+            valid = false;
+        }
+
+        if (!valid) {
+            printf("Error: invalid CPUID policy on line %zu\n", line_num);
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string CPUIDSnapshot::host_id(void)
+{
+    std::string id = "";
+    std::string microcode = "";
+    std::string line = "";
+    unsigned int eax = 1, ebx = 0, ecx = 0, edx = 0;
+    struct utsname uts;
+
+    sev::native_cpuid(&eax, &ebx, &ecx, &edx);
+    char sig[16];
+    snprintf(sig, sizeof(sig), "%08x", eax);
+    id += "sig=" + std::string(sig);
+
+    // One microcode revision line is enough, they're the same on every CPU
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 9, "microcode") == 0) {
+            microcode = line.substr(line.find(':') + 1);
+            size_t first = microcode.find_first_not_of(" \t");
+            microcode = (first == std::string::npos) ? "" : microcode.substr(first);
+            break;
+        }
+    }
+    id += " microcode=" + microcode;
+
+    if (uname(&uts) == 0)
+        id += " kernel=" + std::string(uts.release) + " " + std::string(uts.version);
+    return id;
+}
+
+void CPUIDSnapshot::add(uint32_t leaf, uint32_t subleaf)
+{
+    snp_cpuid_function_t func;
+    unsigned int eax = leaf, ebx = 0, ecx = subleaf, edx = 0;
+
+    sev::native_cpuid(&eax, &ebx, &ecx, &edx);
+    memset(&func, 0, sizeof(func));
+    func.eax_in = leaf;
+    func.ecx_in = subleaf;
+    func.eax = eax;
+    func.ebx = ebx;
+    func.ecx = ecx;
+    func.edx = edx;
+    m_leaves.push_back(func);
+}
+
+const snp_cpuid_function_t *CPUIDSnapshot::find(uint32_t leaf, uint32_t subleaf) const
+{
+    for (size_t i = 0; i < m_leaves.size(); i++) {
+        if (m_leaves[i].eax_in == leaf && m_leaves[i].ecx_in == subleaf)
+            return &m_leaves[i];
+    }
+    return NULL;
+}
+
+/**
+ * Captures leaf 0 and 0x80000000's ranges. Indexed leaves get every valid
+ * subleaf, found the way each leaf defines it
+ */
+void CPUIDSnapshot::capture(void)
+{
+    const uint32_t ranges[] = { 0x0, 0x80000000 };
+
+    m_leaves.clear();
+    m_host_id = host_id();
+
+    for (size_t r = 0; r < sizeof(ranges)/sizeof(ranges[0]); r++) {
+        unsigned int max_leaf = ranges[r], ebx = 0, ecx = 0, edx = 0;
+        sev::native_cpuid(&max_leaf, &ebx, &ecx, &edx);
+        if (max_leaf < ranges[r] || max_leaf - ranges[r] > 0xff)   // Range not there
+            continue;
+
+        for (uint32_t leaf = ranges[r]; leaf <= max_leaf; leaf++) {
+            add(leaf, 0);
+            const snp_cpuid_function_t sub0 = m_leaves.back();
+            uint32_t subleaf = 1;
+
+            switch (leaf) {
+            case 0x4:
+            case 0x8000001D:    // Cache topology, until the NULL cache type
+                if ((sub0.eax & 0x1f) == 0)
+                    break;
+                for (; subleaf < CPUID_MAX_SUBLEAVES; subleaf++) {
+                    add(leaf, subleaf);
+                    if ((m_leaves.back().eax & 0x1f) == 0)
+                        break;
+                }
+                break;
+            case 0x7:
+            case 0x14:
+            case 0x17:
+            case 0x18:
+            case 0x1D:
+            case 0x20:          // Subleaf 0 EAX is the max subleaf
+                for (; subleaf <= sub0.eax && subleaf < CPUID_MAX_SUBLEAVES; subleaf++)
+                    add(leaf, subleaf);
+                break;
+            case 0xB:
+            case 0x1F:
+            case 0x80000026:    // Topology levels, until the invalid level type
+                if (((sub0.ecx >> 8) & 0xff) == 0)
+                    break;
+                for (; subleaf < CPUID_MAX_SUBLEAVES; subleaf++) {
+                    add(leaf, subleaf);
+                    if (((m_leaves.back().ecx >> 8) & 0xff) == 0)
+                        break;
+                }
+                break;
+            case 0xD: {         // XSAVE: subleaf 1, then one per supported component
+                add(leaf, 1);
+                const snp_cpuid_function_t sub1 = m_leaves.back();
+                uint64_t components = sub0.eax | ((uint64_t)sub0.edx << 32) |
+                                      sub1.ecx | ((uint64_t)sub1.edx << 32);
+                for (subleaf = 2; subleaf < CPUID_MAX_SUBLEAVES; subleaf++) {
+                    if (components & (1ULL << subleaf))
+                        add(leaf, subleaf);
+                }
+                break;
+            }
+            case 0xF:
+            case 0x10:          // RDT monitoring/allocation resources
+                for (; subleaf < 4; subleaf++)
+                    add(leaf, subleaf);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+bool CPUIDSnapshot::load_cache(const std::string cache_file)
+{
+    sev::FileView file;
+    std::string id = host_id();
+    size_t magic_len = strlen(CPUID_SNAPSHOT_CACHE_MAGIC);
+    uint32_t version = 0, id_len = 0, count = 0;
+
+    // No cache yet is the normal first run, not an error
+    if (sev::get_file_size(cache_file) == 0 || !file.open(cache_file))
+        return false;
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+
+    // [magic] [version] [host id length] [host id] [count] [count entries]
+    size_t offset = magic_len + 2*sizeof(uint32_t);
+    if (size < offset || memcmp(data, CPUID_SNAPSHOT_CACHE_MAGIC, magic_len) != 0)
+        return false;
+    memcpy(&version, data + magic_len, sizeof(version));
+    memcpy(&id_len, data + magic_len + sizeof(version), sizeof(id_len));
+    if (version != CPUID_SNAPSHOT_CACHE_VERSION || size - offset < (size_t)id_len + sizeof(count))
+        return false;
+    if (id.size() != id_len || memcmp(data + offset, id.data(), id_len) != 0)
+        return false;       // Another host, or this one's microcode/kernel changed
+    offset += id_len;
+    memcpy(&count, data + offset, sizeof(count));
+    offset += sizeof(count);
+    if ((size - offset) / sizeof(snp_cpuid_function_t) != count ||
+        (size - offset) % sizeof(snp_cpuid_function_t) != 0)
+        return false;
+
+    m_leaves.resize(count);
+    if (count)
+        memcpy(m_leaves.data(), data + offset, count * sizeof(snp_cpuid_function_t));
+    m_host_id = id;
+    return true;
+}
+
+bool CPUIDSnapshot::save_cache(const std::string cache_file) const
+{
+    std::string data = CPUID_SNAPSHOT_CACHE_MAGIC;
+    uint32_t version = CPUID_SNAPSHOT_CACHE_VERSION;
+    uint32_t id_len = (uint32_t)m_host_id.size();
+    uint32_t count = (uint32_t)m_leaves.size();
+
+    data.append((const char *)&version, sizeof(version));
+    data.append((const char *)&id_len, sizeof(id_len));
+    data.append(m_host_id);
+    data.append((const char *)&count, sizeof(count));
+    data.append((const char *)m_leaves.data(), count * sizeof(snp_cpuid_function_t));
+
+    // write_file replaces it atomically, so a reader never sees half a cache
+    return sev::write_file(cache_file, data.data(), data.size()) == data.size();
+}
+
+int CPUIDSnapshot::load_or_capture(const std::string cache_file, bool *from_cache)
+{
+    bool cached = load_cache(cache_file);
+
+    if (from_cache)
+        *from_cache = cached;
+    if (cached)
+        return STATUS_SUCCESS;
+
+    capture();
+    if (m_leaves.empty())
+        return ERROR_UNSUPPORTED;
+    if (!save_cache(cache_file))
+        printf("Warning: unable to cache the CPUID snapshot in %s\n", cache_file.c_str());
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Size of the XSAVE area for xfeatures, from the per-component sizes and
+ * offsets in leaf 0xD: standard format (subleaf 0 EBX) or compacted
+ * (subleaf 1 EBX), where components are packed in order, some 64B aligned
+ */
+uint32_t CPUIDSnapshot::xsave_size(uint64_t xfeatures, bool compacted) const
+{
+    uint32_t size = CPUID_XSAVE_LEGACY_SIZE;
+
+    for (uint32_t i = 2; i < CPUID_MAX_SUBLEAVES; i++) {
+        const snp_cpuid_function_t *comp = find(0xD, i);
+        if (!(xfeatures & (1ULL << i)) || !comp)
+            continue;
+        if (compacted) {
+            if (comp->ecx & 0x2)
+                size = (size + 63) & ~63U;
+            size += comp->eax;
+        }
+        else {
+            size = std::max(size, comp->ebx + comp->eax);
+        }
+    }
+    return size;
+}
+
+static bool cpuid_function_less(const snp_cpuid_function_t &a, const snp_cpuid_function_t &b)
+{
+    if (a.eax_in != b.eax_in)
+        return a.eax_in < b.eax_in;
+    if (a.ecx_in != b.ecx_in)
+        return a.ecx_in < b.ecx_in;
+    if (a.xcr0_in != b.xcr0_in)
+        return a.xcr0_in < b.xcr0_in;
+    return a.xss_in < b.xss_in;
+}
+
+static uint64_t host_xcr0(void)
+{
+    unsigned int eax = 1, ebx = 0, ecx = 0, edx = 0;
+    uint32_t lo = 0, hi = 0;
+
+    sev::native_cpuid(&eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1U << 27)))        // OSXSAVE
+        return 0x1;
+    asm volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return lo | ((uint64_t)hi << 32);
+}
+
+int CPUIDSnapshot::build_page(const cpuid_policy_t &policy,
+                              snp_launch_update_cpuid_page *page) const
+{
+    std::vector<snp_cpuid_function_t> funcs;
+    std::vector<uint64_t> xcr0s = policy.xcr0;
+    std::vector<uint64_t> xsss = policy.xss;
+
+    if (xcr0s.empty())
+        xcr0s.push_back(host_xcr0());
+    if (xsss.empty())
+        xsss.push_back(0);
+
+    for (size_t i = 0; i < m_leaves.size(); i++) {
+        const snp_cpuid_function_t &leaf = m_leaves[i];
+        const cpuid_policy_entry_t *rule = NULL;
+
+        for (size_t p = 0; p < policy.entries.size() && !rule; p++) {
+            const cpuid_policy_entry_t &entry = policy.entries[p];
+            if (entry.leaf == leaf.eax_in && (entry.all_subleaves || entry.subleaf == leaf.ecx_in))
+                rule = &entry;
+        }
+        if (!rule)
+            continue;
+
+        snp_cpuid_function_t func;
+        memset(&func, 0, sizeof(func));
+        func.eax_in = leaf.eax_in;
+        func.ecx_in = leaf.ecx_in;
+        func.eax = leaf.eax & rule->mask[0];
+        func.ebx = leaf.ebx & rule->mask[1];
+        func.ecx = leaf.ecx & rule->mask[2];
+        func.edx = leaf.edx & rule->mask[3];
+
+        // XSAVE sizes depend on the enabled features: one entry per XCR0
+        // (subleaf 0) or XCR0/XSS pair (subleaf 1)
+        if (func.eax_in == 0xD && func.ecx_in <= 1) {
+            for (size_t x = 0; x < xcr0s.size(); x++) {
+                for (size_t s = 0; s < (func.ecx_in == 1 ? xsss.size() : 1); s++) {
+                    snp_cpuid_function_t variant = func;
+                    variant.xcr0_in = xcr0s[x];
+                    variant.xss_in = (func.ecx_in == 1) ? xsss[s] : 0;
+                    variant.ebx = xsave_size(variant.xcr0_in | variant.xss_in,
+                                             func.ecx_in == 1) & rule->mask[1];
+                    funcs.push_back(variant);
+                }
+            }
+            continue;
+        }
+        funcs.push_back(func);
+    }
+
+    // Duplicate XCR0/XSS values in the policy give duplicate entries
+    std::sort(funcs.begin(), funcs.end(), cpuid_function_less);
+    funcs.erase(std::unique(funcs.begin(), funcs.end(),
+                            [](const snp_cpuid_function_t &a, const snp_cpuid_function_t &b) {
+                                return !cpuid_function_less(a, b) && !cpuid_function_less(b, a);
+                            }), funcs.end());
+
+    if (funcs.size() > SNP_CPUID_COUNT_MAX) {
+        printf("Error: the policy allows %zu CPUID functions, the page holds %d\n",
+               funcs.size(), SNP_CPUID_COUNT_MAX);
+        return ERROR_INVALID_LENGTH;
+    }
+
+    memset(page, 0, sizeof(*page));
+    page->count = (uint32_t)funcs.size();
+    if (!funcs.empty())
+        memcpy(page->cpuid_function, funcs.data(), funcs.size() * sizeof(snp_cpuid_function_t));
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,112 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef CPUIDPAGE_H
+#define CPUIDPAGE_H
+
+#include "sevapi.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define CPUID_SNAPSHOT_CACHE_MAGIC      "SEVCPUID"
+#define CPUID_SNAPSHOT_CACHE_VERSION    1
+
+// Subleaves past this aren't captured, whatever the leaf claims
+#define CPUID_MAX_SUBLEAVES             64
+
+// Leaf 0xD's XSAVE components start after the legacy area and header
+#define CPUID_XSAVE_LEGACY_SIZE         576
+
+/**
+ * One policy rule: keep leaf/subleaf (any subleaf if all_subleaves) and AND
+ * its outputs with mask (eax, ebx, ecx, edx)
+ */
+struct cpuid_policy_entry_t {
+    uint32_t leaf;
+    uint32_t subleaf;
+    bool all_subleaves;
+    uint32_t mask[4];
+};
+
+/**
+ * Which host leaves go in the page, and the XCR0/XSS values to emit leaf 0xD
+ * variants for. With no xcr0 values, the host's current XCR0 is used
+ */
+struct cpuid_policy_t {
+    std::vector<cpuid_policy_entry_t> entries;
+    std::vector<uint64_t> xcr0;
+    std::vector<uint64_t> xss;
+};
+
+/**
+ * Reads a policy file. Each line is one of
+ *   leaf [leaf] [subleaf or *] [eax mask] [ebx mask] [ecx mask] [edx mask]
+ *   xcr0 [value]
+ *   xss [value]
+ * Masks are optional (default all ones). Numbers are decimal or 0x hex.
+ * Blank lines and lines starting with # are ignored. "default" gives
+ * default_cpuid_policy()
+ */
+bool read_cpuid_policy(const std::string file_name, cpuid_policy_t *policy);
+
+/**
+ * The basic (0x0-0xD) and extended (0x80000000-0x80000008, 0x8000001F)
+ * leaves, with the per-CPU APIC IDs (leaf 0x1 EBX[31:24], leaf 0xB EDX)
+ * masked off. Leaf 0x1F isn't included, so its x2APIC ID never appears
+ */
+void default_cpuid_policy(cpuid_policy_t *policy);
+
+/**
+ * Every CPUID leaf and subleaf of the host, captured once. CPUID traps (and
+ * in a VM, exits), so the snapshot is cached in a file keyed by the host's
+ * identity (CPU signature, microcode revision and kernel); the cache is
+ * only rebuilt when one of them changes.
+ *
+ * build_page() turns the snapshot into a canonical CPUID page: only the
+ * leaves the policy allows, masked, with leaf 0xD subleaf 0/1 expanded for
+ * each XCR0/XSS the policy lists, sorted by input and zero everywhere else,
+ * so the same host and policy always give the same page
+ */
+class CPUIDSnapshot
+{
+private:
+    std::vector<snp_cpuid_function_t> m_leaves;
+    std::string m_host_id;
+
+    void add(uint32_t leaf, uint32_t subleaf);
+    const snp_cpuid_function_t *find(uint32_t leaf, uint32_t subleaf) const;
+    uint32_t xsave_size(uint64_t xfeatures, bool compacted) const;
+
+public:
+    // Identifies the host's CPUID results: signature, microcode, kernel
+    static std::string host_id(void);
+
+    void capture(void);
+    bool load_cache(const std::string cache_file);
+    bool save_cache(const std::string cache_file) const;
+
+    // Loads cache_file if it matches this host, else captures and rewrites it
+    int load_or_capture(const std::string cache_file, bool *from_cache = NULL);
+
+    const std::vector<snp_cpuid_function_t> &leaves(void) const { return m_leaves; }
+
+    int build_page(const cpuid_policy_t &policy, snp_launch_update_cpuid_page *page) const;
+};
+
+#endif /* CPUIDPAGE_H */
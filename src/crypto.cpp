@@ -22,6 +22,9 @@
 #include <openssl/hmac.h>
 #include <openssl/ts.h>
 #include <openssl/ecdh.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>     // for OSSL_MAC_NAME_HMAC
+#endif
 
 // NIST Compliant KDF
 bool kdf(uint8_t *key_out,       size_t key_out_length,
@@ -35,7 +38,6 @@ bool kdf(uint8_t *key_out,       size_t key_out_length,
 
     bool ret_val = false;
     uint8_t null_byte = '\0';
-    unsigned int out_len = 0;
     uint8_t prf_out[NIST_KDF_H_BYTES];      // Buffer to collect PRF output
 
     // Length in bits of derived key
@@ -47,31 +49,28 @@ bool kdf(uint8_t *key_out,       size_t key_out_length,
     size_t BytesLeft = key_out_length;
     uint32_t offset = 0;
 
-    // Create and initialize the context
-    HMAC_CTX *ctx;
-    if (!(ctx = HMAC_CTX_new()))
-        return ret_val;
+    // Keyed once, then rewound for each later block
+    HMACSha256 ctx;
+    if (!ctx.init(key_in, key_in_length))
+        return false;
 
     for (unsigned int i = 1; i <= n; i++) {
-        if (HMAC_CTX_reset(ctx) != 1)
-            break;
-
         // Calculate a chunk of random data from the PRF
-        if (HMAC_Init_ex(ctx, key_in, (int)key_in_length, EVP_sha256(), NULL) != 1)
+        if (i > 1 && !ctx.rewind())
             break;
-        if (HMAC_Update(ctx, (uint8_t *)&i, sizeof(i)) != 1)
+        if (!ctx.update((uint8_t *)&i, sizeof(i)))
             break;
-        if (HMAC_Update(ctx, (unsigned char*)label, label_length) != 1)
+        if (!ctx.update((unsigned char*)label, label_length))
             break;
-        if (HMAC_Update(ctx, &null_byte, sizeof(null_byte)) != 1)
+        if (!ctx.update(&null_byte, sizeof(null_byte)))
             break;
         if ((context) && (context_length != 0)) {
-            if (HMAC_Update(ctx, (unsigned char*)context, context_length) != 1)
+            if (!ctx.update((unsigned char*)context, context_length))
                 break;
         }
-        if (HMAC_Update(ctx, (uint8_t *)&l, sizeof(l)) != 1)
+        if (!ctx.update((uint8_t *)&l, sizeof(l)))
             break;
-        if (HMAC_Final(ctx, prf_out, &out_len) != 1)
+        if (!ctx.final(prf_out))
             break;
 
         // Write out the key bytes
@@ -88,7 +87,9 @@ bool kdf(uint8_t *key_out,       size_t key_out_length,
             ret_val = true;
     }
 
-    HMAC_CTX_free(ctx);
+    // The last block holds derived key bytes
+    OPENSSL_cleanse(prf_out, sizeof(prf_out));
+
     return ret_val;
 }
 
@@ -158,7 +159,6 @@ bool derive_master_secret(aes_128_key master_secret,
     SEVCert temp_obj(&dummy);           // TODO. Hack b/c just want to call function later
     bool ret = false;
     EVP_PKEY *plat_pub_key = NULL;   // Peer key
-    size_t shared_key_len = 0;
 
     do {
         // New up the Platform's public EVP_PKEY
@@ -174,6 +174,30 @@ bool derive_master_secret(aes_128_key master_secret,
         if (temp_obj.compile_public_key_from_certificate(pdh_public, plat_pub_key) != STATUS_SUCCESS)
             break;
 
+        ret = derive_master_secret(master_secret, godh_priv_key, plat_pub_key, nonce);
+    } while (0);
+
+    EVP_PKEY_free(plat_pub_key);
+
+    return ret;
+}
+
+/**
+ * Same as above, for when the platform's PDH public key has already been
+ * compiled from its cert (ex. once for many guests)
+ */
+bool derive_master_secret(aes_128_key master_secret,
+                          EVP_PKEY *godh_priv_key,
+                          EVP_PKEY *plat_pub_key,
+                          const uint8_t nonce[sizeof(nonce_128)])
+{
+    if (!godh_priv_key || !plat_pub_key)
+        return false;
+
+    bool ret = false;
+    size_t shared_key_len = 0;
+
+    do {
         /*
          * Calculate the shared secret
          * This function is allocating memory for this uint8_t[],
@@ -184,19 +208,18 @@ bool derive_master_secret(aes_128_key master_secret,
             break;
 
         // Derive the master secret from the intermediate secret
-        if (!kdf((unsigned char*)master_secret, sizeof(aes_128_key), shared_key,
+        bool kdf_ret = kdf((unsigned char*)master_secret, sizeof(aes_128_key), shared_key,
             shared_key_len, (uint8_t *)SEV_MASTER_SECRET_LABEL,
-            sizeof(SEV_MASTER_SECRET_LABEL)-1, nonce, sizeof(nonce_128))) // sizeof(nonce), bad?
-            break;
+            sizeof(SEV_MASTER_SECRET_LABEL)-1, nonce, sizeof(nonce_128)); // sizeof(nonce), bad?
 
         // Free memory allocated in calculate_shared_secret
-        OPENSSL_free(shared_key);    // Local variable
+        OPENSSL_clear_free(shared_key, shared_key_len);    // Local variable
+        if (!kdf_ret)
+            break;
 
         ret = true;
     } while (0);
 
-    EVP_PKEY_free(plat_pub_key);
-
     return ret;
 }
 
@@ -219,14 +242,147 @@ bool gen_hmac(hmac_sha_256 *out, hmac_key_128 key, uint8_t *msg, size_t msg_len)
     if (!out || !msg)
         return false;
 
+    return hmac_sha256(key, sizeof(hmac_key_128), msg, msg_len, (uint8_t *)out);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+// The HMAC implementation, fetched once per thread. Contexts hold their own
+// reference to it, so they outlive the thread that made them just fine
+struct hmac_fetch_t {
+    EVP_MAC *mac;
+
+    hmac_fetch_t() : mac(NULL) {}
+    ~hmac_fetch_t() { EVP_MAC_free(mac); }
+};
+
+static thread_local hmac_fetch_t t_hmac_fetch;
+
+static hmac_sha256_ctx_t *mac_ctx_new(void)
+{
+    if (!t_hmac_fetch.mac)
+        t_hmac_fetch.mac = EVP_MAC_fetch(NULL, OSSL_MAC_NAME_HMAC, NULL);
+    return t_hmac_fetch.mac ? EVP_MAC_CTX_new(t_hmac_fetch.mac) : NULL;
+}
+
+// Frees the context, wiping the keyed state and the copy of the key in it
+static void mac_ctx_free(hmac_sha256_ctx_t *ctx)
+{
+    EVP_MAC_CTX_free(ctx);
+}
+
+static bool mac_ctx_set_key(hmac_sha256_ctx_t *ctx, const uint8_t *key, size_t key_len)
+{
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    return EVP_MAC_init(ctx, key, key_len, params) == 1;
+}
+
+// Back to the state right after the key was set, without re-keying
+static bool mac_ctx_rewind(hmac_sha256_ctx_t *ctx)
+{
+    return EVP_MAC_init(ctx, NULL, 0, NULL) == 1;
+}
+
+static bool mac_ctx_update(hmac_sha256_ctx_t *ctx, const void *data, size_t len)
+{
+    return EVP_MAC_update(ctx, (const uint8_t *)data, len) == 1;
+}
+
+static bool mac_ctx_final(hmac_sha256_ctx_t *ctx, uint8_t *out)
+{
+    size_t out_len = 0;
+    return EVP_MAC_final(ctx, out, &out_len, DIGEST_SHA256_SIZE_BYTES) == 1 &&
+           out_len == DIGEST_SHA256_SIZE_BYTES;
+}
+#else
+static hmac_sha256_ctx_t *mac_ctx_new(void)
+{
+    return HMAC_CTX_new();
+}
+
+// Frees the context, wiping the keyed state
+static void mac_ctx_free(hmac_sha256_ctx_t *ctx)
+{
+    HMAC_CTX_free(ctx);
+}
+
+static bool mac_ctx_set_key(hmac_sha256_ctx_t *ctx, const uint8_t *key, size_t key_len)
+{
+    return HMAC_Init_ex(ctx, key, (int)key_len, EVP_sha256(), NULL) == 1;
+}
+
+// Back to the state right after the key was set, without re-keying
+static bool mac_ctx_rewind(hmac_sha256_ctx_t *ctx)
+{
+    return HMAC_Init_ex(ctx, NULL, 0, NULL, NULL) == 1;
+}
+
+static bool mac_ctx_update(hmac_sha256_ctx_t *ctx, const void *data, size_t len)
+{
+    return HMAC_Update(ctx, (const uint8_t *)data, len) == 1;
+}
+
+static bool mac_ctx_final(hmac_sha256_ctx_t *ctx, uint8_t *out)
+{
     unsigned int out_len = 0;
-    HMAC(EVP_sha256(), key, sizeof(hmac_key_128), msg,    // Returns NULL or value of out
-         msg_len, (uint8_t *)out, &out_len);
+    return HMAC_Final(ctx, out, &out_len) == 1 && out_len == DIGEST_SHA256_SIZE_BYTES;
+}
+#endif
+
+HMACSha256::HMACSha256()
+    : m_ctx(NULL)
+{
+}
 
-    if ((out != NULL) && (out_len == sizeof(hmac_sha_256)))
-        return true;
-    else
+HMACSha256::~HMACSha256()
+{
+    clear();
+}
+
+void HMACSha256::clear(void)
+{
+    mac_ctx_free(m_ctx);
+    m_ctx = NULL;
+}
+
+bool HMACSha256::init(const uint8_t *key, size_t key_len)
+{
+    if (!key) {
+        clear();
+        return false;
+    }
+    // A context from an earlier init() is re-keyed rather than reallocated
+    if (!m_ctx && !(m_ctx = mac_ctx_new()))
         return false;
+    if (!mac_ctx_set_key(m_ctx, key, key_len)) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+bool HMACSha256::rewind(void)
+{
+    return m_ctx && mac_ctx_rewind(m_ctx);
+}
+
+bool HMACSha256::update(const void *data, size_t len)
+{
+    return m_ctx && mac_ctx_update(m_ctx, data, len);
+}
+
+bool HMACSha256::final(uint8_t out[DIGEST_SHA256_SIZE_BYTES])
+{
+    return m_ctx && mac_ctx_final(m_ctx, out);
+}
+
+bool hmac_sha256(const uint8_t *key, size_t key_len, const void *msg,
+                 size_t msg_len, uint8_t out[DIGEST_SHA256_SIZE_BYTES])
+{
+    HMACSha256 mac;
+    return mac.init(key, key_len) && mac.update(msg, msg_len) && mac.final(out);
 }
 
 bool encrypt(uint8_t *out, const uint8_t *in, size_t length,
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/opensslv.h>       // OPENSSL_VERSION_NUMBER
 #include <openssl/rsa.h>
 #include <openssl/sha.h>
 
@@ -92,11 +93,53 @@ bool derive_master_secret(aes_128_key master_secret,
                           EVP_PKEY *godh_priv_key,
                           const sev_cert *pdh_public,
                           const uint8_t nonce[sizeof(nonce_128)]);
+bool derive_master_secret(aes_128_key master_secret,
+                          EVP_PKEY *godh_priv_key,
+                          EVP_PKEY *plat_pub_key,
+                          const uint8_t nonce[sizeof(nonce_128)]);
 
 bool derive_kek(aes_128_key kek, const aes_128_key master_secret);
 bool derive_kik(hmac_key_128 kik, const aes_128_key master_secret);
 bool gen_hmac(hmac_sha_256 *out, hmac_key_128 key, uint8_t *msg, size_t msg_len);
 
+/**
+ * HMAC_SHA256
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX hmac_sha256_ctx_t;
+#else
+typedef HMAC_CTX hmac_sha256_ctx_t;      // EVP_MAC is OpenSSL 3.0+
+#endif
+
+/**
+ * One HMAC-SHA256 computation, on a context owned by this object. For many
+ * messages under one key (ex. the KDF's counter blocks), rewind() starts
+ * over from the keyed state without re-keying. No copy of the key is kept
+ * outside of the context, and clear() (or the destructor) wipes and frees it.
+ * init() may be called again on the same object, with any key
+ */
+class HMACSha256
+{
+private:
+    hmac_sha256_ctx_t *m_ctx;
+
+    HMACSha256(const HMACSha256 &);               // Not copyable
+    HMACSha256 &operator=(const HMACSha256 &);
+
+public:
+    HMACSha256();
+    ~HMACSha256();
+
+    bool init(const uint8_t *key, size_t key_len);
+    bool rewind(void);
+    bool update(const void *data, size_t len);
+    bool final(uint8_t out[DIGEST_SHA256_SIZE_BYTES]);
+    void clear(void);
+};
+
+bool hmac_sha256(const uint8_t *key, size_t key_len, const void *msg,
+                 size_t msg_len, uint8_t out[DIGEST_SHA256_SIZE_BYTES]);
+
 // AES128 encrypt a buffer
 bool encrypt(uint8_t *out, const uint8_t *in, size_t length,
              const aes_128_key key, const uint8_t iv[128/8]);
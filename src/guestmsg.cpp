@@ -0,0 +1,322 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "guestmsg.h"
+#include <openssl/crypto.h>     // for OPENSSL_cleanse
+#include <cstring>
+
+SNPGuestMessageCodec::SNPGuestMessageCodec(snp_gmsg_role_t role) :
+    m_role(role)
+{
+    for (size_t i = 0; i < SNP_VMPCK_COUNT; i++) {
+        m_vmpck[i].enc = NULL;
+        m_vmpck[i].dec = NULL;
+        m_vmpck[i].next_seqno = 1;
+    }
+}
+
+SNPGuestMessageCodec::~SNPGuestMessageCodec()
+{
+    // Frees (and zeroizes) the expanded keys
+    for (size_t i = 0; i < SNP_VMPCK_COUNT; i++) {
+        EVP_CIPHER_CTX_free(m_vmpck[i].enc);
+        EVP_CIPHER_CTX_free(m_vmpck[i].dec);
+    }
+}
+
+uint8_t SNPGuestMessageCodec::max_msg_version(uint8_t msg_type)
+{
+    switch (msg_type) {
+        case SNP_MSG_CPUID_REQ:       return SNP_GMSG_MAX_MSG_VERSION_CPUID_REQ;
+        case SNP_MSG_CPUID_RSP:       return SNP_GMSG_MAX_MSG_VERSION_CPUID_RSP;
+        case SNP_MSG_KEY_REQ:         return SNP_GMSG_MAX_MSG_VERSION_KEY_REQ;
+        case SNP_MSG_KEY_RSP:         return SNP_GMSG_MAX_MSG_VERSION_KEY_RSP;
+        case SNP_MSG_REPORT_REQ:      return SNP_GMSG_MAX_MSG_VERSION_REPORT_REQ;
+        case SNP_MSG_REPORT_RSP:      return SNP_GMSG_MAX_MSG_VERSION_REPORT_RSP;
+        case SNP_MSG_EXPORT_REQ:      return SNP_GMSG_MAX_MSG_VERSION_EXPORT_REQ;
+        case SNP_MSG_EXPORT_RSP:      return SNP_GMSG_MAX_MSG_VERSION_EXPORT_RSP;
+        case SNP_MSG_IMPORT_REQ:      return SNP_GMSG_MAX_MSG_VERSION_IMPORT_REQ;
+        case SNP_MSG_IMPORT_RSP:      return SNP_GMSG_MAX_MSG_VERSION_IMPORT_RSP;
+        case SNP_MSG_ABSORB_REQ:      return SNP_GMSG_MAX_MSG_VERSION_ABSORB_REQ;
+        case SNP_MSG_ABSORB_RSP:      return SNP_GMSG_MAX_MSG_VERSION_ABSORB_RSP;
+        case SNP_MSG_VMRK_REQ:        return SNP_GMSG_MAX_MSG_VERSION_VMRK_REQ;
+        case SNP_MSG_VMRK_RSP:        return SNP_GMSG_MAX_MSG_VERSION_VMRK_RSP;
+        case SNP_MSG_ABSORB_NOMA_REQ: return SNP_GMSG_MAX_MSG_VERSION_ABSORB_NOMA_REQ;
+        case SNP_MSG_ABSORB_NOMA_RSP: return SNP_GMSG_MAX_MSG_VERSION_ABSORB_NOMA_RSP;
+        default:                      return 0;
+    }
+}
+
+int SNPGuestMessageCodec::set_vmpck(uint8_t vmpck, const uint8_t *key, size_t key_size,
+                                    uint64_t msg_count)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+
+    do {
+        if (vmpck >= SNP_VMPCK_COUNT || !key || key_size != SNP_VMPCK_SIZE)
+            break;
+
+        // Leave room for at least one request/response pair
+        if (msg_count >= UINT64_MAX - 2) {
+            cmd_ret = ERROR_AEAD_OFLOW;
+            break;
+        }
+
+        vmpck_state_t &state = m_vmpck[vmpck];
+        if (!state.enc && !(state.enc = EVP_CIPHER_CTX_new()))
+            break;
+        if (!state.dec && !(state.dec = EVP_CIPHER_CTX_new()))
+            break;
+
+        // Expand the key now. Per message, only the IV is set
+        if (EVP_EncryptInit_ex(state.enc, EVP_aes_256_gcm(), NULL, key, NULL) != 1)
+            break;
+        if (EVP_DecryptInit_ex(state.dec, EVP_aes_256_gcm(), NULL, key, NULL) != 1)
+            break;
+
+        state.next_seqno = msg_count + 1;
+        state.pending.clear();
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+uint64_t SNPGuestMessageCodec::msg_count(uint8_t vmpck)
+{
+    if (vmpck >= SNP_VMPCK_COUNT)
+        return 0;
+    return m_vmpck[vmpck].next_seqno - 1 - 2 * m_vmpck[vmpck].pending.size();
+}
+
+// Checks everything in a received header except the auth tag
+int SNPGuestMessageCodec::check_header(const snp_gmsg_t &msg, uint64_t seqno)
+{
+    const snp_guest_message_header_t *hdr = msg.hdr;
+
+    if (hdr->algo != AEAD_ALGO_AES_256_GCM ||
+        hdr->hdr_version == 0 || hdr->hdr_version > SNP_GMSG_MAX_HDR_VERSION ||
+        hdr->hdr_size != SNP_GMSG_HDR_SIZE)
+        return ERROR_INVALID_PARAM;
+
+    if (hdr->msg_type != msg.msg_type || hdr->msg_vmpck != msg.vmpck ||
+        hdr->msg_version == 0 || hdr->msg_version > max_msg_version(hdr->msg_type))
+        return ERROR_INVALID_PARAM;
+
+    if (SNP_GMSG_HDR_SIZE + hdr->msg_size > msg.buf_size)
+        return ERROR_INVALID_LENGTH;
+
+    if (hdr->msg_seqno != seqno)    // Replayed, dropped or reordered
+        return ERROR_INVALID_PARAM;
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * IV is MSG_SEQNO, little endian, zero extended to 96 bits. AAD is the
+ * header from ALGO (0x30) up to the payload (0x60)
+ */
+int SNPGuestMessageCodec::encrypt(snp_gmsg_t &msg, uint64_t seqno)
+{
+    snp_guest_message_header_t *hdr = msg.hdr;
+    EVP_CIPHER_CTX *ctx = m_vmpck[msg.vmpck].enc;
+    uint8_t iv[SNP_GMSG_IV_SIZE] = {0};
+    int len = 0;
+
+    memset(hdr, 0, SNP_GMSG_HDR_SIZE);
+    hdr->msg_seqno = seqno;
+    hdr->algo = AEAD_ALGO_AES_256_GCM;
+    hdr->hdr_version = SNP_GMSG_MAX_HDR_VERSION;
+    hdr->hdr_size = (uint16_t)SNP_GMSG_HDR_SIZE;
+    hdr->msg_type = msg.msg_type;
+    hdr->msg_version = msg.msg_version;
+    hdr->msg_size = msg.msg_size;
+    hdr->msg_vmpck = msg.vmpck;
+    memcpy(iv, &seqno, sizeof(seqno));
+
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_EncryptUpdate(ctx, NULL, &len, &hdr->algo, (int)SNP_GMSG_HDR_AAD_SIZE) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_EncryptUpdate(ctx, &hdr->payload, &len, &hdr->payload, msg.msg_size) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_EncryptFinal_ex(ctx, &hdr->payload + len, &len) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SNP_GMSG_AUTHTAG_SIZE, hdr->auth_tag) != 1)
+        return ERROR_INVALID_PARAM;
+
+    return STATUS_SUCCESS;
+}
+
+int SNPGuestMessageCodec::decrypt(snp_gmsg_t &msg)
+{
+    snp_guest_message_header_t *hdr = msg.hdr;
+    EVP_CIPHER_CTX *ctx = m_vmpck[msg.vmpck].dec;
+    uint8_t iv[SNP_GMSG_IV_SIZE] = {0};
+    uint64_t seqno = hdr->msg_seqno;
+    uint16_t msg_size = hdr->msg_size;
+    int len = 0;
+
+    memcpy(iv, &seqno, sizeof(seqno));
+
+    if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_DecryptUpdate(ctx, NULL, &len, &hdr->algo, (int)SNP_GMSG_HDR_AAD_SIZE) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_DecryptUpdate(ctx, &hdr->payload, &len, &hdr->payload, msg_size) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SNP_GMSG_AUTHTAG_SIZE, hdr->auth_tag) != 1)
+        return ERROR_INVALID_PARAM;
+    if (EVP_DecryptFinal_ex(ctx, &hdr->payload + len, &len) != 1)
+        return ERROR_BAD_SIGNATURE;     // Auth tag mismatch
+
+    return STATUS_SUCCESS;
+}
+
+int SNPGuestMessageCodec::seal(snp_gmsg_t &msg)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    bool is_request = (msg.msg_type & 1) != 0;
+    uint64_t seqno = 0;
+
+    do {
+        if (msg.vmpck >= SNP_VMPCK_COUNT || !m_vmpck[msg.vmpck].enc || !msg.hdr)
+            break;
+        if (msg.msg_type == SNP_MSG_INVALID || msg.msg_type >= SNP_MSG_LIMIT ||
+            msg.msg_version == 0 || msg.msg_version > max_msg_version(msg.msg_type))
+            break;
+        if (SNP_GMSG_HDR_SIZE + msg.msg_size > msg.buf_size) {
+            cmd_ret = ERROR_INVALID_LENGTH;
+            break;
+        }
+
+        vmpck_state_t &state = m_vmpck[msg.vmpck];
+        if (m_role == SNP_GMSG_ROLE_GUEST) {
+            if (!is_request)
+                break;
+            // The response will need seqno+1 as well
+            if (state.next_seqno >= UINT64_MAX - 1) {
+                cmd_ret = ERROR_AEAD_OFLOW;
+                break;
+            }
+            seqno = state.next_seqno;
+        }
+        else {
+            // Answers the oldest request still waiting
+            if (is_request || state.pending.empty() ||
+                msg.msg_type != state.pending.front().msg_type + 1)
+                break;
+            seqno = state.pending.front().seqno + 1;
+        }
+
+        cmd_ret = encrypt(msg, seqno);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        if (m_role == SNP_GMSG_ROLE_GUEST) {
+            pending_t req = { seqno, msg.msg_type };
+            state.pending.push_back(req);
+            state.next_seqno += 2;
+        }
+        else {
+            state.pending.pop_front();
+        }
+    } while (0);
+
+    msg.status = cmd_ret;
+    return cmd_ret;
+}
+
+int SNPGuestMessageCodec::open(snp_gmsg_t &msg)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    bool is_request = (msg.msg_type & 1) != 0;
+    uint64_t seqno = 0;
+
+    do {
+        if (msg.vmpck >= SNP_VMPCK_COUNT || !m_vmpck[msg.vmpck].dec ||
+            !msg.hdr || msg.buf_size < SNP_GMSG_HDR_SIZE)
+            break;
+        if (msg.msg_type == SNP_MSG_INVALID || msg.msg_type >= SNP_MSG_LIMIT)
+            break;
+
+        vmpck_state_t &state = m_vmpck[msg.vmpck];
+        if (m_role == SNP_GMSG_ROLE_GUEST) {
+            // Must answer the oldest request still waiting
+            if (is_request || state.pending.empty() ||
+                msg.msg_type != state.pending.front().msg_type + 1)
+                break;
+            seqno = state.pending.front().seqno + 1;
+        }
+        else {
+            if (!is_request)
+                break;
+            if (state.next_seqno >= UINT64_MAX - 1) {
+                cmd_ret = ERROR_AEAD_OFLOW;
+                break;
+            }
+            seqno = state.next_seqno;
+        }
+
+        cmd_ret = check_header(msg, seqno);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = decrypt(msg);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        msg.msg_version = msg.hdr->msg_version;
+        msg.msg_size = msg.hdr->msg_size;
+
+        if (m_role == SNP_GMSG_ROLE_GUEST) {
+            state.pending.pop_front();
+        }
+        else {
+            pending_t req = { seqno, msg.msg_type };
+            state.pending.push_back(req);
+            state.next_seqno += 2;
+        }
+    } while (0);
+
+    // Don't leave unauthenticated plaintext (or a rejected message) behind
+    if (cmd_ret != STATUS_SUCCESS && msg.hdr && msg.buf_size > SNP_GMSG_HDR_SIZE)
+        OPENSSL_cleanse(&msg.hdr->payload, msg.buf_size - SNP_GMSG_HDR_SIZE);
+
+    msg.status = cmd_ret;
+    return cmd_ret;
+}
+
+size_t SNPGuestMessageCodec::seal_batch(snp_gmsg_t *msgs, size_t count)
+{
+    size_t i = 0;
+    for (; i < count; i++) {
+        if (seal(msgs[i]) != STATUS_SUCCESS)
+            break;
+    }
+    return i;
+}
+
+size_t SNPGuestMessageCodec::open_batch(snp_gmsg_t *msgs, size_t count)
+{
+    size_t i = 0;
+    for (; i < count; i++) {
+        if (open(msgs[i]) != STATUS_SUCCESS)
+            break;
+    }
+    return i;
+}
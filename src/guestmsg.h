@@ -0,0 +1,125 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef GUESTMSG_H
+#define GUESTMSG_H
+
+#include "rmp.h"
+#include "sevapi.h"
+#include <openssl/evp.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#define SNP_VMPCK_COUNT         4       // VMPCK0 to VMPCK3
+#define SNP_VMPCK_SIZE          32      // AES-256 key
+#define SNP_GMSG_HDR_SIZE       (offsetof(snp_guest_message_header_t, payload))  // 0x60
+#define SNP_GMSG_AUTHTAG_SIZE   16      // Of the 32 byte AUTHTAG field, GCM uses the first 16
+#define SNP_GMSG_IV_SIZE        12      // MSG_SEQNO, zero extended
+
+// Which end of the channel a codec is. Guests send requests, firmware responds
+enum snp_gmsg_role_t {
+    SNP_GMSG_ROLE_GUEST,
+    SNP_GMSG_ROLE_FIRMWARE,
+};
+
+/**
+ * One guest message, sealed or opened in place. hdr points to a buffer of
+ * buf_size bytes holding the header followed by the payload
+ *   seal: fill in the payload, vmpck, msg_type, msg_version and msg_size.
+ *         The header is filled in and the payload encrypted over the top
+ *   open: fill in vmpck and msg_type (what the caller expects to receive).
+ *         On success the payload is plaintext and msg_version/msg_size are
+ *         set from the header. On failure the whole payload area
+ *         (buf_size past the header) is wiped, and nothing is printed:
+ *         the return code and status say why
+ */
+struct snp_gmsg_t {
+    snp_guest_message_header_t *hdr;
+    size_t buf_size;
+    uint8_t vmpck;
+    uint8_t msg_type;
+    uint8_t msg_version;
+    uint16_t msg_size;      // Payload bytes
+    int status;             // Result of the last seal/open of this message
+};
+
+/**
+ * Builds and parses SNP guest messages (SNP ABI 8.26 / 9.21), AES-256-GCM
+ * under one of the guest's VMPCKs. Each key is expanded into its cipher
+ * contexts once, in set_vmpck(), and only the IV changes per message.
+ *
+ * Sequence numbers are tracked per VMPCK the same way the firmware does: a
+ * request carries MSG_COUNT+1, its response MSG_COUNT+2. Requests may be
+ * pipelined (several sealed before the first response is opened); responses
+ * must then come back in the same order. A message with any other sequence
+ * number is rejected, so replays and reordering are caught before decryption.
+ *
+ * Not thread safe. Use one codec per thread (or per guest)
+ */
+class SNPGuestMessageCodec
+{
+private:
+    struct pending_t {
+        uint64_t seqno;
+        uint8_t msg_type;
+    };
+    struct vmpck_state_t {
+        EVP_CIPHER_CTX *enc;
+        EVP_CIPHER_CTX *dec;
+        uint64_t next_seqno;            // Of the next request
+        std::deque<pending_t> pending;  // Requests waiting on a response
+    };
+
+    snp_gmsg_role_t m_role;
+    vmpck_state_t m_vmpck[SNP_VMPCK_COUNT];
+
+    SNPGuestMessageCodec(const SNPGuestMessageCodec &);             // Not copyable, holds keys
+    SNPGuestMessageCodec &operator=(const SNPGuestMessageCodec &);
+
+    int check_header(const snp_gmsg_t &msg, uint64_t seqno);
+    int encrypt(snp_gmsg_t &msg, uint64_t seqno);
+    int decrypt(snp_gmsg_t &msg);
+
+public:
+    SNPGuestMessageCodec(snp_gmsg_role_t role);
+    ~SNPGuestMessageCodec();
+
+    /**
+     * Loads VMPCK vmpck (0-3) and resets its sequence numbers to
+     * msg_count (0 for a freshly launched guest)
+     */
+    int set_vmpck(uint8_t vmpck, const uint8_t *key, size_t key_size,
+                  uint64_t msg_count = 0);
+    // MSG_COUNT of vmpck: sequence number of the last completed response
+    uint64_t msg_count(uint8_t vmpck);
+
+    int seal(snp_gmsg_t &msg);
+    int open(snp_gmsg_t &msg);
+
+    /**
+     * Seal or open count messages in order, stopping at the first failure.
+     * Returns how many succeeded; the failing message's status says why
+     */
+    size_t seal_batch(snp_gmsg_t *msgs, size_t count);
+    size_t open_batch(snp_gmsg_t *msgs, size_t count);
+
+    // Highest MSG_VERSION this tool understands for msg_type, 0 if unknown
+    static uint8_t max_msg_version(uint8_t msg_type);
+};
+
+#endif /* GUESTMSG_H */
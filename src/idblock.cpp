@@ -0,0 +1,184 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "idblock.h"
+#include "crypto.h"     // for sign_message
+#include "sevcert.h"    // for read_priv_key_pem_into_evpkey
+#include <openssl/ec.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>     // for OSSL_PKEY_PARAM_EC_PUB_X
+#include <openssl/objects.h>        // for OBJ_sn2nid
+#endif
+#include <cstring>
+#include <stdio.h>
+
+// The auth page's key fields are wider (0x404 bytes), the rest reserved/zero
+static_assert(sizeof(sev_ecdsa_pub_key) <= sizeof(snp_launch_finish_id_auth_page::id_key), "Error, static assertion failed");
+static_assert(sizeof(sev_ecdsa_pub_key) <= sizeof(snp_launch_finish_id_auth_page::author_key), "Error, static assertion failed");
+static_assert(sizeof(sev_sig) == sizeof(snp_launch_finish_id_auth_page::id_block_sig), "Error, static assertion failed");
+static_assert(sizeof(sev_sig) == sizeof(snp_launch_finish_id_auth_page::id_key_sig), "Error, static assertion failed");
+
+SNPIDBlockSigner::SNPIDBlockSigner()
+    : m_id_key(NULL),
+      m_author_key(NULL)
+{
+    memset(&m_auth, 0, sizeof(m_auth));
+}
+
+SNPIDBlockSigner::~SNPIDBlockSigner()
+{
+    EVP_PKEY_free(m_id_key);
+    EVP_PKEY_free(m_author_key);
+}
+
+bool SNPIDBlockSigner::ecdsa_pub_key(EVP_PKEY *key, sev_ecdsa_pub_key *pub_key)
+{
+    bool success = false;
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+    EC_KEY *ec_key = NULL;
+#endif
+    BIGNUM *x_bignum = BN_new();
+    BIGNUM *y_bignum = BN_new();
+
+    memset(pub_key, 0, sizeof(*pub_key));
+
+    do {
+        if (!x_bignum || !y_bignum)
+            break;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        char curve_name[80];
+        if (EVP_PKEY_base_id(key) != EVP_PKEY_EC ||
+            !EVP_PKEY_get_group_name(key, curve_name, sizeof(curve_name), NULL))
+            break;
+
+        // The firmware only accepts P-384 ID and author keys
+        if (OBJ_sn2nid(curve_name) != NID_secp384r1)
+            break;
+        pub_key->curve = SEV_EC_P384;
+
+        if (!EVP_PKEY_get_bn_param(key, OSSL_PKEY_PARAM_EC_PUB_X, &x_bignum) ||
+            !EVP_PKEY_get_bn_param(key, OSSL_PKEY_PARAM_EC_PUB_Y, &y_bignum))
+            break;
+#else
+        if (!(ec_key = EVP_PKEY_get1_EC_KEY(key)))
+            break;
+
+        // The firmware only accepts P-384 ID and author keys
+        const EC_GROUP *ec_group = EC_KEY_get0_group(ec_key);
+        if (EC_GROUP_get_curve_name(ec_group) != NID_secp384r1)
+            break;
+        pub_key->curve = SEV_EC_P384;
+
+        if (!EC_POINT_get_affine_coordinates_GFp(ec_group, EC_KEY_get0_public_key(ec_key),
+                                                 x_bignum, y_bignum, NULL))
+            break;
+#endif
+        if (BN_bn2lebinpad(x_bignum, pub_key->qx, sizeof(pub_key->qx)) <= 0 ||
+            BN_bn2lebinpad(y_bignum, pub_key->qy, sizeof(pub_key->qy)) <= 0)
+            break;
+
+        success = true;
+    } while (0);
+
+    BN_free(y_bignum);
+    BN_free(x_bignum);
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+    EC_KEY_free(ec_key);
+#endif
+    return success;
+}
+
+int SNPIDBlockSigner::load(const std::string id_key_file, const std::string author_key_file)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    sev_ecdsa_pub_key id_pub_key;
+    sev_ecdsa_pub_key author_pub_key;
+    sev_sig id_key_sig;
+
+    EVP_PKEY_free(m_id_key);
+    EVP_PKEY_free(m_author_key);
+    m_id_key = m_author_key = NULL;
+    memset(&m_auth, 0, sizeof(m_auth));
+    memset(&id_key_sig, 0, sizeof(id_key_sig));
+
+    do {
+        if (!read_priv_key_pem_into_evpkey(id_key_file, &m_id_key) ||
+            !ecdsa_pub_key(m_id_key, &id_pub_key)) {
+            printf("Error: %s isn't an ECDSA P-384 private key\n", id_key_file.c_str());
+            break;
+        }
+        m_auth.id_key_algo = SNP_ID_KEY_ALGO_ECDSA_P384_SHA384;
+        memcpy(m_auth.id_key, &id_pub_key, sizeof(id_pub_key));
+
+        if (!author_key_file.empty()) {
+            if (!read_priv_key_pem_into_evpkey(author_key_file, &m_author_key) ||
+                !ecdsa_pub_key(m_author_key, &author_pub_key)) {
+                printf("Error: %s isn't an ECDSA P-384 private key\n", author_key_file.c_str());
+                break;
+            }
+
+            // The author key signs the ID key, as it appears in the auth page
+            if (!sign_message(&id_key_sig, &m_author_key, m_auth.id_key,
+                              sizeof(m_auth.id_key), SEV_SIG_ALGO_ECDSA_SHA384))
+                break;
+            m_auth.auth_key_algo = SNP_ID_KEY_ALGO_ECDSA_P384_SHA384;
+            memcpy(m_auth.id_key_sig, &id_key_sig, sizeof(m_auth.id_key_sig));
+            memcpy(m_auth.author_key, &author_pub_key, sizeof(author_pub_key));
+        }
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    if (cmd_ret != STATUS_SUCCESS) {
+        EVP_PKEY_free(m_id_key);
+        EVP_PKEY_free(m_author_key);
+        m_id_key = m_author_key = NULL;
+    }
+    return cmd_ret;
+}
+
+void SNPIDBlockSigner::build_id_block(const uint8_t ld[48], const uint8_t family_id[16],
+                                      const uint8_t image_id[16], uint32_t guest_svn,
+                                      uint64_t policy, snp_launch_finish_id_block *id_block)
+{
+    memset(id_block, 0, sizeof(*id_block));
+    memcpy(id_block->ld, ld, sizeof(id_block->ld));
+    memcpy(id_block->family_id, family_id, sizeof(id_block->family_id));
+    memcpy(id_block->image_id, image_id, sizeof(id_block->image_id));
+    id_block->version = SNP_LAUNCH_FINISH_ID_BLOCK_MAX_VERSION;
+    id_block->guest_svn = guest_svn;
+    id_block->policy = policy;
+}
+
+int SNPIDBlockSigner::sign(const snp_launch_finish_id_block *id_block,
+                           snp_launch_finish_id_auth_page *id_auth)
+{
+    EVP_PKEY *id_key = m_id_key;    // sign_message wants a non-const EVP_PKEY**
+    sev_sig id_block_sig;
+
+    if (!id_key)
+        return ERROR_INVALID_PARAM;
+
+    memset(&id_block_sig, 0, sizeof(id_block_sig));
+    if (!sign_message(&id_block_sig, &id_key, (const uint8_t *)id_block,
+                      sizeof(*id_block), SEV_SIG_ALGO_ECDSA_SHA384))
+        return ERROR_BAD_SIGNATURE;
+
+    memcpy(id_auth, &m_auth, sizeof(*id_auth));
+    memcpy(id_auth->id_block_sig, &id_block_sig, sizeof(id_auth->id_block_sig));
+    return STATUS_SUCCESS;
+}
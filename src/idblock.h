@@ -0,0 +1,63 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef IDBLOCK_H
+#define IDBLOCK_H
+
+#include "sevapi.h"
+#include <openssl/evp.h>
+#include <string>
+
+// ID_KEY_ALGO/AUTH_KEY_ALGO values (SNP ABI, Table "ID Authentication Information")
+#define SNP_ID_KEY_ALGO_INVALID             0
+#define SNP_ID_KEY_ALGO_ECDSA_P384_SHA384   1
+
+/**
+ * Builds and signs the ID block and ID authentication page passed to
+ * SNP_LAUNCH_FINISH. The keys are loaded, and the public parts of the auth
+ * page (ID key, author key, the author's signature of the ID key) built,
+ * once in load(). Each sign() is then just the one ECDSA signature of the
+ * ID block, so signing many variants with the same keys is cheap. sign()
+ * only reads the signer's state and can be called from several threads
+ */
+class SNPIDBlockSigner
+{
+private:
+    EVP_PKEY *m_id_key;
+    EVP_PKEY *m_author_key;
+    snp_launch_finish_id_auth_page m_auth;  // Everything but id_block_sig
+
+public:
+    SNPIDBlockSigner();
+    ~SNPIDBlockSigner();
+
+    // ECDSA P-384 private keys in PEM. author_key_file is optional
+    int load(const std::string id_key_file, const std::string author_key_file = "");
+    bool has_author_key(void) { return m_author_key != NULL; }
+
+    int sign(const snp_launch_finish_id_block *id_block,
+             snp_launch_finish_id_auth_page *id_auth);
+
+    static void build_id_block(const uint8_t ld[48], const uint8_t family_id[16],
+                               const uint8_t image_id[16], uint32_t guest_svn,
+                               uint64_t policy, snp_launch_finish_id_block *id_block);
+
+    // Public key in the firmware's little-endian format
+    static bool ecdsa_pub_key(EVP_PKEY *key, sev_ecdsa_pub_key *pub_key);
+};
+
+#endif /* IDBLOCK_H */
@@ -0,0 +1,339 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "kds.h"
+#include "psp-sev.h"
+#include "utilities.h"
+#include "x509cert.h"
+#include <sys/stat.h>
+#include <cstdlib>      // for atoi
+#include <fstream>
+#include <map>
+#include <memory>       // for std::shared_ptr
+#include <mutex>
+#include <strings.h>    // for strncasecmp
+#include <time.h>
+
+struct kds_meta_t {
+    std::string url;
+    std::string etag;
+    std::string last_modified;
+};
+
+struct kds_cache_entry_t {
+    std::string url;
+    std::string body;
+    time_t validated;
+    std::vector<std::shared_ptr<X509> > x509_certs;    // Parsed on first use
+};
+
+// In-memory copies of everything fetched this run, keyed by cache_file
+static std::mutex g_kds_mutex;
+static std::map<std::string, kds_cache_entry_t> g_kds_cache;
+
+static bool read_meta(const std::string meta_file, kds_meta_t &meta, time_t *mtime)
+{
+    struct stat file_details;
+    std::ifstream file(meta_file);
+    std::string line = "";
+
+    if (!file.is_open() || stat(meta_file.c_str(), &file_details) != 0)
+        return false;
+
+    while (std::getline(file, line)) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = line.substr(0, eq);
+        std::string val = line.substr(eq + 1);
+        if (key == "url")
+            meta.url = val;
+        else if (key == "etag")
+            meta.etag = val;
+        else if (key == "last_modified")
+            meta.last_modified = val;
+    }
+    *mtime = file_details.st_mtime;
+    return true;
+}
+
+static bool write_meta(const std::string meta_file, const kds_meta_t &meta)
+{
+    std::string buf = "url=" + meta.url + "\n" +
+                      "etag=" + meta.etag + "\n" +
+                      "last_modified=" + meta.last_modified + "\n";
+    return sev::write_file(meta_file, buf.data(), buf.size()) == buf.size();
+}
+
+// Case-insensitive lookup of a single response header. Empty if not present
+static std::string get_header(const std::string &headers, const std::string name)
+{
+    size_t pos = 0;
+    while ((pos = headers.find("\r\n", pos)) != std::string::npos) {
+        pos += 2;
+        if (strncasecmp(headers.c_str() + pos, name.c_str(), name.size()) == 0 &&
+            headers.compare(pos + name.size(), 1, ":") == 0) {
+            size_t start = headers.find_first_not_of(' ', pos + name.size() + 1);
+            size_t end = headers.find("\r\n", pos);
+            if (start == std::string::npos || start >= end)
+                return "";
+            return headers.substr(start, end - start);
+        }
+    }
+    return "";
+}
+
+// Validators come from the server or the sidecar file. Anything but
+// printable ASCII (ex. a CR/LF starting another header) isn't sent back
+static bool header_value_ok(const std::string &val)
+{
+    for (size_t i = 0; i < val.size(); i++) {
+        if (val[i] < 0x20 || val[i] > 0x7e)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * GETs url, sending whichever validators meta has. Returns the HTTP status
+ * (0 if the server couldn't be reached). wget is told to keep the response
+ * headers (and the body on errors) so a 304 can be told apart from a failure.
+ * wget is run without a shell, so nothing in the url or validators is
+ * interpreted
+ */
+static int http_get(const std::string url, const kds_meta_t &meta,
+                    std::string &headers, std::string &body)
+{
+    std::vector<std::string> args;
+    std::string output = "";
+    size_t end_of_headers = 0;
+
+    args.push_back("wget");
+    args.push_back("-q");
+    args.push_back("--save-headers");
+    args.push_back("--content-on-error");
+    args.push_back("-O");
+    args.push_back("-");
+    if (!meta.etag.empty() && header_value_ok(meta.etag))
+        args.push_back("--header=If-None-Match: " + meta.etag);
+    if (!meta.last_modified.empty() && header_value_ok(meta.last_modified))
+        args.push_back("--header=If-Modified-Since: " + meta.last_modified);
+    args.push_back("--");
+    args.push_back(url);
+
+    if (!sev::execute_program(args, &output))
+        return 0;
+
+    end_of_headers = output.find("\r\n\r\n");
+    if (output.compare(0, 5, "HTTP/") != 0 || end_of_headers == std::string::npos)
+        return 0;
+
+    headers = output.substr(0, end_of_headers + 2);
+    body = output.substr(end_of_headers + 4);
+
+    size_t space = headers.find(' ');
+    if (space == std::string::npos)
+        return 0;
+    return atoi(headers.c_str() + space + 1);
+}
+
+// Formats a file's mtime as an HTTP-date, for files cached before the
+// sidecar existed
+static std::string http_date(const std::string file_name)
+{
+    struct stat file_details;
+    struct tm tm_mtime;
+    char buf[64];
+
+    if (stat(file_name.c_str(), &file_details) != 0 ||
+        !gmtime_r(&file_details.st_mtime, &tm_mtime) ||
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm_mtime) == 0)
+        return "";
+    return buf;
+}
+
+static void store_entry(const std::string cache_file, const std::string url,
+                        const std::string &body, time_t validated)
+{
+    kds_cache_entry_t &entry = g_kds_cache[cache_file];
+    if (entry.url != url || entry.body != body)
+        entry.x509_certs.clear();
+    entry.url = url;
+    entry.body = body;
+    entry.validated = validated;
+}
+
+int sev::kds_fetch(const std::string url, const std::string cache_file,
+                   std::string &buffer, bool *updated)
+{
+    std::lock_guard<std::mutex> lock(g_kds_mutex);
+    int cmd_ret = SEV_RET_UNSUPPORTED;
+    std::string meta_file = cache_file + KDS_META_EXTENSION;
+    kds_meta_t meta;
+    kds_meta_t validators;
+    time_t meta_mtime = 0;
+    time_t now = time(NULL);
+    bool have_meta = false;
+    bool have_file = false;
+    std::string headers = "";
+    std::string body = "";
+    int status = 0;
+
+    if (updated)
+        *updated = false;
+
+    do {
+        // Already fetched (or revalidated) this run
+        std::map<std::string, kds_cache_entry_t>::iterator it = g_kds_cache.find(cache_file);
+        if (it != g_kds_cache.end() && it->second.url == url &&
+            now - it->second.validated < KDS_REVALIDATE_SECONDS) {
+            buffer = it->second.body;
+            cmd_ret = SEV_RET_SUCCESS;
+            break;
+        }
+
+        have_meta = read_meta(meta_file, meta, &meta_mtime);
+        have_file = sev::get_file_size(cache_file) != 0;
+
+        // A cached copy of a different url (ex. VCEK for an older TCB) is
+        // of no use, not even as a fallback
+        if (have_file && have_meta && meta.url != url)
+            have_file = false;
+
+        if (have_file) {
+            // Checked recently enough, don't even ask the server
+            if (have_meta && now - meta_mtime < KDS_REVALIDATE_SECONDS) {
+                if (!sev::read_file(cache_file, buffer))
+                    break;
+                store_entry(cache_file, url, buffer, meta_mtime);
+                cmd_ret = SEV_RET_SUCCESS;
+                break;
+            }
+
+            if (have_meta) {
+                validators = meta;
+            }
+            else {
+                // Cached before validators were tracked. Use the file's age
+                validators.last_modified = http_date(cache_file);
+            }
+        }
+
+        status = http_get(url, validators, headers, body);
+
+        if (status == 304 && have_file) {
+            if (!sev::read_file(cache_file, buffer))
+                break;
+            meta.url = url;
+            if (!have_meta)
+                meta.last_modified = validators.last_modified;
+            write_meta(meta_file, meta);     // Resets the revalidation clock
+            store_entry(cache_file, url, buffer, now);
+            cmd_ret = SEV_RET_SUCCESS;
+            break;
+        }
+
+        if (status == 200 && !body.empty()) {
+            if (sev::write_file(cache_file, body.data(), body.size()) != body.size())
+                break;
+            meta.url = url;
+            meta.etag = get_header(headers, "ETag");
+            meta.last_modified = get_header(headers, "Last-Modified");
+            if (!header_value_ok(meta.etag))
+                meta.etag = "";
+            if (!header_value_ok(meta.last_modified))
+                meta.last_modified = "";
+            write_meta(meta_file, meta);
+            buffer = body;
+            store_entry(cache_file, url, buffer, now);
+            if (updated)
+                *updated = true;
+            cmd_ret = SEV_RET_SUCCESS;
+            break;
+        }
+
+        // Couldn't revalidate. A stale copy beats no copy; the sidecar isn't
+        // touched, so the next run tries again
+        if (have_file) {
+            printf("Warning: unable to revalidate %s (HTTP %d), using cached copy\n",
+                   cache_file.c_str(), status);
+            if (!sev::read_file(cache_file, buffer))
+                break;
+            store_entry(cache_file, url, buffer, now);
+            cmd_ret = SEV_RET_SUCCESS;
+            break;
+        }
+    } while (0);
+
+    return cmd_ret;
+}
+
+int sev::kds_fetch_x509(const std::string url, const std::string cache_file,
+                        std::vector<X509 *> &x509_certs, bool *updated)
+{
+    int cmd_ret = SEV_RET_UNSUPPORTED;
+    std::string buffer = "";
+    std::vector<X509 *> parsed;
+
+    cmd_ret = sev::kds_fetch(url, cache_file, buffer, updated);
+    if (cmd_ret != SEV_RET_SUCCESS)
+        return cmd_ret;
+
+    std::lock_guard<std::mutex> lock(g_kds_mutex);
+    kds_cache_entry_t &entry = g_kds_cache[cache_file];
+    cmd_ret = SEV_RET_UNSUPPORTED;
+
+    do {
+        // The in-memory entry may be missing if the fetch fell back to a
+        // stale copy. Parse straight from the buffer in that case
+        bool cacheable = (entry.url == url && entry.body == buffer);
+
+        if (!cacheable || entry.x509_certs.empty()) {
+            if (buffer.find("-----BEGIN CERTIFICATE-----") != std::string::npos) {
+                if (!split_pem_chain(buffer, parsed))
+                    break;
+            }
+            else {
+                X509 *x509_cert = NULL;
+                if (!read_der_buf_into_x509(buffer, &x509_cert))
+                    break;
+                parsed.push_back(x509_cert);
+            }
+
+            if (!cacheable) {
+                x509_certs.insert(x509_certs.end(), parsed.begin(), parsed.end());
+                parsed.clear();
+                cmd_ret = SEV_RET_SUCCESS;
+                break;
+            }
+            for (size_t i = 0; i < parsed.size(); i++)
+                entry.x509_certs.push_back(std::shared_ptr<X509>(parsed[i], X509_free));
+            parsed.clear();
+        }
+
+        // Hand out new references, so the cache and caller can free independently
+        for (size_t i = 0; i < entry.x509_certs.size(); i++) {
+            X509_up_ref(entry.x509_certs[i].get());
+            x509_certs.push_back(entry.x509_certs[i].get());
+        }
+        cmd_ret = SEV_RET_SUCCESS;
+    } while (0);
+
+    for (size_t i = 0; i < parsed.size(); i++)
+        X509_free(parsed[i]);
+
+    return cmd_ret;
+}
@@ -0,0 +1,57 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef KDS_H
+#define KDS_H
+
+#include <openssl/x509.h>
+#include <string>
+#include <vector>
+
+namespace sev
+{
+    // How long a cached KDS artifact is trusted before the server is asked
+    // (with a conditional request) whether it has changed
+    #define KDS_REVALIDATE_SECONDS  (24*60*60)
+
+    // Sidecar file next to each cached artifact, holding its source url and
+    // the ETag/Last-Modified validators. Its mtime is the last revalidation
+    #define KDS_META_EXTENSION      ".meta"
+
+    /**
+     * Returns the contents of url, using cache_file as an on-disk cache.
+     * - Within KDS_REVALIDATE_SECONDS of the last check, the cached copy is
+     *   used without touching the network
+     * - After that, a conditional request is sent. 304 keeps the cached
+     *   copy, 200 replaces it
+     * - If the server can't be reached, the cached copy is used
+     * Results are also kept in memory, so repeat calls in the same run
+     * don't re-read the disk.
+     * updated (optional) is set if cache_file was (re)written
+     */
+    int kds_fetch(const std::string url, const std::string cache_file,
+                  std::string &buffer, bool *updated = NULL);
+
+    /**
+     * Same as kds_fetch, but returns the contents parsed as certificates (a
+     * PEM chain, or a single DER cert). Parsed certs are cached in memory
+     * alongside the raw contents. The caller must X509_free each entry
+     */
+    int kds_fetch_x509(const std::string url, const std::string cache_file,
+                       std::vector<X509 *> &x509_certs, bool *updated = NULL);
+} // namespace
+
+#endif /* KDS_H */
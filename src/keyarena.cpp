@@ -0,0 +1,149 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "keyarena.h"
+#include <openssl/crypto.h>     // for OPENSSL_cleanse
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unistd.h>             // for sysconf
+#include <vector>
+
+struct key_arena_chunk_t {
+    uint8_t *base;
+    uint64_t free_mask;         // Bit n set if slot n is free
+};
+
+static_assert(KEY_ARENA_CHUNK_SLOTS <= 64, "free_mask holds one bit per slot");
+
+static std::mutex g_key_arena_mutex;
+// Never freed, so keys released during static destruction are still safe
+static std::vector<key_arena_chunk_t> &g_key_arena_chunks = *new std::vector<key_arena_chunk_t>;
+static size_t g_key_slots_in_use = 0;
+static bool g_key_arena_lock_warned = false;
+
+static bool add_chunk(void)
+{
+    key_arena_chunk_t chunk;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = KEY_ARENA_SLOT_SIZE * KEY_ARENA_CHUNK_SLOTS;
+
+    // Round up to whole pages, mlock and madvise work on pages
+    len = ((len + page_size - 1) / page_size) * page_size;
+
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        printf("Error: unable to map memory for keys\n");
+        return false;
+    }
+
+    if (mlock(base, len) != 0 && !g_key_arena_lock_warned) {
+        printf("Warning: unable to lock key memory, keys may be swapped out (check RLIMIT_MEMLOCK)\n");
+        g_key_arena_lock_warned = true;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(base, len, MADV_DONTDUMP);
+#endif
+
+    chunk.base = (uint8_t *)base;
+    chunk.free_mask = (KEY_ARENA_CHUNK_SLOTS == 64) ? ~0ULL : ((1ULL << KEY_ARENA_CHUNK_SLOTS) - 1);
+    g_key_arena_chunks.push_back(chunk);
+    return true;
+}
+
+// Bits for count slots starting at slot 0
+static uint64_t run_mask(size_t count)
+{
+    return (count >= 64) ? ~0ULL : ((1ULL << count) - 1);
+}
+
+// First slot of a run of count free slots in chunk, or -1 if there's none
+static int find_free_run(const key_arena_chunk_t &chunk, size_t count)
+{
+    uint64_t mask = run_mask(count);
+
+    for (size_t slot = 0; slot + count <= KEY_ARENA_CHUNK_SLOTS; slot++) {
+        if (((chunk.free_mask >> slot) & mask) == mask)
+            return (int)slot;
+    }
+    return -1;
+}
+
+void *sev::key_slot_alloc(void)
+{
+    return key_slots_alloc(1);
+}
+
+void sev::key_slot_free(void *slot)
+{
+    key_slots_free(slot, 1);
+}
+
+void *sev::key_slots_alloc(size_t count)
+{
+    if (count == 0 || count > KEY_ARENA_CHUNK_SLOTS)
+        return NULL;
+
+    std::lock_guard<std::mutex> lock(g_key_arena_mutex);
+    key_arena_chunk_t *chunk = NULL;
+    int slot = -1;
+
+    for (size_t i = 0; i < g_key_arena_chunks.size() && !chunk; i++) {
+        if ((slot = find_free_run(g_key_arena_chunks[i], count)) >= 0)
+            chunk = &g_key_arena_chunks[i];
+    }
+    if (!chunk) {
+        if (!add_chunk())
+            return NULL;
+        chunk = &g_key_arena_chunks.back();
+        slot = 0;
+    }
+
+    // Slots are zeroized when freed, and fresh pages are zero
+    chunk->free_mask &= ~(run_mask(count) << slot);
+    g_key_slots_in_use += count;
+    return chunk->base + (size_t)slot * KEY_ARENA_SLOT_SIZE;
+}
+
+void sev::key_slots_free(void *slots, size_t count)
+{
+    if (!slots)
+        return;
+
+    std::lock_guard<std::mutex> lock(g_key_arena_mutex);
+    uint8_t *ptr = (uint8_t *)slots;
+
+    for (size_t i = 0; i < g_key_arena_chunks.size(); i++) {
+        key_arena_chunk_t &chunk = g_key_arena_chunks[i];
+        if (ptr >= chunk.base && ptr < chunk.base + KEY_ARENA_SLOT_SIZE * KEY_ARENA_CHUNK_SLOTS) {
+            size_t index = (size_t)(ptr - chunk.base) / KEY_ARENA_SLOT_SIZE;
+            if (count == 0 || index + count > KEY_ARENA_CHUNK_SLOTS)
+                break;
+            OPENSSL_cleanse(chunk.base + index * KEY_ARENA_SLOT_SIZE, count * KEY_ARENA_SLOT_SIZE);
+            chunk.free_mask |= (run_mask(count) << index);
+            g_key_slots_in_use -= count;
+            return;
+        }
+    }
+    printf("Error: freeing key slots that aren't from the key arena\n");
+}
+
+size_t sev::key_slots_in_use(void)
+{
+    std::lock_guard<std::mutex> lock(g_key_arena_mutex);
+    return g_key_slots_in_use;
+}
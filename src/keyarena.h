@@ -0,0 +1,82 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef KEYARENA_H
+#define KEYARENA_H
+
+#include <cstddef>
+
+// Every slot handed out by the arena is this size. Big enough for a TEK/TIK
+// pair, any SEV symmetric key, or an ECDH shared secret
+#define KEY_ARENA_SLOT_SIZE     64
+// Slots per chunk. The arena grows a chunk (one mmap + mlock) at a time
+#define KEY_ARENA_CHUNK_SLOTS   64
+
+namespace sev
+{
+    /**
+     * Returns a zeroed KEY_ARENA_SLOT_SIZE byte slot for key material, or
+     * NULL if no memory could be mapped. Slots come from a shared pool of
+     * pages that are mlock'd (kept out of swap) and excluded from core dumps,
+     * so handing one out is just a bitmap update under a mutex. If the pages
+     * can't be locked (ex. RLIMIT_MEMLOCK), a warning is printed once and the
+     * slots are still usable
+     */
+    void *key_slot_alloc(void);
+
+    // Zeroizes the slot and returns it to the arena. NULL is ignored
+    void key_slot_free(void *slot);
+
+    /**
+     * Same as key_slot_alloc, but count (up to KEY_ARENA_CHUNK_SLOTS)
+     * contiguous slots, for key state bigger than one slot. Give them back
+     * with key_slots_free and the same count
+     */
+    void *key_slots_alloc(size_t count);
+    void key_slots_free(void *slots, size_t count);
+
+    // Slots currently handed out
+    size_t key_slots_in_use(void);
+} // namespace
+
+/**
+ * A T (ex. tek_tik, aes_128_key) living in a key arena slot for the
+ * lifetime of this object, zeroized when it goes out of scope. Check valid()
+ * before use
+ */
+template <typename T>
+class SecureKey
+{
+private:
+    static_assert(sizeof(T) <= KEY_ARENA_SLOT_SIZE, "Key too large for a key arena slot");
+
+    T *m_key;
+
+    SecureKey(const SecureKey &);               // Not copyable
+    SecureKey &operator=(const SecureKey &);
+
+public:
+    SecureKey() : m_key((T *)sev::key_slot_alloc()) {}
+    ~SecureKey() { sev::key_slot_free(m_key); }
+
+    bool valid(void) const { return m_key != NULL; }
+    T *get(void) { return m_key; }
+    const T *get(void) const { return m_key; }
+    T &operator*(void) { return *m_key; }
+    T *operator->(void) { return m_key; }
+};
+
+#endif /* KEYARENA_H */
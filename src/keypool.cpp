@@ -0,0 +1,153 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "keypool.h"
+#include "crypto.h"     // for generate_ecdh_key_pair
+#include <system_error>
+
+ECDHKeyPool::ECDHKeyPool(size_t low_watermark, size_t high_watermark,
+                         uint64_t max_keys, SEV_EC curve)
+    : m_curve(curve),
+      m_low_watermark(low_watermark),
+      m_high_watermark(high_watermark),
+      m_max_keys(max_keys),
+      m_stop(false)
+{
+    if (m_high_watermark == 0)
+        m_high_watermark = 1;
+    if (m_low_watermark >= m_high_watermark)
+        m_low_watermark = m_high_watermark - 1;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+ECDHKeyPool::~ECDHKeyPool()
+{
+    stop();
+}
+
+bool ECDHKeyPool::start(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_thread.joinable())
+        return true;
+
+    m_stop = false;
+    try {
+        m_thread = std::thread(&ECDHKeyPool::refill_thread, this);
+    }
+    catch (const std::system_error &) {
+        printf("Error: unable to start ECDH key pool thread\n");
+        return false;
+    }
+    return true;
+}
+
+void ECDHKeyPool::stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_refill.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (!m_keys.empty()) {
+        release(m_keys.front());
+        m_keys.pop_front();
+        m_stats.discarded++;
+    }
+}
+
+void ECDHKeyPool::refill_thread(void)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (!m_stop) {
+        // Top up to the high watermark, generating outside the lock so
+        // acquire() is never held up by key generation
+        while (!m_stop && m_keys.size() < m_high_watermark) {
+            // Every key that will be needed is already out there
+            if (m_max_keys != 0 && m_stats.generated + m_stats.misses >= m_max_keys)
+                return;
+
+            EVP_PKEY *key = NULL;
+            lock.unlock();
+            bool ok = generate_ecdh_key_pair(&key, m_curve);
+            lock.lock();
+            if (!ok) {
+                EVP_PKEY_free(key);
+                printf("Error: ECDH key pool unable to generate key pair\n");
+                return;     // acquire() falls back to inline generation
+            }
+            m_keys.push_back(key);
+            m_stats.generated++;
+        }
+
+        m_refill.wait(lock, [this]() {
+            return m_stop || m_keys.size() <= m_low_watermark;
+        });
+    }
+}
+
+EVP_PKEY *ECDHKeyPool::acquire(void)
+{
+    EVP_PKEY *key = NULL;
+    bool wake = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_keys.empty()) {
+            key = m_keys.front();
+            m_keys.pop_front();
+            m_stats.hits++;
+        }
+        else {
+            m_stats.misses++;
+        }
+        wake = (m_keys.size() <= m_low_watermark);
+    }
+    if (wake)
+        m_refill.notify_one();
+
+    if (!key && !generate_ecdh_key_pair(&key, m_curve)) {
+        EVP_PKEY_free(key);
+        key = NULL;
+    }
+    return key;
+}
+
+/**
+ * EVP_PKEY_free clears the private scalar (BN_clear_free) and the EC_KEY
+ * itself (OPENSSL_clear_free) before giving the memory back
+ */
+void ECDHKeyPool::release(EVP_PKEY *key)
+{
+    EVP_PKEY_free(key);
+}
+
+ecdh_key_pool_stats_t ECDHKeyPool::stats(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+size_t ECDHKeyPool::size(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_keys.size();
+}
@@ -0,0 +1,91 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef KEYPOOL_H
+#define KEYPOOL_H
+
+#include "sevapi.h"     // for SEV_EC
+#include <openssl/evp.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/**
+ * Pool hit-rate counters. A hit is an acquire() served from the pool, a miss
+ * is one that had to generate a key inline because the pool was empty
+ */
+struct ecdh_key_pool_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t generated;     // Keys made by the background thread
+    uint64_t discarded;     // Keys never handed out, zeroized on shutdown
+};
+
+/**
+ * Pool of ECDH key pairs generated ahead of time on a background thread, so
+ * key generation is off the critical path of building a launch session.
+ * Whenever the pool drops to low_watermark keys, the background thread
+ * refills it up to high_watermark, then sleeps until it's drained again.
+ * acquire() never blocks on the background thread: if the pool is empty,
+ * the key is generated inline and counted as a miss.
+ */
+class ECDHKeyPool
+{
+private:
+    SEV_EC m_curve;
+    size_t m_low_watermark;
+    size_t m_high_watermark;
+    uint64_t m_max_keys;    // Total keys that will ever be wanted, 0 if unknown
+    std::deque<EVP_PKEY *> m_keys;
+    std::mutex m_mutex;
+    std::condition_variable m_refill;
+    std::thread m_thread;
+    bool m_stop;
+    ecdh_key_pool_stats_t m_stats;
+
+    void refill_thread(void);
+
+public:
+    /**
+     * If the caller knows how many keys it will need in total (max_keys), the
+     * background thread stops once that many have been handed out or queued,
+     * instead of leaving a full pool to be thrown away at the end
+     */
+    ECDHKeyPool(size_t low_watermark, size_t high_watermark,
+                uint64_t max_keys = 0, SEV_EC curve = SEV_EC_P384);
+    ~ECDHKeyPool();
+
+    // Starts the background thread. The pool starts filling right away
+    bool start(void);
+    // Stops the background thread and zeroizes every key still in the pool
+    void stop(void);
+
+    /**
+     * Returns a fresh key pair (never handed out before), or NULL if inline
+     * generation fails. The caller owns it and must give it back with
+     * release() (or EVP_PKEY_free) when done
+     */
+    EVP_PKEY *acquire(void);
+    static void release(EVP_PKEY *key);
+
+    ecdh_key_pool_stats_t stats(void);
+    size_t size(void);
+};
+
+#endif /* KEYPOOL_H */
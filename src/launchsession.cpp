@@ -0,0 +1,338 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "launchsession.h"
+#include "sevcert.h"
+#include "utilities.h"
+#include <openssl/crypto.h>     // for CRYPTO_memcmp, OPENSSL_cleanse
+
+LaunchSession::LaunchSession()
+    : m_policy(0),
+      m_api_major(0),
+      m_api_minor(0),
+      m_have_measurement(false),
+      m_secret_cipher(NULL),
+      m_secret_len(0),
+      m_secret_done(0)
+{
+    memset(&m_measurement, 0, sizeof(m_measurement));
+    memset(&m_godh_cert, 0, sizeof(m_godh_cert));
+    memset(&m_session_buf, 0, sizeof(m_session_buf));
+}
+
+LaunchSession::~LaunchSession()
+{
+    end_secret();
+    OPENSSL_cleanse(&m_measurement, sizeof(m_measurement));
+}
+
+// Drops the TEK/TIK keyed contexts of the secret being packaged, if any
+void LaunchSession::end_secret(void)
+{
+    EVP_CIPHER_CTX_free(m_secret_cipher);      // Cleanses the key schedule
+    m_secret_cipher = NULL;
+    m_secret_mac.clear();
+    m_secret_len = 0;
+    m_secret_done = 0;
+}
+
+int LaunchSession::create(EVP_PKEY *plat_pub_key, uint32_t policy, ECDHKeyPool *key_pool)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    EVP_PKEY *godh_key_pair = NULL;      // Guest Owner Diffie-Hellman
+    SecureKey<aes_128_key> master_secret;
+    SecureKey<aes_128_key> kek;
+    SecureKey<hmac_key_128> kik;
+    tek_tik *tk = m_tk.get();
+    sev_session_buf *buf = &m_session_buf;
+
+    memset(&m_session_buf, 0, sizeof(m_session_buf));
+    memset(&m_godh_cert, 0, sizeof(m_godh_cert));
+    m_policy = policy;
+    m_have_measurement = false;
+
+    do {
+        if (!plat_pub_key || !tk || !master_secret.valid() || !kek.valid() || !kik.valid())
+            break;
+
+        // Launch Start needs the GODH Pubkey as a cert, so need to create it
+        SEVCert cert_obj(&m_godh_cert);
+
+        // Generate a new GODH Public/Private keypair, or take a pre-generated
+        // one from the pool
+        if (key_pool)
+            godh_key_pair = key_pool->acquire();
+        else if (!generate_ecdh_key_pair(&godh_key_pair)) {
+            EVP_PKEY_free(godh_key_pair);
+            godh_key_pair = NULL;
+        }
+        if (!godh_key_pair) {
+            printf("Error generating new GODH ECDH keypair\n");
+            break;
+        }
+
+        // This cert is really just a way to send over the godh public key,
+        // so the api major/minor don't matter here
+        if (!cert_obj.create_godh_cert(&godh_key_pair, 0, 0)) {
+            printf("Error creating GODH certificate\n");
+            break;
+        }
+
+        // Generate a random nonce
+        sev::gen_random_bytes(buf->nonce, sizeof(buf->nonce));
+
+        // Derive Master Secret
+        if (!derive_master_secret(*master_secret, godh_key_pair, plat_pub_key, buf->nonce))
+            break;
+
+        // Derive the KEK and KIK
+        if (!derive_kek(*kek, *master_secret))
+            break;
+        if (!derive_kik(*kik, *master_secret))
+            break;
+
+        // Generate a random TEK and TIK. Combine in to TK. Wrap.
+        // Preserve TK for use in LAUNCH_MEASURE and LAUNCH_SECRET
+        sev::gen_random_bytes(tk->tek, sizeof(tk->tek));
+        sev::gen_random_bytes(tk->tik, sizeof(tk->tik));
+
+        // Create an IV and wrap the TK with KEK and IV
+        sev::gen_random_bytes(buf->wrap_iv, sizeof(buf->wrap_iv));
+        if (!encrypt((uint8_t *)&buf->wrap_tk, (uint8_t *)tk, sizeof(*tk), *kek, buf->wrap_iv))
+            break;
+
+        // Generate the HMAC for the wrap_tk
+        if (!gen_hmac(&buf->wrap_mac, *kik, (uint8_t *)&buf->wrap_tk, sizeof(buf->wrap_tk)))
+            break;
+
+        // Generate the HMAC for the Policy bits
+        if (!gen_hmac(&buf->policy_mac, tk->tik, (uint8_t *)&policy, sizeof(policy)))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    ECDHKeyPool::release(godh_key_pair);
+
+    if (cmd_ret != STATUS_SUCCESS && tk)
+        OPENSSL_cleanse(tk, sizeof(*tk));
+
+    return cmd_ret;
+}
+
+bool LaunchSession::set_tk(const tek_tik *tk)
+{
+    if (!m_tk.valid())
+        return false;
+    memcpy(m_tk.get(), tk, sizeof(tek_tik));
+    return true;
+}
+
+void LaunchSession::set_api_version(uint8_t api_major, uint8_t api_minor)
+{
+    m_api_major = api_major;
+    m_api_minor = api_minor;
+}
+
+void LaunchSession::set_measurement(const hmac_sha_256 measurement)
+{
+    memcpy(m_measurement, measurement, sizeof(m_measurement));
+    m_have_measurement = true;
+}
+
+int LaunchSession::calculate_measurement(const measurement_t *user_data, hmac_sha_256 *final_meas)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    HMACSha256 ctx;
+
+    do {
+        if (!ctx.init(user_data->tik, sizeof(user_data->tik)))
+            break;
+        if (sev::min_api_version(user_data->api_major, user_data->api_minor, 0, 17)) {
+            if (!ctx.update(&user_data->meas_ctx, sizeof(user_data->meas_ctx)))
+                break;
+            if (!ctx.update(&user_data->api_major, sizeof(user_data->api_major)))
+                break;
+            if (!ctx.update(&user_data->api_minor, sizeof(user_data->api_minor)))
+                break;
+            if (!ctx.update(&user_data->build_id, sizeof(user_data->build_id)))
+                break;
+        }
+        if (!ctx.update((const uint8_t *)&user_data->policy, sizeof(user_data->policy)))
+            break;
+        if (!ctx.update((const uint8_t *)&user_data->digest, sizeof(user_data->digest)))
+            break;
+        // Use the same random MNonce as the FW in our validation calculations
+        if (!ctx.update((const uint8_t *)&user_data->mnonce, sizeof(user_data->mnonce)))
+            break;
+        if (!ctx.final((uint8_t *)final_meas))  // size = 32
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+int LaunchSession::verify_measurement(const sev_measure_buf *measure, uint8_t build_id,
+                                      const uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    measurement_t user_data;
+    hmac_sha_256 expected;
+
+    if (!m_tk.valid())
+        return ERROR_UNSUPPORTED;
+
+    user_data.meas_ctx = LAUNCH_MEASURE_CTX;
+    user_data.api_major = m_api_major;
+    user_data.api_minor = m_api_minor;
+    user_data.build_id = build_id;
+    user_data.policy = m_policy;
+    memcpy(user_data.digest, digest, sizeof(user_data.digest));
+    memcpy(user_data.mnonce, measure->m_nonce, sizeof(user_data.mnonce));
+    memcpy(user_data.tik, m_tk->tik, sizeof(user_data.tik));
+
+    do {
+        if (calculate_measurement(&user_data, &expected) != STATUS_SUCCESS)
+            break;
+
+        if (CRYPTO_memcmp(expected, measure->measurement, sizeof(expected)) != 0) {
+            cmd_ret = ERROR_BAD_MEASUREMENT;
+            break;
+        }
+
+        set_measurement(measure->measurement);
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    OPENSSL_cleanse(&user_data, sizeof(user_data));
+
+    return cmd_ret;
+}
+
+// Note: API <= 0.16 and older does LaunchSecret differently than Naples API >= 0.17
+bool LaunchSession::secret_includes_measurement(void)
+{
+    return sev::min_api_version(m_api_major, m_api_minor, 0, 17);
+}
+
+int LaunchSession::begin_secret(size_t secret_len, uint32_t flags, sev_hdr_buf *header)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    const uint8_t meas_ctx = 0x01;
+    uint32_t buf_len = (uint32_t)secret_len;
+
+    memset(header, 0, sizeof(sev_hdr_buf));
+    header->flags = flags;
+    sev::gen_random_bytes(header->iv, sizeof(header->iv));     // Pick a random IV
+
+    do {
+        if (!m_tk.valid())
+            break;
+        if (secret_len > UINT32_MAX) {
+            cmd_ret = ERROR_INVALID_LENGTH;
+            break;
+        }
+        if (secret_includes_measurement() && !m_have_measurement) {
+            printf("Error: launch measurement needed to package a secret\n");
+            break;
+        }
+
+        // Encrypt the secret with the TEK (AES-128-CTR)
+        end_secret();
+        if (!(m_secret_cipher = EVP_CIPHER_CTX_new()) ||
+            EVP_EncryptInit_ex(m_secret_cipher, EVP_aes_128_ctr(), NULL, m_tk->tek, header->iv) != 1)
+            break;
+
+        // Everything in the header mac that comes before the data
+        if (!m_secret_mac.init(m_tk->tik, sizeof(m_tk->tik)))
+            break;
+        if (!m_secret_mac.update(&meas_ctx, sizeof(meas_ctx)))
+            break;
+        if (!m_secret_mac.update((const uint8_t *)&header->flags, sizeof(header->flags)))
+            break;
+        if (!m_secret_mac.update((const uint8_t *)&header->iv, sizeof(header->iv)))
+            break;
+        if (!m_secret_mac.update((uint8_t *)&buf_len, sizeof(buf_len)))  // Guest Length
+            break;
+        if (!m_secret_mac.update((uint8_t *)&buf_len, sizeof(buf_len)))  // Trans Length
+            break;
+
+        m_secret_len = buf_len;
+        m_secret_done = 0;
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    if (cmd_ret != STATUS_SUCCESS)
+        end_secret();
+
+    return cmd_ret;
+}
+
+int LaunchSession::encrypt_secret(const uint8_t *in, uint8_t *out, size_t len)
+{
+    int encrypted_len = 0;
+
+    if (!m_secret_cipher || len > m_secret_len - m_secret_done || len > INT_MAX)
+        return ERROR_INVALID_LENGTH;
+
+    if (EVP_EncryptUpdate(m_secret_cipher, out, &encrypted_len, in, (int)len) != 1 ||
+        (size_t)encrypted_len != len)           // CTR is a stream cipher
+        return ERROR_UNSUPPORTED;
+
+    // The mac is over the encrypted data
+    if (!m_secret_mac.update(out, len))
+        return ERROR_UNSUPPORTED;
+
+    m_secret_done += (uint32_t)len;
+    return STATUS_SUCCESS;
+}
+
+int LaunchSession::finish_secret(sev_hdr_buf *header)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+
+    do {
+        if (!m_secret_cipher || m_secret_done != m_secret_len) {
+            cmd_ret = ERROR_INVALID_LENGTH;
+            break;
+        }
+        if (secret_includes_measurement()) {
+            if (!m_secret_mac.update(m_measurement, sizeof(m_measurement)))  // Measure
+                break;
+        }
+        if (!m_secret_mac.final((uint8_t *)&header->mac))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    end_secret();
+
+    return cmd_ret;
+}
+
+int LaunchSession::package_secret(const uint8_t *secret, size_t secret_len, uint8_t *out,
+                                  sev_hdr_buf *header, uint32_t flags)
+{
+    int cmd_ret = begin_secret(secret_len, flags, header);
+    if (cmd_ret == STATUS_SUCCESS)
+        cmd_ret = encrypt_secret(secret, out, secret_len);
+    if (cmd_ret == STATUS_SUCCESS)
+        cmd_ret = finish_secret(header);
+    return cmd_ret;
+}
@@ -0,0 +1,111 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef LAUNCHSESSION_H
+#define LAUNCHSESSION_H
+
+#include "commands.h"   // for measurement_t
+#include "crypto.h"     // for HMACSha256
+#include "keyarena.h"   // for SecureKey
+#include "keypool.h"    // for ECDHKeyPool
+#include "sevapi.h"
+#include <openssl/evp.h>
+
+/**
+ * Everything the Guest Owner has to keep for one guest's launch, from
+ * LAUNCH_START through LAUNCH_SECRET, held in memory: the TEK/TIK, the GODH
+ * cert and session buffer sent to the platform, the platform's API version,
+ * and the verified launch measurement. Nothing is read from or written to
+ * disk, so a launch service can handle many guests without tmp_tk.bin etc.
+ * The TK lives in the locked key arena, and it and the measurement are
+ * zeroized when the session is destroyed.
+ *
+ * Typical flow:
+ *   create()               -> send godh_cert() and session_buf() to the PO
+ *   set_api_version()      -> from the PEK cert or PLATFORM_STATUS
+ *   verify_measurement()   -> with LAUNCH_MEASURE's output from the PO
+ *   package_secret()       -> send the header and data to LAUNCH_SECRET
+ */
+class LaunchSession
+{
+private:
+    SecureKey<tek_tik> m_tk;
+    uint32_t m_policy;
+    uint8_t m_api_major;
+    uint8_t m_api_minor;
+    hmac_sha_256 m_measurement;
+    bool m_have_measurement;
+    sev_cert m_godh_cert;
+    sev_session_buf m_session_buf;
+
+    // Secret being packaged, between begin_secret and finish_secret. Both
+    // contexts belong to this session (not to any thread), and are wiped
+    // and freed by finish_secret
+    EVP_CIPHER_CTX *m_secret_cipher;
+    HMACSha256 m_secret_mac;
+    uint32_t m_secret_len;
+    uint32_t m_secret_done;
+
+    LaunchSession(const LaunchSession &);               // Not copyable, holds keys
+    LaunchSession &operator=(const LaunchSession &);
+
+    bool secret_includes_measurement(void);
+    void end_secret(void);
+
+public:
+    LaunchSession();
+    ~LaunchSession();
+
+    /**
+     * Generates a new GODH key pair (from key_pool, if given), TEK and TIK,
+     * and wraps the TK for the platform whose PDH public key is plat_pub_key
+     */
+    int create(EVP_PKEY *plat_pub_key, uint32_t policy, ECDHKeyPool *key_pool = NULL);
+    const sev_cert *godh_cert(void) { return &m_godh_cert; }
+    const sev_session_buf *session_buf(void) { return &m_session_buf; }
+
+    // Restore or save a session's state (ex. tmp_tk.bin)
+    const tek_tik *tk(void) { return m_tk.get(); }
+    bool set_tk(const tek_tik *tk);
+    void set_policy(uint32_t policy) { m_policy = policy; }
+    void set_api_version(uint8_t api_major, uint8_t api_minor);
+    void set_measurement(const hmac_sha_256 measurement);
+
+    static int calculate_measurement(const measurement_t *user_data, hmac_sha_256 *final_meas);
+
+    /**
+     * Checks LAUNCH_MEASURE's output against the measurement expected for
+     * this session's TIK, policy and API version, the build_id and the
+     * digest of the launched image. On a match, the measurement is kept for
+     * the LAUNCH_SECRET header
+     */
+    int verify_measurement(const sev_measure_buf *measure, uint8_t build_id,
+                           const uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+    /**
+     * Encrypts a secret with the TEK and builds its LAUNCH_SECRET header,
+     * either all at once, or streamed: begin_secret with the total length,
+     * encrypt_secret for each piece (in order, any size), then finish_secret
+     * for the header mac. out may be the same buffer as in
+     */
+    int package_secret(const uint8_t *secret, size_t secret_len, uint8_t *out,
+                       sev_hdr_buf *header, uint32_t flags = 0);
+    int begin_secret(size_t secret_len, uint32_t flags, sev_hdr_buf *header);
+    int encrypt_secret(const uint8_t *in, uint8_t *out, size_t len);
+    int finish_secret(sev_hdr_buf *header);
+};
+
+#endif /* LAUNCHSESSION_H */
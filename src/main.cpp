@@ -14,9 +14,12 @@
  * limitations under the License.
  **************************************************************************/
 
+#include "archive.h"   // for redirect_stdout_to_stderr
 #include "commands.h"  // has measurement_t
 #include "tests.h"     // for test_all
 #include "utilities.h" // for str_to_array
+#include <cerrno>
+#include <cstdint>     // for UINT32_MAX
 #include <getopt.h>    // for getopt_long
 #include <stdio.h>
 #include <string>
@@ -32,6 +35,10 @@
 const char help_array[] = "The following commands are supported:\n"
                           " sevtool -[global opts] --[command] [command opts]\n"
                           "(Please see the readme file for more detailed information)\n"
+                          "Global opts:\n"
+                          "  ofolder [folder], verbose, brief, stdout, repetitions [n]\n"
+                          "  cache [file] (calc_snp_measurement(_matrix), calc_launch_digest)\n"
+                          "  durability [none|sync|batch] (output files, default none)\n"
                           "Platform Owner commands:\n"
                           "  factory_reset\n"
                           "  platform_status\n"
@@ -66,10 +73,63 @@ const char help_array[] = "The following commands are supported:\n"
                           "          uint32_t digest\n"
                           "          uint8_t  m_nonce[128/8]\n"
                           "          uint8_t  gctx_tik[128/8]\n"
+                          "  calc_measurement_batch\n"
+                          "      Input params:\n"
+                          "          input file, one line of calc_measurement params per\n"
+                          "          measurement (- for stdin)\n"
+                          "  calc_snp_measurement\n"
+                          "      Input params:\n"
+                          "          firmware image file (ex. OVMF.fd)\n"
+                          "          page layout file\n"
+                          "  calc_snp_measurement_matrix\n"
+                          "      Input params:\n"
+                          "          matrix file of images, vcpus, policies and vmms\n"
+                          "  calc_launch_digest\n"
+                          "      Input params:\n"
+                          "          input file of key=value lines (mode, ovmf, kernel, ...)\n"
+                          "  generate_id_block\n"
+                          "      Input params (all hex):\n"
+                          "          uint8_t  ld[384/8]\n"
+                          "          uint8_t  family_id[128/8]\n"
+                          "          uint8_t  image_id[128/8]\n"
+                          "          uint32_t guest_svn\n"
+                          "          uint64_t policy\n"
+                          "          ID key PEM file (ECDSA P-384)\n"
+                          "          optional: author key PEM file (ECDSA P-384)\n"
+                          "  generate_id_block_batch\n"
+                          "      Input params:\n"
+                          "          input file, one line of generate_id_block ID block\n"
+                          "          params per ID block (- for stdin)\n"
+                          "          ID key PEM file (ECDSA P-384)\n"
+                          "          optional: author key PEM file (ECDSA P-384)\n"
+                          "  build_cpuid_page\n"
+                          "      Input params:\n"
+                          "          CPUID policy file, or default\n"
+                          "  analyze_rmp\n"
+                          "      Input params:\n"
+                          "          RMP dump file\n"
+                          "  diff_rmp\n"
+                          "      Input params:\n"
+                          "          earlier RMP dump file\n"
+                          "          later RMP dump file\n"
+                          "  verify_swap\n"
+                          "      Input params:\n"
+                          "          swap image file\n"
+                          "          swap metadata pages file\n"
+                          "  rmp_model_benchmark\n"
+                          "      Input params:\n"
+                          "          number of 4K pages, a multiple of 512\n"
+                          "  random_benchmark\n"
+                          "      Input params:\n"
+                          "          number of launches\n"
                           "  validate_cert_chain\n"
                           "  generate_launch_blob\n"
                           "      Input params:\n"
                           "          uint32_t policy\n"
+                          "  generate_launch_blob_batch\n"
+                          "      Input params:\n"
+                          "          uint32_t policy\n"
+                          "          number of guests\n"
                           "  package_secret\n"
                           "  validate_attestation\n"
                           "  validate_guest_report\n"
@@ -78,13 +138,17 @@ const char help_array[] = "The following commands are supported:\n"
 
 /* Flag set by '--verbose' */
 static int verbose_flag = 0;
+/* Flag set by '--stdout'. export_cert_chain(_vcek) stream the zip to stdout */
+static int stdout_flag = 0;
 static int repetitions = 1; 
+static sev::write_durability_t durability = sev::WRITE_DURABILITY_NONE;
 
 static struct option long_options[] =
     {
         /* These options set a flag. */
         {"verbose", no_argument, &verbose_flag, 1},
         {"brief", no_argument, &verbose_flag, 0},
+        {"stdout", no_argument, &stdout_flag, 1},
 
         /* These options don't set a flag. We distinguish them by their indices. */
         /* Platform Owner commands */
@@ -106,8 +170,21 @@ static struct option long_options[] =
         /* Guest Owner commands */
         {"get_ask_ark", no_argument, 0, 'n'},
         {"calc_measurement", required_argument, 0, 't'},
+        {"calc_measurement_batch", required_argument, 0, 'C'},
+        {"calc_snp_measurement", required_argument, 0, 'D'},
+        {"calc_snp_measurement_matrix", required_argument, 0, 'L'},
+        {"calc_launch_digest", required_argument, 0, 'E'},
+        {"generate_id_block", required_argument, 0, 'F'},
+        {"generate_id_block_batch", required_argument, 0, 'G'},
+        {"build_cpuid_page", required_argument, 0, 'J'},
+        {"analyze_rmp", required_argument, 0, 'M'},
+        {"diff_rmp", required_argument, 0, 'N'},
+        {"rmp_model_benchmark", required_argument, 0, 'P'},
+        {"verify_swap", required_argument, 0, 'Q'},
+        {"random_benchmark", required_argument, 0, 'R'},
         {"validate_cert_chain", no_argument, 0, 'u'},
         {"generate_launch_blob", required_argument, 0, 'v'},
+        {"generate_launch_blob_batch", required_argument, 0, 'B'},
         {"package_secret", no_argument, 0, 'w'},
         {"validate_attestation", no_argument, 0, 'x'},  // SEV attestation command
         {"validate_guest_report", no_argument, 0, 'y'}, // SNP GuestRequest ReportRequest
@@ -119,8 +196,27 @@ static struct option long_options[] =
         {"help", no_argument, 0, 'H'},
         {"sys_info", no_argument, 0, 'I'},
         {"ofolder", required_argument, 0, 'O'},
+        {"cache", required_argument, 0, 'K'},
+        {"durability", required_argument, 0, 'W'},
         {0, 0, 0, 0}};
 
+/**
+ * Parses all of str as an unsigned 32-bit number in base. Returns false if
+ * it isn't one (empty, trailing characters, negative or too big)
+ */
+static bool parse_uint32(const char *str, int base, uint32_t *value)
+{
+    char *end = NULL;
+
+    errno = 0;
+    unsigned long long val = strtoull(str, &end, base);
+    if (end == str || *end != '\0' || errno != 0 || strchr(str, '-') ||
+        val > UINT32_MAX)
+        return false;
+    *value = (uint32_t)val;
+    return true;
+}
+
 template <typename Func>
 int perform_repetitions_and_analysis(Func func, int repetitions = 10)
 {
@@ -130,6 +226,8 @@ int perform_repetitions_and_analysis(Func func, int repetitions = 10)
 
     for (int i = 0; i < repetitions; i++)
     {
+        // Each repetition's outputs are synced together, after it
+        sev::WriteBatch batch;
         cmd_ret = func(measurements);
 
         if (cmd_ret != 0)
@@ -199,11 +297,15 @@ int main(int argc, char **argv)
     int c = 0;
     int option_index = 0; /* getopt_long stores the option index here. */
     std::string output_folder = "./";
+    std::string cache_file = "";
 
     int cmd_ret = 0xFFFF;
 
     while ((c = getopt_long(argc, argv, "hio:r:", long_options, &option_index)) != -1)
     {
+        // A command's outputs are synced together once it's done
+        sev::set_write_options(durability, verbose_flag != 0);
+        sev::WriteBatch batch;
 
         switch (c)
         {
@@ -246,6 +348,26 @@ int main(int argc, char **argv)
 
             break;
         }
+        case 'K': // cache
+        {
+            cache_file = optarg;
+            break;
+        }
+        case 'W': // durability
+        {
+            std::string mode = optarg;
+            if (mode == "none")
+                durability = sev::WRITE_DURABILITY_NONE;
+            else if (mode == "sync")
+                durability = sev::WRITE_DURABILITY_SYNC;
+            else if (mode == "batch")
+                durability = sev::WRITE_DURABILITY_BATCH;
+            else {
+                printf("Error. Unknown durability %s, expected none, sync or batch\n", optarg);
+                return false;
+            }
+            break;
+        }
         case 'a':
         {
             cmd_ret = perform_repetitions_and_analysis([&](std::vector<double> &measurements)
@@ -353,14 +475,26 @@ int main(int argc, char **argv)
         }
         case 'p':
         { // EXPORT_CERT_CHAIN
+            int archive_fd = -1;
+            if (stdout_flag && (archive_fd = sev::redirect_stdout_to_stderr()) < 0)
+            {
+                printf("Error: unable to redirect stdout\n");
+                return false;
+            }
             Command cmd(output_folder, verbose_flag);
-            cmd_ret = cmd.export_cert_chain();
+            cmd_ret = cmd.export_cert_chain(archive_fd);
             break;
         }
         case 'q':
         { // EXPORT_CERT_CHAIN_VCEK
+            int archive_fd = -1;
+            if (stdout_flag && (archive_fd = sev::redirect_stdout_to_stderr()) < 0)
+            {
+                printf("Error: unable to redirect stdout\n");
+                return false;
+            }
             Command cmd(output_folder, verbose_flag);
-            cmd_ret = cmd.export_cert_chain_vcek();
+            cmd_ret = cmd.export_cert_chain_vcek(archive_fd);
             break;
         }
         case 'r':
@@ -410,6 +544,193 @@ int main(int argc, char **argv)
             cmd_ret = cmd.calc_measurement(&user_data);
             break;
         }
+        case 'C':
+        {             // CALC_MEASUREMENT_BATCH
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 1)
+            {
+                printf("Error: Expecting exactly 1 arg for calc_measurement_batch\n");
+                return false;
+            }
+
+            std::string input_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.calc_measurement_batch(input_file);
+            break;
+        }
+        case 'D':
+        {             // CALC_SNP_MEASUREMENT
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 2)
+            {
+                printf("Error: Expecting exactly 2 args for calc_snp_measurement\n");
+                return false;
+            }
+
+            std::string firmware_file = argv[optind++];
+            std::string layout_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            if (!cache_file.empty())
+                cmd.set_measurement_cache(cache_file);
+            cmd_ret = cmd.calc_snp_measurement(firmware_file, layout_file);
+            break;
+        }
+        case 'L':
+        {             // CALC_SNP_MEASUREMENT_MATRIX
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 1)
+            {
+                printf("Error: Expecting exactly 1 arg for calc_snp_measurement_matrix\n");
+                return false;
+            }
+
+            std::string input_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            if (!cache_file.empty())
+                cmd.set_measurement_cache(cache_file);
+            cmd_ret = cmd.calc_snp_measurement_matrix(input_file);
+            break;
+        }
+        case 'E':
+        {             // CALC_LAUNCH_DIGEST
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 1)
+            {
+                printf("Error: Expecting exactly 1 arg for calc_launch_digest\n");
+                return false;
+            }
+
+            std::string input_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            if (!cache_file.empty())
+                cmd.set_measurement_cache(cache_file);
+            cmd_ret = cmd.calc_launch_digest(input_file);
+            break;
+        }
+        case 'F':
+        {             // GENERATE_ID_BLOCK
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 6 && argc - optind != 7)
+            {
+                printf("Error: Expecting 6 or 7 args for generate_id_block\n");
+                return false;
+            }
+
+            std::string id_block_args = "";
+            for (int i = 0; i < 5; i++)
+                id_block_args += std::string(argv[optind++]) + " ";
+            std::string id_key_file = argv[optind++];
+            std::string author_key_file = (optind < argc) ? argv[optind++] : "";
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.generate_id_block(id_block_args, id_key_file, author_key_file);
+            break;
+        }
+        case 'G':
+        {             // GENERATE_ID_BLOCK_BATCH
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 2 && argc - optind != 3)
+            {
+                printf("Error: Expecting 2 or 3 args for generate_id_block_batch\n");
+                return false;
+            }
+
+            std::string input_file = argv[optind++];
+            std::string id_key_file = argv[optind++];
+            std::string author_key_file = (optind < argc) ? argv[optind++] : "";
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.generate_id_block_batch(input_file, id_key_file, author_key_file);
+            break;
+        }
+        case 'J':
+        {             // BUILD_CPUID_PAGE
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 1)
+            {
+                printf("Error: Expecting exactly 1 arg for build_cpuid_page\n");
+                return false;
+            }
+
+            std::string policy_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.build_cpuid_page(policy_file);
+            break;
+        }
+        case 'M':
+        {             // ANALYZE_RMP
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 1)
+            {
+                printf("Error: Expecting exactly 1 arg for analyze_rmp\n");
+                return false;
+            }
+
+            std::string dump_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.analyze_rmp(dump_file);
+            break;
+        }
+        case 'N':
+        {             // DIFF_RMP
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 2)
+            {
+                printf("Error: Expecting exactly 2 args for diff_rmp\n");
+                return false;
+            }
+
+            std::string before_file = argv[optind++];
+            std::string after_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.diff_rmp(before_file, after_file);
+            break;
+        }
+        case 'P':
+        {             // RMP_MODEL_BENCHMARK
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 1)
+            {
+                printf("Error: Expecting exactly 1 arg for rmp_model_benchmark\n");
+                return false;
+            }
+
+            uint64_t num_pages = strtoull(argv[optind++], NULL, 0);
+            cmd_ret = perform_repetitions_and_analysis([&](std::vector<double> &measurements)
+                                                       {
+                Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+                return cmd.rmp_model_benchmark(num_pages, measurements); }, repetitions);
+            break;
+        }
+        case 'R':
+        {             // RANDOM_BENCHMARK
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 1)
+            {
+                printf("Error: Expecting exactly 1 arg for random_benchmark\n");
+                return false;
+            }
+
+            uint64_t num_launches = strtoull(argv[optind++], NULL, 0);
+            cmd_ret = perform_repetitions_and_analysis([&](std::vector<double> &measurements)
+                                                       {
+                Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+                return cmd.random_benchmark(num_launches, measurements); }, repetitions);
+            break;
+        }
+        case 'Q':
+        {             // VERIFY_SWAP
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 2)
+            {
+                printf("Error: Expecting exactly 2 args for verify_swap\n");
+                return false;
+            }
+
+            std::string image_file = argv[optind++];
+            std::string metadata_file = argv[optind++];
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.verify_swap(image_file, metadata_file);
+            break;
+        }
         case 'u':
         { // VALIDATE_CERT_CHAIN
             Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
@@ -425,11 +746,41 @@ int main(int argc, char **argv)
                 return false;
             }
 
-            uint32_t guest_policy = (uint8_t)strtol(argv[optind++], NULL, 16);
+            uint32_t guest_policy = 0;
+            if (!parse_uint32(argv[optind++], 16, &guest_policy))
+            {
+                printf("Error: guest policy must be a 32-bit hex number\n");
+                return false;
+            }
             Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
             cmd_ret = cmd.generate_launch_blob(guest_policy);
             break;
         }
+        case 'B':
+        {             // GENERATE_LAUNCH_BLOB_BATCH
+            optind--; // Can't use option_index because it doesn't account for '-' flags
+            if (argc - optind != 2)
+            {
+                printf("Error: Expecting exactly 2 args for generate_launch_blob_batch\n");
+                return false;
+            }
+
+            uint32_t guest_policy = 0;
+            uint32_t num_guests = 0;
+            if (!parse_uint32(argv[optind++], 16, &guest_policy))
+            {
+                printf("Error: guest policy must be a 32-bit hex number\n");
+                return false;
+            }
+            if (!parse_uint32(argv[optind++], 10, &num_guests) || num_guests == 0)
+            {
+                printf("Error: number of guests must be a decimal number, at least 1\n");
+                return false;
+            }
+            Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
+            cmd_ret = cmd.generate_launch_blob_batch(guest_policy, num_guests);
+            break;
+        }
         case 'w':
         { // PACKAGE_SECRET
             Command cmd(output_folder, verbose_flag, CCP_NOT_REQ);
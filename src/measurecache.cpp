@@ -0,0 +1,191 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "measurecache.h"
+#include "sevmeasure.h"     // for sha256_file
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>          // open
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::string to_hex(const uint8_t *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(len * 2, '0');
+    for (size_t i = 0; i < len; i++) {
+        hex[i*2] = digits[data[i] >> 4];
+        hex[i*2+1] = digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+static bool from_hex(const std::string &hex, std::vector<uint8_t> &out)
+{
+    if (hex.empty() || hex.size() % 2 != 0)
+        return false;
+    out.resize(hex.size() / 2);
+    for (size_t i = 0; i < out.size(); i++) {
+        char byte[3] = { hex[i*2], hex[i*2+1], '\0' };
+        char *end = NULL;
+        out[i] = (uint8_t)strtoul(byte, &end, 16);
+        if (*end != '\0')
+            return false;
+    }
+    return true;
+}
+
+MeasurementCacheKey::MeasurementCacheKey(const std::string kind)
+    : m_ctx(EVP_MD_CTX_new()),
+      m_ok(false)
+{
+    m_ok = m_ctx && EVP_DigestInit_ex(m_ctx, EVP_sha256(), NULL) == 1;
+    add(kind);
+}
+
+MeasurementCacheKey::~MeasurementCacheKey()
+{
+    EVP_MD_CTX_free(m_ctx);
+}
+
+void MeasurementCacheKey::add(const void *data, size_t len)
+{
+    uint64_t len64 = len;
+    m_ok = m_ok && EVP_DigestUpdate(m_ctx, &len64, sizeof(len64)) == 1 &&
+           EVP_DigestUpdate(m_ctx, data, len) == 1;
+}
+
+bool MeasurementCacheKey::final(uint8_t key[MEASUREMENT_CACHE_KEY_SIZE])
+{
+    // A partial key could collide with another input's, so never hand one out
+    m_ok = m_ok && EVP_DigestFinal_ex(m_ctx, key, NULL) == 1;
+    return m_ok;
+}
+
+bool MeasurementCache::open(const std::string cache_file)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::ifstream file(cache_file);
+    std::string line = "";
+
+    m_file = cache_file;
+    m_file_digests.clear();
+    m_digests.clear();
+    if (!file.is_open()) {
+        struct stat st;
+        return stat(cache_file.c_str(), &st) != 0 && errno == ENOENT;  // A new cache
+    }
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string type = "", id = "", digest_str = "", extra = "";
+        std::vector<uint8_t> digest;
+
+        fields >> type;
+        if (type == "f") {
+            std::string dev, ino, size, mtime, ctime;
+            if (!(fields >> dev >> ino >> size >> mtime >> ctime >> digest_str) || (fields >> extra) ||
+                !from_hex(digest_str, digest) || digest.size() != SHA256_DIGEST_LENGTH)
+                continue;
+            m_file_digests[dev + " " + ino + " " + size + " " + mtime + " " + ctime] =
+                std::string(digest.begin(), digest.end());
+        }
+        else if (type == "m") {
+            if (!(fields >> id >> digest_str) || (fields >> extra) ||
+                id.size() != MEASUREMENT_CACHE_KEY_SIZE*2 || !from_hex(digest_str, digest))
+                continue;
+            m_digests[id] = digest;
+        }
+    }
+    return true;
+}
+
+bool MeasurementCache::append(const std::string &line)
+{
+    if (m_file.empty())
+        return true;        // In-memory only
+
+    int fd = ::open(m_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    ssize_t written = write(fd, line.data(), line.size());     // One write, one whole line
+    close(fd);
+    return written == (ssize_t)line.size();
+}
+
+bool MeasurementCache::file_digest(const std::string file_name, uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+    struct stat st;
+    char id_buf[160];
+
+    if (stat(file_name.c_str(), &st) != 0) {
+        printf("Error: unable to open %s\n", file_name.c_str());
+        return false;
+    }
+    snprintf(id_buf, sizeof(id_buf), "%llx %llx %llx %lld.%09ld %lld.%09ld",
+             (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size,
+             (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+             (long long)st.st_ctim.tv_sec, (long)st.st_ctim.tv_nsec);
+    std::string id = id_buf;
+
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        std::map<std::string, std::string>::iterator it = m_file_digests.find(id);
+        if (it != m_file_digests.end()) {
+            memcpy(digest, it->second.data(), SHA256_DIGEST_LENGTH);
+            return true;
+        }
+    }
+
+    // Hashed outside the lock, so threads can hash different files at once
+    if (!sha256_file(file_name, digest))
+        return false;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_file_digests[id] = std::string((const char *)digest, SHA256_DIGEST_LENGTH);
+    if (!append("f " + id + " " + to_hex(digest, SHA256_DIGEST_LENGTH) + "\n"))
+        printf("Warning: unable to update the measurement cache %s\n", m_file.c_str());
+    return true;
+}
+
+bool MeasurementCache::lookup(const uint8_t key[MEASUREMENT_CACHE_KEY_SIZE], uint8_t *digest, size_t len)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::map<std::string, std::vector<uint8_t> >::iterator it =
+        m_digests.find(to_hex(key, MEASUREMENT_CACHE_KEY_SIZE));
+
+    if (it == m_digests.end() || it->second.size() != len)
+        return false;
+    memcpy(digest, it->second.data(), len);
+    m_hits++;
+    return true;
+}
+
+bool MeasurementCache::store(const uint8_t key[MEASUREMENT_CACHE_KEY_SIZE], const uint8_t *digest, size_t len)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::string id = to_hex(key, MEASUREMENT_CACHE_KEY_SIZE);
+
+    if (m_digests.count(id))
+        return true;
+    m_digests[id] = std::vector<uint8_t>(digest, digest + len);
+    return append("m " + id + " " + to_hex(digest, len) + "\n");
+}
@@ -0,0 +1,93 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef MEASURECACHE_H
+#define MEASURECACHE_H
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>    // for SHA256_DIGEST_LENGTH
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define MEASUREMENT_CACHE_KEY_SIZE  SHA256_DIGEST_LENGTH
+
+/**
+ * Builds a cache key: the SHA-256 of every input that determines a digest,
+ * each added with its length so different splits never collide
+ */
+class MeasurementCacheKey
+{
+private:
+    EVP_MD_CTX *m_ctx;
+    bool m_ok;          // Cleared by any failed digest call, fails final()
+
+public:
+    // kind names what's being cached (and its format version)
+    MeasurementCacheKey(const std::string kind);
+    ~MeasurementCacheKey();
+
+    MeasurementCacheKey(const MeasurementCacheKey &) = delete;
+    MeasurementCacheKey &operator=(const MeasurementCacheKey &) = delete;
+
+    void add(const void *data, size_t len);
+    void add(const std::string str) { add(str.data(), str.size()); }
+    void add(uint64_t value) { add(&value, sizeof(value)); }
+    bool final(uint8_t key[MEASUREMENT_CACHE_KEY_SIZE]);
+};
+
+/**
+ * Persistent, content-addressed cache of expected launch digests. Two maps
+ * share one append-only text file:
+ *   f [dev] [inode] [size] [mtime] [ctime] [sha256]  file identity -> digest
+ *   m [key] [digest]                                  MeasurementCacheKey -> digest
+ * A file seen before (same inode, size and times) is never read again, so a
+ * cache hit for a multi-megabyte image costs a stat() and two map lookups.
+ * Lines are appended whole, so concurrent writers and a crash mid-write can
+ * at worst lose an entry; unreadable lines are skipped when loading.
+ * Safe to use from several threads
+ */
+class MeasurementCache
+{
+private:
+    std::string m_file;
+    std::map<std::string, std::string> m_file_digests;
+    std::map<std::string, std::vector<uint8_t> > m_digests;
+    std::mutex m_lock;
+    size_t m_hits;
+
+    bool append(const std::string &line);
+
+public:
+    MeasurementCache() : m_hits(0) {}
+
+    // Loads cache_file, if it exists. New entries are appended to it
+    bool open(const std::string cache_file);
+
+    // SHA-256 of a file's contents, computed only if the file changed
+    bool file_digest(const std::string file_name, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+    bool lookup(const uint8_t key[MEASUREMENT_CACHE_KEY_SIZE], uint8_t *digest, size_t len);
+    bool store(const uint8_t key[MEASUREMENT_CACHE_KEY_SIZE], const uint8_t *digest, size_t len);
+
+    size_t hits(void) { return m_hits; }
+};
+
+#endif /* MEASURECACHE_H */
@@ -0,0 +1,121 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "ovmf.h"
+#include <cstring>
+#include <stdio.h>
+#include <uuid/uuid.h>
+
+bool guid_to_le(const char *guid_str, uint8_t guid[16])
+{
+    uuid_t uuid;
+
+    if (uuid_parse(guid_str, uuid) != 0)
+        return false;
+
+    // The first three fields are stored little-endian
+    guid[0] = uuid[3]; guid[1] = uuid[2]; guid[2] = uuid[1]; guid[3] = uuid[0];
+    guid[4] = uuid[5]; guid[5] = uuid[4];
+    guid[6] = uuid[7]; guid[7] = uuid[6];
+    memcpy(guid + 8, uuid + 8, 8);
+    return true;
+}
+
+bool OVMFImage::parse(const uint8_t *data, size_t size)
+{
+    uint8_t footer_guid[16];
+    uint16_t entry_size = 0;
+
+    m_data = data;
+    m_size = size;
+    m_table.clear();
+
+    if (!guid_to_le(OVMF_TABLE_FOOTER_GUID, footer_guid))
+        return false;
+    if (size < OVMF_FOOTER_OFFSET + OVMF_ENTRY_HEADER_SIZE)
+        return true;
+
+    // The footer entry's size covers the whole table
+    size_t footer = size - OVMF_FOOTER_OFFSET - OVMF_ENTRY_HEADER_SIZE;
+    if (memcmp(data + footer + sizeof(uint16_t), footer_guid, sizeof(footer_guid)) != 0)
+        return true;        // No table
+
+    memcpy(&entry_size, data + footer, sizeof(entry_size));
+    if (entry_size < OVMF_ENTRY_HEADER_SIZE || entry_size - OVMF_ENTRY_HEADER_SIZE > footer) {
+        printf("Error: OVMF footer table is malformed\n");
+        return false;
+    }
+
+    // Walk the entries backwards, from the footer
+    size_t start = footer - (entry_size - OVMF_ENTRY_HEADER_SIZE);
+    size_t end = footer;
+    while (end - start >= OVMF_ENTRY_HEADER_SIZE) {
+        const uint8_t *header = data + end - OVMF_ENTRY_HEADER_SIZE;
+        memcpy(&entry_size, header, sizeof(entry_size));
+        if (entry_size < OVMF_ENTRY_HEADER_SIZE || entry_size > end - start) {
+            printf("Error: OVMF footer table is malformed\n");
+            return false;
+        }
+        std::string guid((const char *)header + sizeof(uint16_t), 16);
+        m_table[guid] = std::make_pair(data + end - entry_size,
+                                       (size_t)(entry_size - OVMF_ENTRY_HEADER_SIZE));
+        end -= entry_size;
+    }
+
+    return true;
+}
+
+bool OVMFImage::find_entry(const char *guid_str, const uint8_t **data, size_t *len)
+{
+    uint8_t guid[16];
+
+    if (!guid_to_le(guid_str, guid))
+        return false;
+
+    std::map<std::string, std::pair<const uint8_t *, size_t> >::iterator it =
+        m_table.find(std::string((const char *)guid, sizeof(guid)));
+    if (it == m_table.end())
+        return false;
+
+    *data = it->second.first;
+    *len = it->second.second;
+    return true;
+}
+
+bool OVMFImage::sev_es_reset_eip(uint32_t *eip)
+{
+    const uint8_t *data = NULL;
+    size_t len = 0;
+
+    if (!find_entry(OVMF_SEV_ES_RESET_BLOCK_GUID, &data, &len) || len < sizeof(*eip))
+        return false;
+    memcpy(eip, data, sizeof(*eip));
+    return true;
+}
+
+bool OVMFImage::sev_hashes_table(uint32_t *gpa, uint32_t *size)
+{
+    const uint8_t *data = NULL;
+    size_t len = 0;
+
+    if (!find_entry(OVMF_SEV_HASH_TABLE_RV_GUID, &data, &len) ||
+        len < sizeof(*gpa) + sizeof(*size))
+        return false;
+    memcpy(gpa, data, sizeof(*gpa));
+    memcpy(size, data + sizeof(*gpa), sizeof(*size));
+    return true;
+}
@@ -0,0 +1,70 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef OVMF_H
+#define OVMF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+// GUIDs of OVMF footer table entries (OvmfPkg/ResetVector)
+#define OVMF_TABLE_FOOTER_GUID      "96b582de-1fb2-45f7-baea-a366c55a082d"
+#define OVMF_SEV_ES_RESET_BLOCK_GUID "00f771de-1a7e-4fcb-890e-68c77e2fb44e"
+#define OVMF_SEV_HASH_TABLE_RV_GUID "7255371f-3a3b-4b04-927b-1da6efa8d454"
+#define OVMF_SEV_METADATA_GUID      "dc886566-984a-4798-a75e-5585a7bf67cc"
+
+// The footer table ends this far from the end of the image
+#define OVMF_FOOTER_OFFSET          32
+// Each entry is [data][uint16_t size][guid], size including the 18 byte header
+#define OVMF_ENTRY_HEADER_SIZE      (sizeof(uint16_t) + 16)
+
+/**
+ * Converts a GUID string to its in-memory (little-endian, EFI_GUID) bytes
+ */
+bool guid_to_le(const char *guid_str, uint8_t guid[16]);
+
+/**
+ * Read-only view of an OVMF image's footer table, where the reset vector code
+ * publishes what a VMM (or measurement tool) needs to know: the SEV-ES AP
+ * reset address, where the kernel hashes table goes, etc. The image must
+ * stay mapped while the OVMFImage is in use
+ */
+class OVMFImage
+{
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+    // GUID (le bytes) -> entry data
+    std::map<std::string, std::pair<const uint8_t *, size_t> > m_table;
+
+public:
+    OVMFImage() : m_data(NULL), m_size(0) {}
+
+    // False if the footer table is malformed. An image without one is fine
+    bool parse(const uint8_t *data, size_t size);
+
+    const uint8_t *data(void) { return m_data; }
+    size_t size(void) { return m_size; }
+
+    bool find_entry(const char *guid_str, const uint8_t **data, size_t *len);
+    bool sev_es_reset_eip(uint32_t *eip);
+    bool sev_hashes_table(uint32_t *gpa, uint32_t *size);
+};
+
+#endif /* OVMF_H */
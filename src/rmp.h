@@ -467,28 +467,28 @@ typedef struct snp_msg_vmrk_rsp
 } snp_msg_vmrk_rsp_t;
 
 // 9.21 Data Structores and Encodings
-// typedef enum snp_guest_message
-// {
-//     SNP_MSG_INVALID         = 0x0,
-//     SNP_MSG_CPUID_REQ       = 0x1,
-//     SNP_MSG_CPUID_RSP       = 0x2,
-//     SNP_MSG_KEY_REQ         = 0x3,
-//     SNP_MSG_KEY_RSP         = 0x4,
-//     SNP_MSG_REPORT_REQ      = 0x5,
-//     SNP_MSG_REPORT_RSP      = 0x6,
-//     SNP_MSG_EXPORT_REQ      = 0x7,
-//     SNP_MSG_EXPORT_RSP      = 0x8,
-//     SNP_MSG_IMPORT_REQ      = 0x9,
-//     SNP_MSG_IMPORT_RSP      = 0xA,
-//     SNP_MSG_ABSORB_REQ      = 0xB,
-//     SNP_MSG_ABSORB_RSP      = 0xC,
-//     SNP_MSG_VMRK_REQ        = 0xD,
-//     SNP_MSG_VMRK_RSP        = 0xE,
-//     SNP_MSG_ABSORB_NOMA_REQ = 0xF,
-//     SNP_MSG_ABSORB_NOMA_RSP = 0x10,
-
-//     SNP_MSG_LIMIT,
-// } snp_guest_message_t;
+typedef enum snp_guest_message
+{
+    SNP_MSG_INVALID         = 0x0,
+    SNP_MSG_CPUID_REQ       = 0x1,
+    SNP_MSG_CPUID_RSP       = 0x2,
+    SNP_MSG_KEY_REQ         = 0x3,
+    SNP_MSG_KEY_RSP         = 0x4,
+    SNP_MSG_REPORT_REQ      = 0x5,
+    SNP_MSG_REPORT_RSP      = 0x6,
+    SNP_MSG_EXPORT_REQ      = 0x7,
+    SNP_MSG_EXPORT_RSP      = 0x8,
+    SNP_MSG_IMPORT_REQ      = 0x9,
+    SNP_MSG_IMPORT_RSP      = 0xA,
+    SNP_MSG_ABSORB_REQ      = 0xB,
+    SNP_MSG_ABSORB_RSP      = 0xC,
+    SNP_MSG_VMRK_REQ        = 0xD,
+    SNP_MSG_VMRK_RSP        = 0xE,
+    SNP_MSG_ABSORB_NOMA_REQ = 0xF,
+    SNP_MSG_ABSORB_NOMA_RSP = 0x10,
+
+    SNP_MSG_LIMIT,
+} snp_guest_message_t;
 
 #define PADDR_INVALID  ~(0x0ull)            /* -1 */
 
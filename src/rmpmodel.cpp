@@ -0,0 +1,299 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "rmpmodel.h"
+#include "utilities.h"      // for write_file, PAGE_SIZE_4K
+#include <cstring>
+
+// rmp_fields_t.gpa, which holds the GPA's page frame
+#define RMP_ENTRY_GPA_MASK  (((1ULL << 39) - 1) << RMP_ENTRY_GPA_SHIFT)
+
+RMPModel::RMPModel(size_t num_pages)
+{
+    rmp_vmpl_entry_t hypervisor_page;
+    memset(&hypervisor_page, 0, sizeof(hypervisor_page));
+    m_entries.assign(num_pages, hypervisor_page);
+    m_assigned_4k.assign((num_pages + RMP_ENTRIES_PER_2M - 1) / RMP_ENTRIES_PER_2M, 0);
+    m_counters.assign(RMP_NUM_ASID_COUNTERS, 0);
+}
+
+int RMPModel::check_spa(uint64_t spa, bool page_2m)
+{
+    uint64_t frame = spa / PAGE_SIZE_4K;
+    uint64_t pages = page_2m ? RMP_ENTRIES_PER_2M : 1;
+
+    if (spa % (pages * PAGE_SIZE_4K) != 0 || frame + pages > m_entries.size())
+        return ERROR_INVALID_ADDRESS;
+    return STATUS_SUCCESS;
+}
+
+size_t RMPModel::governing(size_t frame) const
+{
+    size_t head = frame - frame % RMP_ENTRIES_PER_2M;
+    return m_entries[head].rmp.f.page_size ? head : frame;
+}
+
+void RMPModel::set_entry(size_t frame, const rmp_vmpl_entry_t &entry)
+{
+    const rmp_fields_t &old_fields = m_entries[frame].rmp.f;
+    const rmp_fields_t &new_fields = entry.rmp.f;
+    size_t region = frame / RMP_ENTRIES_PER_2M;
+
+    if (old_fields.assigned) {
+        m_counters[old_fields.asid] -= old_fields.page_size ? RMP_ENTRIES_PER_2M : 1;
+        if (!old_fields.page_size)
+            m_assigned_4k[region]--;
+    }
+    if (new_fields.assigned) {
+        m_counters[new_fields.asid] += new_fields.page_size ? RMP_ENTRIES_PER_2M : 1;
+        if (!new_fields.page_size)
+            m_assigned_4k[region]++;
+    }
+    m_entries[frame] = entry;
+}
+
+const rmp_vmpl_entry_t &RMPModel::lookup(uint64_t spa) const
+{
+    return m_entries[governing((size_t)(spa / PAGE_SIZE_4K))];
+}
+
+snp_page_state_t RMPModel::page_state(uint64_t spa) const
+{
+    if (spa / PAGE_SIZE_4K >= m_entries.size())
+        return SNP_PAGE_STATE_INVALID;
+
+    const rmp_fields_t &f = lookup(spa).rmp.f;
+    if (!f.assigned)
+        return SNP_PAGE_STATE_HYPERVISOR;
+    if (f.asid == 0) {
+        if (!f.immutable)
+            return SNP_PAGE_STATE_RECLAIM;
+        if (f.vmsa)
+            return SNP_PAGE_STATE_CONTEXT;
+        return f.gpa ? SNP_PAGE_STATE_METADATA : SNP_PAGE_STATE_FIRMWARE;
+    }
+    if (f.immutable)
+        return f.validated ? SNP_PAGE_STATE_PRE_SWAP : SNP_PAGE_STATE_PRE_GUEST;
+    return f.validated ? SNP_PAGE_STATE_GUEST_VALID : SNP_PAGE_STATE_GUEST_INVALID;
+}
+
+int RMPModel::rmpupdate(uint64_t spa, bool page_2m, bool assigned, uint32_t asid,
+                        uint64_t gpa, bool immutable)
+{
+    int ret = check_spa(spa, page_2m);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+    if (asid >= RMP_NUM_ASIDS)
+        return ERROR_INVALID_ASID;
+    if (assigned && gpa % (page_2m ? PAGE_SIZE_2M : PAGE_SIZE_4K) != 0)
+        return ERROR_INVALID_ADDRESS;
+
+    size_t frame = (size_t)(spa / PAGE_SIZE_4K);
+    const rmp_fields_t &cur = m_entries[governing(frame)].rmp.f;
+    if (cur.immutable)
+        return ERROR_INVALID_PAGE_STATE;
+    if (page_2m && !cur.page_size && m_assigned_4k[frame / RMP_ENTRIES_PER_2M] != 0)
+        return ERROR_INVALID_PAGE_SIZE;     // Part of the 2M range is assigned as 4K pages
+    if (!page_2m && cur.page_size)
+        return ERROR_INVALID_PAGE_SIZE;     // Inside a 2M page, needs a PSMASH first
+
+    rmp_vmpl_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    if (assigned) {
+        entry.rmp.f.assigned = 1;
+        entry.rmp.f.page_size = page_2m;
+        entry.rmp.f.immutable = immutable;
+        entry.rmp.f.asid = asid & (RMP_NUM_ASIDS - 1);
+        entry.rmp.f.gpa = (gpa >> RMP_ENTRY_GPA_SHIFT) & ((1ULL << 39) - 1);
+    }
+    set_entry(frame, entry);
+    return STATUS_SUCCESS;
+}
+
+int RMPModel::pvalidate(uint32_t asid, uint64_t spa, bool page_2m, bool validate)
+{
+    int ret = check_spa(spa, page_2m);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    rmp_fields_t &f = m_entries[governing((size_t)(spa / PAGE_SIZE_4K))].rmp.f;
+    if (!f.assigned || asid == 0 || f.asid != asid)
+        return ERROR_INVALID_PAGE_OWNER;
+    if (f.immutable)
+        return ERROR_INVALID_PAGE_STATE;
+    if ((bool)f.page_size != page_2m)
+        return ERROR_INVALID_PAGE_SIZE;
+    if ((bool)f.validated == validate)
+        return ERROR_INVALID_PAGE_STATE;    // PVALIDATE would report no change
+
+    f.validated = validate;
+    return STATUS_SUCCESS;
+}
+
+int RMPModel::rmpadjust(uint32_t asid, uint64_t spa, uint32_t vmpl, uint8_t perms, bool vmsa)
+{
+    int ret = check_spa(spa, false);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+    if (vmpl < 1 || vmpl > 3 || perms > MAX_VMPL_PERM)
+        return ERROR_INVALID_PARAM;
+
+    rmp_vmpl_entry_t &entry = m_entries[governing((size_t)(spa / PAGE_SIZE_4K))];
+    rmp_fields_t &f = entry.rmp.f;
+    if (!f.assigned || asid == 0 || f.asid != asid)
+        return ERROR_INVALID_PAGE_OWNER;
+    if (f.immutable || !f.validated)
+        return ERROR_INVALID_PAGE_STATE;
+    if (vmsa && f.page_size)
+        return ERROR_INVALID_PAGE_SIZE;     // A VMSA is always a 4K page
+
+    vmpl_perm_mask_t *masks[] = { NULL, &entry.vmpl.f.vmpl1, &entry.vmpl.f.vmpl2, &entry.vmpl.f.vmpl3 };
+    masks[vmpl]->val = perms;
+    f.vmsa = vmsa;
+    return STATUS_SUCCESS;
+}
+
+int RMPModel::psmash(uint64_t spa)
+{
+    int ret = check_spa(spa, true);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    size_t frame = (size_t)(spa / PAGE_SIZE_4K);
+    rmp_vmpl_entry_t head = m_entries[frame];
+    if (!head.rmp.f.page_size)
+        return ERROR_INVALID_PAGE_SIZE;
+
+    // Same owner and state, so the ASID counter doesn't change
+    head.rmp.f.page_size = 0;
+    for (size_t i = 0; i < RMP_ENTRIES_PER_2M; i++) {
+        m_entries[frame + i] = head;
+        m_entries[frame + i].rmp.f.gpa = (head.rmp.f.gpa + i) & ((1ULL << 39) - 1);
+    }
+    m_assigned_4k[frame / RMP_ENTRIES_PER_2M] = RMP_ENTRIES_PER_2M;
+    return STATUS_SUCCESS;
+}
+
+int RMPModel::firmware_transition(uint64_t spa, snp_page_state_t state, uint32_t asid)
+{
+    int ret = check_spa(spa, false);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    size_t frame = (size_t)(spa / PAGE_SIZE_4K);
+    if (governing(frame) != frame || m_entries[frame].rmp.f.page_size)
+        return ERROR_INVALID_PAGE_SIZE;
+    snp_page_state_t cur = page_state(spa);
+    rmp_vmpl_entry_t entry = m_entries[frame];
+
+    if (state == SNP_PAGE_STATE_FIRMWARE || state == SNP_PAGE_STATE_CONTEXT) {
+        if (cur != SNP_PAGE_STATE_HYPERVISOR)
+            return ERROR_INVALID_PAGE_STATE;
+        memset(&entry, 0, sizeof(entry));
+        entry.rmp.f.assigned = 1;
+        entry.rmp.f.immutable = 1;
+        entry.rmp.f.vmsa = (state == SNP_PAGE_STATE_CONTEXT);
+    }
+    else if (state == SNP_PAGE_STATE_PRE_GUEST) {
+        if (cur != SNP_PAGE_STATE_GUEST_INVALID || entry.rmp.f.asid != asid)
+            return ERROR_INVALID_PAGE_STATE;
+        entry.rmp.f.immutable = 1;
+    }
+    else {
+        return ERROR_INVALID_PARAM;
+    }
+    set_entry(frame, entry);
+    return STATUS_SUCCESS;
+}
+
+int RMPModel::page_reclaim(const snp_page_reclaim_cmd_buf &buf)
+{
+    uint64_t spa = buf.page_addr_size & ~(uint64_t)(PAGE_SIZE_4K - 1);
+    bool page_2m = (buf.page_addr_size & 1);
+    int ret = check_spa(spa, page_2m);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    size_t frame = governing((size_t)(spa / PAGE_SIZE_4K));
+    if ((bool)m_entries[frame].rmp.f.page_size != page_2m)
+        return ERROR_INVALID_PAGE_SIZE;
+    switch (page_state(spa)) {
+    case SNP_PAGE_STATE_FIRMWARE:
+    case SNP_PAGE_STATE_CONTEXT:
+    case SNP_PAGE_STATE_METADATA:
+    case SNP_PAGE_STATE_PRE_GUEST:
+    case SNP_PAGE_STATE_PRE_SWAP:
+        break;
+    default:
+        return ERROR_INVALID_PAGE_STATE;
+    }
+
+    rmp_vmpl_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.rmp.f.assigned = 1;
+    entry.rmp.f.page_size = page_2m;
+    set_entry(frame, entry);
+    return STATUS_SUCCESS;
+}
+
+int RMPModel::page_unsmash(const snp_page_unsmash_cmd_buf &buf)
+{
+    int ret = check_spa(buf.page_p_addr, true);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    size_t frame = (size_t)(buf.page_p_addr / PAGE_SIZE_4K);
+    const rmp_vmpl_entry_t &head = m_entries[frame];
+    if (head.rmp.f.page_size)
+        return ERROR_INVALID_PAGE_SIZE;
+    if (!head.rmp.f.assigned || head.rmp.f.vmsa || head.rmp.f.gpa % RMP_ENTRIES_PER_2M != 0)
+        return ERROR_INVALID_PAGE_STATE;
+
+    // Every page must match the first but for its GPA, and the GPAs be contiguous
+    for (size_t i = 1; i < RMP_ENTRIES_PER_2M; i++) {
+        const rmp_vmpl_entry_t &entry = m_entries[frame + i];
+        if ((entry.rmp.val & ~RMP_ENTRY_GPA_MASK) != (head.rmp.val & ~RMP_ENTRY_GPA_MASK) ||
+            entry.rmp.f.gpa != head.rmp.f.gpa + i || entry.vmpl.val != head.vmpl.val)
+            return ERROR_INVALID_PAGE_STATE;
+    }
+
+    // Same owner and state, so the ASID counter doesn't change
+    rmp_vmpl_entry_t combined = head;
+    combined.rmp.f.page_size = 1;
+    memset(&m_entries[frame + 1], 0, (RMP_ENTRIES_PER_2M - 1) * sizeof(rmp_vmpl_entry_t));
+    m_entries[frame] = combined;
+    m_assigned_4k[frame / RMP_ENTRIES_PER_2M] = 0;
+    return STATUS_SUCCESS;
+}
+
+bool RMPModel::save_dump(const std::string dump_file) const
+{
+    std::vector<uint8_t> dump(RMP_ASID_COUNTERS_SIZE + m_entries.size() * RMP_ENTRY_SIZE, 0);
+    rmp_asid_counters_t *counters = (rmp_asid_counters_t *)dump.data();
+    rmp_entry_t *entries = (rmp_entry_t *)(dump.data() + RMP_ASID_COUNTERS_SIZE);
+
+    memcpy(counters->counters, m_counters.data(), sizeof(counters->counters));
+    for (size_t frame = 0; frame < m_entries.size(); frame++) {
+        size_t head = governing(frame);
+        entries[frame] = m_entries[head].rmp;
+        if (head != frame) {    // Every entry of a 2M page is marked 2M, at its own GPA
+            entries[frame].f.gpa = (m_entries[head].rmp.f.gpa + (frame - head)) & ((1ULL << 39) - 1);
+            entries[frame].f.vmsa = 0;
+        }
+    }
+    return sev::write_file(dump_file, dump.data(), dump.size()) == dump.size();
+}
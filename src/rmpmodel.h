@@ -0,0 +1,87 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef RMPMODEL_H
+#define RMPMODEL_H
+
+#include "rmp.h"
+#include "rmptable.h"
+#include "sevapi.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Software model of the RMP, for exercising SNP page-state flows without
+ * hardware. It applies the RMP side of the instructions (RMPUPDATE,
+ * PVALIDATE, RMPADJUST, PSMASH) and firmware commands (PAGE_RECLAIM,
+ * PAGE_UNSMASH) that change page state, with the checks the hardware and
+ * firmware make, returning SEV_ERROR_CODEs.
+ *
+ * The table is one flat array of rmp_vmpl_entry_t, indexed by 4K page frame,
+ * with the ASID counters kept up to date as pages change hands. A 2M page
+ * lives in its first entry alone (the other 511 are unused until it's
+ * smashed), and a count of the assigned 4K pages in each 2M region is kept,
+ * so every 4K and 2M transition is O(1). Only PSMASH and PAGE_UNSMASH touch
+ * all 512 entries, as they must. Not thread safe
+ */
+class RMPModel
+{
+private:
+    std::vector<rmp_vmpl_entry_t> m_entries;
+    std::vector<uint16_t> m_assigned_4k;        // Assigned 4K pages per 2M region
+    std::vector<uint64_t> m_counters;           // RMP_NUM_ASID_COUNTERS, 4K pages per ASID
+
+    int check_spa(uint64_t spa, bool page_2m);
+    // The entry that governs the page at frame: its 2M page's first entry, if any
+    size_t governing(size_t frame) const;
+    void set_entry(size_t frame, const rmp_vmpl_entry_t &entry);
+
+public:
+    RMPModel(size_t num_pages);
+
+    size_t num_pages(void) const { return m_entries.size(); }
+    const rmp_vmpl_entry_t &lookup(uint64_t spa) const;
+    snp_page_state_t page_state(uint64_t spa) const;
+    // 4K pages assigned to asid; 0 for an ASID outside the counter table
+    uint64_t asid_counter(uint32_t asid) const
+    {
+        return asid < m_counters.size() ? m_counters[asid] : 0;
+    }
+
+    // RMPUPDATE: the hypervisor (un)assigns a page. Clears validated and the VMPL permissions
+    int rmpupdate(uint64_t spa, bool page_2m, bool assigned, uint32_t asid = 0,
+                  uint64_t gpa = 0, bool immutable = false);
+    // PVALIDATE: guest asid validates or invalidates one of its pages
+    int pvalidate(uint32_t asid, uint64_t spa, bool page_2m, bool validate);
+    // RMPADJUST: guest asid, at VMPL0, sets the permissions of a higher VMPL
+    int rmpadjust(uint32_t asid, uint64_t spa, uint32_t vmpl, uint8_t perms, bool vmsa = false);
+    // PSMASH: a 2M page becomes 512 4K pages with the same attributes
+    int psmash(uint64_t spa);
+
+    // Firmware takes a hypervisor page (SNP_PAGE_STATE_FIRMWARE or _CONTEXT),
+    // or a guest's invalid page for launch (SNP_PAGE_STATE_PRE_GUEST)
+    int firmware_transition(uint64_t spa, snp_page_state_t state, uint32_t asid = 0);
+    int page_reclaim(const snp_page_reclaim_cmd_buf &buf);
+    int page_unsmash(const snp_page_unsmash_cmd_buf &buf);
+
+    // Writes the table in the RMP dump format analyze_rmp reads
+    bool save_dump(const std::string dump_file) const;
+};
+
+#endif /* RMPMODEL_H */
@@ -0,0 +1,372 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "rmptable.h"
+#include "sevapi.h"         // for STATUS_SUCCESS
+#include "utilities.h"      // for map_file
+#include <algorithm>        // std::min
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Entries skipped at once when none of them are anything but a hypervisor page
+#define RMP_SCAN_BLOCK_ENTRIES  64
+
+RMPDump::~RMPDump()
+{
+    sev::unmap_file(m_data, m_size);
+}
+
+bool RMPDump::open(const std::string dump_file)
+{
+    sev::unmap_file(m_data, m_size);
+    m_data = sev::map_file(dump_file, &m_size);
+    if (!m_data)
+        return false;
+    if (m_size < RMP_ASID_COUNTERS_SIZE || (m_size - RMP_ASID_COUNTERS_SIZE) % RMP_ENTRY_SIZE != 0) {
+        printf("Error: %s isn't an RMP dump: 16K of ASID counters, then 8 byte entries\n",
+               dump_file.c_str());
+        sev::unmap_file(m_data, m_size);
+        m_data = NULL;
+        m_size = 0;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * True if none of the entries are assigned, validated, VMSAs or 2M, so there's
+ * nothing to count or check
+ */
+static bool rmp_block_is_hypervisor(const rmp_entry_t *entries, size_t count)
+{
+    const uint64_t interesting = RMP_ENTRY_ASSIGNED | RMP_ENTRY_PAGE_SIZE |
+                                 RMP_ENTRY_VMSA | RMP_ENTRY_VALIDATED;
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi64x((long long)interesting);
+    __m128i any = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i *vals = (const __m128i *)&entries[i];
+        __m128i a = _mm_or_si128(_mm_loadu_si128(vals), _mm_loadu_si128(vals + 1));
+        __m128i b = _mm_or_si128(_mm_loadu_si128(vals + 2), _mm_loadu_si128(vals + 3));
+        any = _mm_or_si128(any, _mm_and_si128(_mm_or_si128(a, b), mask));
+    }
+    uint64_t rest = 0;
+    for (; i < count; i++)
+        rest |= entries[i].val & interesting;
+    return rest == 0 && _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF;
+#else
+    uint64_t any = 0;
+    for (size_t i = 0; i < count; i++)
+        any |= entries[i].val & interesting;
+    return any == 0;
+#endif
+}
+
+static void rmp_add_error(rmp_analysis_t &analysis, size_t entry, const char *what)
+{
+    if (analysis.errors.size() < RMP_MAX_REPORTED_ERRORS) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "entry 0x%zx (SPA 0x%llx): %s", entry,
+                 (unsigned long long)entry * PAGE_SIZE_4K, what);
+        analysis.errors.push_back(buf);
+    }
+    analysis.num_errors++;
+}
+
+// Scans entries [first, last) into analysis, which starts out zeroed
+static void rmp_scan(const rmp_entry_t *entries, size_t first, size_t last,
+                     rmp_analysis_t &analysis)
+{
+    size_t i = first;
+    while (i < last) {
+        size_t block = std::min((size_t)RMP_SCAN_BLOCK_ENTRIES, last - i);
+        if (rmp_block_is_hypervisor(&entries[i], block)) {
+            i += block;
+            continue;
+        }
+
+        for (size_t end = i + block; i < end; i++) {
+            const rmp_fields_t &f = entries[i].f;
+            if (!f.assigned) {
+                if (f.validated)
+                    rmp_add_error(analysis, i, "validated, but not assigned");
+                if (f.vmsa)
+                    rmp_add_error(analysis, i, "VMSA, but not assigned");
+                if (f.page_size)
+                    rmp_add_error(analysis, i, "2M, but not assigned");
+                continue;
+            }
+
+            rmp_asid_stats_t &asid = analysis.asids[f.asid];
+            analysis.assigned++;
+            asid.assigned++;
+            if (f.validated) {
+                analysis.validated++;
+                asid.validated++;
+                if (f.asid == 0)
+                    rmp_add_error(analysis, i, "validated, but not assigned to a guest");
+            }
+            if (f.immutable)
+                analysis.immutable++;
+            if (f.vmsa) {
+                asid.vmsas++;
+                analysis.vmsas.push_back(std::make_pair((uint64_t)i, (uint32_t)f.asid));
+            }
+
+            if (!f.page_size) {
+                analysis.pages_4k++;
+                asid.pages_4k++;
+            }
+            else if (i % RMP_ENTRIES_PER_2M == 0) {
+                analysis.pages_2m++;
+                asid.pages_2m++;
+                if (f.gpa % RMP_ENTRIES_PER_2M != 0)
+                    rmp_add_error(analysis, i, "2M page at a GPA that isn't 2M aligned");
+            }
+            else {
+                const rmp_fields_t &head = entries[i - i % RMP_ENTRIES_PER_2M].f;
+                if (!head.assigned || !head.page_size || head.asid != f.asid)
+                    rmp_add_error(analysis, i, "2M entry doesn't match the 2M page's first entry");
+            }
+        }
+    }
+}
+
+int rmp_analyze(const RMPDump &dump, rmp_analysis_t &analysis, size_t num_threads)
+{
+    const rmp_entry_t *entries = dump.entries();
+    size_t num_entries = dump.num_entries();
+    std::vector<rmp_analysis_t> slices;
+    std::vector<std::thread> workers;
+
+    // Each thread scans a contiguous, 2M aligned slice into its own totals
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+    size_t per_thread = (num_entries + num_threads - 1) / num_threads;
+    per_thread = (per_thread + RMP_ENTRIES_PER_2M - 1) / RMP_ENTRIES_PER_2M * RMP_ENTRIES_PER_2M;
+    if (per_thread == 0)
+        per_thread = RMP_ENTRIES_PER_2M;
+    num_threads = (num_entries + per_thread - 1) / per_thread;
+
+    slices.resize(num_threads);
+    for (size_t t = 0; t < num_threads; t++) {
+        size_t first = t * per_thread;
+        size_t last = std::min(first + per_thread, num_entries);
+        slices[t].num_entries = 0;
+        slices[t].assigned = slices[t].validated = slices[t].immutable = 0;
+        slices[t].pages_2m = slices[t].pages_4k = 0;
+        slices[t].num_errors = 0;
+        slices[t].asids.assign(RMP_NUM_ASIDS, rmp_asid_stats_t());
+        workers.push_back(std::thread([&, t, first, last]() {
+            rmp_scan(entries, first, last, slices[t]);
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+
+    // Merge the slices, in address order
+    analysis.num_entries = num_entries;
+    analysis.assigned = analysis.validated = analysis.immutable = 0;
+    analysis.pages_2m = analysis.pages_4k = 0;
+    analysis.asids.assign(RMP_NUM_ASIDS, rmp_asid_stats_t());
+    analysis.vmsas.clear();
+    analysis.num_errors = 0;
+    analysis.errors.clear();
+    for (size_t t = 0; t < slices.size(); t++) {
+        const rmp_analysis_t &slice = slices[t];
+        analysis.assigned += slice.assigned;
+        analysis.validated += slice.validated;
+        analysis.immutable += slice.immutable;
+        analysis.pages_2m += slice.pages_2m;
+        analysis.pages_4k += slice.pages_4k;
+        for (size_t a = 0; a < RMP_NUM_ASIDS; a++) {
+            analysis.asids[a].assigned += slice.asids[a].assigned;
+            analysis.asids[a].validated += slice.asids[a].validated;
+            analysis.asids[a].pages_2m += slice.asids[a].pages_2m;
+            analysis.asids[a].pages_4k += slice.asids[a].pages_4k;
+            analysis.asids[a].vmsas += slice.asids[a].vmsas;
+        }
+        analysis.vmsas.insert(analysis.vmsas.end(), slice.vmsas.begin(), slice.vmsas.end());
+        for (size_t e = 0; e < slice.errors.size() && analysis.errors.size() < RMP_MAX_REPORTED_ERRORS; e++)
+            analysis.errors.push_back(slice.errors[e]);
+        analysis.num_errors += slice.num_errors;
+    }
+
+    // Each guest ASID's counter against its assigned entries (ASID 0 isn't a guest)
+    const rmp_asid_counters_t *counters = dump.counters();
+    for (size_t a = 1; a < RMP_NUM_ASID_COUNTERS; a++) {
+        uint64_t expected = (a < RMP_NUM_ASIDS) ? analysis.asids[a].assigned : 0;
+        if (counters->counters[a] == expected)
+            continue;
+        if (analysis.errors.size() < RMP_MAX_REPORTED_ERRORS) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "ASID %zu counter is %llu, but %llu entries are assigned to it",
+                     a, (unsigned long long)counters->counters[a], (unsigned long long)expected);
+            analysis.errors.push_back(buf);
+        }
+        analysis.num_errors++;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+const char *rmp_field_name(rmp_field_t field)
+{
+    static const char *names[RMP_FIELD_LIMIT] = {
+        "assigned", "asid", "validated", "page_size", "vmsa", "gpa", "other",
+    };
+    return (field < RMP_FIELD_LIMIT) ? names[field] : "unknown";
+}
+
+// Records how entry changed, into diff (changes and per-ASID totals)
+static void rmp_diff_entry(size_t entry, const rmp_entry_t &old_entry,
+                           const rmp_entry_t &new_entry, rmp_diff_t &diff)
+{
+    const rmp_fields_t &o = old_entry.f;
+    const rmp_fields_t &n = new_entry.f;
+    const struct {
+        rmp_field_t field;
+        uint64_t old_value;
+        uint64_t new_value;
+    } fields[] = {
+        { RMP_FIELD_ASSIGNED,  o.assigned,  n.assigned },
+        { RMP_FIELD_ASID,      o.asid,      n.asid },
+        { RMP_FIELD_VALIDATED, o.validated, n.validated },
+        { RMP_FIELD_PAGE_SIZE, o.page_size, n.page_size },
+        { RMP_FIELD_VMSA,      o.vmsa,      n.vmsa },
+        { RMP_FIELD_GPA,       o.gpa,       n.gpa },
+    };
+    bool reported = false;
+
+    diff.changed_entries++;
+    for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+        if (fields[i].old_value == fields[i].new_value)
+            continue;
+        rmp_change_t change = { entry, fields[i].field, fields[i].old_value, fields[i].new_value };
+        diff.changes.push_back(change);
+        reported = true;
+    }
+    if (!reported) {
+        rmp_change_t change = { entry, RMP_FIELD_OTHER, old_entry.val, new_entry.val };
+        diff.changes.push_back(change);
+    }
+
+    if (o.assigned != n.assigned || (o.assigned && o.asid != n.asid)) {
+        if (o.assigned)
+            diff.asids[o.asid].lost++;
+        if (n.assigned)
+            diff.asids[n.asid].gained++;
+    }
+    if (o.validated != n.validated) {
+        rmp_asid_changes_t &asid = diff.asids[n.assigned ? n.asid : o.asid];
+        if (n.validated)
+            asid.validated++;
+        else
+            asid.invalidated++;
+    }
+    if (o.page_size != n.page_size)
+        diff.asids[n.assigned ? n.asid : o.asid].page_size++;
+}
+
+int rmp_diff(const RMPDump &before, const RMPDump &after, rmp_diff_t &diff, size_t num_threads)
+{
+    const rmp_entry_t *old_entries = before.entries();
+    const rmp_entry_t *new_entries = after.entries();
+    size_t num_entries = before.num_entries();
+    size_t num_chunks = (num_entries + RMP_DIFF_CHUNK_ENTRIES - 1) / RMP_DIFF_CHUNK_ENTRIES;
+    std::vector<rmp_diff_t> slices;
+    std::vector<std::thread> workers;
+
+    if (after.num_entries() != num_entries) {
+        printf("Error: the RMP dumps are different sizes, so not of the same host\n");
+        return ERROR_INVALID_LENGTH;
+    }
+
+    // Each thread diffs a contiguous run of chunks into its own slice
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+    if (num_threads > num_chunks)
+        num_threads = num_chunks;
+    size_t per_thread = num_threads ? (num_chunks + num_threads - 1) / num_threads : 0;
+
+    slices.resize(num_threads);
+    for (size_t t = 0; t < num_threads; t++) {
+        size_t first = t * per_thread;
+        size_t last = std::min(first + per_thread, num_chunks);
+        slices[t].changed_entries = 0;
+        slices[t].identical_chunks = 0;
+        slices[t].asids.assign(RMP_NUM_ASIDS, rmp_asid_changes_t());
+        workers.push_back(std::thread([&, t, first, last]() {
+            rmp_diff_t &slice = slices[t];
+            for (size_t chunk = first; chunk < last; chunk++) {
+                size_t start = chunk * RMP_DIFF_CHUNK_ENTRIES;
+                size_t end = std::min(start + RMP_DIFF_CHUNK_ENTRIES, num_entries);
+                if (memcmp(&old_entries[start], &new_entries[start],
+                           (end - start) * RMP_ENTRY_SIZE) == 0) {
+                    slice.identical_chunks++;
+                    continue;
+                }
+                for (size_t i = start; i < end; i++) {
+                    if (old_entries[i].val != new_entries[i].val)
+                        rmp_diff_entry(i, old_entries[i], new_entries[i], slice);
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+
+    // Merge the slices, in address order
+    diff.num_entries = num_entries;
+    diff.num_chunks = num_chunks;
+    diff.changed_entries = 0;
+    diff.identical_chunks = 0;
+    diff.changes.clear();
+    diff.asids.assign(RMP_NUM_ASIDS, rmp_asid_changes_t());
+    for (size_t t = 0; t < slices.size(); t++) {
+        const rmp_diff_t &slice = slices[t];
+        diff.changed_entries += slice.changed_entries;
+        diff.identical_chunks += slice.identical_chunks;
+        diff.changes.insert(diff.changes.end(), slice.changes.begin(), slice.changes.end());
+        for (size_t a = 0; a < RMP_NUM_ASIDS; a++) {
+            diff.asids[a].gained += slice.asids[a].gained;
+            diff.asids[a].lost += slice.asids[a].lost;
+            diff.asids[a].validated += slice.asids[a].validated;
+            diff.asids[a].invalidated += slice.asids[a].invalidated;
+            diff.asids[a].page_size += slice.asids[a].page_size;
+        }
+    }
+
+    diff.counters.clear();
+    for (size_t a = 0; a < RMP_NUM_ASID_COUNTERS; a++) {
+        uint64_t old_count = before.counters()->counters[a];
+        uint64_t new_count = after.counters()->counters[a];
+        if (old_count != new_count)
+            diff.counters.push_back(std::make_pair(a, std::make_pair(old_count, new_count)));
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,151 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef RMPTABLE_H
+#define RMPTABLE_H
+
+#include "rmp.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// rmp_fields_t bits, for code that tests many entries at once
+#define RMP_ENTRY_ASSIGNED      (1ULL << 0)
+#define RMP_ENTRY_PAGE_SIZE     (1ULL << 1)
+#define RMP_ENTRY_VMSA          (1ULL << 61)
+#define RMP_ENTRY_VALIDATED     (1ULL << 62)
+
+#define RMP_NUM_ASIDS           (1 << 10)       // rmp_fields_t.asid is 10 bits
+#define RMP_ENTRIES_PER_2M      512
+
+// rmp_diff compares this many entries (64K) at a time, skipping identical ones
+#define RMP_DIFF_CHUNK_ENTRIES  8192
+
+// Only the first inconsistencies are described, the rest are just counted
+#define RMP_MAX_REPORTED_ERRORS 100
+
+/**
+ * Read-only view of an RMP dump: the 16K of ASID counters, then one
+ * rmp_entry_t per 4K page of system memory, entry i describing the page at
+ * i * 4K. The dump is mapped, not read, so it can be tens of GB
+ */
+class RMPDump
+{
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+
+public:
+    RMPDump() : m_data(NULL), m_size(0) {}
+    ~RMPDump();
+
+    bool open(const std::string dump_file);
+
+    const rmp_asid_counters_t *counters(void) const { return (const rmp_asid_counters_t *)m_data; }
+    const rmp_entry_t *entries(void) const { return (const rmp_entry_t *)(m_data + RMP_ASID_COUNTERS_SIZE); }
+    size_t num_entries(void) const { return (m_size - RMP_ASID_COUNTERS_SIZE) / RMP_ENTRY_SIZE; }
+};
+
+struct rmp_asid_stats_t {
+    uint64_t assigned;          // 4K entries
+    uint64_t validated;         // 4K entries
+    uint64_t pages_2m;
+    uint64_t pages_4k;
+    uint64_t vmsas;
+};
+
+struct rmp_analysis_t {
+    uint64_t num_entries;
+    uint64_t assigned;          // 4K entries
+    uint64_t validated;         // 4K entries
+    uint64_t immutable;         // 4K entries
+    uint64_t pages_2m;          // Assigned 2M pages (512 entries each)
+    uint64_t pages_4k;          // Assigned 4K pages
+    std::vector<rmp_asid_stats_t> asids;            // RMP_NUM_ASIDS
+    std::vector<std::pair<uint64_t, uint32_t> > vmsas;  // [entry index, ASID], in address order
+    uint64_t num_errors;
+    std::vector<std::string> errors;                // The first RMP_MAX_REPORTED_ERRORS
+};
+
+/**
+ * Scans every entry of an RMP dump for per-ASID counts, the 2M/4K split and
+ * the VMSA pages, and checks it's consistent: validated and VMSA pages must
+ * be assigned (validated ones to a guest), every entry of a 2M page must
+ * match its first entry, and each ASID counter must match the number of
+ * entries assigned to that ASID.
+ * The dump is split across num_threads threads (0 for one per CPU), each
+ * skipping runs of plain hypervisor pages 64 entries at a time with SIMD
+ */
+int rmp_analyze(const RMPDump &dump, rmp_analysis_t &analysis, size_t num_threads = 0);
+
+// The fields rmp_diff reports changes to
+enum rmp_field_t
+{
+    RMP_FIELD_ASSIGNED  = 0,
+    RMP_FIELD_ASID      = 1,
+    RMP_FIELD_VALIDATED = 2,
+    RMP_FIELD_PAGE_SIZE = 3,
+    RMP_FIELD_VMSA      = 4,
+    RMP_FIELD_GPA       = 5,
+    RMP_FIELD_OTHER     = 6,    // Any other bits, old and new are the whole entry
+
+    RMP_FIELD_LIMIT,
+};
+
+const char *rmp_field_name(rmp_field_t field);
+
+struct rmp_change_t {
+    uint64_t entry;
+    rmp_field_t field;
+    uint64_t old_value;
+    uint64_t new_value;
+};
+
+/**
+ * Changes by ASID. A page moving between ASIDs (or to or from the
+ * hypervisor) is lost by one and gained by the other. Validation changes
+ * count against the page's ASID after the change, if it's still assigned
+ */
+struct rmp_asid_changes_t {
+    uint64_t gained;
+    uint64_t lost;
+    uint64_t validated;
+    uint64_t invalidated;
+    uint64_t page_size;
+};
+
+struct rmp_diff_t {
+    uint64_t num_entries;
+    uint64_t changed_entries;
+    uint64_t num_chunks;
+    uint64_t identical_chunks;
+    std::vector<rmp_change_t> changes;              // In address order
+    std::vector<rmp_asid_changes_t> asids;          // RMP_NUM_ASIDS
+    std::vector<std::pair<size_t, std::pair<uint64_t, uint64_t> > > counters;  // [ASID, [old, new]]
+};
+
+/**
+ * Lists what changed between two RMP dumps of the same host, field by field,
+ * and totals it by ASID. Page-state churn touches a small part of the RMP
+ * between snapshots, so the dumps are compared RMP_DIFF_CHUNK_ENTRIES at a
+ * time and only the chunks that differ are decoded, split across
+ * num_threads threads (0 for one per CPU)
+ */
+int rmp_diff(const RMPDump &before, const RMPDump &after, rmp_diff_t &diff, size_t num_threads = 0);
+
+#endif /* RMPTABLE_H */
@@ -208,6 +208,7 @@ bool read_priv_key_pem_into_eckey(const std::string file_name, EC_KEY **ec_priv_
 
 /**
  * Description:   Calls read_privkey_pem_into_eckey and converts EC key to EVP key
+ *                (OpenSSL 3: reads the PEM straight into a provider EC key)
  * Notes:         This function allocates a new EVP key which will free the
  *                associated EC key and the EVP key must be freed by the calling
  *                function
@@ -216,6 +217,36 @@ bool read_priv_key_pem_into_eckey(const std::string file_name, EC_KEY **ec_priv_
  */
 bool read_priv_key_pem_into_evpkey(const std::string file_name, EVP_PKEY **evp_priv_key)
 {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    /*
+     * Read it as a provider key, so its parameters (e.g. the public point's
+     * coordinates) can be queried through EVP_PKEY_get_*_param. An EC key
+     * assigned to an EVP_PKEY only exports a subset of them
+     */
+    bool success = false;
+    EVP_PKEY_CTX *check_ctx = NULL;
+
+    *evp_priv_key = NULL;
+    do {
+        FILE *pFile = fopen(file_name.c_str(), "r");
+        if (!pFile)
+            break;
+        *evp_priv_key = PEM_read_PrivateKey(pFile, NULL, NULL, NULL);
+        fclose(pFile);
+
+        // Make sure the key is good
+        if (!*evp_priv_key || EVP_PKEY_base_id(*evp_priv_key) != EVP_PKEY_EC)
+            break;
+        if (!(check_ctx = EVP_PKEY_CTX_new(*evp_priv_key, NULL)) ||
+            EVP_PKEY_check(check_ctx) != 1)
+            break;
+
+        success = true;
+    } while (0);
+
+    EVP_PKEY_CTX_free(check_ctx);
+    return success;
+#else
     EC_KEY *ec_privkey = NULL;
 
     // New up the EVP_PKEY
@@ -236,6 +267,16 @@ bool read_priv_key_pem_into_evpkey(const std::string file_name, EVP_PKEY **evp_p
         return false;
 
     return true;
+#endif
+}
+
+// Writes out a memory BIO's contents through write_file
+static bool write_pem_bio(const std::string file_name, BIO *bio)
+{
+    char *data = NULL;
+    long len = BIO_get_mem_data(bio, &data);
+
+    return len > 0 && sev::write_file(file_name, data, (size_t)len) == (size_t)len;
 }
 
 /**
@@ -245,19 +286,15 @@ bool read_priv_key_pem_into_evpkey(const std::string file_name, EVP_PKEY **evp_p
  */
 bool write_pub_key_pem(const std::string file_name, EVP_PKEY *evp_key_pair)
 {
-    FILE *pFile = NULL;
-    pFile = fopen(file_name.c_str(), "wt");
-    if (!pFile)
-        return false;
+    bool ret = false;
+    BIO *bio = BIO_new(BIO_s_mem());
 
-    // printf("Writing to file: %s\n", file_name.c_str());
-    if (PEM_write_PUBKEY(pFile, evp_key_pair) != 1) {
+    if (bio && PEM_write_bio_PUBKEY(bio, evp_key_pair) == 1)
+        ret = write_pem_bio(file_name, bio);
+    if (!ret)
         printf("Error writing pubkey to file: %s\n", file_name.c_str());
-        fclose(pFile);
-        return false;
-    }
-    fclose(pFile);
-    return true;
+    BIO_free(bio);
+    return ret;
 }
 
 /**
@@ -268,19 +305,15 @@ bool write_pub_key_pem(const std::string file_name, EVP_PKEY *evp_key_pair)
  */
 bool write_priv_key_pem(const std::string file_name, EVP_PKEY *evp_key_pair)
 {
-    FILE *pFile = NULL;
-    pFile = fopen(file_name.c_str(), "wt");
-    if (!pFile)
-        return false;
+    bool ret = false;
+    BIO *bio = BIO_new(BIO_s_secmem());     // Wiped when freed
 
-    // printf("Writing to file: %s\n", file_name.c_str());
-    if (PEM_write_PrivateKey(pFile, evp_key_pair, NULL, NULL, 0, NULL, 0) != 1) {
+    if (bio && PEM_write_bio_PrivateKey(bio, evp_key_pair, NULL, NULL, 0, NULL, NULL) == 1)
+        ret = write_pem_bio(file_name, bio);
+    if (!ret)
         printf("Error writing privkey to file: %s\n", file_name.c_str());
-        fclose(pFile);
-        return false;
-    }
-    fclose(pFile);
-    return true;
+    BIO_free(bio);
+    return ret;
 }
 
 /**
@@ -74,6 +74,13 @@ constexpr uint8_t PLAT_STAT_CONFIGES_OFFSET = 8;
 constexpr uint32_t PLAT_STAT_OWNER_MASK = (1U << PLAT_STAT_OWNER_OFFSET);
 constexpr uint32_t PLAT_STAT_ES_MASK = (1U << PLAT_STAT_CONFIGES_OFFSET);
 
+// A cert for zip_certs: its name in the archive and its contents
+struct zip_cert_t
+{
+    std::string name;
+    std::string data;
+};
+
 namespace sev
 {
     // Global Functions that don't require ioctls
@@ -83,9 +90,10 @@ namespace sev
                          unsigned api_major, unsigned api_minor);
     int get_ask_ark(const std::string output_folder, const std::string cert_file);
     int get_ask_ark_pem(const std::string output_folder, const std::string cert_chain_file,
-                        const std::string ask_file, const std::string ark_file);
+                        const std::string ask_file, const std::string ark_file,
+                        std::vector<zip_cert_t> *certs = NULL);
     int zip_certs(const std::string output_folder, const std::string zip_name,
-                  const std::string files_to_zip);
+                  const std::vector<zip_cert_t> &certs, int out_fd = -1);
 } // namespace
 
 // Class to access the special SEV FW API test suite driver.
@@ -156,7 +164,8 @@ public:
 
     int generate_vcek_ask(const std::string output_folder,
                           const std::string vcek_der_file,
-                          const std::string vcek_pem_file);
+                          const std::string vcek_pem_file,
+                          std::vector<zip_cert_t> *certs = NULL);
     int generate_vcek_ask(const std::string output_folder,
                           const std::string vcek_der_file,
                           const std::string vcek_pem_file, std::vector<double> &measurements);
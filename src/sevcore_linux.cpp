@@ -16,6 +16,8 @@
 
 #include "sevapi.h"
 #ifdef __linux__
+#include "archive.h"
+#include "kds.h"
 #include "sevcore.h"
 #include "utilities.h"
 #include "psp-sev.h"
@@ -88,31 +90,21 @@ bool sev::min_api_version(unsigned platform_major, unsigned platform_minor,
 int sev::get_ask_ark(const std::string output_folder, const std::string cert_file)
 {
     int cmd_ret = SEV_RET_UNSUPPORTED;
-    std::string cmd = "wget ";
-    std::string output = "";
+    std::string url = "";
+    std::string cert_buf = "";
     ePSP_DEVICE_TYPE device_type = PSP_DEVICE_TYPE_INVALID;
-    std::string cert_w_path = "";
+    std::string cert_w_path = output_folder + cert_file;
 
     do {
-        cmd += "-O " + output_folder + cert_file + " ";
-        cert_w_path = output_folder + cert_file;
-
-        // Don't re-download the CEK from the KDS server if you already have it
-        if (sev::get_file_size(cert_w_path) != 0) {
-            // printf("ASK_ARK already exists, not re-downloading\n");
-            cmd_ret = SEV_RET_SUCCESS;
-            break;
-        }
-
         device_type = get_device_type();
         if (device_type == PSP_DEVICE_TYPE_NAPLES) {
-            cmd += ASK_ARK_NAPLES_SITE;
+            url = ASK_ARK_NAPLES_SITE;
         }
         else if (device_type == PSP_DEVICE_TYPE_ROME) {
-            cmd += ASK_ARK_ROME_SITE;
+            url = ASK_ARK_ROME_SITE;
         }
         else if (device_type == PSP_DEVICE_TYPE_MILAN) {
-            cmd += ASK_ARK_MILAN_SITE;
+            url = ASK_ARK_MILAN_SITE;
         }
         else {
             printf("Error: Unable to determine Platform type. " \
@@ -120,15 +112,9 @@ int sev::get_ask_ark(const std::string output_folder, const std::string cert_fil
             break;
         }
 
-        // Download the certificate from the AMD server
-        if (!sev::execute_system_command(cmd, &output)) {
-            printf("Error: pipe not opened for system command\n");
-            cmd_ret = SEV_RET_UNSUPPORTED;
-            break;
-        }
-
-        // Check if the file got downloaded
-        if (sev::get_file_size(cert_w_path) == 0) {
+        // Download the certificate from the AMD server, or revalidate the
+        // copy we already have
+        if (sev::kds_fetch(url, cert_w_path, cert_buf) != SEV_RET_SUCCESS) {
             printf("Error: command to get ask_ark cert failed\n");
             cmd_ret = SEV_RET_UNSUPPORTED;
             break;
@@ -140,97 +126,108 @@ int sev::get_ask_ark(const std::string output_folder, const std::string cert_fil
     return cmd_ret;
 }
 
+/**
+ * If certs is passed in, the chain, ASK and ARK PEMs are also added to it,
+ * with the same contents as the files
+ */
 int sev::get_ask_ark_pem(const std::string output_folder, const std::string cert_chain_file,
-                         const std::string ask_file, const std::string ark_file)
+                         const std::string ask_file, const std::string ark_file,
+                         std::vector<zip_cert_t> *certs)
 {
     int cmd_ret = SEV_RET_UNSUPPORTED;
-    struct stat file_details;
-    std::string cmd = "wget ";
-    std::string output = "";
+    bool updated = false;
     std::string cert_chain_w_path = output_folder + cert_chain_file;
     std::string ask_w_path = output_folder + ask_file;
     std::string ark_w_path = output_folder + ark_file;
+    std::vector<X509 *> x509_certs;
 
     do {
-        cmd += "-O " + cert_chain_w_path;  // Really ASK and ARK
-        cmd += " \"";
-        cmd += KDS_VCEK;
-        cmd += "Milan/";
-        cmd += KDS_VCEK_CERT_CHAIN;
-        cmd += "\"";
-
-        // Don't re-download the CEK from the KDS server if you already have it
-        if (sev::get_file_size(cert_chain_w_path) != 0) {
-            // printf("ASK_ARK pem already exists, not re-downloading\n");
-            cmd_ret = SEV_RET_SUCCESS;
-            break;
-        }
-
-        // Download the certificate from the AMD server
-        if (!sev::execute_system_command(cmd, &output)) {
-            printf("Error: pipe not opened for system command\n");
-            cmd_ret = SEV_RET_UNSUPPORTED;
+        // Download the certificate chain from the AMD server (really ASK and
+        // ARK), or revalidate the copy we already have
+        if (sev::kds_fetch_x509(KDS_VCEK "Milan/" KDS_VCEK_CERT_CHAIN, cert_chain_w_path,
+                                x509_certs, &updated) != SEV_RET_SUCCESS) {
+            printf("Error: command to get ask_ark cert failed\n");
             break;
         }
-
-        // Check if the file got downloaded
-        if (sev::get_file_size(cert_chain_w_path) == 0) {
-            printf("Error: command to get ask_ark cert failed\n");
-            cmd_ret = SEV_RET_UNSUPPORTED;
+        if (x509_certs.size() != 2) {
+            printf("Error: unexpected vcek cert chain contents\n");
             break;
         }
-
-        // Create the required SEV assets directory if it doesn't exist.
-        if (stat(SEV_DEFAULT_DIR, &file_details) == -1) {
-            if (errno == ENOENT) {
-                if (mkdir(SEV_DEFAULT_DIR, 0775) != -1) {
-                    printf("Info: Created missing directory: %s\n", SEV_DEFAULT_DIR);
-                } else {
-                    fprintf(stderr, "Error: Unable to create required directory: %s\n", SEV_DEFAULT_DIR);
-                }
+        if (certs) {
+            zip_cert_t chain = { cert_chain_file, "" };
+            zip_cert_t ask = { ask_file, "" };
+            zip_cert_t ark = { ark_file, "" };
+            // Already fetched above, so this comes from the in-memory cache
+            if (sev::kds_fetch(KDS_VCEK "Milan/" KDS_VCEK_CERT_CHAIN, cert_chain_w_path,
+                               chain.data) != SEV_RET_SUCCESS ||
+                !write_x509_pem_buf(x509_certs[0], ask.data) ||
+                !write_x509_pem_buf(x509_certs[1], ark.data)) {
+                printf("Error: encoding vcek cert chain\n");
+                break;
             }
+            certs->push_back(chain);
+            certs->push_back(ask);
+            certs->push_back(ark);
         }
 
-        // Split it from ask_ark into 2 separate pem files
-        cmd = "csplit -z -f " SEV_DEFAULT_DIR "cert_chain- ";
-        cmd += cert_chain_w_path;
-        cmd += " '/-----BEGIN CERTIFICATE-----/' '{*}'";
-        if (!execute_system_command(cmd, &output)) {
-            printf("Error: pipe not opened for system command\n");
-            break;
-        }
-
-        // Move the file from "cert_chain-xx" to something known (cert_chain_w_path)
-        if (std::rename(SEV_DEFAULT_DIR "cert_chain-00", ask_w_path.c_str()) != 0) {
-            printf("Error: renaming vcek cert chain file\n");
+        // Only rewrite the separate ASK and ARK pem files if the chain changed
+        if (!updated && sev::get_file_size(ask_w_path) != 0 &&
+            sev::get_file_size(ark_w_path) != 0) {
+            cmd_ret = SEV_RET_SUCCESS;
             break;
         }
-        if (std::rename(SEV_DEFAULT_DIR "cert_chain-01", ark_w_path.c_str()) != 0) {
-            printf("Error: renaming vcek cert chain file\n");
+        if (!write_x509_pem(ask_w_path, x509_certs[0]) ||
+            !write_x509_pem(ark_w_path, x509_certs[1])) {
+            printf("Error: writing vcek cert chain files\n");
             break;
         }
 
         cmd_ret = SEV_RET_SUCCESS;
     } while (0);
 
+    for (size_t i = 0; i < x509_certs.size(); i++)
+        X509_free(x509_certs[i]);
+
     return cmd_ret;
 }
 
+/**
+ * Zips up certs into output_folder/zip_name.zip, or streams the archive to
+ * out_fd instead if one is passed in. out_fd is closed when done. A zip
+ * file is written aside and only renamed into place once it's complete
+ */
 int sev::zip_certs(const std::string output_folder, const std::string zip_name,
-                   const std::string files_to_zip)
+                   const std::vector<zip_cert_t> &certs, int out_fd)
 {
-    int cmd_ret = SEV_RET_SUCCESS;
-    std::string cmd = "";
-    std::string output = "";
-    std::string error = "zip error";
+    int cmd_ret = -1;
+    ZipWriter zip;
+    std::string zip_file = output_folder + zip_name + ".zip";
 
-    cmd = "zip -j " + output_folder + zip_name + " " + files_to_zip;
-    sev::execute_system_command(cmd, &output);
+    do {
+        if (out_fd >= 0) {
+            if (!zip.open(out_fd))
+                break;
+        }
+        else if (!zip.open(zip_file)) {
+            break;
+        }
 
-    if (output.find(error) != std::string::npos) {
-        printf("Error when zipping up files!");
-        cmd_ret = -1;
-    }
+        size_t i = 0;
+        for (i = 0; i < certs.size(); i++) {
+            if (!zip.add_entry(certs[i].name, certs[i].data.data(), certs[i].data.size()))
+                break;
+        }
+        if (i != certs.size())
+            break;
+
+        if (!zip.close())
+            break;
+
+        cmd_ret = SEV_RET_SUCCESS;
+    } while (0);
+
+    if (cmd_ret != SEV_RET_SUCCESS)
+        printf("Error when zipping up files!\n");
 
     return cmd_ret;
 }
@@ -978,16 +975,78 @@ int SEVDevice::generate_cek_ask(const std::string output_folder,
     return cmd_ret;
 }
 
+/**
+ * Gets the VCEK from the KDS server (or revalidates the cached DER) and
+ * writes it out as PEM if it changed. The PEM is encoded in memory from the
+ * parsed DER. If certs is passed in, the DER and PEM are also added to it
+ */
+static int fetch_vcek(const std::string url, const std::string der_cert_w_path,
+                      const std::string pem_cert_w_path,
+                      std::vector<zip_cert_t> *certs = NULL)
+{
+    int cmd_ret = SEV_RET_UNSUPPORTED;
+    bool updated = false;
+    std::vector<X509 *> x509_certs;
+
+    do {
+        // The AMD KDS server only accepts requests every 10 seconds
+        bool cert_found = false;
+        int sec_to_sleep = 6;
+        int retries = 0;
+        int max_retries = (int)((10/sec_to_sleep)+2);
+        while (!cert_found && retries <= max_retries) {
+            if (sev::kds_fetch_x509(url, der_cert_w_path, x509_certs, &updated) == SEV_RET_SUCCESS) {
+                cert_found = true;
+                break;
+            }
+            sleep(sec_to_sleep);
+            printf("Trying again\n");
+            retries++;
+        }
+        if (!cert_found || x509_certs.size() != 1) {
+            printf("Error: command to get vcek_ask cert failed\n");
+            break;
+        }
+
+        // Convert the cert from DER to PEM
+        if (updated || sev::get_file_size(pem_cert_w_path) == 0) {
+            if (!write_x509_pem(pem_cert_w_path, x509_certs[0]))
+                break;
+        }
+
+        if (certs) {
+            size_t slash = der_cert_w_path.find_last_of('/');
+            zip_cert_t der = { der_cert_w_path.substr(slash + 1), "" };
+            slash = pem_cert_w_path.find_last_of('/');
+            zip_cert_t pem = { pem_cert_w_path.substr(slash + 1), "" };
+            // Already fetched above, so this comes from the in-memory cache
+            if (sev::kds_fetch(url, der_cert_w_path, der.data) != SEV_RET_SUCCESS ||
+                !write_x509_pem_buf(x509_certs[0], pem.data)) {
+                printf("Error: encoding vcek cert\n");
+                break;
+            }
+            certs->push_back(der);
+            certs->push_back(pem);
+        }
+
+        cmd_ret = SEV_RET_SUCCESS;
+    } while (0);
+
+    for (size_t i = 0; i < x509_certs.size(); i++)
+        X509_free(x509_certs[i]);
+
+    return cmd_ret;
+}
+
 int SEVDevice::generate_vcek_ask(const std::string output_folder,
                                  const std::string vcek_der_file,
-                                 const std::string vcek_pem_file)
+                                 const std::string vcek_pem_file,
+                                 std::vector<zip_cert_t> *certs)
 {
     int cmd_ret = SEV_RET_UNSUPPORTED;
     int ioctl_ret = -1;
     sev_user_data_get_id id_buf;
-    // char cmd[235];
-    std::string cmd = "wget ";
-    std::string output = "";
+    std::string url = "";
     std::string der_cert_w_path = output_folder + vcek_der_file;
     std::string pem_cert_w_path = output_folder + vcek_pem_file;
 
@@ -995,9 +1054,8 @@ int SEVDevice::generate_vcek_ask(const std::string output_folder,
     memset(&id_buf, 0, sizeof(sev_user_data_get_id));
 
     do {
-        cmd += "-O " + der_cert_w_path + " \"";
-        cmd += KDS_VCEK;
-        cmd += "Milan/";
+        url += KDS_VCEK;
+        url += "Milan/";
 
 
         // Get the ID of the Platform
@@ -1014,54 +1072,19 @@ int SEVDevice::generate_vcek_ask(const std::string output_folder,
         {
             sprintf(id0_buf+strlen(id0_buf), "%02x", id_buf.socket1[i]);
         }
-        cmd += id0_buf;
+        url += id0_buf;
         // Create a container to store the TCB Version in.
         snp_tcb_version tcb_data = {.val = 0};
 
         // Get the TCB version of the Platform
         request_tcb_data(tcb_data);
 
-        cmd += "?blSPL=" + std::to_string(tcb_data.f.boot_loader);
-        cmd += "&teeSPL=" + std::to_string(tcb_data.f.tee);
-        cmd += "&snpSPL=" + std::to_string(tcb_data.f.snp);
-        cmd += "&ucodeSPL=" + std::to_string(tcb_data.f.microcode) + "\"";
-
-        // Don't re-download the VCEK from the KDS server if you already have it
-        if (sev::get_file_size(pem_cert_w_path) != 0) {
-            // printf("VCEK already exists, not re-downloading\n");
-            cmd_ret = SEV_RET_SUCCESS;
-            break;
-        }
-
-        // The AMD KDS server only accepts requests every 10 seconds
-        bool cert_found = false;
-        int sec_to_sleep = 6;
-        int retries = 0;
-        int max_retries = (int)((10/sec_to_sleep)+2);
-        while (!cert_found && retries <= max_retries) {
-            if (!sev::execute_system_command(cmd, &output)) {
-                printf("Error: pipe not opened for system command\n");
-                cmd_ret = SEV_RET_UNSUPPORTED;
-                break;
-            }
-
-            // Check if the file got downloaded
-            if (sev::get_file_size(der_cert_w_path) != 0) {
-                cert_found = true;
-                break;
-            }
-            sleep(sec_to_sleep);
-            printf("Trying again\n");
-            retries++;
-        }
-        if (!cert_found) {
-            printf("Error: command to get vcek_ask cert failed\n");
-            cmd_ret = SEV_RET_UNSUPPORTED;
-            break;
-        }
+        url += "?blSPL=" + std::to_string(tcb_data.f.boot_loader);
+        url += "&teeSPL=" + std::to_string(tcb_data.f.tee);
+        url += "&snpSPL=" + std::to_string(tcb_data.f.snp);
+        url += "&ucodeSPL=" + std::to_string(tcb_data.f.microcode);
 
-        // Convert the file from a DER to a PEM file
-        convert_der_to_pem(der_cert_w_path, pem_cert_w_path);
+        cmd_ret = fetch_vcek(url, der_cert_w_path, pem_cert_w_path, certs);
     } while (0);
 
     return cmd_ret;
@@ -1074,9 +1097,7 @@ int SEVDevice::generate_vcek_ask(const std::string output_folder,
     int cmd_ret = SEV_RET_UNSUPPORTED;
     int ioctl_ret = -1;
     sev_user_data_get_id id_buf;
-    // char cmd[235];
-    std::string cmd = "wget ";
-    std::string output = "";
+    std::string url = "";
     std::string der_cert_w_path = output_folder + vcek_der_file;
     std::string pem_cert_w_path = output_folder + vcek_pem_file;
 
@@ -1084,9 +1105,8 @@ int SEVDevice::generate_vcek_ask(const std::string output_folder,
     memset(&id_buf, 0, sizeof(sev_user_data_get_id));
 
     do {
-        cmd += "-O " + der_cert_w_path + " \"";
-        cmd += KDS_VCEK;
-        cmd += "Milan/";
+        url += KDS_VCEK;
+        url += "Milan/";
 
 
         // Get the ID of the Platform
@@ -1103,54 +1123,19 @@ int SEVDevice::generate_vcek_ask(const std::string output_folder,
         {
             sprintf(id0_buf+strlen(id0_buf), "%02x", id_buf.socket1[i]);
         }
-        cmd += id0_buf;
+        url += id0_buf;
         // Create a container to store the TCB Version in.
         snp_tcb_version tcb_data = {.val = 0};
 
         // Get the TCB version of the Platform
         request_tcb_data(tcb_data);
 
-        cmd += "?blSPL=" + std::to_string(tcb_data.f.boot_loader);
-        cmd += "&teeSPL=" + std::to_string(tcb_data.f.tee);
-        cmd += "&snpSPL=" + std::to_string(tcb_data.f.snp);
-        cmd += "&ucodeSPL=" + std::to_string(tcb_data.f.microcode) + "\"";
-
-        // Don't re-download the VCEK from the KDS server if you already have it
-        if (sev::get_file_size(pem_cert_w_path) != 0) {
-            // printf("VCEK already exists, not re-downloading\n");
-            cmd_ret = SEV_RET_SUCCESS;
-            break;
-        }
-
-        // The AMD KDS server only accepts requests every 10 seconds
-        bool cert_found = false;
-        int sec_to_sleep = 6;
-        int retries = 0;
-        int max_retries = (int)((10/sec_to_sleep)+2);
-        while (!cert_found && retries <= max_retries) {
-            if (!sev::execute_system_command(cmd, &output)) {
-                printf("Error: pipe not opened for system command\n");
-                cmd_ret = SEV_RET_UNSUPPORTED;
-                break;
-            }
-
-            // Check if the file got downloaded
-            if (sev::get_file_size(der_cert_w_path) != 0) {
-                cert_found = true;
-                break;
-            }
-            sleep(sec_to_sleep);
-            printf("Trying again\n");
-            retries++;
-        }
-        if (!cert_found) {
-            printf("Error: command to get vcek_ask cert failed\n");
-            cmd_ret = SEV_RET_UNSUPPORTED;
-            break;
-        }
+        url += "?blSPL=" + std::to_string(tcb_data.f.boot_loader);
+        url += "&teeSPL=" + std::to_string(tcb_data.f.tee);
+        url += "&snpSPL=" + std::to_string(tcb_data.f.snp);
+        url += "&ucodeSPL=" + std::to_string(tcb_data.f.microcode);
 
-        // Convert the file from a DER to a PEM file
-        convert_der_to_pem(der_cert_w_path, pem_cert_w_path);
+        cmd_ret = fetch_vcek(url, der_cert_w_path, pem_cert_w_path);
     } while (0);
 
     return cmd_ret;
@@ -0,0 +1,205 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "sevmeasure.h"
+#include "ovmf.h"
+#include "sevapi.h"
+#include "utilities.h"
+#include <openssl/evp.h>
+#include <algorithm>  // std::min
+#include <cstring>
+#include <stdio.h>
+
+// Large files are hashed in pieces, so the mapping is read once, in order
+#define SHA256_FILE_CHUNK_SIZE  (1024 * 1024)
+
+bool sha256_file(const std::string file_name, uint8_t hash[SHA256_DIGEST_LENGTH])
+{
+    sev::FileView file;
+    EVP_MD_CTX *ctx = NULL;
+    bool ret = false;
+
+    do {
+        // An empty file is fine, if it exists
+        if (!file.open(file_name))
+            break;
+
+        if (!(ctx = EVP_MD_CTX_new()) || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+            break;
+
+        size_t offset = 0;
+        for (; offset < file.size(); offset += SHA256_FILE_CHUNK_SIZE) {
+            size_t len = std::min((size_t)SHA256_FILE_CHUNK_SIZE, file.size() - offset);
+            if (EVP_DigestUpdate(ctx, file.data() + offset, len) != 1)
+                break;
+        }
+        if (offset < file.size())
+            break;
+
+        ret = EVP_DigestFinal_ex(ctx, hash, NULL) == 1;
+    } while (0);
+
+    EVP_MD_CTX_free(ctx);
+    return ret;
+}
+
+static bool set_hash_entry(sev_hash_table_entry *entry, const char *guid_str)
+{
+    entry->length = (uint16_t)sizeof(*entry);
+    return guid_to_le(guid_str, entry->guid);
+}
+
+int build_sev_hash_table(const std::string kernel_file, const std::string initrd_file,
+                         const std::string append, sev_hash_table *table)
+{
+    memset(table, 0, sizeof(*table));
+    table->length = (uint16_t)SEV_HASH_TABLE_LENGTH;
+
+    if (!guid_to_le(SEV_HASH_TABLE_HEADER_GUID, table->guid) ||
+        !set_hash_entry(&table->cmdline, SEV_CMDLINE_ENTRY_GUID) ||
+        !set_hash_entry(&table->initrd, SEV_INITRD_ENTRY_GUID) ||
+        !set_hash_entry(&table->kernel, SEV_KERNEL_ENTRY_GUID))
+        return ERROR_INVALID_PARAM;
+
+    // The command line is hashed with its NUL terminator, as QEMU passes it
+    if (!SHA256((const uint8_t *)append.c_str(), append.size() + 1, table->cmdline.hash))
+        return ERROR_INVALID_PARAM;
+
+    if (initrd_file.empty()) {
+        if (!SHA256(NULL, 0, table->initrd.hash))
+            return ERROR_INVALID_PARAM;
+    }
+    else if (!sha256_file(initrd_file, table->initrd.hash)) {
+        return ERROR_INVALID_PARAM;
+    }
+
+    if (!sha256_file(kernel_file, table->kernel.hash))
+        return ERROR_INVALID_PARAM;
+
+    return STATUS_SUCCESS;
+}
+
+int calc_sev_launch_digest(const sev_launch_digest_input_t &input,
+                           uint8_t ld[SHA256_DIGEST_LENGTH])
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    size_t ovmf_size = 0;
+    const uint8_t *ovmf_data = NULL;
+    OVMFImage ovmf;
+    EVP_MD_CTX *ctx = NULL;
+    sev_hash_table table;
+
+    do {
+        if (!(ctx = EVP_MD_CTX_new()) || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+            break;
+
+        if (!(ovmf_data = sev::map_file(input.ovmf_file, &ovmf_size)))
+            break;
+        if (!ovmf.parse(ovmf_data, ovmf_size))
+            break;
+
+        size_t offset = 0;
+        for (; offset < ovmf_size; offset += SHA256_FILE_CHUNK_SIZE) {
+            size_t len = std::min((size_t)SHA256_FILE_CHUNK_SIZE, ovmf_size - offset);
+            if (EVP_DigestUpdate(ctx, ovmf_data + offset, len) != 1)
+                break;
+        }
+        if (offset < ovmf_size)
+            break;
+
+        if (!input.kernel_file.empty()) {
+            uint32_t table_gpa = 0, table_size = 0;
+            if (!ovmf.sev_hashes_table(&table_gpa, &table_size)) {
+                printf("Error: %s has no kernel hashes table, kernel can't be measured\n",
+                       input.ovmf_file.c_str());
+                break;
+            }
+            cmd_ret = build_sev_hash_table(input.kernel_file, input.initrd_file,
+                                           input.append, &table);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+            cmd_ret = ERROR_INVALID_PARAM;
+            if (EVP_DigestUpdate(ctx, &table, sizeof(table)) != 1)
+                break;
+        }
+
+        if (input.mode == SEV_LAUNCH_MODE_SEV_ES) {
+            VMSASet vmsas;
+            uint32_t ap_eip = 0;
+
+            if (input.vcpus == 0)
+                break;
+            if (input.vcpus > 1 && !ovmf.sev_es_reset_eip(&ap_eip)) {
+                printf("Error: %s has no SEV-ES reset block, APs can't be measured\n",
+                       input.ovmf_file.c_str());
+                break;
+            }
+
+            vmsas.add_vcpus(input.vcpus, ap_eip, 0, input.vcpu_sig, input.vmm_type);
+            size_t vcpu = 0;
+            for (; vcpu < vmsas.num_vcpus(); vcpu++) {
+                if (EVP_DigestUpdate(ctx, vmsas.page(vcpu), VMSA_PAGE_SIZE) != 1)
+                    break;
+            }
+            if (vcpu != vmsas.num_vcpus())
+                break;
+        }
+
+        if (EVP_DigestFinal_ex(ctx, ld, NULL) != 1)
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    EVP_MD_CTX_free(ctx);
+    sev::unmap_file(ovmf_data, ovmf_size);
+    return cmd_ret;
+}
+
+bool sev_launch_digest_cache_key(MeasurementCache &cache, const sev_launch_digest_input_t &input,
+                                 uint8_t key[MEASUREMENT_CACHE_KEY_SIZE])
+{
+    MeasurementCacheKey builder("sev-launch-digest-v1");
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+
+    builder.add((uint64_t)input.mode);
+    if (!cache.file_digest(input.ovmf_file, digest))
+        return false;
+    builder.add(digest, sizeof(digest));
+
+    builder.add((uint64_t)!input.kernel_file.empty());
+    if (!input.kernel_file.empty()) {
+        if (!cache.file_digest(input.kernel_file, digest))
+            return false;
+        builder.add(digest, sizeof(digest));
+        builder.add((uint64_t)!input.initrd_file.empty());
+        if (!input.initrd_file.empty()) {
+            if (!cache.file_digest(input.initrd_file, digest))
+                return false;
+            builder.add(digest, sizeof(digest));
+        }
+        builder.add(input.append);
+    }
+
+    if (input.mode == SEV_LAUNCH_MODE_SEV_ES) {
+        builder.add((uint64_t)input.vcpus);
+        builder.add((uint64_t)input.vcpu_sig);
+        builder.add((uint64_t)input.vmm_type);
+    }
+
+    return builder.final(key);
+}
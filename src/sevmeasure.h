@@ -0,0 +1,99 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef SEVMEASURE_H
+#define SEVMEASURE_H
+
+#include "measurecache.h"
+#include "vmsa.h"
+#include <openssl/sha.h>    // for SHA256_DIGEST_LENGTH
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Kernel hashes table OVMF checks before booting a -kernel (OvmfPkg/AmdSev)
+#define SEV_HASH_TABLE_HEADER_GUID  "9438d606-4f22-4cc9-b479-a793d411fd21"
+#define SEV_KERNEL_ENTRY_GUID       "4de79437-abd2-427f-b835-d5b172d2045b"
+#define SEV_INITRD_ENTRY_GUID       "44baf731-3a2f-4bd7-9af1-41e29169781d"
+#define SEV_CMDLINE_ENTRY_GUID      "97d02dd8-bd20-4c94-aa78-e7714d36ab2a"
+
+typedef struct __attribute__ ((__packed__)) sev_hash_table_entry_t
+{
+    uint8_t  guid[16];
+    uint16_t length;        // Of the whole entry
+    uint8_t  hash[SHA256_DIGEST_LENGTH];
+} sev_hash_table_entry;
+static_assert(sizeof(sev_hash_table_entry) == 50, "Error, static assertion failed");
+
+typedef struct __attribute__ ((__packed__)) sev_hash_table_t
+{
+    uint8_t  guid[16];
+    uint16_t length;        // Of the whole table, not counting the padding
+    sev_hash_table_entry cmdline;
+    sev_hash_table_entry initrd;
+    sev_hash_table_entry kernel;
+    uint8_t  padding[8];    // QEMU pads the table to 16 bytes
+} sev_hash_table;
+static_assert(sizeof(sev_hash_table) == 176, "Error, static assertion failed");
+#define SEV_HASH_TABLE_LENGTH   offsetof(sev_hash_table, padding)   // 168
+
+enum sev_launch_mode_t {
+    SEV_LAUNCH_MODE_SEV    = 0,
+    SEV_LAUNCH_MODE_SEV_ES = 1,
+};
+
+/**
+ * Everything that goes into a SEV or SEV-ES guest's launch digest. kernel,
+ * initrd and append are only used if kernel is set (QEMU -kernel with
+ * kernel-hashes=on); an empty initrd hashes as an empty file.
+ * vcpus, vcpu_sig and vmm_type are only used for SEV-ES, whose VMSAs are
+ * measured too
+ */
+struct sev_launch_digest_input_t {
+    sev_launch_mode_t mode;
+    std::string ovmf_file;
+    std::string kernel_file;
+    std::string initrd_file;
+    std::string append;
+    uint32_t vcpus;
+    uint32_t vcpu_sig;
+    vmm_type_t vmm_type;
+};
+
+// SHA-256 of a whole file, read through a read-only mapping
+bool sha256_file(const std::string file_name, uint8_t hash[SHA256_DIGEST_LENGTH]);
+
+int build_sev_hash_table(const std::string kernel_file, const std::string initrd_file,
+                         const std::string append, sev_hash_table *table);
+
+/**
+ * Computes GCTX.LD, the SHA-256 the firmware accumulates over everything
+ * passed to LAUNCH_UPDATE_DATA and LAUNCH_UPDATE_VMSA, in QEMU's order:
+ * the OVMF image, the kernel hashes table, then one VMSA per vCPU (BSP
+ * first). This is the digest calc_measurement needs
+ */
+int calc_sev_launch_digest(const sev_launch_digest_input_t &input,
+                           uint8_t ld[SHA256_DIGEST_LENGTH]);
+
+/**
+ * Cache key for input's launch digest: the digests (not names) of the files
+ * and every other input, so the same images under another path hit
+ */
+bool sev_launch_digest_cache_key(MeasurementCache &cache, const sev_launch_digest_input_t &input,
+                                 uint8_t key[MEASUREMENT_CACHE_KEY_SIZE]);
+
+#endif /* SEVMEASURE_H */
@@ -0,0 +1,213 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "snpmeasure.h"
+#include "crypto.h"         // for digest_sha
+#include "utilities.h"      // for PAGE_SIZE_4K
+#include <algorithm>  // std::min
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <thread>
+
+SNPLaunchDigest::SNPLaunchDigest(const uint8_t *initial_ld)
+{
+    if (initial_ld)
+        memcpy(m_initial, initial_ld, sizeof(m_initial));
+    else
+        memset(m_initial, 0, sizeof(m_initial));
+}
+
+bool SNPLaunchDigest::is_valid_page_type(uint8_t page_type)
+{
+    return page_type >= SNP_PAGE_TYPE_NORMAL && page_type <= SNP_PAGE_TYPE_CPUID;
+}
+
+bool SNPLaunchDigest::page_type_from_name(const std::string name, uint8_t *page_type)
+{
+    static const struct {
+        const char *name;
+        uint8_t page_type;
+    } names[] = {
+        { "normal",     SNP_PAGE_TYPE_NORMAL },
+        { "vmsa",       SNP_PAGE_TYPE_VMSA },
+        { "zero",       SNP_PAGE_TYPE_ZERO },
+        { "unmeasured", SNP_PAGE_TYPE_UNMEASURED },
+        { "secrets",    SNP_PAGE_TYPE_SECRETS },
+        { "cpuid",      SNP_PAGE_TYPE_CPUID },
+    };
+
+    for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+        if (name == names[i].name) {
+            *page_type = names[i].page_type;
+            return true;
+        }
+    }
+    return false;
+}
+
+int SNPLaunchDigest::add_range(uint8_t page_type, uint64_t gpa, uint64_t length,
+                               const uint8_t *data, const uint8_t *vmpl_perms)
+{
+    snp_page_range_t range;
+
+    range.page_type = page_type;
+    range.gpa = gpa;
+    range.length = length;
+    range.data = data;
+    if (vmpl_perms)
+        memcpy(range.vmpl_perms, vmpl_perms, sizeof(range.vmpl_perms));
+    else
+        memset(range.vmpl_perms, 0, sizeof(range.vmpl_perms));
+
+    return add_range(range);
+}
+
+int SNPLaunchDigest::add_range(const snp_page_range_t &range)
+{
+    if (!is_valid_page_type(range.page_type) ||
+        (range.gpa % PAGE_SIZE_4K) != 0 || range.length == 0 ||
+        (range.length % PAGE_SIZE_4K) != 0 ||
+        range.gpa + range.length < range.gpa)       // Wraps
+        return ERROR_INVALID_PARAM;
+
+    // Only NORMAL and VMSA pages have measured contents
+    if (!range.data && (range.page_type == SNP_PAGE_TYPE_NORMAL ||
+                        range.page_type == SNP_PAGE_TYPE_VMSA))
+        return ERROR_INVALID_PARAM;
+
+    // A VMSA is one page, passed to its own LAUNCH_UPDATE
+    if (range.page_type == SNP_PAGE_TYPE_VMSA && range.length != PAGE_SIZE_4K)
+        return ERROR_INVALID_LENGTH;
+
+    m_ranges.push_back(range);
+    return STATUS_SUCCESS;
+}
+
+size_t SNPLaunchDigest::num_pages(void)
+{
+    size_t pages = 0;
+    for (size_t i = 0; i < m_ranges.size(); i++)
+        pages += (size_t)(m_ranges[i].length / PAGE_SIZE_4K);
+    return pages;
+}
+
+bool SNPLaunchDigest::update_page(uint8_t ld[SNP_LD_SIZE], const uint8_t contents[SNP_LD_SIZE],
+                                  uint8_t page_type, uint64_t gpa,
+                                  const uint8_t *vmpl_perms)
+{
+    snp_launch_update_page_info page_info;
+
+    memset(&page_info, 0, sizeof(page_info));
+    memcpy(page_info.digest_cur, ld, sizeof(page_info.digest_cur));
+    memcpy(page_info.contents, contents, sizeof(page_info.contents));
+    page_info.length = (uint16_t)SNP_PAGE_INFO_LENGTH;
+    page_info.page_type = page_type;
+    if (vmpl_perms) {
+        page_info.vmpl_1_perms = vmpl_perms[0];
+        page_info.vmpl_2_perms = vmpl_perms[1];
+        page_info.vmpl_3_perms = vmpl_perms[2];
+    }
+    page_info.gpa = gpa;
+
+    return digest_sha(&page_info, sizeof(page_info), ld, SNP_LD_SIZE, SHA_TYPE_384);
+}
+
+int SNPLaunchDigest::calculate(uint8_t ld[SNP_LD_SIZE], size_t num_threads)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::vector<const uint8_t *> measured;  // Every distinct page whose contents get hashed
+    std::vector<uint8_t> contents;          // SNP_LD_SIZE per measured page
+    std::vector<size_t> range_contents;     // Index of each range's first page in measured
+    std::map<const uint8_t *, size_t> range_by_data;    // data -> range that measures it
+    std::vector<std::thread> workers;
+    std::atomic<uint32_t> num_failed(0);
+    const uint8_t zero_contents[SNP_LD_SIZE] = {0};
+
+    do {
+        // Ranges with the same contents (ex. every AP's VMSA) are hashed once
+        range_contents.resize(m_ranges.size());
+        for (size_t r = 0; r < m_ranges.size(); r++) {
+            const snp_page_range_t &range = m_ranges[r];
+            if (range.page_type != SNP_PAGE_TYPE_NORMAL &&
+                range.page_type != SNP_PAGE_TYPE_VMSA)
+                continue;
+            std::map<const uint8_t *, size_t>::iterator it = range_by_data.find(range.data);
+            if (it != range_by_data.end() && m_ranges[it->second].length >= range.length) {
+                range_contents[r] = range_contents[it->second];
+                continue;
+            }
+            range_by_data[range.data] = r;
+            range_contents[r] = measured.size();
+            for (uint64_t offset = 0; offset < range.length; offset += PAGE_SIZE_4K)
+                measured.push_back(range.data + offset);
+        }
+        contents.resize(measured.size() * SNP_LD_SIZE);
+
+        // Hash the page contents, each thread one contiguous slice
+        if (num_threads == 0)
+            num_threads = std::thread::hardware_concurrency();
+        if (num_threads == 0 || measured.size() < SNP_PARALLEL_HASH_MIN_PAGES)
+            num_threads = 1;
+        if (num_threads > measured.size())
+            num_threads = measured.size();
+        size_t per_thread = num_threads ? (measured.size() + num_threads - 1) / num_threads : 0;
+
+        for (size_t t = 0; t < num_threads; t++) {
+            size_t first = t * per_thread;
+            size_t last = std::min(first + per_thread, measured.size());
+            workers.push_back(std::thread([&, first, last]() {
+                for (size_t i = first; i < last; i++) {
+                    if (!digest_sha(measured[i], PAGE_SIZE_4K, &contents[i * SNP_LD_SIZE],
+                                    SNP_LD_SIZE, SHA_TYPE_384))
+                        num_failed++;
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+        if (num_failed != 0)
+            break;
+
+        // Chain them, in LAUNCH_UPDATE order
+        uint8_t cur[SNP_LD_SIZE];
+        memcpy(cur, m_initial, sizeof(cur));
+        for (size_t r = 0; r < m_ranges.size() && num_failed == 0; r++) {
+            const snp_page_range_t &range = m_ranges[r];
+            bool has_contents = (range.page_type == SNP_PAGE_TYPE_NORMAL ||
+                                 range.page_type == SNP_PAGE_TYPE_VMSA);
+            size_t page = range_contents[r];
+            for (uint64_t offset = 0; offset < range.length; offset += PAGE_SIZE_4K) {
+                const uint8_t *page_contents = zero_contents;
+                if (has_contents)
+                    page_contents = &contents[(page++) * SNP_LD_SIZE];
+                if (!update_page(cur, page_contents, range.page_type,
+                                 range.gpa + offset, range.vmpl_perms)) {
+                    num_failed++;
+                    break;
+                }
+            }
+        }
+        if (num_failed != 0)
+            break;
+
+        memcpy(ld, cur, SNP_LD_SIZE);
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
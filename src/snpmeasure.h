@@ -0,0 +1,88 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef SNPMEASURE_H
+#define SNPMEASURE_H
+
+#include "sevapi.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define SNP_LD_SIZE             48              // SHA-384 launch digest
+#define SNP_PAGE_INFO_LENGTH    sizeof(snp_launch_update_page_info)
+
+// Fewer measured pages than this aren't worth starting threads for
+#define SNP_PARALLEL_HASH_MIN_PAGES 64
+
+/**
+ * A run of 4K pages passed to one SNP_LAUNCH_UPDATE. data points to the page
+ * contents for NORMAL and VMSA pages (length bytes) and is ignored for the
+ * other page types, whose contents aren't measured
+ */
+struct snp_page_range_t {
+    uint8_t page_type;          // SNP_LAUNCH_UPDATE_PAGE
+    uint64_t gpa;               // 4K aligned
+    uint64_t length;            // Multiple of 4K
+    const uint8_t *data;
+    uint8_t vmpl_perms[3];      // VMPL1-3 permissions, usually 0
+};
+
+/**
+ * Offline SNP launch digest: replays the measurement the firmware makes in
+ * SNP_LAUNCH_UPDATE (SNP ABI 8.17), where for every page
+ *   LD = SHA-384(PAGE_INFO(LD, CONTENTS, PAGE_TYPE, VMPL perms, GPA))
+ * CONTENTS is the page's SHA-384 for NORMAL and VMSA pages, zero otherwise.
+ *
+ * The per-page content hashes don't depend on each other, so calculate()
+ * computes them on a pool of threads, then chains the (cheap) PAGE_INFO
+ * hashes in order. Ranges added with the same data pointer (ex. the VMSAs of
+ * identical vCPUs from a VMSASet) are only hashed once. The ranges' data
+ * must stay valid until calculate() returns
+ */
+class SNPLaunchDigest
+{
+private:
+    uint8_t m_initial[SNP_LD_SIZE];
+    std::vector<snp_page_range_t> m_ranges;
+
+public:
+    // Starts from an all-zero digest, or initial_ld to continue a digest
+    // computed earlier (ex. a shared firmware prefix)
+    SNPLaunchDigest(const uint8_t *initial_ld = NULL);
+
+    int add_range(uint8_t page_type, uint64_t gpa, uint64_t length,
+                  const uint8_t *data = NULL, const uint8_t *vmpl_perms = NULL);
+    int add_range(const snp_page_range_t &range);
+    size_t num_pages(void);
+
+    /**
+     * Computes the digest over every range added so far. num_threads of 0
+     * means one per CPU
+     */
+    int calculate(uint8_t ld[SNP_LD_SIZE], size_t num_threads = 0);
+
+    // One step of the chain: folds a page with the given CONTENTS into ld
+    static bool update_page(uint8_t ld[SNP_LD_SIZE], const uint8_t contents[SNP_LD_SIZE],
+                            uint8_t page_type, uint64_t gpa,
+                            const uint8_t *vmpl_perms = NULL);
+    static bool is_valid_page_type(uint8_t page_type);
+    static bool page_type_from_name(const std::string name, uint8_t *page_type);
+};
+
+#endif /* SNPMEASURE_H */
@@ -0,0 +1,264 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "swapverify.h"
+#include "sevapi.h"         // for STATUS_SUCCESS
+#include <algorithm>        // std::min, std::sort
+#include <cstdio>
+#include <thread>
+#include <utility>
+
+// snp_metadata_entry_t bits 5 to 11, and the reserved bits of vmpl_entry_t
+#define SWAP_MDATA_RESERVED_MASK    0xFE0ULL
+#define SWAP_VMPL_RESERVED_MASK     0xFFFFFFFFF0F0F0F0ULL
+
+typedef std::pair<uint64_t, std::string> swap_error_t;  // [entry, problem]
+typedef std::pair<uint64_t, uint64_t> swap_key_t;       // [GPA frame or IV, entry]
+
+struct swap_slice_t {
+    swap_verify_t counts;
+    std::vector<swap_error_t> errors;
+    uint64_t image_bytes;
+    std::vector<swap_key_t> gpas;
+    std::vector<swap_key_t> ivs;
+};
+
+bool SwapSet::open(const std::string image_file, const std::string metadata_file)
+{
+    do {
+        if (!m_image.open(image_file) || !m_metadata.open(metadata_file))
+            break;
+        if (m_metadata.size() == 0) {
+            printf("Error: %s is empty, there are no metadata pages\n", metadata_file.c_str());
+            break;
+        }
+        if (m_metadata.size() % PAGE_SIZE_4K != 0) {
+            printf("Error: %s isn't made of 4K metadata pages\n", metadata_file.c_str());
+            break;
+        }
+        return true;
+    } while (0);
+
+    m_image.close();
+    m_metadata.close();
+    return false;
+}
+
+static void swap_add_error(std::vector<swap_error_t> &errors, uint64_t &num_errors,
+                           uint64_t entry, const char *what)
+{
+    if (errors.size() < SWAP_MAX_REPORTED_ERRORS) {
+        char buf[160];
+        snprintf(buf, sizeof(buf), "entry 0x%llx: %s", (unsigned long long)entry, what);
+        errors.push_back(std::make_pair(entry, std::string(buf)));
+    }
+    num_errors++;
+}
+
+static uint64_t swap_page_bytes(const snp_metadata_page_t &entry)
+{
+    return entry.mdata_entry.f.page_size ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+}
+
+// Checks the metadata entries [first, last) into slice, which starts out zeroed
+static void swap_check_entries(const snp_metadata_page_t *entries, size_t first, size_t last,
+                               swap_slice_t &slice)
+{
+    swap_verify_t &counts = slice.counts;
+    for (size_t i = first; i < last; i++) {
+        const snp_metadata_page_t &entry = entries[i];
+        const mdata_perm_mask_t &f = entry.mdata_entry.f;
+        if (!f.valid) {
+            const uint64_t *words = (const uint64_t *)&entry;
+            uint64_t any = 0;
+            for (size_t w = 0; w < SNP_METADATA_ENTRY_SIZE / sizeof(uint64_t); w++)
+                any |= words[w];
+            if (any)
+                swap_add_error(slice.errors, counts.num_errors, i, "unused entry isn't zeroed");
+            continue;
+        }
+
+        if ((entry.mdata_entry.val & SWAP_MDATA_RESERVED_MASK) || entry.reserved2 ||
+            entry.reserved3 || (entry.vmpl.val & SWAP_VMPL_RESERVED_MASK))
+            swap_add_error(slice.errors, counts.num_errors, i, "reserved field set");
+        if (f.vmsa && f.metadata)
+            swap_add_error(slice.errors, counts.num_errors, i, "both a VMSA and a metadata page");
+        else if ((f.vmsa || f.metadata) && f.page_size)
+            swap_add_error(slice.errors, counts.num_errors, i, "2M VMSA or metadata page");
+
+        if (f.page_size)
+            counts.pages_2m++;
+        else
+            counts.pages_4k++;
+        if (f.vmsa)
+            counts.vmsas++;
+        if (f.page_validated)
+            counts.validated++;
+        slice.image_bytes += swap_page_bytes(entry);
+
+        // Metadata pages belong to the hypervisor, not to a GPA
+        if (f.metadata) {
+            counts.metadata_pages++;
+        }
+        else {
+            if (f.page_size && f.gpa % (PAGE_SIZE_2M / PAGE_SIZE_4K) != 0)
+                swap_add_error(slice.errors, counts.num_errors, i, "2M page at a GPA that isn't 2M aligned");
+            slice.gpas.push_back(std::make_pair((uint64_t)f.gpa, (uint64_t)i));
+        }
+        slice.ivs.push_back(std::make_pair(entry.iv, (uint64_t)i));
+    }
+}
+
+// Encrypted pages are never all zeros, so almost always stops at the first word
+static bool swap_page_is_zero(const uint8_t *page, uint64_t bytes)
+{
+    const uint64_t *words = (const uint64_t *)page;
+    for (uint64_t w = 0; w < bytes / sizeof(uint64_t); w++) {
+        if (words[w])
+            return false;
+    }
+    return true;
+}
+
+// Checks the image pages of entries [first, last), which start at offset
+static void swap_check_image(const SwapSet &swap_set, size_t first, size_t last,
+                             uint64_t offset, swap_slice_t &slice)
+{
+    const snp_metadata_page_t *entries = swap_set.entries();
+    for (size_t i = first; i < last; i++) {
+        if (!entries[i].mdata_entry.f.valid)
+            continue;
+        uint64_t bytes = swap_page_bytes(entries[i]);
+        if (offset + bytes > swap_set.image_size())
+            break;          // Reported once, for the whole image
+        if (swap_page_is_zero(swap_set.image() + offset, bytes))
+            swap_add_error(slice.errors, slice.counts.num_errors, i,
+                           "swapped-out page was never written (all zeros)");
+        offset += bytes;
+    }
+}
+
+int swap_verify(const SwapSet &swap_set, swap_verify_t &result, size_t num_threads)
+{
+    const snp_metadata_page_t *entries = swap_set.entries();
+    size_t num_entries = swap_set.num_entries();
+    std::vector<swap_slice_t> slices;
+    std::vector<std::thread> workers;
+
+    // Each thread takes a contiguous slice of whole metadata pages
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+    size_t per_thread = (num_entries + num_threads - 1) / num_threads;
+    per_thread = (per_thread + SWAP_MDATA_ENTRIES_PER_PAGE - 1) / SWAP_MDATA_ENTRIES_PER_PAGE *
+                 SWAP_MDATA_ENTRIES_PER_PAGE;
+    if (per_thread == 0)
+        per_thread = SWAP_MDATA_ENTRIES_PER_PAGE;
+    num_threads = (num_entries + per_thread - 1) / per_thread;
+
+    slices.resize(num_threads);
+    for (size_t t = 0; t < num_threads; t++) {
+        size_t first = t * per_thread;
+        size_t last = std::min(first + per_thread, num_entries);
+        slices[t].counts = swap_verify_t();
+        slices[t].image_bytes = 0;
+        workers.push_back(std::thread([&, t, first, last]() {
+            swap_check_entries(entries, first, last, slices[t]);
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+
+    // Where each slice's pages start in the image, then check the pages
+    uint64_t offset = 0;
+    workers.clear();
+    for (size_t t = 0; t < num_threads; t++) {
+        size_t first = t * per_thread;
+        size_t last = std::min(first + per_thread, num_entries);
+        workers.push_back(std::thread([&, t, first, last, offset]() {
+            swap_check_image(swap_set, first, last, offset, slices[t]);
+        }));
+        offset += slices[t].image_bytes;
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+
+    // Merge the slices, in entry order
+    result = swap_verify_t();
+    result.num_entries = num_entries;
+    result.image_bytes = offset;
+    std::vector<swap_error_t> errors;
+    std::vector<swap_key_t> gpas, ivs;
+    for (size_t t = 0; t < slices.size(); t++) {
+        const swap_slice_t &slice = slices[t];
+        result.pages_4k += slice.counts.pages_4k;
+        result.pages_2m += slice.counts.pages_2m;
+        result.vmsas += slice.counts.vmsas;
+        result.metadata_pages += slice.counts.metadata_pages;
+        result.validated += slice.counts.validated;
+        result.num_errors += slice.counts.num_errors;
+        errors.insert(errors.end(), slice.errors.begin(), slice.errors.end());
+        gpas.insert(gpas.end(), slice.gpas.begin(), slice.gpas.end());
+        ivs.insert(ivs.end(), slice.ivs.begin(), slice.ivs.end());
+    }
+
+    // No two pages may cover the same GPA, or be encrypted with the same IV
+    std::vector<swap_error_t> gpa_errors, iv_errors;
+    std::sort(gpas.begin(), gpas.end());
+    uint64_t covered_end = 0, covered_by = 0;
+    for (size_t g = 0; g < gpas.size(); g++) {
+        uint64_t frame = gpas[g].first, entry = gpas[g].second;
+        if (g > 0 && frame < covered_end) {
+            char what[96];
+            snprintf(what, sizeof(what), "GPA 0x%llx is also swapped out by entry 0x%llx",
+                     (unsigned long long)frame * PAGE_SIZE_4K, (unsigned long long)covered_by);
+            swap_add_error(gpa_errors, result.num_errors, entry, what);
+        }
+        uint64_t end = frame + swap_page_bytes(entries[entry]) / PAGE_SIZE_4K;
+        if (end > covered_end) {
+            covered_end = end;
+            covered_by = entry;
+        }
+    }
+    std::sort(ivs.begin(), ivs.end());
+    for (size_t v = 1; v < ivs.size(); v++) {
+        if (ivs[v].first != ivs[v - 1].first)
+            continue;
+        char what[96];
+        snprintf(what, sizeof(what), "IV 0x%llx is also used by entry 0x%llx",
+                 (unsigned long long)ivs[v].first, (unsigned long long)ivs[v - 1].second);
+        swap_add_error(iv_errors, result.num_errors, ivs[v].second, what);
+    }
+
+    // Report the problems in entry order
+    errors.insert(errors.end(), gpa_errors.begin(), gpa_errors.end());
+    errors.insert(errors.end(), iv_errors.begin(), iv_errors.end());
+    std::stable_sort(errors.begin(), errors.end(),
+                     [](const swap_error_t &a, const swap_error_t &b) { return a.first < b.first; });
+    if (result.image_bytes != swap_set.image_size()) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "image is %zu bytes, but the metadata describes %llu",
+                 swap_set.image_size(), (unsigned long long)result.image_bytes);
+        errors.insert(errors.begin(), std::make_pair((uint64_t)0, std::string(buf)));
+        result.num_errors++;
+    }
+    for (size_t e = 0; e < errors.size() && result.errors.size() < SWAP_MAX_REPORTED_ERRORS; e++)
+        result.errors.push_back(errors[e].second);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef SWAPVERIFY_H
+#define SWAPVERIFY_H
+
+#include "rmp.h"
+#include "utilities.h"      // for FileView
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define SWAP_MDATA_ENTRIES_PER_PAGE (PAGE_SIZE_4K / SNP_METADATA_ENTRY_SIZE)   // 64
+
+// Only the first problems are described, the rest are just counted
+#define SWAP_MAX_REPORTED_ERRORS    100
+
+/**
+ * Read-only view of a swapped-out page set: the swap image, holding the
+ * encrypted pages back to back, and the metadata pages that describe them,
+ * 64 snp_metadata_page_t entries per 4K page. The Nth valid entry describes
+ * the Nth page of the image; unused entries are all zeros. Both files are
+ * FileViews, so large ones are mapped, not read, and can be many GB. The
+ * image may be empty (nothing swapped out), the metadata may not
+ */
+class SwapSet
+{
+private:
+    sev::FileView m_image;
+    sev::FileView m_metadata;
+
+public:
+    bool open(const std::string image_file, const std::string metadata_file);
+
+    const uint8_t *image(void) const { return m_image.data(); }
+    size_t image_size(void) const { return m_image.size(); }
+    const snp_metadata_page_t *entries(void) const { return (const snp_metadata_page_t *)m_metadata.data(); }
+    size_t num_entries(void) const { return m_metadata.size() / SNP_METADATA_ENTRY_SIZE; }
+};
+
+struct swap_verify_t {
+    uint64_t num_entries;       // Including unused ones
+    uint64_t pages_4k;
+    uint64_t pages_2m;
+    uint64_t vmsas;
+    uint64_t metadata_pages;    // Swapped-out metadata pages
+    uint64_t validated;
+    uint64_t image_bytes;       // Described by the metadata
+    uint64_t num_errors;
+    std::vector<std::string> errors;    // The first SWAP_MAX_REPORTED_ERRORS, in entry order
+};
+
+/**
+ * Checks a swap set without the guest's keys, so the auth tags can't be
+ * verified: every entry's flags and reserved fields, that unused entries are
+ * zeroed, that the image is exactly as long as the pages described, that no
+ * two pages cover the same GPA, that no IV is used twice, and that no page of
+ * the image was left unwritten (all zeros).
+ * The entries are split across num_threads threads (0 for one per CPU), each
+ * checking its own contiguous slice of the metadata and then its pages of
+ * the image
+ */
+int swap_verify(const SwapSet &swap_set, swap_verify_t &result, size_t num_threads = 0);
+
+#endif /* SWAPVERIFY_H */
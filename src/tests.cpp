@@ -15,15 +15,38 @@
  **************************************************************************/
 
 #include "amdcert.h"
+#include "archive.h"
 #include "commands.h"
+#include "cpuidpage.h"
 #include "crypto.h"
+#include "guestmsg.h"
+#include "idblock.h"
+#include "keyarena.h"
+#include "keypool.h"
+#include "launchsession.h"
+#include "ovmf.h"
+#include "rmpmodel.h"
+#include "rmptable.h"
 #include "sevapi.h"
 #include "sevcert.h"
+#include "sevmeasure.h"
+#include "swapverify.h"
 #include "tests.h"
 #include "utilities.h"  // for read_file
+#include "x509cert.h"
+#include <openssl/x509.h>   // i2d_PUBKEY
+#include <algorithm>    // std::count
+#include <climits>      // PATH_MAX
 #include <cstring>      // For memcmp
+#include <dirent.h>     // opendir
+#include <sched.h>      // sched_setaffinity
 #include <stdio.h>      // prboolf
 #include <stdlib.h>     // malloc
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>   // chmod
+#include <sys/wait.h>   // waitpid
+#include <unistd.h>     // usleep
 
 Tests::Tests(std::string output_folder, int verbose_flag)
      : m_output_folder(output_folder),
@@ -129,9 +152,7 @@ bool Tests::test_pek_gen(void)
     std::string cert_chain_full = m_output_folder + CERT_CHAIN_HEX_FILENAME;
     std::string pdh_cert_full = m_output_folder + PDH_FILENAME;
     sev_cert_chain_buf cert_chain_orig;
-    sev_cert_chain_buf cert_chain_new;
     sev_cert pdh_orig;
-    sev_cert pdh_new;
 
     do {
         printf("*Starting pek_gen tests\n");
@@ -142,7 +163,7 @@ bool Tests::test_pek_gen(void)
             break;
         }
 
-        // Read in the original PEK/PDH certs
+        // Read in the original PEK/PDH certs. Copied out, as the files get rewritten
         if (sev::read_file(cert_chain_full, &cert_chain_orig, sizeof(sev_cert_chain_buf)) != sizeof(sev_cert_chain_buf))
             break;
         if (sev::read_file(pdh_cert_full, &pdh_orig, sizeof(sev_cert)) != sizeof(sev_cert))
@@ -161,17 +182,20 @@ bool Tests::test_pek_gen(void)
         }
 
         // Read in the new PEK/PDH certs
-        if (sev::read_file(cert_chain_full, &cert_chain_new, sizeof(sev_cert_chain_buf)) != sizeof(sev_cert_chain_buf))
+        sev::FileView cert_chain_view, pdh_view;
+        if (!cert_chain_view.open(cert_chain_full) || !pdh_view.open(pdh_cert_full))
             break;
-        if (sev::read_file(pdh_cert_full, &pdh_new, sizeof(sev_cert)) != sizeof(sev_cert))
+        const sev_cert_chain_buf *cert_chain_new = cert_chain_view.as<sev_cert_chain_buf>();
+        const sev_cert *pdh_new = pdh_view.as<sev_cert>();
+        if (!cert_chain_new || !pdh_new)
             break;
 
         // Make sure the original and new certs are different
-        if (memcmp(PEK_IN_CERT_CHAIN(&cert_chain_new), PEK_IN_CERT_CHAIN(&cert_chain_orig), sizeof(sev_cert)) == 0) {
+        if (memcmp(PEK_IN_CERT_CHAIN(cert_chain_new), PEK_IN_CERT_CHAIN(&cert_chain_orig), sizeof(sev_cert)) == 0) {
             printf("Error: PEK cert did not change after pek_gen\n");
             break;
         }
-        if (memcmp(&pdh_new, &pdh_orig, sizeof(sev_cert)) == 0) {
+        if (memcmp(pdh_new, &pdh_orig, sizeof(sev_cert)) == 0) {
             printf("Error: PDH cert did not change after pek_gen\n");
             break;
         }
@@ -225,9 +249,7 @@ bool Tests::test_pdh_gen(void)
     std::string cert_chain_full = m_output_folder + CERT_CHAIN_HEX_FILENAME;
     std::string pdh_cert_full = m_output_folder + PDH_FILENAME;
     sev_cert_chain_buf cert_chain_orig;
-    sev_cert_chain_buf cert_chain_new;
     sev_cert pdh_orig;
-    sev_cert pdh_new;
 
     do {
         printf("*Starting pek_gen tests\n");
@@ -238,7 +260,7 @@ bool Tests::test_pdh_gen(void)
             break;
         }
 
-        // Read in the original PEK/PDH certs
+        // Read in the original PEK/PDH certs. Copied out, as the files get rewritten
         if (sev::read_file(cert_chain_full, &cert_chain_orig, sizeof(sev_cert_chain_buf)) != sizeof(sev_cert_chain_buf))
             break;
         if (sev::read_file(pdh_cert_full, &pdh_orig, sizeof(sev_cert)) != sizeof(sev_cert))
@@ -257,17 +279,20 @@ bool Tests::test_pdh_gen(void)
         }
 
         // Read in the new PEK/PDH certs
-        if (sev::read_file(cert_chain_full, &cert_chain_new, sizeof(sev_cert_chain_buf)) != sizeof(sev_cert_chain_buf))
+        sev::FileView cert_chain_view, pdh_view;
+        if (!cert_chain_view.open(cert_chain_full) || !pdh_view.open(pdh_cert_full))
             break;
-        if (sev::read_file(pdh_cert_full, &pdh_new, sizeof(sev_cert)) != sizeof(sev_cert))
+        const sev_cert_chain_buf *cert_chain_new = cert_chain_view.as<sev_cert_chain_buf>();
+        const sev_cert *pdh_new = pdh_view.as<sev_cert>();
+        if (!cert_chain_new || !pdh_new)
             break;
 
         // Make sure the PEK certs are the same and PDH certs are different
-        if (memcmp(PEK_IN_CERT_CHAIN(&cert_chain_new), PEK_IN_CERT_CHAIN(&cert_chain_orig), sizeof(sev_cert)) != 0) {
+        if (memcmp(PEK_IN_CERT_CHAIN(cert_chain_new), PEK_IN_CERT_CHAIN(&cert_chain_orig), sizeof(sev_cert)) != 0) {
             printf("Error: PEK cert changed after pek_gen\n");
             break;
         }
-        if (memcmp(&pdh_new, &pdh_orig, sizeof(sev_cert)) == 0) {
+        if (memcmp(pdh_new, &pdh_orig, sizeof(sev_cert)) == 0) {
             printf("Error: PDH cert did not change after pek_gen\n");
             break;
         }
@@ -288,8 +313,8 @@ bool Tests::test_pdh_cert_export(void)
     Command cmd(m_output_folder, m_verbose_flag);
     std::string cert_chain_full = m_output_folder + CERT_CHAIN_HEX_FILENAME;
     std::string pdh_cert_full = m_output_folder + PDH_FILENAME;
-    sev_cert_chain_buf cert_chain;
-    sev_cert pdh;
+    sev::FileView cert_chain_view;
+    sev::FileView pdh_view;
 
     do {
         printf("*Starting pdh_cert_export tests\n");
@@ -301,16 +326,18 @@ bool Tests::test_pdh_cert_export(void)
         }
 
         // Read in the PDH and cert chain
-        if (sev::read_file(cert_chain_full, &cert_chain, sizeof(sev_cert_chain_buf)) != sizeof(sev_cert_chain_buf))
+        if (!cert_chain_view.open(cert_chain_full) || !pdh_view.open(pdh_cert_full))
             break;
-        if (sev::read_file(pdh_cert_full, &pdh, sizeof(sev_cert)) != sizeof(sev_cert))
+        const sev_cert_chain_buf *cert_chain = cert_chain_view.as<sev_cert_chain_buf>();
+        const sev_cert *pdh = pdh_view.as<sev_cert>();
+        if (!cert_chain || !pdh)
             break;
 
         // Check the usage of all certs
-        if (pdh.pub_key_usage != SEV_USAGE_PDH ||
-           ((sev_cert *)PEK_IN_CERT_CHAIN(&cert_chain))->pub_key_usage != SEV_USAGE_PEK ||
-           ((sev_cert *)OCA_IN_CERT_CHAIN(&cert_chain))->pub_key_usage != SEV_USAGE_OCA ||
-           ((sev_cert *)CEK_IN_CERT_CHAIN(&cert_chain))->pub_key_usage != SEV_USAGE_CEK) {
+        if (pdh->pub_key_usage != SEV_USAGE_PDH ||
+           ((sev_cert *)PEK_IN_CERT_CHAIN(cert_chain))->pub_key_usage != SEV_USAGE_PEK ||
+           ((sev_cert *)OCA_IN_CERT_CHAIN(cert_chain))->pub_key_usage != SEV_USAGE_OCA ||
+           ((sev_cert *)CEK_IN_CERT_CHAIN(cert_chain))->pub_key_usage != SEV_USAGE_CEK) {
             printf("Error: Certificate Usage did not match expected value\n");
             break;
         }
@@ -383,9 +410,7 @@ bool Tests::test_pek_cert_import(void)
     bool ret = false;
     Command cmd(m_output_folder, m_verbose_flag);
     sev_cert_chain_buf cert_chain_orig;
-    sev_cert_chain_buf cert_chain_new;
     sev_cert pdh_orig;
-    sev_cert pdh_new;
 
     std::string cert_chain_full = m_output_folder + CERT_CHAIN_HEX_FILENAME;
     std::string pdh_cert_full = m_output_folder + PDH_FILENAME;
@@ -409,7 +434,7 @@ bool Tests::test_pek_cert_import(void)
             break;
         }
 
-        // Read in the original PEK/PDH certs
+        // Read in the original PEK/PDH certs. Copied out, as the files get rewritten
         if (sev::read_file(cert_chain_full, &cert_chain_orig, sizeof(sev_cert_chain_buf)) != sizeof(sev_cert_chain_buf))
             break;
         if (sev::read_file(pdh_cert_full, &pdh_orig, sizeof(sev_cert)) != sizeof(sev_cert))
@@ -449,17 +474,20 @@ bool Tests::test_pek_cert_import(void)
         }
 
         // Read in the new PEK/PDH certs
-        if (sev::read_file(cert_chain_full, &cert_chain_new, sizeof(sev_cert_chain_buf)) != sizeof(sev_cert_chain_buf))
+        sev::FileView cert_chain_view, pdh_view;
+        if (!cert_chain_view.open(cert_chain_full) || !pdh_view.open(pdh_cert_full))
             break;
-        if (sev::read_file(pdh_cert_full, &pdh_new, sizeof(sev_cert)) != sizeof(sev_cert))
+        const sev_cert_chain_buf *cert_chain_new = cert_chain_view.as<sev_cert_chain_buf>();
+        const sev_cert *pdh_new = pdh_view.as<sev_cert>();
+        if (!cert_chain_new || !pdh_new)
             break;
 
         // Make sure the original and new certs are different
-        if (memcmp(PEK_IN_CERT_CHAIN(&cert_chain_new), PEK_IN_CERT_CHAIN(&cert_chain_orig), sizeof(sev_cert)) == 0) {
+        if (memcmp(PEK_IN_CERT_CHAIN(cert_chain_new), PEK_IN_CERT_CHAIN(&cert_chain_orig), sizeof(sev_cert)) == 0) {
             printf("Error: PEK cert did not change after pek_gen\n");
             break;
         }
-        if (memcmp(&pdh_new, &pdh_orig, sizeof(sev_cert)) == 0) {
+        if (memcmp(pdh_new, &pdh_orig, sizeof(sev_cert)) == 0) {
             printf("Error: PDH cert did not change after pek_gen\n");
             break;
         }
@@ -749,6 +777,1340 @@ bool Tests::test_calc_measurement(void)
     return ret;
 }
 
+/**
+ *  Known inputs (with comments and blank lines) in, expected outputs in the
+ *  same order out
+ */
+bool Tests::test_calc_measurement_batch(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string input_file = m_output_folder + "calc_measurement_batch_in.txt";
+    std::string meas_batch_full = m_output_folder + CALC_MEASUREMENT_BATCH_FILENAME;
+    std::string input = "# meas_ctx api_major api_minor build_id policy digest mnonce tik\n"
+        "04 00 12 0f 00 e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855 4fbe0bedbad6c86ae8f68971d103e554 66320db73158a35a255d051758e95ed4\n"
+        "\n"
+        "04 00 18 0f 39 e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855 00112233445566778899aabbccddeeff 0f1e2d3c4b5a69788796a5b4c3d2e1f0\n"
+        "04 00 12 0f 00 e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855 4fbe0bedbad6c86ae8f68971d103e554 66320db73158a35a255d051758e95ed4\n";
+    std::string expected_output = "6faab2daae389bcd3405a05d6cafe33c0414f7bedd0bae19ba5f38b7fd1664ea\n"
+                                  "761517ad161794e40b3a8912e212c0b1fb2ded6daa0e72da2d014d5acd412d97\n"
+                                  "6faab2daae389bcd3405a05d6cafe33c0414f7bedd0bae19ba5f38b7fd1664ea\n";
+    std::string actual_output = "";
+
+    do {
+        printf("*Starting calc_measurement_batch tests\n");
+
+        if (sev::write_file(input_file, input.data(), input.size()) != input.size())
+            break;
+
+        if (cmd.calc_measurement_batch(input_file) != STATUS_SUCCESS)
+            break;
+
+        if (!sev::read_file(meas_batch_full, actual_output))
+            break;
+
+        printf("Expected:\n%sActual:\n%s", expected_output.c_str(), actual_output.c_str());
+        if (actual_output != expected_output)
+            break;
+
+        // Enough lines that the inputs are regrown (and wiped) a few times
+        size_t start = input.find('\n') + 1;   // The first measurement line
+        std::string line = input.substr(start, input.find('\n', start) + 1 - start);
+        std::string first_meas = expected_output.substr(0, expected_output.find('\n') + 1);
+        input = expected_output = "";
+        for (size_t i = 0; i < 200; i++) {
+            input += line;
+            expected_output += first_meas;
+        }
+        if (sev::write_file(input_file, input.data(), input.size()) != input.size())
+            break;
+        if (cmd.calc_measurement_batch(input_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(meas_batch_full, actual_output) || actual_output != expected_output)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_calc_snp_measurement(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string firmware_file = m_output_folder + "calc_snp_measurement_fw.bin";
+    std::string vmsa_file = m_output_folder + "calc_snp_measurement_vmsa.bin";
+    std::string layout_file = m_output_folder + "calc_snp_measurement_layout.txt";
+    std::string meas_readable_full = m_output_folder + CALC_SNP_MEASUREMENT_READABLE_FILENAME;
+    std::string layout = "# page_type gpa length source\n"
+                         "firmware\n"
+                         "zero 0x800000 0x9000\n"
+                         "secrets 0x80d000 0x1000\n"
+                         "cpuid 0x80e000 4096\n"
+                         "vmsa 0xfffffffff000 0x1000 " + vmsa_file + "\n";
+    std::string expected_output = "1bec00811f3ca9d878f6ae210e18970371753386d73fa1ed65cdec2de68a7cf747e1e40cc1a736c2fed20a4bc17e9332";
+    std::string actual_output = "";
+    std::vector<uint8_t> firmware(256*1024);
+    std::vector<uint8_t> vmsa(PAGE_SIZE_4K, 0xaa);
+
+    do {
+        printf("*Starting calc_snp_measurement tests\n");
+
+        // 64 pages, enough to be hashed in parallel
+        for (size_t i = 0; i < firmware.size(); i++)
+            firmware[i] = (uint8_t)(i*7 + (i >> 12));
+        if (sev::write_file(firmware_file, firmware.data(), firmware.size()) != firmware.size() ||
+            sev::write_file(vmsa_file, vmsa.data(), vmsa.size()) != vmsa.size() ||
+            sev::write_file(layout_file, layout.data(), layout.size()) != layout.size())
+            break;
+
+        if (cmd.calc_snp_measurement(firmware_file, layout_file) != STATUS_SUCCESS)
+            break;
+
+        if (!sev::read_file(meas_readable_full, actual_output))
+            break;
+
+        printf("Expected: %s\nActual  : %s\n", expected_output.c_str(), actual_output.c_str());
+        if (actual_output != expected_output)
+            break;
+
+        // VMSAs built from the vCPU type: BSP + 3 identical APs. This and the
+        // EC2 digest below were checked against an implementation written
+        // from the SNP ABI and sev-snp-measure's VMSA layout, sharing no code
+        layout = "firmware\n"
+                 "vcpus 4 EPYC-Milan 0x80b004\n";
+        expected_output = "49642b1babe36d612a4155da3174ad85df9fb7f04488b145f3335c24306b04e5d91551c66cca0f30f75a2541069c2c1e";
+        if (sev::write_file(layout_file, layout.data(), layout.size()) != layout.size())
+            break;
+        if (cmd.calc_snp_measurement(firmware_file, layout_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(meas_readable_full, actual_output))
+            break;
+        printf("Expected: %s\nActual  : %s\n", expected_output.c_str(), actual_output.c_str());
+        if (actual_output != expected_output)
+            break;
+
+        // EC2 leaves the FPU state in the VMSA zero
+        layout = "firmware\n"
+                 "vcpus 4 EPYC-Milan 0x80b004 ec2\n";
+        expected_output = "f0a51bc9cbb2006eb1e43491164600d99d3e79dd8d1a958d9094c37e49b100808d69b8b6ee470da99fd857f71142106b";
+        if (sev::write_file(layout_file, layout.data(), layout.size()) != layout.size())
+            break;
+        if (cmd.calc_snp_measurement(firmware_file, layout_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(meas_readable_full, actual_output))
+            break;
+        printf("Expected: %s\nActual  : %s\n", expected_output.c_str(), actual_output.c_str());
+        if (actual_output != expected_output)
+            break;
+
+        // FAILURE test: a VMSA range longer than one page
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        layout = "vmsa 0xfffffffff000 0x2000 0\n";
+        if (sev::write_file(layout_file, layout.data(), layout.size()) != layout.size())
+            break;
+        if (cmd.calc_snp_measurement(firmware_file, layout_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_calc_snp_measurement_matrix(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string firmware_file[2] = { m_output_folder + "calc_snp_matrix_fw1.bin",
+                                     m_output_folder + "calc_snp_matrix_fw2.bin" };
+    std::string layout_file = m_output_folder + "calc_snp_matrix_layout.txt";
+    std::string check_layout_file = m_output_folder + "calc_snp_matrix_check_layout.txt";
+    std::string input_file = m_output_folder + "calc_snp_matrix_input.txt";
+    std::string index_full = m_output_folder + CALC_SNP_MEASUREMENT_MATRIX_FILENAME;
+    std::string meas_readable_full = m_output_folder + CALC_SNP_MEASUREMENT_READABLE_FILENAME;
+    std::string cache_file = m_output_folder + "calc_snp_matrix.cache";
+    std::string layout = "firmware\n";
+    std::string input = "image fw1 " + firmware_file[0] + " " + layout_file + " 0x80b004\n"
+                        "image fw2 " + firmware_file[1] + " " + layout_file + " 0x80b004\n"
+                        "vcpu_type EPYC-Milan\n"
+                        "vcpus 4 1\n"
+                        "policy 30000 30002\n"
+                        "vmm qemu\n"
+                        "vmm ec2\n";
+    // Same as calc_snp_measurement's firmware + 4 EPYC-Milan vCPUs
+    std::string expected_line = "49642b1babe36d612a4155da3174ad85df9fb7f04488b145f3335c24306b04e5d91551c66cca0f30f75a2541069c2c1e fw1 4 qemu 30000";
+    std::string index = "", actual_output = "";
+    std::vector<uint8_t> firmware(256*1024);
+    std::vector<std::string> lines;
+
+    do {
+        printf("*Starting calc_snp_measurement_matrix tests\n");
+
+        for (size_t i = 0; i < firmware.size(); i++)
+            firmware[i] = (uint8_t)(i*7 + (i >> 12));
+        if (sev::write_file(firmware_file[0], firmware.data(), firmware.size()) != firmware.size())
+            break;
+        firmware[0] ^= 1;
+        if (sev::write_file(firmware_file[1], firmware.data(), firmware.size()) != firmware.size() ||
+            sev::write_file(layout_file, layout.data(), layout.size()) != layout.size() ||
+            sev::write_file(input_file, input.data(), input.size()) != input.size())
+            break;
+
+        if (cmd.calc_snp_measurement_matrix(input_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(index_full, index))
+            break;
+
+        // Every combination, sorted, each matching its own calc_snp_measurement
+        std::istringstream index_stream(index);
+        std::string line = "";
+        while (std::getline(index_stream, line))
+            lines.push_back(line);
+        if (lines.size() != 2*2*2*2 || !std::is_sorted(lines.begin(), lines.end()) ||
+            std::find(lines.begin(), lines.end(), expected_line) == lines.end())
+            break;
+        size_t matched = 0;
+        for (size_t i = 0; i < lines.size(); i++) {
+            std::istringstream fields(lines[i]);
+            std::string meas = "", image = "", vcpus = "", vmm = "", policy = "";
+            fields >> meas >> image >> vcpus >> vmm >> policy;
+            std::string check_layout = layout + "vcpus " + vcpus + " EPYC-Milan 0x80b004 " + vmm + "\n";
+            if (sev::write_file(check_layout_file, check_layout.data(), check_layout.size()) != check_layout.size())
+                break;
+            if (cmd.calc_snp_measurement(firmware_file[image == "fw1" ? 0 : 1], check_layout_file) != STATUS_SUCCESS)
+                break;
+            if (!sev::read_file(meas_readable_full, actual_output) || actual_output != meas)
+                break;
+            matched++;
+        }
+        printf("%zu of %zu index entries match calc_snp_measurement\n", matched, lines.size());
+        if (matched != lines.size())
+            break;
+
+        // Sharing a cache with calc_snp_measurement of the same layout, the
+        // matrix still gets its own prefixes: the same index, uncached or cached
+        unlink(cache_file.c_str());
+        cmd.set_measurement_cache(cache_file);
+        std::string cached_index = "";
+        if (cmd.calc_snp_measurement(firmware_file[0], layout_file) != STATUS_SUCCESS ||
+            cmd.calc_snp_measurement(firmware_file[1], layout_file) != STATUS_SUCCESS)
+            break;
+        size_t run = 0;
+        for (; run < 2; run++) {
+            if (cmd.calc_snp_measurement_matrix(input_file) != STATUS_SUCCESS ||
+                !sev::read_file(index_full, cached_index) || cached_index != index)
+                break;
+        }
+        if (run != 2)
+            break;
+
+        // FAILURE test: the layout adds vCPUs of its own, even once
+        // calc_snp_measurement has cached its full launch digest
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        layout = "firmware\nvcpus 1 EPYC-Milan\n";
+        if (sev::write_file(layout_file, layout.data(), layout.size()) != layout.size())
+            break;
+        if (cmd.calc_snp_measurement(firmware_file[0], layout_file) != STATUS_SUCCESS ||
+            cmd.calc_snp_measurement(firmware_file[1], layout_file) != STATUS_SUCCESS)
+            break;
+        if (cmd.calc_snp_measurement_matrix(input_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_calc_launch_digest(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string ovmf_file = m_output_folder + "calc_launch_digest_ovmf.fd";
+    std::string kernel_file = m_output_folder + "calc_launch_digest_kernel";
+    std::string initrd_file = m_output_folder + "calc_launch_digest_initrd";
+    std::string input_file = m_output_folder + "calc_launch_digest_input.txt";
+    std::string ld_readable_full = m_output_folder + CALC_LAUNCH_DIGEST_READABLE_FILENAME;
+    std::string meas_readable_full = m_output_folder + CALC_MEASUREMENT_READABLE_FILENAME;
+    std::string input = "# SEV-ES guest booted with -kernel, 4 vCPUs\n"
+                        "mode=sev-es\n"
+                        "ovmf=" + ovmf_file + "\n"
+                        "kernel=" + kernel_file + "\n"
+                        "initrd=" + initrd_file + "\n"
+                        "append=console=ttyS0\n"
+                        "vcpus=4\n"
+                        "vcpu_sig=800f12\n"
+                        "api_major=0\n"
+                        "api_minor=16\n"
+                        "build_id=d\n"
+                        "policy=1\n"
+                        "mnonce=000102030405060708090a0b0c0d0e0f\n"
+                        "tik=101112131415161718191a1b1c1d1e1f\n";
+    // Checked against a standalone implementation of sev-snp-measure's sev-es mode
+    std::string expected_ld = "23a4957fdecc725945a99f1b40e9b93ce9d57e5661f8bc4af1c3759619a858cb";
+    std::string expected_meas = "3551693c4b797ff8abf79458b04c33c2b6228d021bc04c431ff5004eda1b0725";
+    std::string actual_output = "";
+    std::vector<uint8_t> ovmf(64*1024);
+    std::vector<uint8_t> kernel(10000);
+    std::vector<uint8_t> initrd(5000);
+
+    do {
+        printf("*Starting calc_launch_digest tests\n");
+
+        for (size_t i = 0; i < ovmf.size(); i++)
+            ovmf[i] = (uint8_t)(i*13 + (i >> 8));
+        for (size_t i = 0; i < kernel.size(); i++)
+            kernel[i] = (uint8_t)(i*5);
+        for (size_t i = 0; i < initrd.size(); i++)
+            initrd[i] = (uint8_t)(i*3 + 1);
+
+        // Footer table: SEV-ES reset block and hashes table entries, then the footer
+        uint8_t *entry = &ovmf[ovmf.size() - OVMF_FOOTER_OFFSET - 66];
+        uint32_t ap_eip = 0x80b004, table_gpa = 0x80c000, table_size = 0x400;
+        uint16_t entry_size = 22;
+        memcpy(entry, &ap_eip, sizeof(ap_eip));
+        memcpy(entry + 4, &entry_size, sizeof(entry_size));
+        guid_to_le(OVMF_SEV_ES_RESET_BLOCK_GUID, entry + 6);
+        entry_size = 26;
+        memcpy(entry + 22, &table_gpa, sizeof(table_gpa));
+        memcpy(entry + 26, &table_size, sizeof(table_size));
+        memcpy(entry + 30, &entry_size, sizeof(entry_size));
+        guid_to_le(OVMF_SEV_HASH_TABLE_RV_GUID, entry + 32);
+        entry_size = 66;
+        memcpy(entry + 48, &entry_size, sizeof(entry_size));
+        guid_to_le(OVMF_TABLE_FOOTER_GUID, entry + 50);
+
+        if (sev::write_file(ovmf_file, ovmf.data(), ovmf.size()) != ovmf.size() ||
+            sev::write_file(kernel_file, kernel.data(), kernel.size()) != kernel.size() ||
+            sev::write_file(initrd_file, initrd.data(), initrd.size()) != initrd.size() ||
+            sev::write_file(input_file, input.data(), input.size()) != input.size())
+            break;
+
+        if (cmd.calc_launch_digest(input_file) != STATUS_SUCCESS)
+            break;
+
+        if (!sev::read_file(ld_readable_full, actual_output))
+            break;
+        printf("Expected: %s\nActual  : %s\n", expected_ld.c_str(), actual_output.c_str());
+        if (actual_output != expected_ld)
+            break;
+
+        if (!sev::read_file(meas_readable_full, actual_output))
+            break;
+        printf("Expected: %s\nActual  : %s\n", expected_meas.c_str(), actual_output.c_str());
+        if (actual_output != expected_meas)
+            break;
+
+        // FAILURE test: a kernel with an OVMF that has no hashes table
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        memset(entry, 0, 66);
+        input = "mode=sev\novmf=" + ovmf_file + "\nkernel=" + kernel_file + "\n";
+        if (sev::write_file(ovmf_file, ovmf.data(), ovmf.size()) != ovmf.size() ||
+            sev::write_file(input_file, input.data(), input.size()) != input.size())
+            break;
+        if (cmd.calc_launch_digest(input_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_generate_id_block(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string id_key_file = m_output_folder + "id_key.pem";
+    std::string author_key_file = m_output_folder + "author_key.pem";
+    std::string input_file = m_output_folder + "id_block_batch_input.txt";
+    std::string batch_full = m_output_folder + SNP_ID_BLOCK_BATCH_FILENAME;
+    std::string ld = "1bec00811f3ca9d878f6ae210e18970371753386d73fa1ed65cdec2de68a7cf747e1e40cc1a736c2fed20a4bc17e9332";
+    std::string ids = " 000102030405060708090a0b0c0d0e0f f0e0d0c0b0a090807060504030201000 ";
+    std::string id_block_args = ld + ids + "1 30000";
+    std::string input = "# [ld] [family_id] [image_id] [guest_svn] [policy]\n" +
+                        id_block_args + "\n" +
+                        ld + ids + "2 30000\n" +
+                        ld + ids + "2 b0000\n";
+    EVP_PKEY *id_key = NULL;
+    EVP_PKEY *author_key = NULL;
+    snp_launch_finish_id_block id_block;
+    snp_launch_finish_id_auth_page id_auth;
+    sev_sig sig;
+    std::string batch_output = "";
+
+    do {
+        printf("*Starting generate_id_block tests\n");
+
+        if (!generate_ecdh_key_pair(&id_key) || !generate_ecdh_key_pair(&author_key))
+            break;
+        if (!write_priv_key_pem(id_key_file, id_key) ||
+            !write_priv_key_pem(author_key_file, author_key))
+            break;
+
+        if (cmd.generate_id_block(id_block_args, id_key_file, author_key_file) != STATUS_SUCCESS)
+            break;
+        if (sev::read_file(m_output_folder + SNP_ID_BLOCK_FILENAME, &id_block, sizeof(id_block)) != sizeof(id_block) ||
+            sev::read_file(m_output_folder + SNP_ID_AUTH_FILENAME, &id_auth, sizeof(id_auth)) != sizeof(id_auth))
+            break;
+
+        if (id_block.version != 1 || id_block.guest_svn != 1 || id_block.policy != 0x30000 ||
+            id_block.family_id[1] != 0x01 || id_block.image_id[0] != 0xf0)
+            break;
+        if (id_auth.id_key_algo != SNP_ID_KEY_ALGO_ECDSA_P384_SHA384 ||
+            id_auth.auth_key_algo != SNP_ID_KEY_ALGO_ECDSA_P384_SHA384)
+            break;
+
+        // The ID key signs the ID block and the author key signs the ID key
+        memcpy(&sig, id_auth.id_block_sig, sizeof(sig));
+        if (!verify_message(&sig, &id_key, (uint8_t *)&id_block, sizeof(id_block), SEV_SIG_ALGO_ECDSA_SHA384))
+            break;
+        memcpy(&sig, id_auth.id_key_sig, sizeof(sig));
+        if (!verify_message(&sig, &author_key, id_auth.id_key, sizeof(id_auth.id_key), SEV_SIG_ALGO_ECDSA_SHA384))
+            break;
+
+        // Batch: one line per ID block, the first the same block as above
+        if (sev::write_file(input_file, input.data(), input.size()) != input.size())
+            break;
+        if (cmd.generate_id_block_batch(input_file, id_key_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(batch_full, batch_output))
+            break;
+        if (std::count(batch_output.begin(), batch_output.end(), '\n') != 3)
+            break;
+        if (batch_output.compare(0, 129, sev::base64_encode(&id_block, sizeof(id_block)) + " ") != 0)
+            break;
+
+        // FAILURE test: an ID key that isn't P-384
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        EVP_PKEY_free(id_key);
+        id_key = NULL;
+        if (!generate_ecdh_key_pair(&id_key, SEV_EC_P256) || !write_priv_key_pem(id_key_file, id_key))
+            break;
+        if (cmd.generate_id_block(id_block_args, id_key_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    EVP_PKEY_free(id_key);
+    EVP_PKEY_free(author_key);
+
+    return ret;
+}
+
+bool Tests::test_measurement_cache(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    Command uncached_cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string cache_file = m_output_folder + "measurement_test.cache";
+    std::string ovmf_file = m_output_folder + "measurement_cache_ovmf.fd";
+    std::string input_file = m_output_folder + "measurement_cache_input.txt";
+    std::string ld_readable_full = m_output_folder + CALC_LAUNCH_DIGEST_READABLE_FILENAME;
+    std::string input = "mode=sev\n"
+                        "ovmf=" + ovmf_file + "\n";
+    std::string first_output = "", actual_output = "", expected_output = "";
+    std::vector<uint8_t> ovmf(64*1024);
+    uint8_t expected[SHA256_DIGEST_LENGTH], digest[SHA256_DIGEST_LENGTH];
+    uint8_t key[MEASUREMENT_CACHE_KEY_SIZE];
+    sev_launch_digest_input_t ld_input;
+
+    do {
+        printf("*Starting measurement cache tests\n");
+
+        for (size_t i = 0; i < ovmf.size(); i++)
+            ovmf[i] = (uint8_t)(i*7 + (i >> 8));
+        remove(cache_file.c_str());     // Start from an empty cache
+        if (sev::write_file(ovmf_file, ovmf.data(), ovmf.size()) != ovmf.size() ||
+            sev::write_file(input_file, input.data(), input.size()) != input.size())
+            break;
+
+        // File digests are the SHA-256 of the contents, and entries survive a reopen
+        {
+            MeasurementCache cache;
+            if (!cache.open(cache_file))
+                break;
+            SHA256(ovmf.data(), ovmf.size(), expected);
+            if (!cache.file_digest(ovmf_file, digest) || memcmp(digest, expected, sizeof(digest)) != 0)
+                break;
+            MeasurementCacheKey key_builder("test");
+            key_builder.add(std::string("value"));
+            if (!key_builder.final(key) || !cache.store(key, expected, sizeof(expected)))
+                break;
+        }
+        {
+            MeasurementCache cache;
+            if (!cache.open(cache_file) || !cache.lookup(key, digest, sizeof(digest)) ||
+                memcmp(digest, expected, sizeof(digest)) != 0 || cache.hits() != 1)
+                break;
+        }
+
+        // The second calc_launch_digest is served from the cache, with the same result
+        cmd.set_measurement_cache(cache_file);
+        if (cmd.calc_launch_digest(input_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(ld_readable_full, first_output))
+            break;
+        ld_input.mode = SEV_LAUNCH_MODE_SEV;
+        ld_input.ovmf_file = ovmf_file;
+        ld_input.vcpus = 1;
+        ld_input.vcpu_sig = 0;
+        ld_input.vmm_type = VMM_TYPE_QEMU;
+        {
+            MeasurementCache cache;
+            if (!cache.open(cache_file) || !sev_launch_digest_cache_key(cache, ld_input, key) ||
+                !cache.lookup(key, digest, sizeof(digest)))
+                break;
+        }
+        if (cmd.calc_launch_digest(input_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(ld_readable_full, actual_output))
+            break;
+        printf("Expected: %s\nActual  : %s\n", first_output.c_str(), actual_output.c_str());
+        if (actual_output != first_output)
+            break;
+
+        // A changed image (same size) is hashed again, never served stale
+        ovmf[0] ^= 0xff;
+        if (sev::write_file(ovmf_file, ovmf.data(), ovmf.size()) != ovmf.size())
+            break;
+        if (uncached_cmd.calc_launch_digest(input_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(ld_readable_full, expected_output))
+            break;
+        if (cmd.calc_launch_digest(input_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(ld_readable_full, actual_output))
+            break;
+        printf("Expected: %s\nActual  : %s\n", expected_output.c_str(), actual_output.c_str());
+        if (actual_output != expected_output || actual_output == first_output)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+// Captures the host's CPUID on cpu and builds the default policy's page from it
+static bool default_cpuid_page_on_cpu(int cpu, std::vector<uint8_t> &page)
+{
+    cpu_set_t cpus;
+    cpuid_policy_t policy;
+    CPUIDSnapshot snapshot;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        return false;
+    snapshot.capture();
+
+    default_cpuid_policy(&policy);
+    page.assign(PAGE_SIZE_4K, 0);
+    return snapshot.build_page(policy, (snp_launch_update_cpuid_page *)page.data()) == STATUS_SUCCESS;
+}
+
+bool Tests::test_build_cpuid_page(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string page_full = m_output_folder + SNP_CPUID_PAGE_FILENAME;
+    std::string cache_full = m_output_folder + CPUID_SNAPSHOT_CACHE_FILENAME;
+    std::string policy_file = m_output_folder + "cpuid_policy.txt";
+    std::string policy = "# Vendor string only, and XSAVE sizes for x87+SSE\n"
+                         "leaf 0x0 0 0 0xffffffff 0xffffffff 0xffffffff\n"
+                         "leaf 0xd *\n"
+                         "xcr0 0x3\n";
+    std::vector<uint8_t> page(PAGE_SIZE_4K);
+    std::vector<uint8_t> cached_page(PAGE_SIZE_4K);
+    snp_launch_update_cpuid_page *cpuid_page = (snp_launch_update_cpuid_page *)page.data();
+    CPUIDSnapshot snapshot;
+
+    do {
+        printf("*Starting build_cpuid_page tests\n");
+
+        // The first run captures the host and caches it, the second reuses it
+        if (cmd.build_cpuid_page("default") != STATUS_SUCCESS)
+            break;
+        if (sev::read_file(page_full, page.data(), page.size()) != page.size())
+            break;
+        if (!snapshot.load_cache(cache_full))
+            break;
+        if (cmd.build_cpuid_page("default") != STATUS_SUCCESS)
+            break;
+        if (sev::read_file(page_full, cached_page.data(), cached_page.size()) != cached_page.size())
+            break;
+        if (page != cached_page)
+            break;
+
+        // The default policy masks the APIC IDs, so a capture on another CPU
+        // gives the same page. With one CPU, it's captured twice
+        cpu_set_t allowed;
+        int cpus[2] = { -1, -1 };
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            break;
+        for (int cpu = 0, found = 0; cpu < CPU_SETSIZE && found < 2; cpu++) {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus[found++] = cpu;
+        }
+        if (cpus[1] < 0)
+            cpus[1] = cpus[0];
+        printf("Comparing CPUID captures on CPUs %d and %d\n", cpus[0], cpus[1]);
+        bool same_page = default_cpuid_page_on_cpu(cpus[0], page) &&
+                         default_cpuid_page_on_cpu(cpus[1], cached_page) &&
+                         page == cached_page;
+        sched_setaffinity(0, sizeof(allowed), &allowed);
+        if (!same_page)
+            break;
+        cpuid_policy_t default_policy;
+        bool ids_masked = true;
+        default_cpuid_policy(&default_policy);
+        for (size_t i = 0; i < default_policy.entries.size(); i++) {
+            const cpuid_policy_entry_t &entry = default_policy.entries[i];
+            if ((entry.leaf == 0x1 && (entry.mask[1] >> 24) != 0) || (entry.leaf == 0xB && entry.mask[3] != 0))
+                ids_masked = false;
+        }
+        for (uint32_t i = 0; i < cpuid_page->count; i++) {
+            const snp_cpuid_function_t &func = cpuid_page->cpuid_function[i];
+            if ((func.eax_in == 0x1 && (func.ebx >> 24) != 0) || (func.eax_in == 0xB && func.edx != 0))
+                ids_masked = false;
+        }
+        if (!ids_masked)
+            break;
+
+        if (cpuid_page->count == 0 || cpuid_page->count > SNP_CPUID_COUNT_MAX)
+            break;
+        bool sorted = true;
+        for (uint32_t i = 1; i < cpuid_page->count; i++) {
+            const snp_cpuid_function_t &prev = cpuid_page->cpuid_function[i-1];
+            const snp_cpuid_function_t &cur = cpuid_page->cpuid_function[i];
+            if (prev.eax_in > cur.eax_in || (prev.eax_in == cur.eax_in && prev.ecx_in > cur.ecx_in))
+                sorted = false;
+        }
+        if (!sorted)
+            break;
+
+        // Masked leaf 0, and leaf 0xD sized for the policy's XCR0
+        if (sev::write_file(policy_file, policy.data(), policy.size()) != policy.size())
+            break;
+        if (cmd.build_cpuid_page(policy_file) != STATUS_SUCCESS)
+            break;
+        if (sev::read_file(page_full, page.data(), page.size()) != page.size())
+            break;
+        const snp_cpuid_function_t &leaf0 = cpuid_page->cpuid_function[0];
+        if (leaf0.eax_in != 0 || leaf0.eax != 0 || leaf0.ebx != sev::cpuid_ebx(0))
+            break;
+        bool found_xsave = false;
+        for (uint32_t i = 0; i < cpuid_page->count; i++) {
+            const snp_cpuid_function_t &func = cpuid_page->cpuid_function[i];
+            if (func.eax_in == 0xD && func.ecx_in == 0) {
+                found_xsave = (func.xcr0_in == 0x3 && func.ebx == CPUID_XSAVE_LEGACY_SIZE);
+                break;
+            }
+        }
+        if (!found_xsave)
+            break;
+
+        // FAILURE test: a cache from another host isn't used
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        std::string stale = "";
+        if (!sev::read_file(cache_full, stale))
+            break;
+        stale[strlen(CPUID_SNAPSHOT_CACHE_MAGIC) + 8] ^= 1;    // Changes the host id
+        if (sev::write_file(cache_full, stale.data(), stale.size()) != stale.size())
+            break;
+        if (snapshot.load_cache(cache_full))
+            break;
+        policy = "leaf 0x0 0\nbogus\n";
+        if (sev::write_file(policy_file, policy.data(), policy.size()) != policy.size())
+            break;
+        if (cmd.build_cpuid_page(policy_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_analyze_rmp(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string dump_file = m_output_folder + "rmp_dump.bin";
+    std::string analysis_full = m_output_folder + RMP_ANALYSIS_FILENAME;
+    std::vector<uint8_t> dump(RMP_ASID_COUNTERS_SIZE + 4096*RMP_ENTRY_SIZE, 0);
+    rmp_asid_counters_t *counters = (rmp_asid_counters_t *)dump.data();
+    rmp_entry_t *entries = (rmp_entry_t *)(dump.data() + RMP_ASID_COUNTERS_SIZE);
+    std::string analysis = "";
+    const char *expected_lines[] = {
+        "assigned 523 validated 522 immutable 1\n",
+        "pages_2m 1 pages_4k 11\n",
+        "asid 1 512 512 1 0 0\n",
+        "asid 2 10 10 0 10 1\n",
+        "vmsa 0x7d5000 asid 2\n",
+        "inconsistencies 0\n",
+    };
+
+    do {
+        printf("*Starting analyze_rmp tests\n");
+
+        // ASID 1: one 2M page. ASID 2: ten 4K pages, one a VMSA. One firmware page
+        for (size_t i = 512; i < 1024; i++) {
+            entries[i].f.assigned = 1;
+            entries[i].f.page_size = 1;
+            entries[i].f.validated = 1;
+            entries[i].f.asid = 1;
+            entries[i].f.gpa = (uint32_t)(0x200 + (i - 512));
+        }
+        for (size_t i = 2000; i < 2010; i++) {
+            entries[i].f.assigned = 1;
+            entries[i].f.validated = 1;
+            entries[i].f.asid = 2;
+            entries[i].f.gpa = (uint32_t)i;
+        }
+        entries[2005].f.vmsa = 1;
+        entries[3000].f.assigned = 1;
+        entries[3000].f.immutable = 1;
+        counters->counters[1] = 512;
+        counters->counters[2] = 10;
+        if (sev::write_file(dump_file, dump.data(), dump.size()) != dump.size())
+            break;
+
+        if (cmd.analyze_rmp(dump_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(analysis_full, analysis))
+            break;
+        size_t found = 0;
+        for (size_t i = 0; i < sizeof(expected_lines)/sizeof(expected_lines[0]); i++)
+            found += (analysis.find(expected_lines[i]) != std::string::npos);
+        if (found != sizeof(expected_lines)/sizeof(expected_lines[0]))
+            break;
+
+        // The same, whichever way the entries are split across threads
+        RMPDump rmp_dump;
+        rmp_analysis_t one, many;
+        if (!rmp_dump.open(dump_file) ||
+            rmp_analyze(rmp_dump, one, 1) != STATUS_SUCCESS ||
+            rmp_analyze(rmp_dump, many, 3) != STATUS_SUCCESS)
+            break;
+        if (one.assigned != many.assigned || one.pages_2m != many.pages_2m ||
+            one.vmsas != many.vmsas || one.asids[2].validated != many.asids[2].validated)
+            break;
+
+        // A validated page that isn't assigned, and a wrong ASID counter
+        entries[100].f.validated = 1;
+        counters->counters[2] = 9;
+        if (sev::write_file(dump_file, dump.data(), dump.size()) != dump.size())
+            break;
+        if (cmd.analyze_rmp(dump_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(analysis_full, analysis) ||
+            analysis.find("inconsistencies 2\n") == std::string::npos)
+            break;
+
+        // FAILURE test: not a whole number of entries
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (sev::write_file(dump_file, dump.data(), dump.size() - 1) != dump.size() - 1)
+            break;
+        if (cmd.analyze_rmp(dump_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_diff_rmp(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string before_file = m_output_folder + "rmp_dump_before.bin";
+    std::string after_file = m_output_folder + "rmp_dump_after.bin";
+    std::string diff_full = m_output_folder + RMP_DIFF_FILENAME;
+    size_t num_entries = 4*RMP_DIFF_CHUNK_ENTRIES;
+    std::vector<uint8_t> before(RMP_ASID_COUNTERS_SIZE + num_entries*RMP_ENTRY_SIZE, 0);
+    rmp_entry_t *old_entries = (rmp_entry_t *)(before.data() + RMP_ASID_COUNTERS_SIZE);
+    std::string diff = "";
+    const char *expected_lines[] = {
+        "entries 32768 changed 4 identical_chunks 1 of 4\n",
+        "asid 3 1 0 1 1 0\n",
+        "asid 4 0 0 0 0 1\n",
+        "counter 3 0 1\n",
+        "0xa000 assigned 0x0 0x1\n",
+        "0xa000 asid 0x0 0x3\n",
+        "0xa000 validated 0x0 0x1\n",
+        "0x2328000 page_size 0x0 0x1\n",
+        "0x4e20000 validated 0x1 0x0\n",
+        "0x4e21000 other 0x0 0x8000000000000000\n",
+    };
+
+    do {
+        printf("*Starting diff_rmp tests\n");
+
+        old_entries[9000].f.assigned = 1;
+        old_entries[9000].f.asid = 4;
+        old_entries[20000].f.assigned = 1;
+        old_entries[20000].f.validated = 1;
+        old_entries[20000].f.asid = 3;
+        std::vector<uint8_t> after = before;
+        rmp_asid_counters_t *new_counters = (rmp_asid_counters_t *)after.data();
+        rmp_entry_t *new_entries = (rmp_entry_t *)(after.data() + RMP_ASID_COUNTERS_SIZE);
+
+        // A page assigned to ASID 3 and validated, a page smashed to 2M, a
+        // page invalidated and one locked. Nothing changes in the last chunk
+        new_entries[10].f.assigned = 1;
+        new_entries[10].f.asid = 3;
+        new_entries[10].f.validated = 1;
+        new_entries[9000].f.page_size = 1;
+        new_entries[20000].f.validated = 0;
+        new_entries[20001].f.lock = 1;
+        new_counters->counters[3] = 1;
+        if (sev::write_file(before_file, before.data(), before.size()) != before.size() ||
+            sev::write_file(after_file, after.data(), after.size()) != after.size())
+            break;
+
+        if (cmd.diff_rmp(before_file, after_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(diff_full, diff))
+            break;
+        size_t found = 0;
+        for (size_t i = 0; i < sizeof(expected_lines)/sizeof(expected_lines[0]); i++)
+            found += (diff.find(expected_lines[i]) != std::string::npos);
+        if (found != sizeof(expected_lines)/sizeof(expected_lines[0]))
+            break;
+
+        // A dump against itself
+        if (cmd.diff_rmp(after_file, after_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(diff_full, diff) ||
+            diff.find("entries 32768 changed 0 identical_chunks 4 of 4\n") == std::string::npos)
+            break;
+
+        // FAILURE test: dumps of different hosts
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        after.resize(after.size() - RMP_ENTRY_SIZE);
+        if (sev::write_file(after_file, after.data(), after.size()) != after.size())
+            break;
+        if (cmd.diff_rmp(before_file, after_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_rmp_model(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string dump_file = m_output_folder + "rmp_model_dump.bin";
+    const uint32_t asid = 5;
+    const uint64_t spa_2m = PAGE_SIZE_2M;
+    RMPModel rmp(4*RMP_ENTRIES_PER_2M);
+    snp_page_reclaim_cmd_buf reclaim;
+    snp_page_unsmash_cmd_buf unsmash;
+    memset(&reclaim, 0, sizeof(reclaim));
+    memset(&unsmash, 0, sizeof(unsmash));
+
+    do {
+        printf("*Starting rmp_model tests\n");
+
+        // 4K guest page: assign, validate, make it a VMSA
+        if (rmp.rmpupdate(0, false, true, asid, 0x10000) != STATUS_SUCCESS ||
+            rmp.page_state(0) != SNP_PAGE_STATE_GUEST_INVALID)
+            break;
+        if (rmp.pvalidate(asid + 1, 0, false, true) != ERROR_INVALID_PAGE_OWNER ||
+            rmp.pvalidate(asid, 0, false, true) != STATUS_SUCCESS ||
+            rmp.pvalidate(asid, 0, false, true) != ERROR_INVALID_PAGE_STATE ||
+            rmp.page_state(0) != SNP_PAGE_STATE_GUEST_VALID)
+            break;
+        if (rmp.rmpadjust(asid, 0, 4, 0) != ERROR_INVALID_PARAM ||
+            rmp.rmpadjust(asid, 0, 1, (uint8_t)MAX_VMPL_PERM, true) != STATUS_SUCCESS ||
+            !rmp.lookup(0).rmp.f.vmsa || rmp.lookup(0).vmpl.f.vmpl1.val != MAX_VMPL_PERM)
+            break;
+
+        // Firmware page, reclaimed and given back to the hypervisor
+        reclaim.page_addr_size = 2*PAGE_SIZE_4K;
+        if (rmp.firmware_transition(2*PAGE_SIZE_4K, SNP_PAGE_STATE_FIRMWARE) != STATUS_SUCCESS ||
+            rmp.page_state(2*PAGE_SIZE_4K) != SNP_PAGE_STATE_FIRMWARE ||
+            rmp.page_reclaim(reclaim) != STATUS_SUCCESS ||
+            rmp.page_state(2*PAGE_SIZE_4K) != SNP_PAGE_STATE_RECLAIM ||
+            rmp.rmpupdate(2*PAGE_SIZE_4K, false, false) != STATUS_SUCCESS ||
+            rmp.page_state(2*PAGE_SIZE_4K) != SNP_PAGE_STATE_HYPERVISOR)
+            break;
+
+        // Launch-updated page is immutable
+        if (rmp.rmpupdate(3*PAGE_SIZE_4K, false, true, asid, 0x11000) != STATUS_SUCCESS ||
+            rmp.firmware_transition(3*PAGE_SIZE_4K, SNP_PAGE_STATE_PRE_GUEST, asid) != STATUS_SUCCESS ||
+            rmp.page_state(3*PAGE_SIZE_4K) != SNP_PAGE_STATE_PRE_GUEST ||
+            rmp.rmpupdate(3*PAGE_SIZE_4K, false, false) != ERROR_INVALID_PAGE_STATE)
+            break;
+
+        // 2M page: 4K ops inside it fail until it's smashed
+        if (rmp.rmpupdate(0, true, true, asid, 0) != ERROR_INVALID_PAGE_SIZE ||
+            rmp.rmpupdate(spa_2m + PAGE_SIZE_4K, true, true, asid, 0) != ERROR_INVALID_ADDRESS ||
+            rmp.rmpupdate(spa_2m, true, true, asid, PAGE_SIZE_2M) != STATUS_SUCCESS ||
+            rmp.page_state(spa_2m + 3*PAGE_SIZE_4K) != SNP_PAGE_STATE_GUEST_INVALID ||
+            rmp.pvalidate(asid, spa_2m + 3*PAGE_SIZE_4K, false, true) != ERROR_INVALID_PAGE_SIZE ||
+            rmp.rmpupdate(spa_2m + 3*PAGE_SIZE_4K, false, false) != ERROR_INVALID_PAGE_SIZE ||
+            rmp.pvalidate(asid, spa_2m, true, true) != STATUS_SUCCESS)
+            break;
+        if (rmp.psmash(spa_2m) != STATUS_SUCCESS ||
+            rmp.page_state(spa_2m + 5*PAGE_SIZE_4K) != SNP_PAGE_STATE_GUEST_VALID ||
+            rmp.lookup(spa_2m + 5*PAGE_SIZE_4K).rmp.f.gpa != (PAGE_SIZE_2M/PAGE_SIZE_4K) + 5 ||
+            rmp.lookup(spa_2m + 5*PAGE_SIZE_4K).rmp.f.page_size)
+            break;
+
+        // Unsmash only once all 512 pages match again
+        unsmash.page_p_addr = spa_2m;
+        if (rmp.pvalidate(asid, spa_2m + 7*PAGE_SIZE_4K, false, false) != STATUS_SUCCESS ||
+            rmp.page_unsmash(unsmash) != ERROR_INVALID_PAGE_STATE ||
+            rmp.pvalidate(asid, spa_2m + 7*PAGE_SIZE_4K, false, true) != STATUS_SUCCESS ||
+            rmp.page_unsmash(unsmash) != STATUS_SUCCESS ||
+            !rmp.lookup(spa_2m + 7*PAGE_SIZE_4K).rmp.f.page_size ||
+            rmp.asid_counter(asid) != RMP_ENTRIES_PER_2M + 2 ||
+            rmp.asid_counter(RMP_NUM_ASID_COUNTERS) != 0 || rmp.asid_counter(UINT32_MAX) != 0)
+            break;
+
+        // The model's dump must pass analyze_rmp's consistency checks
+        if (!rmp.save_dump(dump_file))
+            break;
+        RMPDump dump;
+        rmp_analysis_t analysis;
+        if (!dump.open(dump_file) || rmp_analyze(dump, analysis) != STATUS_SUCCESS)
+            break;
+        if (analysis.num_errors != 0 || analysis.asids[asid].assigned != RMP_ENTRIES_PER_2M + 2 ||
+            analysis.pages_2m != 1 || analysis.vmsas.size() != 1)
+            break;
+
+        std::vector<double> measurements;
+        if (cmd.rmp_model_benchmark(4*RMP_ENTRIES_PER_2M, measurements) != STATUS_SUCCESS ||
+            measurements.size() != 1)
+            break;
+
+        // FAILURE test: not a whole number of 2M regions
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (cmd.rmp_model_benchmark(1000, measurements) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_verify_swap(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::string image_file = m_output_folder + "swap_image.bin";
+    std::string metadata_file = m_output_folder + "swap_metadata.bin";
+    std::string verify_full = m_output_folder + SWAP_VERIFY_FILENAME;
+    std::vector<uint8_t> metadata(2*PAGE_SIZE_4K, 0);
+    snp_metadata_page_t *entries = (snp_metadata_page_t *)metadata.data();
+    std::vector<uint8_t> image(4*PAGE_SIZE_4K + PAGE_SIZE_2M, 0xA5);
+    std::string verify = "";
+    const char *expected_lines[] = {
+        "error entry 0x2: swapped-out page was never written (all zeros)\n",
+        "error entry 0x4: GPA 0x201000 is also swapped out by entry 0x1\n",
+        "error entry 0x4: IV 0x1 is also used by entry 0x0\n",
+        "error entry 0x64: unused entry isn't zeroed\n",
+        "problems 4\n",
+    };
+
+    do {
+        printf("*Starting verify_swap tests\n");
+
+        // A 4K page, a 2M page, a VMSA, a metadata page and another 4K page
+        const uint32_t gpas[] = { 0x10, 0x200, 0x11, 0, 0x12 };
+        for (size_t i = 0; i < 5; i++) {
+            entries[i].iv = i + 1;
+            entries[i].mdata_entry.f.valid = 1;
+            entries[i].mdata_entry.f.page_validated = (i != 3);
+            entries[i].mdata_entry.f.gpa = gpas[i];
+        }
+        entries[1].mdata_entry.f.page_size = 1;
+        entries[2].mdata_entry.f.vmsa = 1;
+        entries[3].mdata_entry.f.metadata = 1;
+        if (sev::write_file(image_file, image.data(), image.size()) != image.size() ||
+            sev::write_file(metadata_file, metadata.data(), metadata.size()) != metadata.size())
+            break;
+
+        if (cmd.verify_swap(image_file, metadata_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(verify_full, verify) ||
+            verify.find("entries 128 image_bytes 2113536\n") == std::string::npos ||
+            verify.find("pages_4k 4 pages_2m 1 vmsas 1 metadata_pages 1 validated 4\n") == std::string::npos ||
+            verify.find("problems 0\n") == std::string::npos)
+            break;
+
+        // A page overlapping the 2M page with a reused IV, a stray unused
+        // entry, and the VMSA never written
+        entries[4].mdata_entry.f.gpa = 0x201;
+        entries[4].iv = 1;
+        entries[100].software_data = 1;
+        memset(&image[PAGE_SIZE_4K + PAGE_SIZE_2M], 0, PAGE_SIZE_4K);
+        if (sev::write_file(image_file, image.data(), image.size()) != image.size() ||
+            sev::write_file(metadata_file, metadata.data(), metadata.size()) != metadata.size())
+            break;
+        if (cmd.verify_swap(image_file, metadata_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(verify_full, verify))
+            break;
+        size_t found = 0;
+        for (size_t i = 0; i < sizeof(expected_lines)/sizeof(expected_lines[0]); i++)
+            found += (verify.find(expected_lines[i]) != std::string::npos);
+        if (found != sizeof(expected_lines)/sizeof(expected_lines[0]))
+            break;
+
+        // An image missing its last page
+        if (sev::write_file(image_file, image.data(), image.size() - PAGE_SIZE_4K) != image.size() - PAGE_SIZE_4K)
+            break;
+        if (cmd.verify_swap(image_file, metadata_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(verify_full, verify) ||
+            verify.find("error image is 2109440 bytes, but the metadata describes 2113536\n") == std::string::npos)
+            break;
+
+        // FAILURE test: metadata that isn't whole 4K pages
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (sev::write_file(metadata_file, metadata.data(), metadata.size() - 64) != metadata.size() - 64)
+            break;
+        if (cmd.verify_swap(image_file, metadata_file) == STATUS_SUCCESS)
+            break;
+
+        // An empty image is just nothing swapped out, which the metadata disagrees with
+        if (sev::write_file(metadata_file, metadata.data(), metadata.size()) != metadata.size() ||
+            sev::write_file(image_file, image.data(), 0) != 0)
+            break;
+        if (cmd.verify_swap(image_file, metadata_file) != STATUS_SUCCESS)
+            break;
+        if (!sev::read_file(verify_full, verify) ||
+            verify.find("error image is 0 bytes, but the metadata describes 2113536\n") == std::string::npos)
+            break;
+
+        // FAILURE test: empty metadata
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (sev::write_file(metadata_file, metadata.data(), 0) != 0)
+            break;
+        if (cmd.verify_swap(image_file, metadata_file) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+// Whether file_name is mapped into this process, from /proc/self/maps
+static bool file_is_mapped(const std::string file_name)
+{
+    char path[PATH_MAX];
+    std::string maps = "";
+    if (!realpath(file_name.c_str(), path) || !sev::read_file("/proc/self/maps", maps))
+        return false;
+    return maps.find(std::string(" ") + path + "\n") != std::string::npos;
+}
+
+bool Tests::test_file_view(void)
+{
+    bool ret = false;
+    std::string file_name = m_output_folder + "file_view_test.bin";
+    std::vector<uint8_t> data(FILE_VIEW_MAP_MIN, 0);
+    sev::FileView view;
+
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t)(i * 7);
+
+    do {
+        printf("*Starting file_view tests\n");
+
+        // An empty file is a valid, empty view with nothing to read as a T
+        if (sev::write_file(file_name, data.data(), 0) != 0)
+            break;
+        if (!view.open(file_name) || !view.is_open() || view.size() != 0 ||
+            view.as<uint8_t>() != NULL)
+            break;
+
+        // A file shorter than a T
+        if (sev::write_file(file_name, data.data(), sizeof(uint32_t) - 1) != sizeof(uint32_t) - 1)
+            break;
+        if (!view.open(file_name) || view.size() != sizeof(uint32_t) - 1 ||
+            view.as<uint32_t>() != NULL || !view.as<uint16_t>() ||
+            memcmp(view.data(), data.data(), view.size()) != 0)
+            break;
+
+        // Just under FILE_VIEW_MAP_MIN is read into the view's own buffer,
+        // FILE_VIEW_MAP_MIN and up is mapped
+        const size_t sizes[] = { FILE_VIEW_MAP_MIN - 1, FILE_VIEW_MAP_MIN };
+        size_t i = 0;
+        for (; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+            if (sev::write_file(file_name, data.data(), sizes[i]) != sizes[i])
+                break;
+            if (!view.open(file_name) || view.size() != sizes[i] ||
+                memcmp(view.data(), data.data(), sizes[i]) != 0 ||
+                !view.as<sev_cert>() || view.as<sev_cert>()->version != *(const uint32_t *)data.data())
+                break;
+            if (file_is_mapped(file_name) != (sizes[i] >= FILE_VIEW_MAP_MIN))
+                break;
+            view.close();
+            if (view.is_open() || view.as<uint8_t>() != NULL || file_is_mapped(file_name))
+                break;
+        }
+        if (i != sizeof(sizes)/sizeof(sizes[0]))
+            break;
+
+        // FAILURE test: a file that doesn't exist
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (view.open(m_output_folder + "no_such_file.bin") || view.is_open())
+            break;
+
+        ret = true;
+    } while (0);
+
+    view.close();
+    unlink(file_name.c_str());
+    return ret;
+}
+
+// Little-endian fields of a zip archive read back into memory
+static uint16_t zip_u16(const std::string &zip, size_t offset)
+{
+    return (uint16_t)((uint8_t)zip[offset] | (uint8_t)zip[offset+1] << 8);
+}
+
+static uint32_t zip_u32(const std::string &zip, size_t offset)
+{
+    return (uint32_t)zip_u16(zip, offset) | (uint32_t)zip_u16(zip, offset + 2) << 16;
+}
+
+bool Tests::test_zip_writer(void)
+{
+    bool ret = false;
+    std::string zip_file = m_output_folder + "zip_writer_test.zip";
+    std::string zip = "";
+    const std::string names[] = { "a.txt", "dir/b.bin" };
+    std::string contents[] = { "hello, world\n", std::string(3000, '\0') };
+    const size_t num_entries = sizeof(names)/sizeof(names[0]);
+    const size_t end_record_size = 22;
+
+    for (size_t i = 0; i < contents[1].size(); i++)
+        contents[1][i] = (char)(i * 11);
+
+    do {
+        printf("*Starting zip_writer tests\n");
+
+        // The standard CRC-32 check value
+        if (sev::crc32("123456789", 9) != 0xcbf43926)
+            break;
+
+        {
+            ZipWriter writer;
+            size_t i = 0;
+            if (!writer.open(zip_file))
+                break;
+            for (; i < num_entries; i++) {
+                if (!writer.add_entry(names[i], contents[i].data(), contents[i].size()))
+                    break;
+            }
+            if (i != num_entries || !writer.close())
+                break;
+        }
+        if (!sev::read_file(zip_file, zip) || zip.size() < end_record_size)
+            break;
+
+        // The end record locates a central directory that ends right before it
+        size_t end_record = zip.size() - end_record_size;
+        uint32_t dir_size = zip_u32(zip, end_record + 12);
+        uint32_t dir_offset = zip_u32(zip, end_record + 16);
+        if (zip_u32(zip, end_record) != 0x06054b50 ||
+            zip_u16(zip, end_record + 8) != num_entries || zip_u16(zip, end_record + 10) != num_entries ||
+            (size_t)dir_offset + dir_size != end_record)
+            break;
+
+        // Each central directory entry: the right name, CRC and sizes, and
+        // the offset of a local header matching it, followed by the data
+        size_t dir = dir_offset;
+        size_t i = 0;
+        for (; i < num_entries; i++) {
+            uint32_t crc = sev::crc32(contents[i].data(), contents[i].size());
+            uint32_t size = (uint32_t)contents[i].size();
+            if (dir + 46 > end_record || zip_u32(zip, dir) != 0x02014b50 ||
+                zip_u16(zip, dir + 10) != 0 || zip_u32(zip, dir + 16) != crc ||
+                zip_u32(zip, dir + 20) != size || zip_u32(zip, dir + 24) != size ||
+                zip_u16(zip, dir + 28) != names[i].size() ||
+                zip.compare(dir + 46, names[i].size(), names[i]) != 0)
+                break;
+            size_t local = zip_u32(zip, dir + 42);
+            size_t data = local + 30 + names[i].size() + zip_u16(zip, local + 28);
+            if (local + 30 > dir_offset || zip_u32(zip, local) != 0x04034b50 ||
+                zip_u32(zip, local + 14) != crc || zip_u32(zip, local + 18) != size ||
+                zip_u32(zip, local + 22) != size || zip_u16(zip, local + 26) != names[i].size() ||
+                zip.compare(local + 30, names[i].size(), names[i]) != 0 ||
+                data + size > dir_offset || zip.compare(data, size, contents[i]) != 0)
+                break;
+            dir += 46 + names[i].size() + zip_u16(zip, dir + 30) + zip_u16(zip, dir + 32);
+        }
+        if (i != num_entries || dir != end_record)
+            break;
+
+        // FAILURE test: an entry needs a name, and a closed writer takes nothing
+        {
+            ZipWriter writer;
+            if (writer.close() || !writer.open(zip_file) || writer.add_entry("", "x", 1))
+                break;
+        }
+
+        ret = true;
+    } while (0);
+
+    unlink(zip_file.c_str());
+    return ret;
+}
+
+// A P-256 test root and a leaf it signed, made with openssl req/x509
+static const char *test_leaf_cert_pem =
+    "-----BEGIN CERTIFICATE-----\n"
+    "MIIBIDCBxgIBAjAKBggqhkjOPQQDAjAcMRowGAYDVQQDDBFzZXZ0b29sIHRlc3Qg\n"
+    "cm9vdDAeFw0yNjEwMTcyMTM0MzBaFw0zNjEwMTQyMTM0MzBaMBwxGjAYBgNVBAMM\n"
+    "EXNldnRvb2wgdGVzdCBsZWFmMFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAE5xh1\n"
+    "gIwfRE21YTratnyg4FR96+FUHaUby7OarJDgv2hBpuODhc0ERiFDNTpeO1q9Cife\n"
+    "iZ60N9FUwG88vLNObjAKBggqhkjOPQQDAgNJADBGAiEA9K+Z2wckx5FGRWn1+Sfk\n"
+    "vvnxhKJY1Y/mMkt5fBWx/M8CIQDwL4/s+mCs0ZJjM/PttWGYMRGhCZ7nyjjm2Ny6\n"
+    "nelvXQ==\n"
+    "-----END CERTIFICATE-----\n";
+static const char *test_root_cert_pem =
+    "-----BEGIN CERTIFICATE-----\n"
+    "MIIBjTCCATOgAwIBAgIUc0ZrTBD8GO7sm+MTIWzIgzIP9f0wCgYIKoZIzj0EAwIw\n"
+    "HDEaMBgGA1UEAwwRc2V2dG9vbCB0ZXN0IHJvb3QwHhcNMjYxMDE3MjEzNDMwWhcN\n"
+    "MzYxMDE0MjEzNDMwWjAcMRowGAYDVQQDDBFzZXZ0b29sIHRlc3Qgcm9vdDBZMBMG\n"
+    "ByqGSM49AgEGCCqGSM49AwEHA0IABPd8tb5EPfsuLrJ5KrmOM9D8zVHc+8XGYKvL\n"
+    "R4Fqx/zYzO8vHj77zxIs+unomPyAlKNsUWoD9/cEc+wr1qrQ2i+jUzBRMB0GA1Ud\n"
+    "DgQWBBRafPT90H1M2A/XyEWuHVz4C6dSRzAfBgNVHSMEGDAWgBRafPT90H1M2A/X\n"
+    "yEWuHVz4C6dSRzAPBgNVHRMBAf8EBTADAQH/MAoGCCqGSM49BAMCA0gAMEUCIFrT\n"
+    "jpDqFp5Nh8x9zT58M02cwFzNVeFZuGZUgHhDUbGZAiEA35tQLqqjF6WIYTggP9rp\n"
+    "RrM/essC+VXIdGeKGDMhGNQ=\n"
+    "-----END CERTIFICATE-----\n";
+
+bool Tests::test_x509_pem(void)
+{
+    bool ret = false;
+    std::string leaf_pem = test_leaf_cert_pem;
+    std::string root_pem = test_root_cert_pem;
+    std::string der = "";
+    std::string pem = "";
+    std::string root_der = "";
+    std::vector<X509 *> chain;
+    uint8_t expected_hash[SHA256_DIGEST_LENGTH];
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    EVP_PKEY *root_key = NULL;
+
+    do {
+        printf("*Starting x509_pem tests\n");
+
+        // The leaf's DER, as openssl x509 -outform der gives it, and back
+        if (!pem_to_der(leaf_pem, der) || der.size() != 292)
+            break;
+        SHA256((const uint8_t *)der.data(), der.size(), hash);
+        if (!sev::str_to_array("b8407d1a91a264f4b71f24bc4eb75bc3475ba90cfcf45fbdb6bf1467d92effc4",
+                               expected_hash, sizeof(expected_hash)) ||
+            memcmp(hash, expected_hash, sizeof(hash)) != 0)
+            break;
+        if (!der_to_pem(der, pem) || pem != leaf_pem)
+            break;
+
+        // A two cert chain splits in order, and the root signed the leaf
+        if (!pem_to_der(root_pem, root_der))
+            break;
+        if (!split_pem_chain(leaf_pem + root_pem, chain) || chain.size() != 2)
+            break;
+        size_t i = 0;
+        for (; i < chain.size(); i++) {
+            unsigned char *chain_der = NULL;
+            int len = i2d_X509(chain[i], &chain_der);
+            bool same = len > 0 && std::string((const char *)chain_der, (size_t)len) == (i == 0 ? der : root_der);
+            OPENSSL_free(chain_der);
+            if (!same)
+                break;
+        }
+        if (i != chain.size())
+            break;
+        if (!(root_key = X509_get_pubkey(chain[1])) || X509_verify(chain[0], root_key) != 1)
+            break;
+
+        // FAILURE test: no certificates, and a truncated one
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        std::vector<X509 *> empty_chain;
+        if (split_pem_chain("not a certificate\n", empty_chain) || !empty_chain.empty())
+            break;
+        if (pem_to_der(leaf_pem.substr(0, leaf_pem.size() / 2), der))
+            break;
+        if (der_to_pem(der.substr(0, der.size() / 2), pem))
+            break;
+
+        ret = true;
+    } while (0);
+
+    EVP_PKEY_free(root_key);
+    for (size_t i = 0; i < chain.size(); i++)
+        X509_free(chain[i]);
+    return ret;
+}
+
+bool Tests::test_amd_cert_init(void)
+{
+    bool ret = false;
+    AMDCert tmp_amd;
+    amd_cert cert;
+    amd_cert header;
+    std::vector<uint8_t> buf(sizeof(amd_cert), 0);
+    size_t fixed_size = offsetof(amd_cert, pub_exp);
+
+    // A 2048 bit key: the fixed body, then the exponent, modulus and signature
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    header.key_usage = AMD_USAGE_ASK;
+    header.pub_exp_size = 2048;
+    header.modulus_size = 2048;
+    memcpy(buf.data(), &header, fixed_size);
+    for (size_t i = fixed_size; i < buf.size(); i++)
+        buf[i] = (uint8_t)i;
+    size_t cert_size = tmp_amd.amd_cert_get_size(&header);
+
+    do {
+        printf("*Starting amd_cert_init tests\n");
+
+        if (cert_size != fixed_size + 3*2048/8)
+            break;
+        memset(&cert, 0xFF, sizeof(cert));
+        if (tmp_amd.amd_cert_init(&cert, buf.data(), cert_size) != STATUS_SUCCESS ||
+            cert.key_usage != AMD_USAGE_ASK || cert.modulus_size != 2048 ||
+            memcmp(cert.pub_exp.short_len, &buf[fixed_size], 2048/8) != 0 ||
+            memcmp(cert.sig.short_len, &buf[fixed_size + 2*2048/8], 2048/8) != 0)
+            break;
+
+        // One byte short, shorter than the fixed body, and key sizes bigger
+        // than the cert can hold are all rejected, without reading past len
+        if (tmp_amd.amd_cert_init(&cert, buf.data(), cert_size - 1) != ERROR_INVALID_LENGTH ||
+            tmp_amd.amd_cert_init(&cert, buf.data(), fixed_size - 1) != ERROR_INVALID_LENGTH)
+            break;
+        header.modulus_size = 8192;
+        memcpy(buf.data(), &header, fixed_size);
+        if (tmp_amd.amd_cert_init(&cert, buf.data(), buf.size()) != ERROR_INVALID_CERTIFICATE)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
 bool Tests::test_validate_cert_chain(void)
 {
     bool ret = false;
@@ -766,6 +2128,374 @@ bool Tests::test_validate_cert_chain(void)
     return ret;
 }
 
+bool Tests::test_write_file(void)
+{
+    bool ret = false;
+    std::string file_name = m_output_folder + "write_file_test.bin";
+    std::string contents = "";
+    std::vector<uint8_t> data(3*PAGE_SIZE_4K + 5, 0x5A);
+    struct stat details;
+    const sev::write_durability_t modes[] = {
+        sev::WRITE_DURABILITY_NONE, sev::WRITE_DURABILITY_SYNC, sev::WRITE_DURABILITY_BATCH,
+    };
+    sev::write_durability_t old_durability;
+    bool old_verbose;
+
+    // Put back whatever main set, for the rest of the tests
+    sev::get_write_options(&old_durability, &old_verbose);
+
+    do {
+        printf("*Starting write_file tests\n");
+
+        // Every mode replaces the whole file, and keeps its permissions
+        size_t i = 0;
+        for (; i < sizeof(modes)/sizeof(modes[0]); i++) {
+            sev::set_write_options(modes[i], m_verbose_flag != 0);
+            sev::WriteBatch batch;
+            data[0] = (uint8_t)i;
+            if (sev::write_file(file_name, data.data(), data.size() - i) != data.size() - i)
+                break;
+            if (i == 0 && chmod(file_name.c_str(), 0600) != 0)
+                break;
+            if (!batch.commit())
+                break;
+            if (!sev::read_file(file_name, contents) || contents.size() != data.size() - i ||
+                memcmp(contents.data(), data.data(), contents.size()) != 0)
+                break;
+            if (stat(file_name.c_str(), &details) != 0 || (details.st_mode & 07777) != 0600)
+                break;
+        }
+        if (i != sizeof(modes)/sizeof(modes[0]))
+            break;
+
+        // Batched outside of a batch, and several files in nested batches
+        if (sev::write_file(file_name, data.data(), 1) != 1)
+            break;
+        {
+            sev::WriteBatch outer;
+            if (sev::write_file(file_name, data.data(), 2) != 2)
+                break;
+            sev::WriteBatch inner;
+            if (sev::write_file(file_name + "2", data.data(), 3) != 3 ||
+                !inner.commit() || !outer.commit() || !outer.commit())
+                break;
+        }
+        if (!sev::read_file(file_name, contents) || contents.size() != 2 ||
+            !sev::read_file(file_name + "2", contents) || contents.size() != 3)
+            break;
+
+        // An OutputFile leaves the old file alone until it's committed, and
+        // an aborted one leaves nothing behind
+        {
+            sev::OutputFile out;
+            if (!out.open(file_name) || !out.write(data.data(), 4) ||
+                !sev::read_file(file_name, contents) || contents.size() != 2)
+                break;
+            out.abort();
+            if (!sev::read_file(file_name, contents) || contents.size() != 2)
+                break;
+            if (!out.open(file_name) || !out.write(data.data(), 4) || !out.write(data.data(), 5) ||
+                !out.commit() || !sev::read_file(file_name, contents) || contents.size() != 9)
+                break;
+        }
+
+        // No temporary files are left behind
+        DIR *dir = opendir(m_output_folder.c_str());
+        if (!dir)
+            break;
+        size_t tmp_files = 0;
+        for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir))
+            tmp_files += (strstr(entry->d_name, "write_file_test.bin.tmp") != NULL);
+        closedir(dir);
+        if (tmp_files != 0)
+            break;
+
+        // FAILURE test: a folder that doesn't exist
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (sev::write_file(m_output_folder + "no_such_folder/x.bin", data.data(), 1) != 0)
+            break;
+
+        ret = true;
+    } while (0);
+
+    sev::set_write_options(old_durability, old_verbose);
+    unlink(file_name.c_str());
+    unlink((file_name + "2").c_str());
+    return ret;
+}
+
+// Public key of an ECDH key pair, DER encoded, to tell keys apart
+static std::string key_pool_pub(EVP_PKEY *key)
+{
+    unsigned char *der = NULL;
+    int len = i2d_PUBKEY(key, &der);
+    if (len <= 0)
+        return "";
+    std::string pub((const char *)der, (size_t)len);
+    OPENSSL_free(der);
+    return pub;
+}
+
+bool Tests::test_key_pool(void)
+{
+    bool ret = false;
+    const size_t num_keys = 12;
+    std::vector<std::string> pubs;
+    ecdh_key_pool_stats_t stats;
+
+    do {
+        printf("*Starting key_pool tests\n");
+
+        // Filled up to the high watermark in the background, then drained
+        // past it so some keys come from the refill or are made inline
+        ECDHKeyPool pool(2, 4);
+        if (!pool.start())
+            break;
+        for (int i = 0; i < 500 && pool.size() < 4; i++)
+            usleep(10*1000);
+        if (pool.size() != 4)
+            break;
+        size_t i = 0;
+        for (; i < num_keys; i++) {
+            EVP_PKEY *key = pool.acquire();
+            if (!key)
+                break;
+            pubs.push_back(key_pool_pub(key));
+            ECDHKeyPool::release(key);      // Released keys must never come back
+            if (pubs.back().empty())
+                break;
+        }
+        if (i != num_keys)
+            break;
+        pool.stop();
+        stats = pool.stats();
+        if (stats.hits < 4 || stats.hits + stats.misses != num_keys ||
+            stats.generated != stats.hits + stats.discarded || pool.size() != 0)
+            break;
+
+        // Exhaustion: an empty pool that was never started still hands out
+        // keys, made inline
+        ECDHKeyPool empty_pool(0, 1);
+        EVP_PKEY *key = empty_pool.acquire();
+        if (!key)
+            break;
+        pubs.push_back(key_pool_pub(key));
+        ECDHKeyPool::release(key);
+        stats = empty_pool.stats();
+        if (stats.misses != 1 || stats.hits != 0 || stats.generated != 0)
+            break;
+
+        // With max_keys, no more keys than that are ever made ahead
+        ECDHKeyPool bounded_pool(1, 8, 3);
+        if (!bounded_pool.start())
+            break;
+        for (i = 0; i < 4; i++) {
+            key = bounded_pool.acquire();
+            if (!key)
+                break;
+            pubs.push_back(key_pool_pub(key));
+            ECDHKeyPool::release(key);
+        }
+        if (i != 4)
+            break;
+        bounded_pool.stop();
+        stats = bounded_pool.stats();
+        if (stats.generated > 3 || stats.hits + stats.misses != 4)
+            break;
+
+        // Every key handed out, from every pool, is distinct
+        std::sort(pubs.begin(), pubs.end());
+        if (std::adjacent_find(pubs.begin(), pubs.end()) != pubs.end())
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool Tests::test_key_arena(void)
+{
+    bool ret = false;
+    const size_t num_slots = KEY_ARENA_CHUNK_SLOTS + 1;    // Needs a second chunk
+    size_t in_use = sev::key_slots_in_use();
+    std::vector<void *> slots;
+    void *run = NULL;
+
+    do {
+        printf("*Starting key_arena tests\n");
+
+        // Slots fill any free ones first, then new chunks, so the first and
+        // last of these are in different chunks
+        size_t i = 0;
+        for (; i < num_slots; i++) {
+            uint8_t *slot = (uint8_t *)sev::key_slot_alloc();
+            if (!slot || std::count(slot, slot + KEY_ARENA_SLOT_SIZE, 0) != KEY_ARENA_SLOT_SIZE)
+                break;
+            memset(slot, 0x5a, KEY_ARENA_SLOT_SIZE);
+            slots.push_back(slot);
+        }
+        if (i != num_slots || sev::key_slots_in_use() != in_use + num_slots)
+            break;
+
+        // Freed slots in both chunks are handed out again, first fit, zeroed
+        void *first = slots.front();
+        void *last = slots.back();
+        sev::key_slot_free(first);
+        sev::key_slot_free(last);
+        slots.front() = sev::key_slot_alloc();
+        slots.back() = sev::key_slot_alloc();
+        if (slots.front() != first || slots.back() != last ||
+            std::count((uint8_t *)first, (uint8_t *)first + KEY_ARENA_SLOT_SIZE, 0) != KEY_ARENA_SLOT_SIZE)
+            break;
+
+        // A full chunk's run
+        if (!(run = sev::key_slots_alloc(KEY_ARENA_CHUNK_SLOTS)) ||
+            sev::key_slots_in_use() != in_use + num_slots + KEY_ARENA_CHUNK_SLOTS)
+            break;
+        sev::key_slots_free(run, KEY_ARENA_CHUNK_SLOTS);
+        run = NULL;
+
+        for (i = 0; i < slots.size(); i++)
+            sev::key_slot_free(slots[i]);
+        slots.clear();
+        if (sev::key_slots_in_use() != in_use)
+            break;
+
+        // A SecureKey's slot is zeroized when it goes out of scope, and reused
+        uint8_t *key_slot = NULL;
+        {
+            SecureKey<tek_tik> tk;
+            if (!tk.valid())
+                break;
+            memset(tk.get(), 0xa5, sizeof(tek_tik));
+            key_slot = (uint8_t *)tk.get();
+        }
+        if (std::count(key_slot, key_slot + sizeof(tek_tik), 0) != sizeof(tek_tik))
+            break;
+        {
+            SecureKey<tek_tik> tk;
+            if (!tk.valid() || (uint8_t *)tk.get() != key_slot || sev::key_slots_in_use() != in_use + 1)
+                break;
+        }
+        if (sev::key_slots_in_use() != in_use)
+            break;
+
+        // FAILURE test: bad run sizes, and memory that isn't from the arena
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        uint8_t not_a_slot[KEY_ARENA_SLOT_SIZE];
+        if (sev::key_slots_alloc(0) || sev::key_slots_alloc(KEY_ARENA_CHUNK_SLOTS + 1))
+            break;
+        sev::key_slot_free(not_a_slot);
+        if (sev::key_slots_in_use() != in_use)
+            break;
+
+        ret = true;
+    } while (0);
+
+    sev::key_slots_free(run, KEY_ARENA_CHUNK_SLOTS);
+    for (size_t i = 0; i < slots.size(); i++)
+        sev::key_slot_free(slots[i]);
+    return ret;
+}
+
+// Random bytes from a child process, read back through a pipe
+static std::string random_bytes_from_child(size_t len)
+{
+    std::string out(len, '\0');
+    int pipe_fds[2];
+    int status = 0;
+
+    if (pipe(pipe_fds) != 0)
+        return "";
+    pid_t pid = fork();
+    if (pid == 0) {
+        sev::gen_random_bytes(&out[0], len);
+        _exit(write(pipe_fds[1], out.data(), len) == (ssize_t)len ? 0 : 1);
+    }
+    close(pipe_fds[1]);
+    bool ok = (pid > 0 && read(pipe_fds[0], &out[0], len) == (ssize_t)len);
+    close(pipe_fds[0]);
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+    return (ok && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? out : "";
+}
+
+bool Tests::test_random_bytes(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag, CCP_NOT_REQ);
+    std::vector<double> measurements;
+    const size_t block = 16;
+    std::vector<std::string> blocks;
+    std::string buf(4*RANDOM_POOL_BUF_SIZE + 5, '\0');
+    std::string big(4*RANDOM_POOL_BUF_SIZE + 5, '\0');
+    std::string zeros(big.size(), '\0');
+
+    do {
+        printf("*Starting random_bytes tests\n");
+
+        // A new thread's pool lives in the key arena, and goes back to it
+        // (wiped) when the thread exits
+        size_t slots_before = sev::key_slots_in_use();
+        size_t slots_during = 0;
+        std::thread worker([&]() {
+            uint8_t nonce[16];
+            sev::gen_random_bytes(nonce, sizeof(nonce));
+            slots_during = sev::key_slots_in_use();
+        });
+        worker.join();
+        if (slots_during <= slots_before || sev::key_slots_in_use() != slots_before)
+            break;
+
+        // Sizes around the buffer boundary, enough of them to refill (and
+        // reseed) many times. No 16-byte block may ever repeat
+        const size_t sizes[] = {
+            1, RANDOM_POOL_BUF_SIZE - 2, 3, RANDOM_POOL_BUF_SIZE, RANDOM_POOL_BUF_SIZE + 1, 7,
+        };
+        size_t i = 0;
+        for (; i < (RANDOM_POOL_RESEED_REFILLS + 16) * RANDOM_POOL_BUF_SIZE / block; i++) {
+            size_t len = (i < sizeof(sizes)/sizeof(sizes[0])) ? sizes[i] : block;
+            sev::gen_random_bytes(&buf[0], len);
+            for (size_t off = 0; off + block <= len; off += block)
+                blocks.push_back(buf.substr(off, block));
+        }
+        std::sort(blocks.begin(), blocks.end());
+        if (std::adjacent_find(blocks.begin(), blocks.end()) != blocks.end())
+            break;
+
+        // Bigger than the buffer: straight from getrandom
+        sev::gen_random_bytes(&big[0], big.size());
+        sev::gen_random_bytes(&buf[0], buf.size());
+        if (big == zeros || big == buf)
+            break;
+
+        // After a fork, the parent and each child get different bytes, even
+        // though the children start from a copy of the parent's pool
+        sev::gen_random_bytes(&buf[0], block);      // Leave bytes in the buffer
+        std::string child1 = random_bytes_from_child(2*block);
+        std::string child2 = random_bytes_from_child(2*block);
+        std::string parent(2*block, '\0');
+        sev::gen_random_bytes(&parent[0], parent.size());
+        if (child1.empty() || child2.empty() || child1 == child2 ||
+            child1 == parent || child2 == parent)
+            break;
+
+        // The benchmark command
+        if (cmd.random_benchmark(1000, measurements) != STATUS_SUCCESS || measurements.size() != 1)
+            break;
+
+        // FAILURE test: no launches
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (cmd.random_benchmark(0, measurements) == STATUS_SUCCESS)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
 bool Tests::test_generate_launch_blob(void)
 {
     bool ret = false;
@@ -785,6 +2515,51 @@ bool Tests::test_generate_launch_blob(void)
     return ret;
 }
 
+bool Tests::test_generate_launch_blob_batch(void)
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag);
+    uint32_t policy = SEV_POLICY_MIN;
+    uint32_t num_guests = 4;
+    sev::FileView tk0;
+    sev::FileView tk1;
+
+    do {
+        printf("*Starting generate_launch_blob_batch tests\n");
+
+        if (cmd.generate_launch_blob_batch(policy, num_guests) != STATUS_SUCCESS)
+            break;
+
+        // Every guest gets its own full set of files
+        uint32_t i = 0;
+        for (i = 0; i < num_guests; i++) {
+            std::string folder = m_output_folder + LAUNCH_BLOB_BATCH_FOLDER_PREFIX + std::to_string(i) + "/";
+            if (sev::get_file_size(folder + GUEST_OWNER_DH_FILENAME) != sizeof(sev_cert) ||
+                sev::get_file_size(folder + GUEST_TK_FILENAME) != sizeof(tek_tik) ||
+                sev::get_file_size(folder + LAUNCH_BLOB_FILENAME) != sizeof(sev_session_buf))
+                break;
+        }
+        if (i != num_guests) {
+            printf("Error: missing output files for guest %u\n", i);
+            break;
+        }
+
+        // ...and its own independent session
+        std::string folder = m_output_folder + LAUNCH_BLOB_BATCH_FOLDER_PREFIX;
+        if (!tk0.open(folder + "0/" + GUEST_TK_FILENAME) || !tk0.as<tek_tik>() ||
+            !tk1.open(folder + "1/" + GUEST_TK_FILENAME) || !tk1.as<tek_tik>())
+            break;
+        if (memcmp(tk0.data(), tk1.data(), sizeof(tek_tik)) == 0) {
+            printf("Error: guests were given the same TK\n");
+            break;
+        }
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
 bool Tests::test_package_secret(void)
 {
     bool ret = false;
@@ -840,6 +2615,141 @@ bool Tests::test_package_secret(void)
     return ret;
 }
 
+/**
+ * Checks a packaged secret the way the firmware would: data decrypts to
+ * secret with the TEK and the header IV, and the header mac (with the TIK)
+ * covers the header, the encrypted data and the measurement
+ */
+static bool launch_secret_ok(const tek_tik *tk, const hmac_sha_256 measurement,
+                             const sev_hdr_buf *header, const std::string &data,
+                             const std::string &secret)
+{
+    std::vector<uint8_t> decrypted(data.size());
+    std::string mac_data = "";
+    uint8_t meas_ctx = 0x01;
+    uint32_t len = (uint32_t)data.size();
+    hmac_sha_256 mac;
+
+    if (data.size() != secret.size() ||
+        !encrypt(decrypted.data(), (const uint8_t *)data.data(), data.size(), tk->tek, header->iv) ||
+        memcmp(decrypted.data(), secret.data(), secret.size()) != 0)
+        return false;
+
+    mac_data.append((const char *)&meas_ctx, sizeof(meas_ctx));
+    mac_data.append((const char *)&header->flags, sizeof(header->flags));
+    mac_data.append((const char *)header->iv, sizeof(header->iv));
+    mac_data.append((const char *)&len, sizeof(len));     // Guest Length
+    mac_data.append((const char *)&len, sizeof(len));     // Trans Length
+    mac_data.append(data);
+    mac_data.append((const char *)measurement, sizeof(hmac_sha_256));
+    if (!hmac_sha256(tk->tik, sizeof(tk->tik), mac_data.data(), mac_data.size(), (uint8_t *)&mac))
+        return false;
+    return memcmp(mac, header->mac, sizeof(mac)) == 0;
+}
+
+bool Tests::test_launch_session(void)
+{
+    bool ret = false;
+    std::string folder = m_output_folder + "launch_session/";
+    Command cmd(folder, m_verbose_flag, CCP_NOT_REQ);
+    SecureKey<tek_tik> tk;
+    hmac_sha_256 measurement;
+    sev_cert pek;
+    std::string secret(PACKAGE_SECRET_CHUNK_SIZE + 1000, '\0');
+    std::string packaged = "";
+    sev_hdr_buf header;
+    std::vector<uint8_t> out(secret.size());
+    sev_hdr_buf mem_header;
+
+    do {
+        printf("*Starting launch_session tests\n");
+
+        if (mkdir(folder.c_str(), 0755) != 0 && errno != EEXIST)
+            break;
+        if (!tk.valid())
+            break;
+
+        // What generate_launch_blob and calc_measurement leave for
+        // package_secret, for an API 0.17 platform (header mac includes the
+        // measurement)
+        memset(&pek, 0, sizeof(pek));
+        pek.api_major = 0;
+        pek.api_minor = 17;
+        sev::gen_random_bytes(tk.get(), sizeof(tek_tik));
+        sev::gen_random_bytes(measurement, sizeof(measurement));
+        sev::gen_random_bytes(&secret[0], secret.size());
+        if (sev::write_file(folder + PEK_FILENAME, &pek, sizeof(pek)) != sizeof(pek) ||
+            sev::write_file(folder + GUEST_TK_FILENAME, tk.get(), sizeof(tek_tik)) != sizeof(tek_tik) ||
+            sev::write_file(folder + CALC_MEASUREMENT_FILENAME, measurement, sizeof(measurement)) != sizeof(measurement) ||
+            sev::write_file(folder + SECRET_FILENAME, secret.data(), secret.size()) != secret.size())
+            break;
+
+        // File-based flow
+        if (cmd.package_secret() != STATUS_SUCCESS)
+            break;
+        if (sev::read_file(folder + PACKAGED_SECRET_HEADER_FILENAME, &header, sizeof(header)) != sizeof(header) ||
+            !sev::read_file(folder + PACKAGED_SECRET_FILENAME, packaged))
+            break;
+        if (!launch_secret_ok(tk.get(), measurement, &header, packaged, secret))
+            break;
+
+        // In-memory flow, started on one thread and finished on another,
+        // after the first one has exited
+        bool started = false;
+        {
+            LaunchSession session;
+            session.set_api_version(pek.api_major, pek.api_minor);
+            session.set_measurement(measurement);
+            if (!session.set_tk(tk.get()))
+                break;
+            size_t half = secret.size() / 2;
+            std::thread worker([&]() {
+                started = session.begin_secret(secret.size(), 0, &mem_header) == STATUS_SUCCESS &&
+                          session.encrypt_secret((const uint8_t *)secret.data(), out.data(), half) == STATUS_SUCCESS;
+            });
+            worker.join();
+            if (!started)
+                break;
+            if (session.encrypt_secret((const uint8_t *)secret.data() + half, out.data() + half,
+                                       secret.size() - half) != STATUS_SUCCESS ||
+                session.finish_secret(&mem_header) != STATUS_SUCCESS)
+                break;
+            // Finished, so more data or another finish is an error
+            if (session.encrypt_secret(out.data(), out.data(), 1) == STATUS_SUCCESS ||
+                session.finish_secret(&mem_header) == STATUS_SUCCESS)
+                break;
+        }
+        std::string mem_packaged((const char *)out.data(), out.size());
+        if (!launch_secret_ok(tk.get(), measurement, &mem_header, mem_packaged, secret))
+            break;
+
+        // Same output as the file-based flow, apart from the random IV
+        if (mem_packaged.size() != packaged.size() || mem_header.flags != header.flags ||
+            memcmp(mem_header.iv, header.iv, sizeof(header.iv)) == 0)
+            break;
+
+        // One-shot packaging, on a thread that exits before the session is destroyed
+        LaunchSession one_shot;
+        one_shot.set_api_version(pek.api_major, pek.api_minor);
+        one_shot.set_measurement(measurement);
+        if (!one_shot.set_tk(tk.get()))
+            break;
+        std::thread packer([&]() {
+            started = one_shot.package_secret((const uint8_t *)secret.data(), secret.size(),
+                                              out.data(), &mem_header) == STATUS_SUCCESS;
+        });
+        packer.join();
+        mem_packaged.assign((const char *)out.data(), out.size());
+        if (!started || !launch_secret_ok(tk.get(), measurement, &mem_header, mem_packaged, secret))
+            break;
+
+        ret = true;
+    } while (0);
+
+    OPENSSL_cleanse(&secret[0], secret.size());
+    return ret;
+}
+
 bool Tests::test_export_cert_chain_vcek(void)
 {
     bool ret = false;
@@ -886,6 +2796,174 @@ bool Tests::test_validate_cert_chain_vcek(void)
     return ret;
 }
 
+/**
+ * Runs report requests/responses between a guest-side codec and a firmware
+ * stand-in, then checks one sealed message against the one-shot AES-GCM
+ * helper, and that tampered and replayed messages are rejected
+ */
+// A rejected guest message must not leave any of its payload behind
+static bool payload_wiped(const snp_gmsg_t &msg)
+{
+    const uint8_t *payload = &msg.hdr->payload;
+    for (size_t i = 0; i < msg.buf_size - SNP_GMSG_HDR_SIZE; i++) {
+        if (payload[i] != 0) {
+            printf("Error: rejected guest message payload wasn't wiped\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Tests::test_snp_guest_message(void)
+{
+    bool ret = false;
+    const size_t num_msgs = 1000;
+    const size_t req_buf_size = SNP_GMSG_HDR_SIZE + sizeof(snp_msg_report_req_t);
+    const size_t rsp_buf_size = SNP_GMSG_HDR_SIZE + sizeof(snp_msg_report_rsp_t);
+    SNPGuestMessageCodec guest(SNP_GMSG_ROLE_GUEST);
+    SNPGuestMessageCodec firmware(SNP_GMSG_ROLE_FIRMWARE);
+    uint8_t vmpck0[SNP_VMPCK_SIZE];
+    std::vector<uint8_t> reqs(num_msgs * req_buf_size, 0);
+    std::vector<uint8_t> rsps(num_msgs * rsp_buf_size, 0);
+    std::vector<snp_gmsg_t> req_msgs(num_msgs);
+    std::vector<snp_gmsg_t> rsp_msgs(num_msgs);
+    std::vector<uint8_t> saved(req_buf_size, 0);
+
+    do {
+        printf("*Starting snp_guest_message tests\n");
+
+        sev::gen_random_bytes(vmpck0, sizeof(vmpck0));
+        if (guest.set_vmpck(0, vmpck0, sizeof(vmpck0)) != STATUS_SUCCESS ||
+            firmware.set_vmpck(0, vmpck0, sizeof(vmpck0)) != STATUS_SUCCESS)
+            break;
+
+        // Guest seals a pipelined batch of report requests
+        for (size_t i = 0; i < num_msgs; i++) {
+            snp_gmsg_t &msg = req_msgs[i];
+            msg.hdr = (snp_guest_message_header_t *)&reqs[i * req_buf_size];
+            msg.buf_size = req_buf_size;
+            msg.vmpck = 0;
+            msg.msg_type = SNP_MSG_REPORT_REQ;
+            msg.msg_version = 1;
+            msg.msg_size = (uint16_t)sizeof(snp_msg_report_req_t);
+            memset(&msg.hdr->payload, (int)(i & 0xff), 64);     // report_data
+        }
+        if (guest.seal_batch(req_msgs.data(), num_msgs) != num_msgs)
+            break;
+
+        // Cross check the first one (all zero payload) against
+        // aes_256_gcm_authenticated_encrypt
+        std::vector<uint8_t> plain(sizeof(snp_msg_report_req_t), 0);
+        std::vector<uint8_t> cipher(sizeof(snp_msg_report_req_t), 0);
+        uint8_t iv[SNP_GMSG_IV_SIZE] = {0};
+        uint8_t tag[SNP_GMSG_AUTHTAG_SIZE];
+        uint64_t seqno = req_msgs[0].hdr->msg_seqno;
+        memcpy(iv, &seqno, sizeof(seqno));
+        if (seqno != 1)
+            break;
+        if (aes_256_gcm_authenticated_encrypt(vmpck0, sizeof(vmpck0),
+                                              &req_msgs[0].hdr->algo, SNP_GMSG_HDR_AAD_SIZE,
+                                              plain.data(), plain.size(), cipher.data(),
+                                              iv, sizeof(iv), tag) != STATUS_SUCCESS)
+            break;
+        if (memcmp(cipher.data(), &req_msgs[0].hdr->payload, cipher.size()) != 0 ||
+            memcmp(tag, req_msgs[0].hdr->auth_tag, sizeof(tag)) != 0) {
+            printf("Error: sealed message doesn't match reference AES-GCM output\n");
+            break;
+        }
+
+        // Firmware stand-in opens them, and answers each
+        for (size_t i = 0; i < num_msgs; i++)
+            req_msgs[i].msg_version = 0;
+        if (firmware.open_batch(req_msgs.data(), num_msgs) != num_msgs)
+            break;
+        for (size_t i = 0; i < num_msgs; i++) {
+            snp_msg_report_req_t *req = (snp_msg_report_req_t *)&req_msgs[i].hdr->payload;
+            snp_gmsg_t &msg = rsp_msgs[i];
+            snp_msg_report_rsp_t *rsp = NULL;
+
+            if (req->report_data[0] != (uint8_t)(i & 0xff) || req_msgs[i].msg_version != 1)
+                break;
+            msg.hdr = (snp_guest_message_header_t *)&rsps[i * rsp_buf_size];
+            msg.buf_size = rsp_buf_size;
+            msg.vmpck = 0;
+            msg.msg_type = SNP_MSG_REPORT_RSP;
+            msg.msg_version = 1;
+            msg.msg_size = (uint16_t)sizeof(snp_msg_report_rsp_t);
+            rsp = (snp_msg_report_rsp_t *)&msg.hdr->payload;
+            rsp->report_size = (uint32_t)sizeof(snp_attestation_report_t);
+            memcpy(rsp->report.report_data, req->report_data, sizeof(req->report_data));
+        }
+        if (firmware.seal_batch(rsp_msgs.data(), num_msgs) != num_msgs)
+            break;
+
+        // FAILURE test: a tampered response
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        rsp_msgs[0].hdr->auth_tag[0] ^= 1;
+        if (guest.open(rsp_msgs[0]) != ERROR_BAD_SIGNATURE) {
+            printf("Error: tampered guest message was accepted\n");
+            break;
+        }
+        printf("Error: guest message rejected, status %#x\n", rsp_msgs[0].status);
+        rsp_msgs[0].hdr->auth_tag[0] ^= 1;
+
+        // FAILURE test: a response out of order. Its payload is wiped too
+        if (guest.open(rsp_msgs[1]) == STATUS_SUCCESS) {
+            printf("Error: out of order guest message was accepted\n");
+            break;
+        }
+        if (!payload_wiped(rsp_msgs[1]))
+            break;
+
+        // A tampered (then wiped) response can't be recovered, so reseal them all
+        if (guest.set_vmpck(0, vmpck0, sizeof(vmpck0)) != STATUS_SUCCESS ||
+            firmware.set_vmpck(0, vmpck0, sizeof(vmpck0)) != STATUS_SUCCESS)
+            break;
+        for (size_t i = 0; i < num_msgs; i++) {
+            req_msgs[i].msg_version = 1;
+            req_msgs[i].msg_size = (uint16_t)sizeof(snp_msg_report_req_t);
+        }
+        if (guest.seal_batch(req_msgs.data(), num_msgs) != num_msgs ||
+            firmware.open_batch(req_msgs.data(), num_msgs) != num_msgs)
+            break;
+        memcpy(saved.data(), req_msgs[0].hdr, req_buf_size);
+        for (size_t i = 0; i < num_msgs; i++) {
+            rsp_msgs[i].msg_version = 1;
+            rsp_msgs[i].msg_size = (uint16_t)sizeof(snp_msg_report_rsp_t);
+            memset(&rsp_msgs[i].hdr->payload, 0, sizeof(snp_msg_report_rsp_t));
+            ((snp_msg_report_rsp_t *)&rsp_msgs[i].hdr->payload)->report.report_data[0] = (uint8_t)(i & 0xff);
+        }
+        if (firmware.seal_batch(rsp_msgs.data(), num_msgs) != num_msgs ||
+            guest.open_batch(rsp_msgs.data(), num_msgs) != num_msgs)
+            break;
+
+        size_t i = 0;
+        for (; i < num_msgs; i++) {
+            snp_msg_report_rsp_t *rsp = (snp_msg_report_rsp_t *)&rsp_msgs[i].hdr->payload;
+            if (rsp->report.report_data[0] != (uint8_t)(i & 0xff))
+                break;
+        }
+        if (i != num_msgs || guest.msg_count(0) != 2 * num_msgs ||
+            firmware.msg_count(0) != 2 * num_msgs)
+            break;
+
+        // FAILURE test: replay an old request
+        snp_gmsg_t replay = req_msgs[0];
+        replay.hdr = (snp_guest_message_header_t *)saved.data();
+        if (firmware.open(replay) == STATUS_SUCCESS) {
+            printf("Error: replayed guest message was accepted\n");
+            break;
+        }
+        if (!payload_wiped(replay))
+            break;
+
+        ret = true;
+    } while (0);
+
+    OPENSSL_cleanse(vmpck0, sizeof(vmpck0));
+    return ret;
+}
+
 bool Tests::test_all(void)
 {
     bool ret = false;
@@ -945,12 +3023,75 @@ bool Tests::test_all(void)
         if (!test_calc_measurement())
             break;
 
+        if (!test_calc_measurement_batch())
+            break;
+
+        if (!test_calc_snp_measurement())
+            break;
+
+        if (!test_calc_snp_measurement_matrix())
+            break;
+
+        if (!test_calc_launch_digest())
+            break;
+
+        if (!test_measurement_cache())
+            break;
+
+        if (!test_generate_id_block())
+            break;
+
+        if (!test_build_cpuid_page())
+            break;
+
+        if (!test_analyze_rmp())
+            break;
+
+        if (!test_diff_rmp())
+            break;
+
+        if (!test_rmp_model())
+            break;
+
+        if (!test_verify_swap())
+            break;
+
+        if (!test_write_file())
+            break;
+
+        if (!test_file_view())
+            break;
+
+        if (!test_zip_writer())
+            break;
+
+        if (!test_x509_pem())
+            break;
+
+        if (!test_amd_cert_init())
+            break;
+
+        if (!test_random_bytes())
+            break;
+
         if (!test_validate_cert_chain())
             break;
 
+        if (!test_key_pool())
+            break;
+
+        if (!test_key_arena())
+            break;
+
+        if (!test_launch_session())
+            break;
+
         if (!test_generate_launch_blob())
             break;
 
+        if (!test_generate_launch_blob_batch())
+            break;
+
         if (!test_package_secret())
             break;
 
@@ -960,6 +3101,9 @@ bool Tests::test_all(void)
         if (!test_validate_cert_chain_vcek())
             break;
 
+        if (!test_snp_guest_message())
+            break;
+
         printf("All tests Succeeded!\n");
         ret = true;
     } while (0);
@@ -43,11 +43,33 @@ public:
     bool test_get_ask_ark(void);
     bool test_export_cert_chain(void);
     bool test_calc_measurement(void);
+    bool test_calc_measurement_batch(void);
+    bool test_calc_snp_measurement(void);
+    bool test_calc_snp_measurement_matrix(void);
+    bool test_calc_launch_digest(void);
+    bool test_measurement_cache(void);
+    bool test_generate_id_block(void);
+    bool test_build_cpuid_page(void);
+    bool test_analyze_rmp(void);
+    bool test_diff_rmp(void);
+    bool test_rmp_model(void);
+    bool test_verify_swap(void);
+    bool test_write_file(void);
+    bool test_file_view(void);
+    bool test_zip_writer(void);
+    bool test_x509_pem(void);
+    bool test_amd_cert_init(void);
+    bool test_random_bytes(void);
     bool test_validate_cert_chain(void);
     bool test_generate_launch_blob(void);
+    bool test_generate_launch_blob_batch(void);
+    bool test_key_pool(void);
+    bool test_key_arena(void);
     bool test_package_secret(void);
+    bool test_launch_session(void);
     bool test_export_cert_chain_vcek(void);
     bool test_validate_cert_chain_vcek(void);
+    bool test_snp_guest_message(void);
     bool test_all(void);
 };
 
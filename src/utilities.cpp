@@ -15,12 +15,26 @@
  **************************************************************************/
 
 #include "utilities.h"
+#include "keyarena.h"           // for key_slots_alloc
+#include <openssl/crypto.h>     // for OPENSSL_cleanse
+#include <openssl/evp.h>
+#include <algorithm>    // std::sort
+#include <atomic>
+#include <cerrno>
 #include <climits>
+#include <cstdlib>      // abort
 #include <cstring>      // memcpy
-#include <fstream>
+#include <fcntl.h>      // open
+#include <mutex>        // call_once
+#include <pthread.h>    // pthread_atfork
 #include <stdio.h>
 #include <time.h>
+#include <sys/mman.h>   // mmap
 #include <sys/random.h>
+#include <sys/stat.h>   // fstat
+#include <sys/wait.h>   // waitpid
+#include <unistd.h>     // close, fdatasync
+#include <vector>
 
 bool sev::execute_system_command(const std::string cmd, std::string *log)
 {
@@ -44,60 +58,420 @@ bool sev::execute_system_command(const std::string cmd, std::string *log)
     return true;
 }
 
+bool sev::execute_program(const std::vector<std::string> &args, std::string *log)
+{
+    std::vector<char *> argv;
+    int pipe_fds[2];
+    int status = 0;
+
+    if (args.empty() || pipe2(pipe_fds, O_CLOEXEC) != 0)
+        return false;
+    for (size_t i = 0; i < args.size(); i++)
+        argv.push_back(const_cast<char *>(args[i].c_str()));
+    argv.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // dup2 clears O_CLOEXEC on the new stdout
+        if (dup2(pipe_fds[1], STDOUT_FILENO) < 0)
+            _exit(127);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+
+    char output[4096];
+    ssize_t count;
+    while ((count = read(pipe_fds[0], output, sizeof(output))) != 0) {
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (log)
+            log->append(output, (size_t)count);
+    }
+    close(pipe_fds[0]);
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    return !(WIFEXITED(status) && WEXITSTATUS(status) == 127);
+}
+
+// Reads until len bytes or end of file, retrying short reads
+static size_t read_fd(int fd, void *buffer, size_t len)
+{
+    uint8_t *p = (uint8_t *)buffer;
+    size_t count = 0;
+
+    while (count < len) {
+        ssize_t got = read(fd, p + count, len - count);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        count += (size_t)got;
+    }
+    return count;
+}
+
+static int open_for_read(const std::string file_name, const char *caller)
+{
+    int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("%s Error: Could not open file. " \
+               " ensure directory and file exists\n" \
+               "  file_name: %s\n", caller, file_name.c_str());
+    }
+    return fd;
+}
+
 /**
  * Read up to len bytes from the beginning of a file
  * Returns number of bytes read, or 0 if the file couldn't be opened.
  */
 size_t sev::read_file(const std::string file_name, void *buffer, size_t len)
 {
-    std::ifstream file(file_name, std::ios::binary);
     if (len > INT_MAX) {
         printf("read_file Error: Input length too long\n");
         return 0;
     }
-    std::streamsize slen = (std::streamsize)len;
 
-    if (!file.is_open()) {
-        printf("read_file Error: Could not open file. " \
+    int fd = open_for_read(file_name, "read_file");
+    if (fd < 0)
+        return 0;
+
+    size_t count = read_fd(fd, buffer, len);
+    close(fd);
+
+    return count;
+}
+
+/**
+ * Read an entire file into a string, replacing its contents
+ * Returns false if the file couldn't be opened.
+ */
+bool sev::read_file(const std::string file_name, std::string &buffer)
+{
+    struct stat file_details;
+    int fd = open_for_read(file_name, "read_file");
+    if (fd < 0)
+        return false;
+
+    // Sized up front and read straight in, growing only if the file did
+    buffer.clear();
+    if (fstat(fd, &file_details) == 0 && file_details.st_size > 0)
+        buffer.resize((size_t)file_details.st_size);
+    size_t count = read_fd(fd, &buffer[0], buffer.size());
+    buffer.resize(count);
+    char more[4096];
+    size_t got;
+    while ((got = read_fd(fd, more, sizeof(more))) > 0)
+        buffer.append(more, got);
+    close(fd);
+
+    return true;
+}
+
+const uint8_t *sev::map_file(const std::string file_name, size_t *size)
+{
+    struct stat file_details;
+    void *addr = MAP_FAILED;
+    int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+
+    *size = 0;
+    if (fd < 0) {
+        printf("map_file Error: Could not open file. " \
                " ensure directory and file exists\n" \
                "  file_name: %s\n", file_name.c_str());
-        return 0;
+        return NULL;
     }
 
-    file.read((char *)buffer, slen);
-    size_t count = (size_t)file.gcount();
-    file.close();
+    if (fstat(fd, &file_details) == 0 && file_details.st_size > 0) {
+        addr = mmap(NULL, (size_t)file_details.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            *size = (size_t)file_details.st_size;
+            // Read front to back, once. The advice values aren't flags
+            madvise(addr, *size, MADV_SEQUENTIAL);
+            madvise(addr, *size, MADV_WILLNEED);
+        }
+    }
+    close(fd);      // The mapping holds its own reference
 
-    return count;
+    return (addr == MAP_FAILED) ? NULL : (const uint8_t *)addr;
+}
+
+void sev::unmap_file(const uint8_t *addr, size_t size)
+{
+    if (addr)
+        munmap((void *)addr, size);
+}
+
+bool sev::FileView::open(const std::string file_name)
+{
+    struct stat file_details;
+
+    close();
+    int fd = open_for_read(file_name, "FileView");
+    if (fd < 0)
+        return false;
+
+    do {
+        if (fstat(fd, &file_details) != 0)
+            break;
+        size_t size = (size_t)file_details.st_size;
+
+        if (size >= FILE_VIEW_MAP_MIN) {
+            void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED)
+                break;
+            madvise(addr, size, MADV_SEQUENTIAL);
+            madvise(addr, size, MADV_WILLNEED);
+            m_data = (const uint8_t *)addr;
+            m_size = size;
+            m_mapped = true;
+        }
+        else {
+            m_buffer.resize(size);
+            if (read_fd(fd, m_buffer.data(), size) != size) {
+                m_buffer.clear();
+                break;
+            }
+            m_data = m_buffer.data();
+            m_size = size;
+        }
+        m_open = true;
+    } while (0);
+    ::close(fd);        // A mapping holds its own reference
+
+    if (!m_open)
+        printf("FileView Error: Could not read file: %s\n", file_name.c_str());
+    return m_open;
+}
+
+void sev::FileView::close(void)
+{
+    // Inputs can be secrets, so an owned copy is wiped
+    if (m_mapped)
+        munmap((void *)m_data, m_size);
+    else if (!m_buffer.empty())
+        OPENSSL_cleanse(m_buffer.data(), m_buffer.size());
+    m_buffer.clear();
+    m_data = NULL;
+    m_size = 0;
+    m_open = false;
+    m_mapped = false;
+}
+
+static std::mutex g_write_mutex;
+static sev::write_durability_t g_write_durability = sev::WRITE_DURABILITY_NONE;
+static bool g_write_verbose = false;
+static std::vector<std::string> g_write_pending;   // Folders renamed into, for open WriteBatches
+static size_t g_write_batches = 0;                  // Open WriteBatches
+static std::atomic<unsigned int> g_write_tmp_count(0);
+
+void sev::set_write_options(write_durability_t durability, bool verbose)
+{
+    std::lock_guard<std::mutex> lock(g_write_mutex);
+    g_write_durability = durability;
+    g_write_verbose = verbose;
+}
+
+void sev::get_write_options(write_durability_t *durability, bool *verbose)
+{
+    std::lock_guard<std::mutex> lock(g_write_mutex);
+    *durability = g_write_durability;
+    *verbose = g_write_verbose;
+}
+
+static std::string dir_of(const std::string file_name)
+{
+    size_t slash = file_name.find_last_of('/');
+    if (slash == std::string::npos)
+        return ".";
+    return (slash == 0) ? "/" : file_name.substr(0, slash);
+}
+
+// Makes renames in a directory durable
+static bool fsync_dir(const std::string dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ret = (fsync(fd) == 0);
+    close(fd);
+    return ret;
+}
+
+static bool write_fd(int fd, const void *buffer, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buffer;
+
+    while (len > 0) {
+        ssize_t count = write(fd, p, len);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        p += count;
+        len -= (size_t)count;
+    }
+    return true;
+}
+
+sev::WriteBatch::WriteBatch() : m_open(true)
+{
+    std::lock_guard<std::mutex> lock(g_write_mutex);
+    m_first = g_write_pending.size();
+    g_write_batches++;
+}
+
+bool sev::WriteBatch::commit(void)
+{
+    std::vector<std::string> dirs;
+    bool ret = true;
+
+    {
+        std::lock_guard<std::mutex> lock(g_write_mutex);
+        if (!m_open)
+            return true;
+        m_open = false;
+        g_write_batches--;
+        if (m_first < g_write_pending.size()) {
+            dirs.assign(g_write_pending.begin() + (std::ptrdiff_t)m_first, g_write_pending.end());
+            g_write_pending.resize(m_first);
+        }
+    }
+
+    // The files' data was synced before their renames, so only the renames are left
+    std::sort(dirs.begin(), dirs.end());
+    dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+    for (size_t i = 0; i < dirs.size(); i++) {
+        if (!fsync_dir(dirs[i])) {
+            printf("write_file Error: Could not sync folder %s\n", dirs[i].c_str());
+            ret = false;
+        }
+    }
+
+    return ret;
 }
 
 /**
- * Writes len bytes from the beginning of a file. Does NOT append
- * Returns number of bytes written, or 0 if the file couldn't be opened.
- * ostream CANNOT create a folder, so it has to exist already, to succeed
+ * Creates a temporary file next to file_name for commit() to rename over
+ * it. If the folder doesn't allow creating the temporary file, the file is
+ * rewritten in place instead
  */
-size_t sev::write_file(const std::string file_name, const void *buffer, size_t len)
+bool sev::OutputFile::open(const std::string file_name)
 {
-    std::ofstream file(file_name, std::ofstream::out);
-    if (len > INT_MAX) {
-        printf("write_file Error: Input length too long\n");
-        return 0;
+    bool verbose;
+    {
+        std::lock_guard<std::mutex> lock(g_write_mutex);
+        verbose = g_write_verbose;
     }
-    std::streamsize slen = (std::streamsize)len;
 
-    if (!file.is_open()) {
+    abort();
+    m_file_name = file_name;
+    m_tmp_name = file_name + ".tmp" + std::to_string(getpid()) + "_" +
+                 std::to_string(g_write_tmp_count++);
+    m_fd = ::open(m_tmp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (m_fd < 0 && errno == EACCES) {
+        m_tmp_name.clear();
+        m_fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (m_fd < 0) {
         printf("write_file Error: Could not open/create file. " \
                "Ensure directory exists\n" \
                "  Filename: %s\n", file_name.c_str());
-        return 0;
+        return false;
     }
-    printf("Writing to file: %s\n", file_name.c_str());
+    if (verbose)
+        printf("Writing to file: %s\n", file_name.c_str());
 
-    file.write((char *)buffer, slen);
-    size_t count = (size_t)file.tellp();
-    file.close();
+    // A replaced file keeps its permissions
+    struct stat old_details;
+    if (!m_tmp_name.empty() && stat(file_name.c_str(), &old_details) == 0 &&
+        S_ISREG(old_details.st_mode))
+        fchmod(m_fd, old_details.st_mode & 07777);
 
-    return count;
+    m_ok = true;
+    return true;
+}
+
+bool sev::OutputFile::write(const void *buffer, size_t len)
+{
+    if (m_fd < 0 || !m_ok)
+        return false;
+    m_ok = write_fd(m_fd, buffer, len);
+    return m_ok;
+}
+
+bool sev::OutputFile::commit(void)
+{
+    write_durability_t durability;
+    bool batched;
+    {
+        std::lock_guard<std::mutex> lock(g_write_mutex);
+        durability = g_write_durability;
+        batched = (durability == WRITE_DURABILITY_BATCH && g_write_batches > 0);
+    }
+    // The data always goes to disk before the rename, so the file is never
+    // replaced by a partial one. Only the directory fsync waits for a batch
+    bool sync_data = (durability != WRITE_DURABILITY_NONE);
+    bool sync_dir = (sync_data && !batched);
+
+    if (m_fd < 0)
+        return false;
+
+    bool ok = m_ok;
+    if (ok && sync_data)
+        ok = (fdatasync(m_fd) == 0);
+    ok = (close(m_fd) == 0) && ok;
+    m_fd = -1;
+    if (ok && !m_tmp_name.empty() && rename(m_tmp_name.c_str(), m_file_name.c_str()) != 0)
+        ok = false;
+    if (!ok) {
+        printf("write_file Error: Could not write file: %s\n", m_file_name.c_str());
+        unlink(m_tmp_name.empty() ? m_file_name.c_str() : m_tmp_name.c_str());
+        return false;
+    }
+
+    if (sync_dir && !fsync_dir(dir_of(m_file_name))) {
+        printf("write_file Error: Could not sync folder of %s\n", m_file_name.c_str());
+        return false;
+    }
+    if (batched) {
+        std::lock_guard<std::mutex> lock(g_write_mutex);
+        g_write_pending.push_back(dir_of(m_file_name));
+    }
+    return true;
+}
+
+// Removes the unfinished output: the temporary file, or a file being rewritten in place
+void sev::OutputFile::abort(void)
+{
+    if (m_fd < 0)
+        return;
+    close(m_fd);
+    m_fd = -1;
+    unlink(m_tmp_name.empty() ? m_file_name.c_str() : m_tmp_name.c_str());
+}
+
+/**
+ * Writes the whole file through an OutputFile
+ * Returns number of bytes written, or 0 if the file couldn't be written.
+ */
+size_t sev::write_file(const std::string file_name, const void *buffer, size_t len)
+{
+    OutputFile out;
+
+    if (!out.open(file_name) || !out.write(buffer, len) || !out.commit())
+        return 0;
+    return len;
 }
 
 /**
@@ -106,33 +480,166 @@ size_t sev::write_file(const std::string file_name, const void *buffer, size_t l
  */
 size_t sev::get_file_size(const std::string file_name)
 {
-    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    struct stat file_details;
 
-    if (!file.is_open()) {
+    // No need to open the file just to look at its size
+    if (stat(file_name.c_str(), &file_details) != 0 || !S_ISREG(file_details.st_mode))
         return 0;
-    }
 
-    size_t count = (size_t)file.tellg();
-    file.close();
+    return (size_t)file_details.st_size;
+}
 
-    return count;
+// Bumped in the child after a fork, so buffered bytes are never shared
+// between parent and child
+static std::atomic<unsigned int> g_random_fork_gen(0);
+static std::once_flag g_random_atfork_once;
+
+static void random_atfork_child(void)
+{
+    g_random_fork_gen++;
 }
 
-void sev::gen_random_bytes(void *bytes, size_t num_bytes)
+// Fills buf from the kernel, or aborts. Only EINTR and short reads are retried
+static void getrandom_or_die(void *buf, size_t len)
 {
-    ssize_t num_gen_bytes = 0;
-    num_gen_bytes = getrandom(bytes, num_bytes, 0);
-    if (num_gen_bytes != (ssize_t)num_bytes) {
-        printf("Warning: getrandom failed. Generating random bytes manually\n");
-        // Do it manually
-        uint8_t *addr = (uint8_t *)bytes;
-        srand((unsigned int)time(NULL));
-        while (num_bytes--) {
-            *addr++ = (uint8_t)(rand() & 0xff);
+    uint8_t *p = (uint8_t *)buf;
+
+    while (len > 0) {
+        ssize_t count = getrandom(p, len, 0);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("Error: getrandom failed (errno %d), unable to generate random bytes\n", errno);
+            abort();
         }
+        p += count;
+        len -= (size_t)count;
     }
 }
 
+// The generator's key and buffered output (future TEKs, TIKs, IVs)
+struct random_pool_state_t {
+    uint8_t key[32];
+    uint8_t buf[RANDOM_POOL_BUF_SIZE];
+};
+
+// Key arena slots holding one random_pool_state_t
+#define RANDOM_POOL_SLOTS   ((sizeof(random_pool_state_t) + KEY_ARENA_SLOT_SIZE - 1) / KEY_ARENA_SLOT_SIZE)
+
+/**
+ * Fast-key-erasure generator: each refill runs ChaCha20 under the current key
+ * to produce a new key plus a buffer of output, then forgets the old key.
+ * Bytes are wiped as they're handed out, so nothing already returned can be
+ * recovered from the state. The key and buffer live in the key arena, and
+ * are wiped when the thread exits
+ */
+class random_pool_t
+{
+private:
+    EVP_CIPHER_CTX *m_ctx;
+    random_pool_state_t *m_state;   // NULL if the key arena had no memory
+    size_t m_pos;                   // Next unused byte of m_state->buf
+    unsigned int m_refills;         // Since the last reseed
+    unsigned int m_fork_gen;
+    bool m_seeded;
+
+    void refill(void)
+    {
+        static const uint8_t zeros[RANDOM_POOL_BUF_SIZE] = {0};
+        static const uint8_t iv[16] = {0};   // Never reused: every key is used once
+        uint8_t *key = m_state->key;
+        uint8_t *buf = m_state->buf;
+        int len = 0;
+
+        if (!m_seeded || m_fork_gen != g_random_fork_gen ||
+            m_refills >= RANDOM_POOL_RESEED_REFILLS) {
+            m_fork_gen = g_random_fork_gen;
+            getrandom_or_die(key, sizeof(m_state->key));
+            m_refills = 0;
+            m_seeded = true;
+        }
+
+        bool success = false;
+        do {
+            if (!m_ctx && !(m_ctx = EVP_CIPHER_CTX_new()))
+                break;
+            if (EVP_EncryptInit_ex(m_ctx, EVP_chacha20(), NULL, key, iv) != 1)
+                break;
+            if (EVP_EncryptUpdate(m_ctx, key, &len, zeros, (int)sizeof(m_state->key)) != 1 ||
+                len != (int)sizeof(m_state->key))
+                break;
+            if (EVP_EncryptUpdate(m_ctx, buf, &len, zeros, (int)sizeof(m_state->buf)) != 1 ||
+                len != (int)sizeof(m_state->buf))
+                break;
+            success = true;
+        } while (0);
+
+        if (!success) {
+            printf("Error: random pool refill failed, unable to generate random bytes\n");
+            abort();
+        }
+        m_pos = 0;
+        m_refills++;
+    }
+
+public:
+    random_pool_t() : m_ctx(NULL), m_pos(RANDOM_POOL_BUF_SIZE), m_refills(0),
+                      m_fork_gen(0), m_seeded(false)
+    {
+        m_state = (random_pool_state_t *)sev::key_slots_alloc(RANDOM_POOL_SLOTS);
+    }
+
+    ~random_pool_t()
+    {
+        EVP_CIPHER_CTX_free(m_ctx);
+        sev::key_slots_free(m_state, RANDOM_POOL_SLOTS);   // Wipes it
+    }
+
+    // Returns false if there's no pool state, so callers use getrandom
+    bool get(uint8_t *out, size_t len)
+    {
+        if (!m_state)
+            return false;
+
+        // Stale after a fork: drop whatever is left and reseed
+        if (m_fork_gen != g_random_fork_gen)
+            m_pos = RANDOM_POOL_BUF_SIZE;
+
+        while (len > 0) {
+            if (m_pos == RANDOM_POOL_BUF_SIZE)
+                refill();
+            size_t count = RANDOM_POOL_BUF_SIZE - m_pos;
+            if (count > len)
+                count = len;
+            memcpy(out, m_state->buf + m_pos, count);
+            OPENSSL_cleanse(m_state->buf + m_pos, count);
+            m_pos += count;
+            out += count;
+            len -= count;
+        }
+        return true;
+    }
+};
+
+void sev::gen_random_bytes(void *bytes, size_t num_bytes)
+{
+    if (num_bytes > RANDOM_POOL_BUF_SIZE) {
+        getrandom_or_die(bytes, num_bytes);
+        return;
+    }
+
+    std::call_once(g_random_atfork_once, []() {
+        if (pthread_atfork(NULL, NULL, random_atfork_child) != 0) {
+            printf("Error: pthread_atfork failed, unable to generate random bytes\n");
+            abort();
+        }
+    });
+
+    static thread_local random_pool_t pool;
+    if (!pool.get((uint8_t *)bytes, num_bytes))
+        getrandom_or_die(bytes, num_bytes);
+}
+
 bool sev::verify_access(uint8_t *buf, size_t len)
 {
     uint8_t *master = new uint8_t[len];
@@ -176,6 +683,14 @@ void sev::ascii_hex_bytes_to_binary(void *out, const char *in_bytes, size_t len)
     }
 }
 
+std::string sev::base64_encode(const void *data, size_t len)
+{
+    std::string out(((len + 2) / 3) * 4 + 1, '\0');   // +1 for the null EVP_EncodeBlock adds
+    int out_len = EVP_EncodeBlock((unsigned char *)&out[0], (const unsigned char *)data, (int)len);
+    out.resize(out_len > 0 ? (size_t)out_len : 0);
+    return out;
+}
+
 bool sev::reverse_bytes(uint8_t *bytes, size_t size)
 {
     uint8_t *start = bytes;
@@ -17,7 +17,10 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace sev
 {
@@ -33,6 +36,11 @@ namespace sev
     #define PAGE_SIZE_4K            4096
     #define PAGE_SIZE_2M            (512*PAGE_SIZE_4K)
 
+    #define FILE_VIEW_MAP_MIN           (64*1024)   // Smaller files are read, not mapped
+
+    #define RANDOM_POOL_BUF_SIZE        1024    // Keystream buffered per thread
+    #define RANDOM_POOL_RESEED_REFILLS  1024    // Refills between getrandom reseeds
+
     #define IS_ALIGNED(e, x)            (0==(((uintptr_t)(e))%(x)))
     #define IS_ALIGNED_TO_16_BYTES(e)   IS_ALIGNED((e), 16)         // 4 bits
     #define IS_ALIGNED_TO_32_BYTES(e)   IS_ALIGNED((e), 32)         // 5 bits
@@ -73,6 +81,13 @@ namespace sev
      */
     bool execute_system_command(const std::string cmd, std::string *log);
 
+    /**
+     * Runs args[0] (looked up in PATH) with args as its argv, without a
+     * shell, so the arguments are passed through as they are. Its stdout is
+     * appended to log. Returns false if it couldn't be run
+     */
+    bool execute_program(const std::vector<std::string> &args, std::string *log);
+
     /**
      * Read an entire file in to a buffer, or as much as will fit.
      * Return length of file or of buffer, whichever is smaller.
@@ -80,8 +95,141 @@ namespace sev
     size_t read_file(const std::string file_name, void *buffer, size_t len);
 
     /**
-     * Truncate and write (not append) a file from the beginning
-     * Returns number of bytes written
+     * Read an entire file in to a string.
+     * Returns false if the file couldn't be opened.
+     */
+    bool read_file(const std::string file_name, std::string &buffer);
+
+    /**
+     * Map an entire file read-only, for large inputs (ex. firmware images).
+     * Returns NULL if the file couldn't be opened or is empty, else the
+     * mapping, which must be released with unmap_file
+     */
+    const uint8_t *map_file(const std::string file_name, size_t *size);
+    void unmap_file(const uint8_t *addr, size_t size);
+
+    /**
+     * Read-only view of an entire file, from a single open: files of at least
+     * FILE_VIEW_MAP_MIN bytes are mapped, smaller ones read into a buffer the
+     * view owns (and wipes on close), so callers use the bytes in place
+     * instead of copying them into their own buffers. A mapped view sees later
+     * in-place writes to the file, so use read_file for a snapshot of a file
+     * that's rewritten
+     */
+    class FileView
+    {
+    private:
+        const uint8_t *m_data;
+        size_t m_size;
+        bool m_open;
+        bool m_mapped;
+        std::vector<uint8_t> m_buffer;
+
+        FileView(const FileView &);
+        FileView &operator=(const FileView &);
+
+    public:
+        FileView() : m_data(NULL), m_size(0), m_open(false), m_mapped(false) {}
+        ~FileView() { close(); }
+
+        /**
+         * Returns false if the file couldn't be opened or read. An empty
+         * file is a valid, empty view
+         */
+        bool open(const std::string file_name);
+        void close(void);
+
+        bool is_open(void) const { return m_open; }
+        const uint8_t *data(void) const { return m_data; }
+        size_t size(void) const { return m_size; }
+
+        // The start of the file as a T, or NULL if the file is shorter than a T
+        template <typename T>
+        const T *as(void) const { return (m_open && m_size >= sizeof(T)) ? (const T *)m_data : NULL; }
+    };
+
+    /**
+     * How far write_file goes to get an output onto disk. Every output is
+     * written to a temporary file and renamed over the old one, so readers
+     * see the old file or the new one, never part of one
+     */
+    enum write_durability_t
+    {
+        WRITE_DURABILITY_NONE  = 0,     // Left to the page cache
+        WRITE_DURABILITY_SYNC  = 1,     // fdatasync'd before the rename, directory fsync'd after
+        WRITE_DURABILITY_BATCH = 2,     // fdatasync'd before the rename, directory fsync'd when
+                                        // the WriteBatch it's in ends
+    };
+
+    /**
+     * Process-wide write_file settings. write_file only prints the files
+     * it writes if verbose
+     */
+    void set_write_options(write_durability_t durability, bool verbose);
+    void get_write_options(write_durability_t *durability, bool *verbose);
+
+    /**
+     * Groups the outputs of one command: with WRITE_DURABILITY_BATCH, each
+     * file's data is synced before it's renamed into place, so a crash leaves
+     * the old file or the whole new one, but the renames are only made
+     * durable, one directory fsync per folder, when the batch is committed
+     * (or destroyed). A crash before then may roll some files back to their
+     * old contents. Files are renamed as they're written, not at the commit,
+     * because commands read back what they wrote. Batches nest; each commits
+     * the folders written to since it was opened. Outside of a batch,
+     * WRITE_DURABILITY_BATCH acts like _SYNC
+     */
+    class WriteBatch
+    {
+    private:
+        size_t m_first;     // Index of this batch's first folder in the pending list
+        bool m_open;
+
+        WriteBatch(const WriteBatch &);
+        WriteBatch &operator=(const WriteBatch &);
+
+    public:
+        WriteBatch();
+        ~WriteBatch() { commit(); }
+
+        // Returns false if any of the folders couldn't be synced
+        bool commit(void);
+    };
+
+    /**
+     * An output written a piece at a time, with the same guarantees as
+     * write_file: open() creates a temporary file next to file_name, and
+     * commit() syncs it as the durability setting asks and renames it over
+     * file_name, so until then readers see the old file. abort(), or
+     * destroying it before commit(), removes the unfinished output
+     */
+    class OutputFile
+    {
+    private:
+        std::string m_file_name;
+        std::string m_tmp_name;     // Empty if file_name is being rewritten in place
+        int m_fd;
+        bool m_ok;                  // No write has failed
+
+        OutputFile(const OutputFile &);
+        OutputFile &operator=(const OutputFile &);
+
+    public:
+        OutputFile() : m_fd(-1), m_ok(false) {}
+        ~OutputFile() { abort(); }
+
+        bool open(const std::string file_name);
+        bool write(const void *buffer, size_t len);
+        bool commit(void);
+        void abort(void);
+
+        bool is_open(void) const { return m_fd >= 0; }
+    };
+
+    /**
+     * Replace a file with len bytes, atomically (see write_durability_t)
+     * Returns number of bytes written, or 0 if the file couldn't be written.
+     * Can't create a folder, so it has to exist already, to succeed
      */
     size_t write_file(const std::string file_name, const void *buffer, size_t len);
 
@@ -93,6 +241,14 @@ namespace sev
 
     /**
      * Generate some random bytes
+     *
+     * Requests of up to RANDOM_POOL_BUF_SIZE bytes are served from a per-thread
+     * ChaCha20 keystream buffer, rekeyed from its own output on every refill and
+     * reseeded from getrandom every RANDOM_POOL_RESEED_REFILLS refills and after
+     * a fork. The buffer and its key are in the key arena (locked, kept out of
+     * core dumps). Larger requests, and all requests if the arena has no
+     * memory, go straight to getrandom. There is no fallback: if the kernel
+     * can't supply entropy, the process is aborted
      */
     void gen_random_bytes(void *bytes, size_t num_bytes);
 
@@ -117,6 +273,12 @@ namespace sev
      */
     void ascii_hex_bytes_to_binary(void *out, const char *in_bytes, size_t len);
 
+    /**
+     * Base64 encodes a buffer, without line breaks (ex. for QEMU's
+     * sev-snp-guest id-block and id-auth properties)
+     */
+    std::string base64_encode(const void *data, size_t len);
+
     /**
      * Reverses bytes in a section of memory. Used in validating cert signatures
      */
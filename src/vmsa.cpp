@@ -0,0 +1,182 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#include "vmsa.h"
+#include <cstdlib>
+#include <cstring>
+
+static void set_seg(vmcb_seg *seg, uint16_t selector, uint16_t attrib,
+                    uint32_t limit, uint64_t base)
+{
+    seg->selector = selector;
+    seg->attrib = attrib;
+    seg->limit = limit;
+    seg->base = base;
+}
+
+/**
+ * Matches the register state KVM (via QEMU or EC2's VMM) syncs into the VMSA
+ * at LAUNCH_UPDATE_VMSA: real mode, CS:IP pointing at eip. With QEMU, KVM
+ * also copies in the guest FPU's reset state, of which only MXCSR and FCW
+ * aren't zero
+ */
+void build_vmsa(const vmsa_params_t &params, sev_es_save_area *vmsa)
+{
+    uint16_t cs_attrib = 0x9b;
+    uint16_t ss_attrib = 0x93;
+    uint16_t tr_attrib = 0x8b;
+    uint64_t rdx = params.vcpu_sig;
+    uint32_t mxcsr = VMSA_MXCSR_RESET;
+    uint16_t x87_fcw = VMSA_X87_FCW_RESET;
+
+    if (params.vmm_type == VMM_TYPE_EC2) {
+        cs_attrib = (params.eip == VMSA_BSP_EIP) ? 0x9a : 0x9b;
+        ss_attrib = 0x92;
+        tr_attrib = 0x83;
+        rdx = 0;
+        mxcsr = 0;          // EC2 doesn't sync the FPU state
+        x87_fcw = 0;
+    }
+
+    memset(vmsa, 0, sizeof(*vmsa));
+    set_seg(&vmsa->es, 0, 0x93, 0xffff, 0);
+    set_seg(&vmsa->cs, 0xf000, cs_attrib, 0xffff, params.eip & 0xffff0000);
+    set_seg(&vmsa->ss, 0, ss_attrib, 0xffff, 0);
+    set_seg(&vmsa->ds, 0, 0x93, 0xffff, 0);
+    set_seg(&vmsa->fs, 0, 0x93, 0xffff, 0);
+    set_seg(&vmsa->gs, 0, 0x93, 0xffff, 0);
+    set_seg(&vmsa->gdtr, 0, 0, 0xffff, 0);
+    set_seg(&vmsa->ldtr, 0, 0x82, 0xffff, 0);
+    set_seg(&vmsa->idtr, 0, 0, 0xffff, 0);
+    set_seg(&vmsa->tr, 0, tr_attrib, 0xffff, 0);
+
+    vmsa->efer = 0x1000;                    // SVME
+    vmsa->cr4 = 0x40;                       // MCE
+    vmsa->cr0 = 0x10;                       // ET
+    vmsa->dr7 = 0x400;
+    vmsa->dr6 = 0xffff0ff0;
+    vmsa->rflags = 0x2;
+    vmsa->rip = params.eip & 0xffff;
+    vmsa->g_pat = 0x0007040600070406ULL;    // PAT reset value
+    vmsa->rdx = rdx;
+    vmsa->sev_features = params.sev_features;
+    vmsa->xcr0 = 0x1;
+    vmsa->mxcsr = mxcsr;
+    vmsa->x87_fcw = x87_fcw;
+}
+
+bool vmm_type_from_name(const std::string name, vmm_type_t *vmm_type)
+{
+    if (name == "qemu")
+        *vmm_type = VMM_TYPE_QEMU;
+    else if (name == "ec2")
+        *vmm_type = VMM_TYPE_EC2;
+    else
+        return false;
+    return true;
+}
+
+uint32_t vcpu_sig_from_fms(uint32_t family, uint32_t model, uint32_t stepping)
+{
+    uint32_t family_low = family, family_high = 0;
+
+    if (family > 0xf) {
+        family_low = 0xf;
+        family_high = (family - 0xf) & 0xff;
+    }
+    return (family_high << 20) | (((model >> 4) & 0xf) << 16) |
+           (family_low << 8) | ((model & 0xf) << 4) | (stepping & 0xf);
+}
+
+bool vcpu_sig_from_name(const std::string name, uint32_t *vcpu_sig)
+{
+    static const struct {
+        const char *name;
+        uint32_t family;
+        uint32_t model;
+        uint32_t stepping;
+    } types[] = {
+        { "EPYC",          23,  1, 2 },
+        { "EPYC-v1",       23,  1, 2 },
+        { "EPYC-v2",       23,  1, 2 },
+        { "EPYC-IBPB",     23,  1, 2 },
+        { "EPYC-v3",       23,  1, 2 },
+        { "EPYC-v4",       23,  1, 2 },
+        { "EPYC-Rome",     23, 49, 0 },
+        { "EPYC-Rome-v1",  23, 49, 0 },
+        { "EPYC-Rome-v2",  23, 49, 0 },
+        { "EPYC-Rome-v3",  23, 49, 0 },
+        { "EPYC-Milan",    25,  1, 1 },
+        { "EPYC-Milan-v1", 25,  1, 1 },
+        { "EPYC-Milan-v2", 25,  1, 1 },
+        { "EPYC-Genoa",    25, 17, 0 },
+        { "EPYC-Genoa-v1", 25, 17, 0 },
+    };
+
+    for (size_t i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+        if (name == types[i].name) {
+            *vcpu_sig = vcpu_sig_from_fms(types[i].family, types[i].model, types[i].stepping);
+            return true;
+        }
+    }
+
+    char *end = NULL;
+    unsigned long sig = strtoul(name.c_str(), &end, 16);
+    if (name.empty() || *end != '\0' || sig > UINT32_MAX)
+        return false;
+    *vcpu_sig = (uint32_t)sig;
+    return true;
+}
+
+size_t VMSASet::add_vcpu(const vmsa_params_t &params)
+{
+    sev_es_save_area vmsa;
+    size_t index = 0;
+
+    build_vmsa(params, &vmsa);
+
+    // A guest has a handful of templates at most, so a linear search is fine
+    for (; index < m_templates.size(); index++) {
+        if (memcmp(&m_templates[index], &vmsa, sizeof(vmsa)) == 0)
+            break;
+    }
+    if (index == m_templates.size())
+        m_templates.push_back(vmsa);
+
+    m_vcpu_template.push_back(index);
+    return index;
+}
+
+void VMSASet::add_vcpus(uint32_t num_vcpus, uint32_t ap_eip, uint64_t sev_features,
+                        uint32_t vcpu_sig, vmm_type_t vmm_type)
+{
+    vmsa_params_t params;
+
+    params.sev_features = sev_features;
+    params.vcpu_sig = vcpu_sig;
+    params.vmm_type = vmm_type;
+
+    for (uint32_t vcpu = 0; vcpu < num_vcpus; vcpu++) {
+        params.eip = (vcpu == 0) ? VMSA_BSP_EIP : ap_eip;
+        if (vcpu < 2) {
+            add_vcpu(params);
+        }
+        else {      // Same params as the last AP, no need to build and compare
+            m_vcpu_template.push_back(m_vcpu_template.back());
+        }
+    }
+}
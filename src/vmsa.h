@@ -0,0 +1,236 @@
+/**************************************************************************
+ * Copyright 2020 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+
+#ifndef VMSA_H
+#define VMSA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define VMSA_PAGE_SIZE      4096
+#define VMSA_BSP_EIP        0xfffffff0      // x86 reset vector
+#define VMSA_SNP_GPA        0xFFFFFFFFF000ULL   // Where KVM puts every vCPU's VMSA
+
+// FPU reset values (FNINIT/FXRSTOR defaults), as KVM puts them in the VMSA
+#define VMSA_MXCSR_RESET    0x1f80
+#define VMSA_X87_FCW_RESET  0x037f
+
+// SEV_FEATURES bits
+#define VMSA_SEV_FEATURE_SNP    (1ULL << 0)
+
+typedef struct __attribute__ ((__packed__)) vmcb_seg_t
+{
+    uint16_t selector;
+    uint16_t attrib;
+    uint32_t limit;
+    uint64_t base;
+} vmcb_seg;
+
+/**
+ * VMCB save area of an SEV-ES/SNP guest (AMD APM Vol 2, Table B-4), as much
+ * of it as the initial vCPU state uses, up to the end of the FPU state KVM
+ * syncs in at LAUNCH_UPDATE_VMSA. The rest of the page is zero
+ */
+typedef struct __attribute__ ((__packed__)) sev_es_save_area_t
+{
+    vmcb_seg es;                    // 0x000
+    vmcb_seg cs;
+    vmcb_seg ss;
+    vmcb_seg ds;
+    vmcb_seg fs;
+    vmcb_seg gs;
+    vmcb_seg gdtr;
+    vmcb_seg ldtr;
+    vmcb_seg idtr;
+    vmcb_seg tr;
+    uint64_t vmpl0_ssp;             // 0x0A0
+    uint64_t vmpl1_ssp;
+    uint64_t vmpl2_ssp;
+    uint64_t vmpl3_ssp;
+    uint64_t u_cet;
+    uint8_t  reserved_1[2];         // 0x0C8
+    uint8_t  vmpl;
+    uint8_t  cpl;
+    uint8_t  reserved_2[4];
+    uint64_t efer;                  // 0x0D0
+    uint8_t  reserved_3[104];
+    uint64_t xss;                   // 0x140
+    uint64_t cr4;
+    uint64_t cr3;
+    uint64_t cr0;
+    uint64_t dr7;                   // 0x160
+    uint64_t dr6;
+    uint64_t rflags;
+    uint64_t rip;
+    uint64_t dr0;                   // 0x180
+    uint64_t dr1;
+    uint64_t dr2;
+    uint64_t dr3;
+    uint64_t dr0_addr_mask;
+    uint64_t dr1_addr_mask;
+    uint64_t dr2_addr_mask;
+    uint64_t dr3_addr_mask;
+    uint8_t  reserved_4[24];        // 0x1C0
+    uint64_t rsp;                   // 0x1D8
+    uint64_t s_cet;
+    uint64_t ssp;
+    uint64_t isst_addr;
+    uint64_t rax;                   // 0x1F8
+    uint64_t star;
+    uint64_t lstar;
+    uint64_t cstar;
+    uint64_t sfmask;
+    uint64_t kernel_gs_base;
+    uint64_t sysenter_cs;
+    uint64_t sysenter_esp;
+    uint64_t sysenter_eip;
+    uint64_t cr2;                   // 0x240
+    uint8_t  reserved_5[32];
+    uint64_t g_pat;                 // 0x268
+    uint64_t dbgctl;
+    uint64_t br_from;
+    uint64_t br_to;
+    uint64_t last_excp_from;
+    uint64_t last_excp_to;
+    uint8_t  reserved_7[72];        // 0x298
+    uint32_t spec_ctrl;             // 0x2E0
+    uint8_t  reserved_7b[4];
+    uint32_t pkru;
+    uint8_t  reserved_7a[20];
+    uint64_t reserved_8;            // 0x300, rax is at 0x1F8
+    uint64_t rcx;
+    uint64_t rdx;                   // 0x310
+    uint64_t rbx;
+    uint64_t reserved_9;            // rsp is at 0x1D8
+    uint64_t rbp;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t r8;                    // 0x340
+    uint64_t r9;
+    uint64_t r10;
+    uint64_t r11;
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
+    uint8_t  reserved_10[16];       // 0x380
+    uint64_t sw_exit_code;
+    uint64_t sw_exit_info_1;
+    uint64_t sw_exit_info_2;
+    uint64_t sw_scratch;
+    uint64_t sev_features;          // 0x3B0
+    uint8_t  reserved_11[48];
+    uint64_t xcr0;                  // 0x3E8
+    uint8_t  valid_bitmap[16];
+    uint64_t x87_state_gpa;         // 0x400
+    uint64_t x87_dp;                // 0x408, FXSAVE layout from here
+    uint32_t mxcsr;
+    uint16_t x87_ftw;
+    uint16_t x87_fsw;
+    uint16_t x87_fcw;               // 0x418
+    uint16_t x87_fop;
+    uint16_t x87_ds;
+    uint16_t x87_cs;
+    uint64_t x87_rip;               // 0x420
+    uint8_t  fpreg_x87[8*10];       // 0x428
+    uint8_t  fpreg_xmm[16*16];      // 0x478
+    uint8_t  fpreg_ymm[16*16];      // 0x578
+    uint8_t  reserved_12[VMSA_PAGE_SIZE - 0x678];
+} sev_es_save_area;
+static_assert(offsetof(sev_es_save_area, efer) == 0xD0, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, rip) == 0x178, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, g_pat) == 0x268, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, rdx) == 0x310, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, sev_features) == 0x3B0, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, xcr0) == 0x3E8, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, x87_state_gpa) == 0x400, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, mxcsr) == 0x410, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, x87_fcw) == 0x418, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, fpreg_x87) == 0x428, "Error, static assertion failed");
+static_assert(offsetof(sev_es_save_area, fpreg_ymm) == 0x578, "Error, static assertion failed");
+static_assert(sizeof(sev_es_save_area) == VMSA_PAGE_SIZE, "Error, static assertion failed");
+
+/**
+ * The VMM that creates the vCPUs. They differ in a few segment attributes,
+ * and QEMU/KVM also syncs the FPU's reset MXCSR and FCW into the VMSA
+ */
+enum vmm_type_t {
+    VMM_TYPE_QEMU = 0,
+    VMM_TYPE_EC2  = 1,
+};
+
+/**
+ * Initial (reset) state of one vCPU
+ *   eip:          VMSA_BSP_EIP for the BSP. APs start at the SEV-ES reset
+ *                 block address from the firmware
+ *   sev_features: 0 for SEV-ES, VMSA_SEV_FEATURE_SNP for SNP
+ *   vcpu_sig:     CPUID Fn0000_0001_EAX of the vCPU model. Reset puts it in rdx
+ */
+struct vmsa_params_t {
+    uint32_t eip;
+    uint64_t sev_features;
+    uint32_t vcpu_sig;
+    vmm_type_t vmm_type;
+};
+
+// Builds the VMSA page the VMM passes to LAUNCH_UPDATE_VMSA for one vCPU
+void build_vmsa(const vmsa_params_t &params, sev_es_save_area *vmsa);
+
+bool vmm_type_from_name(const std::string name, vmm_type_t *vmm_type);
+
+// CPUID Fn0000_0001_EAX for a family/model/stepping
+uint32_t vcpu_sig_from_fms(uint32_t family, uint32_t model, uint32_t stepping);
+
+/**
+ * Looks up the signature of a QEMU CPU model (ex. EPYC-Milan, EPYC-v4), or
+ * parses a hex signature (ex. 0xa00f11)
+ */
+bool vcpu_sig_from_name(const std::string name, uint32_t *vcpu_sig);
+
+/**
+ * The VMSA pages of every vCPU of a guest. The APs' pages are almost always
+ * identical, so each distinct page is built (and stored) once as a template
+ * and the vCPUs point at their template. Measuring code can then hash each
+ * template once instead of once per vCPU. Pages stay at the same address
+ * for the life of the VMSASet
+ */
+class VMSASet
+{
+private:
+    std::deque<sev_es_save_area> m_templates;
+    std::vector<size_t> m_vcpu_template;    // vCPU -> index into m_templates
+
+public:
+    // Adds the next vCPU. Returns the index of its template
+    size_t add_vcpu(const vmsa_params_t &params);
+
+    /**
+     * Adds num_vcpus vCPUs of the same type: a BSP starting at the reset
+     * vector and APs starting at ap_eip
+     */
+    void add_vcpus(uint32_t num_vcpus, uint32_t ap_eip, uint64_t sev_features,
+                   uint32_t vcpu_sig, vmm_type_t vmm_type);
+
+    size_t num_vcpus(void) { return m_vcpu_template.size(); }
+    size_t num_templates(void) { return m_templates.size(); }
+    const sev_es_save_area *page(size_t vcpu) { return &m_templates[m_vcpu_template[vcpu]]; }
+};
+
+#endif /* VMSA_H */
@@ -17,6 +17,7 @@
 #include "utilities.h"
 #include "x509cert.h"
 #include <openssl/bn.h>
+#include <openssl/err.h>
 #include <openssl/pem.h>
 #include <cstring>  // memset
 #include <fstream>
@@ -29,20 +30,146 @@
 // OpenSSL verify
 // openssl verify -trusted ark.pem -untrusted ask.pem vcek.pem
 
-void convert_txt_to_der(const std::string in_file_name, const std::string out_file_name)
+bool convert_txt_to_der(const std::string in_file_name, const std::string out_file_name)
 {
-    std::string cmd = "openssl x509 -outform der -in " + in_file_name + " -out " + out_file_name;
-    std::string output = "";
+    std::string pem_buf = "";
+    std::string der_buf = "";
 
-    sev::execute_system_command(cmd, &output);
+    if (!sev::read_file(in_file_name, pem_buf))
+        return false;
+    if (!pem_to_der(pem_buf, der_buf))
+        return false;
+    return sev::write_file(out_file_name, der_buf.data(), der_buf.size()) == der_buf.size();
+}
+
+bool convert_der_to_pem(const std::string in_file_name, const std::string out_file_name)
+{
+    std::string der_buf = "";
+    std::string pem_buf = "";
+
+    if (!sev::read_file(in_file_name, der_buf))
+        return false;
+    if (!der_to_pem(der_buf, pem_buf))
+        return false;
+    return sev::write_file(out_file_name, pem_buf.data(), pem_buf.size()) == pem_buf.size();
+}
+
+/**
+ * Reads a single PEM encoded certificate out of a buffer.
+ * Any certificates after the first one are ignored.
+ */
+bool read_pem_buf_into_x509(const std::string &pem_buf, X509 **x509_cert)
+{
+    BIO *bio = BIO_new_mem_buf(pem_buf.data(), (int)pem_buf.size());
+    if (!bio)
+        return false;
+
+    *x509_cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (!*x509_cert) {
+        printf("Error reading x509 from pem buffer\n");
+        return false;
+    }
+    return true;
+}
+
+bool read_der_buf_into_x509(const std::string &der_buf, X509 **x509_cert)
+{
+    const unsigned char *der = (const unsigned char *)der_buf.data();
+
+    *x509_cert = d2i_X509(NULL, &der, (long)der_buf.size());
+    if (!*x509_cert) {
+        printf("Error reading x509 from der buffer\n");
+        return false;
+    }
+    return true;
+}
+
+bool write_x509_pem_buf(X509 *x509_cert, std::string &pem_buf)
+{
+    bool ret = false;
+    BIO *bio = NULL;
+    char *data = NULL;
+    long len = 0;
+
+    do {
+        bio = BIO_new(BIO_s_mem());
+        if (!bio)
+            break;
+
+        if (PEM_write_bio_X509(bio, x509_cert) != 1) {
+            printf("Error writing x509 to pem buffer\n");
+            break;
+        }
+
+        len = BIO_get_mem_data(bio, &data);
+        if (len <= 0)
+            break;
+        pem_buf.assign(data, (size_t)len);
+
+        ret = true;
+    } while (0);
+
+    BIO_free(bio);
+    return ret;
+}
+
+bool der_to_pem(const std::string &der_buf, std::string &pem_buf)
+{
+    X509 *x509_cert = NULL;
+    bool ret = false;
+
+    if (read_der_buf_into_x509(der_buf, &x509_cert))
+        ret = write_x509_pem_buf(x509_cert, pem_buf);
+
+    X509_free(x509_cert);
+    return ret;
+}
+
+bool pem_to_der(const std::string &pem_buf, std::string &der_buf)
+{
+    X509 *x509_cert = NULL;
+    unsigned char *der = NULL;
+    int len = 0;
+
+    if (!read_pem_buf_into_x509(pem_buf, &x509_cert))
+        return false;
+
+    len = i2d_X509(x509_cert, &der);
+    X509_free(x509_cert);
+    if (len <= 0)
+        return false;
+
+    der_buf.assign((const char *)der, (size_t)len);
+    OPENSSL_free(der);
+    return true;
 }
 
-void convert_der_to_pem(const std::string in_file_name, const std::string out_file_name)
+/**
+ * Splits a buffer holding multiple concatenated PEM certificates (such as
+ * the KDS cert_chain, which is ASK followed by ARK) into X509 objects, in
+ * the order they appear. The caller must X509_free each entry.
+ */
+bool split_pem_chain(const std::string &pem_buf, std::vector<X509 *> &x509_certs)
 {
-    std::string cmd = "openssl x509 -inform der -in " + in_file_name + " -out " + out_file_name;
-    std::string output = "";
+    BIO *bio = BIO_new_mem_buf(pem_buf.data(), (int)pem_buf.size());
+    X509 *x509_cert = NULL;
+
+    if (!bio)
+        return false;
+
+    while ((x509_cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL)
+        x509_certs.push_back(x509_cert);
+
+    // Running out of certificates is reported as a PEM "no start line" error
+    ERR_clear_error();
+    BIO_free(bio);
 
-    sev::execute_system_command(cmd, &output);
+    if (x509_certs.empty()) {
+        printf("Error: no certificates found in pem buffer\n");
+        return false;
+    }
+    return true;
 }
 
 bool read_pem_into_x509(const std::string file_name, X509 **x509_cert)
@@ -65,18 +192,13 @@ bool read_pem_into_x509(const std::string file_name, X509 **x509_cert)
 
 bool write_x509_pem(const std::string file_name, X509 *x509_cert)
 {
-    FILE *pFile = NULL;
-    pFile = fopen(file_name.c_str(), "wt");
-    if (!pFile)
-        return false;
+    std::string pem_buf = "";
 
-    // printf("Writing to file: %s\n", file_name.c_str());
-    if (PEM_write_X509(pFile, x509_cert) != 1) {
+    if (!write_x509_pem_buf(x509_cert, pem_buf) ||
+        sev::write_file(file_name, pem_buf.data(), pem_buf.size()) != pem_buf.size()) {
         printf("Error writing x509 to file: %s\n", file_name.c_str());
-        fclose(pFile);
         return false;
     }
-    fclose(pFile);
     return true;
 }
 
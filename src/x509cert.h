@@ -21,12 +21,21 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <string>
+#include <vector>
 
 // Public global functions
-void convert_txt_to_der(const std::string in_file_name, const std::string out_file_name);
-void convert_der_to_pem(const std::string in_file_name, const std::string out_file_name);
+bool convert_txt_to_der(const std::string in_file_name, const std::string out_file_name);
+bool convert_der_to_pem(const std::string in_file_name, const std::string out_file_name);
 bool read_pem_into_x509(const std::string file_name, X509 **x509_cert);
 bool write_x509_pem(const std::string file_name, X509 *x509_cert);
+
+// In-memory versions of the above. No files or external processes involved
+bool der_to_pem(const std::string &der_buf, std::string &pem_buf);
+bool pem_to_der(const std::string &pem_buf, std::string &der_buf);
+bool read_pem_buf_into_x509(const std::string &pem_buf, X509 **x509_cert);
+bool read_der_buf_into_x509(const std::string &der_buf, X509 **x509_cert);
+bool write_x509_pem_buf(X509 *x509_cert, std::string &pem_buf);
+bool split_pem_chain(const std::string &pem_buf, std::vector<X509 *> &x509_certs);
 bool x509_validate_signature(X509 *child_cert, X509 *intermediate_cert, X509 *parent_cert);
 
 #endif /* X509CERT_H */